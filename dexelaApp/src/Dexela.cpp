@@ -12,11 +12,14 @@
  *
  */
 
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <epicsTime.h>
+#include <epicsEvent.h>
+#include <epicsMessageQueue.h>
 #include <epicsThread.h>
 #include <epicsExit.h>
 #include <epicsString.h>
@@ -27,8 +30,9 @@
 
 using namespace std;
 
-#include "BusScanner.h"
+#include "DexelaBus.h"
 #include "DexelaDetector.h"
+#include "DexelaSimDevice.h"
 
 #include <epicsExport.h>
 
@@ -37,6 +41,9 @@ using namespace std;
 
 static const char *driverName = "Dexela";
 
+// NDArray data types of the software binning types, in the order of DexBinType_t
+static const NDDataType_t binDataTypes[] = {NDUInt16, NDUInt32, NDFloat32};
+
 typedef struct {
   int value;
   const char* string;
@@ -56,15 +63,6 @@ static enumStruct_t binEnums[MAX_BINNING]= {
   {ix22, "2H x 2V digital"}
 };
 
-typedef enum {
-  DEXInternalFreeRun,
-  DEXInternalFixedRate,
-  DEXInternalSoftware,
-  DEXExternalEdgeSingle,
-  DEXExternalEdgeMulti,
-  DEXExternalBulb
-} DEXTriggerMode_t;
-
 #define MAX_TRIGGERS 6
 static enumStruct_t triggerEnums[MAX_TRIGGERS]= {
   {DEXInternalFreeRun,    "Int. Free Run"},
@@ -83,32 +81,116 @@ static enumStruct_t fullWellEnums[MAX_FULL_WELL]= {
 
 // Forward function definitions
 static void exitCallbackC(void *drvPvt);
+static void statusTaskC(void *drvPvt);
+static void connectTaskC(void *drvPvt);
+static void calibrationIOTaskC(void *drvPvt);
 
 //_____________________________________________________________________________________________
 
 /** Configuration command for Dexel driver; creates a new Dexela object.
   * \param[in] portName The name of the asyn port driver to be created.
-  * \param[in] detIndex The detector index in system (0=first detector, etc.)
+  * \param[in] detIndex The detector index in system (0=first detector, etc.), in order of serial number.
+  *            Not used if serialNumber is not 0.
   * \param[in] maxBuffers The maximum number of NDArray buffers that the NDArrayPool for this driver is 
   *            allowed to allocate. Set this to -1 to allow an unlimited number of buffers.
   * \param[in] maxMemory The maximum amount of memory that the NDArrayPool for this driver is 
   *            allowed to allocate. Set this to -1 to allow an unlimited amount of memory.
   * \param[in] priority The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
   * \param[in] stackSize The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+  * \param[in] serialNumber The serial number of the detector, 0 to select it with detIndex.
   */
 extern "C" int DexelaConfig(const char *portName, int detIndex,
-                                 int maxBuffers, size_t maxMemory, int priority, int stackSize)
+                                 int maxBuffers, size_t maxMemory, int priority, int stackSize, int serialNumber)
 {
-    new Dexela(portName, detIndex, maxBuffers, maxMemory, priority, stackSize);
+    new Dexela(portName, detIndex, maxBuffers, maxMemory, priority, stackSize, serialNumber);
+    return(asynSuccess);
+}
+
+/** Opens several detectors in parallel before their drivers are created with DexelaConfig, so that an IOC with
+  * several detectors connects to all of them in the time it takes to connect to one.
+  * \param[in] serialNumbers The serial numbers of the detectors separated by spaces or commas,
+  *            all the detectors in the system if empty.
+  */
+extern "C" int DexelaOpenBoards(const char *serialNumbers)
+{
+    std::vector<int> serials;
+    const char *p = serialNumbers ? serialNumbers : "";
+    char *pEnd;
+    long serial;
+
+    while (*p) {
+      serial = strtol(p, &pEnd, 10);
+      if (pEnd == p) {
+        p++;
+        continue;
+      }
+      serials.push_back((int)serial);
+      p = pEnd;
+    }
+#if DEX_HAVE_SDK
+    try {
+      printf("DexelaOpenBoards opened %d detectors\n", DexelaBus::openBoards(serials));
+    } catch (DexelaException &e) {
+      printf("DexelaOpenBoards error enumerating detectors: %s\n", e.what());
+      return(asynError);
+    }
+    return(asynSuccess);
+#else
+    printf("DexelaOpenBoards needs the Dexela SDK, only simulated detectors can be used\n");
+    return(asynError);
+#endif
+}
+
+/** Creates a simulated detector, which DexelaConfig uses instead of a real one when it is given the same serial
+  * number. This must be called before DexelaConfig.
+  * \param[in] serialNumber The serial number of the simulated detector, must not be 0.
+  * \param[in] model The model number, e.g. 1512 or 2923.
+  * \param[in] sizeX The unbinned width in pixels, 0 for the width of the model.
+  * \param[in] sizeY The unbinned height in pixels, 0 for the height of the model.
+  * \param[in] signalRate The illumination in counts per second per unbinned pixel, 0 for dark frames.
+  */
+extern "C" int DexelaSimConfig(int serialNumber, int model, int sizeX, int sizeY, double signalRate)
+{
+    dexSimConfig_t config;
+
+    if (serialNumber == 0) {
+      printf("DexelaSimConfig the serial number must not be 0\n");
+      return(asynError);
+    }
+    config.serialNumber = serialNumber;
+    config.model        = model;
+    config.sensorX      = sizeX;
+    config.sensorY      = sizeY;
+    config.signalRate   = signalRate;
+    config.rowTimeUs    = 0;
+    if (!DexelaSimDevice::create(config)) return(asynError);
+    return(asynSuccess);
+}
+
+/** Sets the faults a simulated detector injects. Can be called at any time.
+  * \param[in] serialNumber The serial number of the simulated detector.
+  * \param[in] dropFraction The fraction of the frames whose callback is not called, which shows up as a gap in
+  *            the frame counter.
+  * \param[in] errorFraction The fraction of the frames that cannot be read, as if the connection had been lost.
+  */
+extern "C" int DexelaSimInject(int serialNumber, double dropFraction, double errorFraction)
+{
+    DexelaSimDevice *pDevice = DexelaSimDevice::find(serialNumber);
+
+    if (!pDevice) {
+      printf("DexelaSimInject no simulated detector with serial number %d\n", serialNumber);
+      return(asynError);
+    }
+    pDevice->setFaults(dropFraction, errorFraction);
     return(asynSuccess);
 }
 
 //_____________________________________________________________________________________________
 
-// Callback function that is called by Dexela SDK for each frame
-static void newFrameCallback(int frameCounter, int bufferNumber, DexelaDetector *pDet)
+// Callback function that is called by the detector for each frame
+static void newFrameCallback(int frameCounter, int bufferNumber, DexelaDevice *pDevice)
 {
-  Dexela *pDexela = (Dexela *)pDet->GetCallbackData();
+  Dexela *pDexela = (Dexela *)pDevice->GetCallbackData();
   pDexela->newFrameCallback(frameCounter, bufferNumber);
 }
 
@@ -118,25 +200,29 @@ static void newFrameCallback(int frameCounter, int bufferNumber, DexelaDetector
   * After calling the base class constructor this method creates a thread to collect the detector data, 
   * and sets reasonable default values the parameters defined in this class, asynNDArrayDriver, and ADDriver.
   * \param[in] portName The name of the asyn port driver to be created.
-  * \param[in] detIndex The detector index in system (0=first detector, etc.)
+  * \param[in] detIndex The detector index in system (0=first detector, etc.), in order of serial number.
+  *            Not used if serialNumber is not 0.
   * \param[in] maxBuffers The maximum number of NDArray buffers that the NDArrayPool for this driver is 
   *            allowed to allocate. Set this to -1 to allow an unlimited number of buffers.
   * \param[in] maxMemory The maximum amount of memory that the NDArrayPool for this driver is 
   *            allowed to allocate. Set this to -1 to allow an unlimited amount of memory.
   * \param[in] priority The thread priority for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
   * \param[in] stackSize The stack size for the asyn port driver thread if ASYN_CANBLOCK is set in asynFlags.
+  * \param[in] serialNumber The serial number of the detector, 0 to select it with detIndex.
   */
 
 Dexela::Dexela(const char *portName,  int detIndex, 
-                         int maxBuffers, size_t maxMemory, int priority, int stackSize)
+                         int maxBuffers, size_t maxMemory, int priority, int stackSize, int serialNumber)
 
     : ADDriver(portName, 1, 0, maxBuffers, maxMemory, 
-               asynEnumMask, asynEnumMask, ASYN_CANBLOCK, 1, priority, stackSize)
+               asynEnumMask, asynEnumMask, ASYN_CANBLOCK, 1, priority, stackSize),
+      timeStampFit_(DEX_TIMESTAMP_FIT_FRAMES)
 {
-  int status = asynSuccess;
   static const char *functionName = "Dexela";
   
-  int numDevices;
+  char paramName[64];
+  int stage;
+  int i;
   
   /* Add parameters for this driver */
   createParam(DEX_BinningModeString,                 asynParamInt32,   &DEX_BinningMode);
@@ -165,6 +251,81 @@ Dexela::Dexela(const char *portName,  int detIndex,
   createParam(DEX_SoftwareTriggerString,             asynParamInt32,   &DEX_SoftwareTrigger);
   createParam(DEX_CorrectionsDirectoryString,        asynParamOctet,   &DEX_CorrectionsDirectory);
   createParam(DEX_ReadoutModeString,                 asynParamInt32,   &DEX_ReadoutMode);
+  createParam(DEX_NumThreadsString,                  asynParamInt32,   &DEX_NumThreads);
+  createParam(DEX_BytesCopiedString,                 asynParamInt32,   &DEX_BytesCopied);
+  createParam(DEX_CorrectionEngineString,            asynParamInt32,   &DEX_CorrectionEngine);
+  createParam(DEX_CorrectionSIMDString,              asynParamOctet,   &DEX_CorrectionSIMD);
+  createParam(DEX_DefectClassesString,               asynParamInt32,   &DEX_DefectClasses);
+  createParam(DEX_NumDefectsString,                  asynParamInt32,   &DEX_NumDefects);
+  createParam(DEX_CalibrationEstimatorString,        asynParamInt32,   &DEX_CalibrationEstimator);
+  createParam(DEX_CalibrationClipSigmaString,        asynParamFloat64, &DEX_CalibrationClipSigma);
+  createParam(DEX_CalibrationMemoryString,           asynParamFloat64, &DEX_CalibrationMemory);
+  createParam(DEX_CalibrationFinishTimeString,       asynParamFloat64, &DEX_CalibrationFinishTime);
+  createParam(DEX_CalibrationTotalTimeString,        asynParamFloat64, &DEX_CalibrationTotalTime);
+  createParam(DEX_UseCalibrationLibraryString,       asynParamInt32,   &DEX_UseCalibrationLibrary);
+  createParam(DEX_LoadCalibrationLibraryString,      asynParamInt32,   &DEX_LoadCalibrationLibrary);
+  createParam(DEX_CalibrationLibrarySizeString,      asynParamInt32,   &DEX_CalibrationLibrarySize);
+  createParam(DEX_CalibrationKeyString,              asynParamOctet,   &DEX_CalibrationKey);
+  createParam(DEX_CalibrationMissesString,           asynParamInt32,   &DEX_CalibrationMisses);
+  createParam(DEX_FrameRateString,                   asynParamFloat64, &DEX_FrameRate);
+  createParam(DEX_ResetLatencyString,                asynParamInt32,   &DEX_ResetLatency);
+  createParam(DEX_DroppedFramesString,               asynParamInt32,   &DEX_DroppedFrames);
+  createParam(DEX_LastGapString,                     asynParamInt32,   &DEX_LastGap);
+  createParam(DEX_PixelFrameCounterString,           asynParamInt32,   &DEX_PixelFrameCounter);
+  createParam(DEX_PixelCounterErrorsString,          asynParamInt32,   &DEX_PixelCounterErrors);
+  createParam(DEX_TimeStampFitString,                asynParamInt32,   &DEX_TimeStampFit);
+  createParam(DEX_FittedPeriodString,                asynParamFloat64, &DEX_FittedPeriod);
+  createParam(DEX_TimeStampJitterString,             asynParamFloat64, &DEX_TimeStampJitter);
+  createParam(DEX_SoftwareBinXString,                asynParamInt32,   &DEX_SoftwareBinX);
+  createParam(DEX_SoftwareBinYString,                asynParamInt32,   &DEX_SoftwareBinY);
+  createParam(DEX_SoftwareBinOperationString,        asynParamInt32,   &DEX_SoftwareBinOperation);
+  createParam(DEX_SoftwareBinDataTypeString,         asynParamInt32,   &DEX_SoftwareBinDataType);
+  createParam(DEX_ROISupportedString,                asynParamInt32,   &DEX_ROISupported);
+  createParam(DEX_ROIMarginString,                   asynParamInt32,   &DEX_ROIMargin);
+  createParam(DEX_ReadoutTimeString,                 asynParamFloat64, &DEX_ReadoutTime);
+  createParam(DEX_OnBoardUnscramblingString,         asynParamInt32,   &DEX_OnBoardUnscrambling);
+  createParam(DEX_OnBoardLinearizationString,        asynParamInt32,   &DEX_OnBoardLinearization);
+  createParam(DEX_OnBoardXTalkString,                asynParamInt32,   &DEX_OnBoardXTalk);
+  createParam(DEX_HostTimeSavedString,               asynParamFloat64, &DEX_HostTimeSaved);
+  createParam(DEX_NumAccumulateString,               asynParamInt32,   &DEX_NumAccumulate);
+  createParam(DEX_AccumulateDataTypeString,          asynParamInt32,   &DEX_AccumulateDataType);
+  createParam(DEX_NumAccumulatedString,              asynParamInt32,   &DEX_NumAccumulated);
+  createParam(DEX_NumPreallocateString,              asynParamInt32,   &DEX_NumPreallocate);
+  createParam(DEX_LockArraysString,                  asynParamInt32,   &DEX_LockArrays);
+  createParam(DEX_PoolHitsString,                    asynParamInt32,   &DEX_PoolHits);
+  createParam(DEX_PoolMissesString,                  asynParamInt32,   &DEX_PoolMisses);
+  createParam(DEX_StatusRateString,                  asynParamFloat64, &DEX_StatusRate);
+  createParam(DEX_HDRModeString,                     asynParamInt32,   &DEX_HDRMode);
+  createParam(DEX_HDRNumExposuresString,             asynParamInt32,   &DEX_HDRNumExposures);
+  createParam(DEX_HDRSaturationString,               asynParamInt32,   &DEX_HDRSaturation);
+  createParam(DEX_HDRIncompleteCyclesString,         asynParamInt32,   &DEX_HDRIncompleteCycles);
+  createParam(DEX_UseDarkModelString,                asynParamInt32,   &DEX_UseDarkModel);
+  createParam(DEX_FitDarkModelString,                asynParamInt32,   &DEX_FitDarkModel);
+  createParam(DEX_SaveDarkModelString,               asynParamInt32,   &DEX_SaveDarkModel);
+  createParam(DEX_DarkModelAvailableString,          asynParamInt32,   &DEX_DarkModelAvailable);
+  createParam(DEX_DarkModelOffsetsString,            asynParamInt32,   &DEX_DarkModelOffsets);
+  createParam(DEX_OffsetSynthesizedString,           asynParamInt32,   &DEX_OffsetSynthesized);
+  createParam(DEX_SynthesizeTimeString,              asynParamFloat64, &DEX_SynthesizeTime);
+  createParam(DEX_ConnectionStateString,             asynParamInt32,   &DEX_ConnectionState);
+  createParam(DEX_ReconnectString,                   asynParamInt32,   &DEX_Reconnect);
+  createParam(DEX_ReconnectsString,                  asynParamInt32,   &DEX_Reconnects);
+  createParam(DEX_CalibrationFileFormatString,       asynParamInt32,   &DEX_CalibrationFileFormat);
+  createParam(DEX_CalibrationIOBusyString,           asynParamInt32,   &DEX_CalibrationIOBusy);
+  createParam(DEX_CalibrationIOStatusString,         asynParamInt32,   &DEX_CalibrationIOStatus);
+  createParam(DEX_CalibrationIOMessageString,        asynParamOctet,   &DEX_CalibrationIOMessage);
+  createParam(DEX_CalibrationIOTimeString,           asynParamFloat64, &DEX_CalibrationIOTime);
+  for (i=0; i<DEX_MAX_HDR_EXPOSURES; i++) {
+    epicsSnprintf(paramName, sizeof(paramName), "DEX_HDR_EXPOSURE_%d", i+1);
+    createParam(paramName,                           asynParamFloat64, &DEX_HDRExposure[i]);
+  }
+  for (stage=0; stage<DexNumStages; stage++) {
+    epicsSnprintf(paramName, sizeof(paramName), "DEX_%s_LATENCY_P50", dexStageName((DexStage_t)stage));
+    createParam(paramName,                           asynParamFloat64, &DEX_LatencyP50[stage]);
+    epicsSnprintf(paramName, sizeof(paramName), "DEX_%s_LATENCY_P99", dexStageName((DexStage_t)stage));
+    createParam(paramName,                           asynParamFloat64, &DEX_LatencyP99[stage]);
+    epicsSnprintf(paramName, sizeof(paramName), "DEX_%s_LATENCY_MAX", dexStageName((DexStage_t)stage));
+    createParam(paramName,                           asynParamFloat64, &DEX_LatencyMax[stage]);
+  }
 
   /* Set some default values for parameters */
   setStringParam(NDDriverVersion, DRIVER_VERSION);
@@ -178,69 +339,523 @@ Dexela::Dexela(const char *portName,  int detIndex,
   setStringParam (DEX_CorrectionsDirectory, "");
   setStringParam (DEX_GainFile, "");
   setStringParam (DEX_DefectMapFile, "");
+  setIntegerParam(DEX_NumThreads, 0);
+  setIntegerParam(DEX_BytesCopied, 0);
+  setIntegerParam(DEX_CorrectionEngine, DEXCorrectionNative);
+  setStringParam (DEX_CorrectionSIMD, DexelaCorrection::SIMDLevelName(DexelaCorrection::maxSIMDLevel()));
+  setIntegerParam(DEX_DefectClasses, DEX_DEFECT_ALL_CLASSES);
+  setIntegerParam(DEX_NumDefects, 0);
+  setIntegerParam(DEX_CalibrationEstimator, DexEstimatorMedian);
+  setDoubleParam (DEX_CalibrationClipSigma, 3.0);
+  setDoubleParam (DEX_CalibrationMemory, 0.);
+  setDoubleParam (DEX_CalibrationFinishTime, 0.);
+  setDoubleParam (DEX_CalibrationTotalTime, 0.);
+  setIntegerParam(DEX_UseCalibrationLibrary, 1);
+  setIntegerParam(DEX_CalibrationLibrarySize, 0);
+  setStringParam (DEX_CalibrationKey, "");
+  setIntegerParam(DEX_CalibrationMisses, 0);
+  setIntegerParam(DEX_TimeStampFit, 0);
+  setIntegerParam(DEX_SoftwareBinX, 1);
+  setIntegerParam(DEX_SoftwareBinY, 1);
+  setIntegerParam(DEX_SoftwareBinOperation, DexBinSum);
+  setIntegerParam(DEX_SoftwareBinDataType, DexBinUInt32);
+  setIntegerParam(DEX_ROISupported, 0);
+  setIntegerParam(DEX_ROIMargin, 0);
+  setDoubleParam (DEX_ReadoutTime, 0.);
+  setIntegerParam(DEX_OnBoardUnscrambling, 0);
+  setIntegerParam(DEX_OnBoardLinearization, 0);
+  setIntegerParam(DEX_OnBoardXTalk, 0);
+  setDoubleParam (DEX_HostTimeSaved, 0.);
+  setIntegerParam(DEX_NumAccumulate, 1);
+  setIntegerParam(DEX_AccumulateDataType, DEXAccumulateUInt32);
+  setIntegerParam(DEX_NumAccumulated, 0);
+  setIntegerParam(DEX_NumPreallocate, 0);
+  setIntegerParam(DEX_LockArrays, 0);
+  setDoubleParam (DEX_StatusRate, DEX_DEFAULT_STATUS_RATE);
+  setIntegerParam(DEX_HDRMode, 0);
+  setIntegerParam(DEX_HDRNumExposures, 2);
+  setIntegerParam(DEX_HDRSaturation, 16000);
+  setIntegerParam(DEX_HDRIncompleteCycles, 0);
+  for (i=0; i<DEX_MAX_HDR_EXPOSURES; i++) {
+    setDoubleParam(DEX_HDRExposure[i], 0.);
+  }
+  setIntegerParam(DEX_UseDarkModel, 0);
+  setIntegerParam(DEX_DarkModelAvailable, 0);
+  setIntegerParam(DEX_DarkModelOffsets, 0);
+  setIntegerParam(DEX_OffsetSynthesized, 0);
+  setDoubleParam (DEX_SynthesizeTime, 0.);
+  setIntegerParam(DEX_LoadOffsetFile, 0);
+  setIntegerParam(DEX_SaveOffsetFile, 0);
+  setIntegerParam(DEX_LoadGainFile, 0);
+  setIntegerParam(DEX_SaveGainFile, 0);
+  setIntegerParam(DEX_LoadDefectMapFile, 0);
+  setIntegerParam(DEX_LoadCalibrationLibrary, 0);
+  setIntegerParam(DEX_SaveDarkModel, 0);
+  setIntegerParam(DEX_CalibrationIOBusy, 0);
+  setIntegerParam(DEX_CalibrationIOStatus, DEXCalibrationIOSuccess);
+  setStringParam (DEX_CalibrationIOMessage, "");
+  setDoubleParam (DEX_CalibrationIOTime, 0.);
+  arrayPool_.setPool(pNDArrayPool);
+  updateLatencyParams();
+  setIntegerParam(DEX_DroppedFrames, 0);
+  setIntegerParam(DEX_LastGap, 0);
+  setIntegerParam(DEX_PixelFrameCounter, 0);
+  setIntegerParam(DEX_PixelCounterErrors, 0);
+
+  frameQueue_ = NULL;
+  statusEvent_ = NULL;
+  onBoardUnscrambling_ = false;
+  roiSupported_ = false;
+  onBoardLinearization_ = false;
+  onBoardXTalk_ = false;
+  numFrameThreads_ = 0;
+  frameSequence_ = 0;
+  acquireGeneration_ = 0;
+  nextPublishSequence_ = 0;
+  nextFrameCounter_ = -1;
+  queueDropped_ = 0;
+  framesInFlight_ = 0;
+  framesToPublish_ = 0;
+  imageCounter_ = 0;
+  arrayCounter_ = 0;
+  bytesCopied_ = 0;
+  pixelCounterOffset_ = -1;
+  pixelCounterErrors_ = 0;
+  fitTimeStamps_ = false;
+  epicsTimeGetCurrent(&fitOrigin_);
+  pAccumulated_ = NULL;
+  numAccumulated_ = 0;
+  droppedFrames_ = 0;
+  lastGap_ = 0;
+  hdrIncompleteCycles_ = 0;
+  accumulatedGap_ = 0;
+  firstAccumulatedFrame_ = 0;
+  lastAccumulatedFrame_ = 0;
+  hdrNumExposures_ = 0;
+  hdrFirstFrame_ = 0;
+  for (i=0; i<DEX_MAX_HDR_EXPOSURES; i++) pHDRFrames_[i] = NULL;
+  calibrationEstimator_ = DexEstimatorMedian;
+  calibrationFinishing_ = -1;
+  pCalibration_ = std::make_shared<DexelaCalibrationSet>();
+  // Frames are ignored until the detector is connected and a snapshot with acquiring set is published
+  pConfig_ = std::make_shared<dexConfig_t>();
+  epicsTimeGetCurrent(&calibrationStartTime_);
+  pDetector_ = NULL;
+  detIndex_ = detIndex;
+  requestedSerialNumber_ = serialNumber;
+  connected_ = false;
+  sensorX_ = 0;
+  sensorY_ = 0;
+  modelNumber_ = 0;
+  serialNumber_ = 0;
+  firmwareVersion_ = 0;
+  binningMode_ = x11;
+  numBuffers_ = 0;
+  snapBuffer_ = 0;
+  strcpy(modelName_, "Dexela");
+  setStringParam (ADManufacturer, "Perkin Elmer");
+  setIntegerParam(DEX_NumThreads, DEX_DEFAULT_THREADS);
+  setIntegerParam(DEX_ConnectionState, DEXDisconnected);
+  setIntegerParam(DEX_Reconnect, 0);
+  setIntegerParam(DEX_Reconnects, 0);
+  setIntegerParam(ADStatus, ADStatusDisconnected);
+  setStringParam (ADStatusMessage, "Not connected");
+  activateCalibration(pCalibration_, currentCalibrationKey());
+
+  frameTaskExitEvent_ = epicsEventCreate(epicsEventEmpty);
+  publishMutex_ = epicsMutexMustCreate();
+  readyMutex_ = epicsMutexMustCreate();
+  statusEvent_ = epicsEventCreate(epicsEventEmpty);
+  connectEvent_ = epicsEventCreate(epicsEventEmpty);
+  calibrationIOEvent_ = epicsEventCreate(epicsEventEmpty);
+  char taskName[64];
+  epicsSnprintf(taskName, sizeof(taskName), "%s_status", portName);
+  if (epicsThreadCreate(taskName,
+                        epicsThreadPriorityLow,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)statusTaskC,
+                        this) == NULL) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s error creating status thread\n",
+      driverName, functionName);
+  }
+  // Finding and opening the detector can take seconds, so it is done by the connection thread and the IOC does
+  // not wait for it
+  epicsSnprintf(taskName, sizeof(taskName), "%s_connect", portName);
+  if (epicsThreadCreate(taskName,
+                        epicsThreadPriorityMedium,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)connectTaskC,
+                        this) == NULL) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s error creating connection thread\n",
+      driverName, functionName);
+  }
+  // Calibration files are read and written by their own thread, so the port thread and the frame processing
+  // threads never wait for the disk
+  epicsSnprintf(taskName, sizeof(taskName), "%s_calibIO", portName);
+  if (epicsThreadCreate(taskName,
+                        epicsThreadPriorityLow,
+                        epicsThreadGetStackSize(epicsThreadStackMedium),
+                        (EPICSTHREADFUNC)calibrationIOTaskC,
+                        this) == NULL) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s error creating calibration I/O thread\n",
+      driverName, functionName);
+  }
+ 
+  // Set exit handler to clean up
+  epicsAtExit(exitCallbackC, this);
+}
 
-  try {
-    pBusScanner_ = new BusScanner();
-    numDevices = pBusScanner_->EnumerateDevices();
-    if (numDevices <= 0) {
-      throwNewEr("No Dexela devices found", BAD_COMMS, 0, "");
+void Dexela::reportError(const char *functionName, DexelaException &e)
+{
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s exception description=%s\n, function=%s, transport message=%s\n",
+      driverName, functionName, e.what(), e.GetFunctionName(), e.GetTransportMessage());
+    // Communication errors mean the detector was switched off or disconnected, so it has to be opened again
+    switch (e.GetCode()) {
+      case BAD_COMMS:
+      case BAD_COMMS_READ:
+      case BAD_COMMS_WRITE:
+        connectionLost();
+        break;
+      default:
+        break;
     }
+}
 
-    if (detIndex > numDevices-1) {
-      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-        "%s::%s Error: detector index %d not available, only %d devices found\n",
-        driverName, functionName, detIndex, numDevices);
-      throwNewEr("Invalid device index", BAD_COMMS, 0, "");
+/** Marks the detector as disconnected and wakes connectTask() to reopen it.
+  * Called from any thread, with or without the lock. */
+void Dexela::connectionLost(void)
+{
+  if (connected_.exchange(false)) epicsEventSignal(connectEvent_);
+}
+
+//_____________________________________________________________________________________________
+
+static void connectTaskC(void *drvPvt)
+{
+  Dexela *pDexela = (Dexela *)drvPvt;
+  pDexela->connectTask();
+}
+
+/** Connection thread.  It connects to the detector when the driver is created and again whenever the connection
+  * is lost. After a failed attempt it waits DEX_RECONNECT_MIN_DELAY, doubling the wait after each further failure
+  * up to DEX_RECONNECT_MAX_DELAY. */
+void Dexela::connectTask(void)
+{
+  double delay = DEX_RECONNECT_MIN_DELAY;
+  bool connected;
+
+  lock();
+  while (1) {
+    connected = connected_ || connectDetector();
+    unlock();
+    if (connected) {
+      delay = DEX_RECONNECT_MIN_DELAY;
+      epicsEventWait(connectEvent_);
+    } else {
+      epicsEventWaitWithTimeout(connectEvent_, delay);
+      delay *= 2;
+      if (delay > DEX_RECONNECT_MAX_DELAY) delay = DEX_RECONNECT_MAX_DELAY;
     }
-    
-    devInfo_ = pBusScanner_->GetDevice(detIndex);
-    pDetector_ = new DexelaDetector(devInfo_);
-    // Connect to board
-    pDetector_->OpenBoard();
-    sensorX_      = pDetector_->GetSensorWidth();
-    sensorY_      = pDetector_->GetSensorHeight();
-    modelNumber_  = pDetector_->GetModelNumber();
-    binningMode_  = pDetector_->GetBinningMode();
-    serialNumber_ = pDetector_->GetSerialNumber();
-    numBuffers_   = pDetector_->GetNumBuffers();
-    setIntegerParam(ADMaxSizeX, sensorX_);
-    setIntegerParam(ADMaxSizeY, sensorY_);
-    setStringParam(ADManufacturer, "Perkin Elmer");
-    sprintf(modelName_, "Dexela %d", modelNumber_);
-    setStringParam(ADModel, modelName_);
-    char tempString[40];
-    sprintf(tempString, "%d", serialNumber_);
-    setStringParam(ADSerialNumber, tempString);
-    sprintf(tempString, "%d", firmwareVersion_);
-    setStringParam(ADFirmwareVersion, tempString);
-    snapBuffer_ = 0;
-
-    // Set callback
-    pDetector_->SetCallback(::newFrameCallback);
-    pDetector_->SetCallbackData(this);
-
-    // Enable pulse generator
-    pDetector_->EnablePulseGenerator();
-
-    // Turn off pulses
-    pDetector_->ToggleGenerator(false);
+    lock();
+  }
+}
 
+/** Opens the detector, reads its properties and applies the settings in the parameters.
+  * Called with the lock held; the lock is released while the detector is opened because that can take seconds.
+  * Returns true if the detector is connected. */
+bool Dexela::connectDetector(void)
+{
+  DexelaDevice *pDetector;
+  bool reconnect = (pDetector_ != NULL);
+  int acquiring;
+  int numThreads;
+  int reconnects;
+  static const char *functionName = "connectDetector";
+
+  getIntegerParam(ADAcquire, &acquiring);
+  if (acquiring) {
+    // The frames in the SDK buffers are lost, so the acquisition has to be started again
+    acquireStop();
+    setIntegerParam(ADAcquire, 0);
+    publishConfig();
+  }
+  setIntegerParam(DEX_ConnectionState, DEXConnecting);
+  setIntegerParam(ADStatus, ADStatusDisconnected);
+  setStringParam (ADStatusMessage, "Connecting");
+  callParamCallbacks();
+  unlock();
+  try {
+    pDetector = openDetector(pDetector_);
   } catch (DexelaException &e) {
+    lock();
     reportError(functionName, e);
-    this->deviceIsReachable = false;
-    this->disconnect(pasynUserSelf);
-    return;
+    setIntegerParam(DEX_ConnectionState, DEXDisconnected);
+    setStringParam (ADStatusMessage, "Not connected");
+    callParamCallbacks();
+    return false;
   }
- 
-  // Set exit handler to clean up
-  epicsAtExit(exitCallbackC, this);
+  lock();
+  pDetector_ = pDetector;
+  // A communication error while the detector is set up clears connected_ again
+  connected_ = true;
+  try {
+    initDetector();
+    restoreSettings(reconnect);
+    updateEnums();
+  } catch (DexelaException &e) {
+    reportError(functionName, e);
+    connected_ = false;
+  }
+  if (!connected_) {
+    // The event from connectionLost() would cut the wait before the next attempt short
+    epicsEventTryWait(connectEvent_);
+    setIntegerParam(DEX_ConnectionState, DEXDisconnected);
+    setStringParam (ADStatusMessage, "Not connected");
+    callParamCallbacks();
+    return false;
+  }
+  if (!frameQueue_) {
+    // newFrameCallback() limits the frames in flight to fewer than the SDK buffers, so the queue never fills with
+    // frames. The extra entries are for the messages that stop the threads.
+    frameQueue_ = epicsMessageQueueCreate(numBuffers_ + DEX_MAX_THREADS, sizeof(dexFrameMessage_t));
+    getIntegerParam(DEX_NumThreads, &numThreads);
+    startFrameThreads(numThreads);
+  }
+  if (reconnect) {
+    getIntegerParam(DEX_Reconnects, &reconnects);
+    setIntegerParam(DEX_Reconnects, reconnects+1);
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s::%s connected to %s serial number %d\n",
+    driverName, functionName, modelName_, serialNumber_);
+  setIntegerParam(DEX_ConnectionState, DEXConnected);
+  setIntegerParam(ADStatus, ADStatusIdle);
+  setStringParam (ADStatusMessage, "");
+  publishConfig();
+  callParamCallbacks();
+  return true;
 }
 
-void Dexela::reportError(const char *functionName, DexelaException &e)
+/** Opens the detector selected in DexelaConfig. The first time, a simulated detector created with
+  * DexelaSimConfig is used if it has the requested serial number, otherwise the detector is looked up in the list
+  * shared by all the drivers, which is enumerated again if the detector was switched on after the IOC started.
+  * After that the same detector is closed and opened again, so the frame processing threads never see it deleted.
+  * Called without the lock. Throws DexelaException if the detector cannot be opened.
+  * \param[in] pDetector The detector to open again, NULL the first time */
+DexelaDevice *Dexela::openDetector(DexelaDevice *pDetector)
 {
+#if DEX_HAVE_SDK
+  DexelaDetector *pSDKDetector;
+  DevInfo devInfo;
+  bool found;
+#endif
+  static const char *functionName = "openDetector";
+
+  if (pDetector) {
+    try {
+      pDetector->CloseBoard();
+    } catch (DexelaException &) {
+      // The board may already have been closed by the SDK
+    }
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s::%s calling DexelaDetector::OpenBoard()\n",
+      driverName, functionName);
+    pDetector->OpenBoard();
+    return pDetector;
+  }
+  if (requestedSerialNumber_ != 0) pDetector = DexelaSimDevice::take(requestedSerialNumber_);
+  if (pDetector) {
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s::%s calling DexelaDetector::OpenBoard() on simulated detector %d\n",
+      driverName, functionName, requestedSerialNumber_);
+    pDetector->OpenBoard();
+    return pDetector;
+  }
+#if !DEX_HAVE_SDK
+  asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+    "%s::%s Error: no simulated detector with serial number %d, real detectors need the Dexela SDK\n",
+    driverName, functionName, requestedSerialNumber_);
+  throwNewEr("Detector not found", BAD_COMMS_OPEN, 0, "");
+#else
+  if (requestedSerialNumber_ != 0) found = DexelaBus::findDevice(requestedSerialNumber_, &devInfo);
+  else                             found = DexelaBus::getDevice(detIndex_, &devInfo);
+  if (!found) {
+    DexelaBus::rescan();
+    if (requestedSerialNumber_ != 0) found = DexelaBus::findDevice(requestedSerialNumber_, &devInfo);
+    else                             found = DexelaBus::getDevice(detIndex_, &devInfo);
+  }
+  if (!found) {
     asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-      "%s::%s exception description=%s\n, function=%s, transport message=%s\n",
-      driverName, functionName, e.what(), e.GetFunctionName(), e.GetTransportMessage());
+      "%s::%s Error: detector with serial number %d or index %d not found\n",
+      driverName, functionName, requestedSerialNumber_, detIndex_);
+    throwNewEr("Detector not found", BAD_COMMS_OPEN, 0, "");
+  }
+  // devInfo_ is only used by this thread
+  devInfo_ = devInfo;
+  // Use the detector if DexelaOpenBoards has already connected to it
+  pSDKDetector = DexelaBus::takeDetector(devInfo.serialNum);
+  if (pSDKDetector) return new DexelaSDKDevice(pSDKDetector);
+  pSDKDetector = new DexelaDetector(devInfo);
+  try {
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s::%s calling DexelaDetector::OpenBoard()\n",
+      driverName, functionName);
+    pSDKDetector->OpenBoard();
+  } catch (DexelaException &) {
+    delete pSDKDetector;
+    throw;
+  }
+  return new DexelaSDKDevice(pSDKDetector);
+#endif
+}
+
+/** Reads the properties of the detector that has just been opened and sets up the frame callback.
+  * Called with the lock held. Throws DexelaException. */
+void Dexela::initDetector(void)
+{
+  char tempString[40];
+
+  sensorX_      = pDetector_->GetSensorWidth();
+  sensorY_      = pDetector_->GetSensorHeight();
+  modelNumber_  = pDetector_->GetModelNumber();
+  binningMode_  = pDetector_->GetBinningMode();
+  serialNumber_ = pDetector_->GetSerialNumber();
+  numBuffers_   = pDetector_->GetNumBuffers();
+  onBoardUnscrambling_ = (pDetector_->QueryOnBoardUnscrambling() == 1);
+  onBoardLinearization_ = (pDetector_->QueryOnBoardLinearization() == 1);
+  onBoardXTalk_ = (pDetector_->QueryOnBoardXTalkCorrection() == 1);
+  setIntegerParam(DEX_OnBoardUnscrambling, onBoardUnscrambling_ ? 1 : 0);
+  roiSupported_ = (pDetector_->QueryROI() == 1);
+  // The ROI is in unbinned pixels, so the maximum size does not depend on the binning
+  if (roiSupported_) pDetector_->GetMaximumROISize(sensorX_, sensorY_);
+  setIntegerParam(DEX_ROISupported, roiSupported_ ? 1 : 0);
+  setIntegerParam(ADMaxSizeX, sensorX_);
+  setIntegerParam(ADMaxSizeY, sensorY_);
+  sprintf(modelName_, "Dexela %d", modelNumber_);
+  setStringParam(ADModel, modelName_);
+  sprintf(tempString, "%d", serialNumber_);
+  setStringParam(ADSerialNumber, tempString);
+  sprintf(tempString, "%d", firmwareVersion_);
+  setStringParam(ADFirmwareVersion, tempString);
+
+  // Set callback
+  pDetector_->SetCallback(::newFrameCallback);
+  pDetector_->SetCallbackData(this);
+
+  // Enable pulse generator
+  pDetector_->EnablePulseGenerator();
+
+  // Turn off pulses
+  pDetector_->ToggleGenerator(false);
+}
+
+/** Applies the settings in the parameters to the detector that has just been opened.
+  * After a reconnection all the settings are applied, because the detector may have been power cycled. The first
+  * time only the settings that were written before the detector connected are applied, the detector keeps its
+  * own values of the others. Called with the lock held. Throws DexelaException.
+  * \param[in] all Apply all the settings rather than only the ones written while disconnected */
+void Dexela::restoreSettings(bool all)
+{
+  int value;
+  double acquireTime;
+  static const char *functionName = "restoreSettings";
+
+  if (all || pendingSettings_.count(DEX_BinningMode)) {
+    getIntegerParam(DEX_BinningMode, &value);
+    binningMode_ = (bins)value;
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s::%s calling DexelaDetector::SetBinningMode(%d)\n",
+      driverName, functionName, binningMode_);
+    pDetector_->SetBinningMode(binningMode_);
+  }
+  if (all || pendingSettings_.count(DEX_FullWellMode)) {
+    getIntegerParam(DEX_FullWellMode, &value);
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s::%s calling DexelaDetector::SetFullWellMode(%d)\n",
+      driverName, functionName, value);
+    pDetector_->SetFullWellMode((FullWellModes)value);
+  }
+  if (all || pendingSettings_.count(DEX_ReadoutMode)) {
+    getIntegerParam(DEX_ReadoutMode, &value);
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s::%s calling DexelaDetector::SetReadoutMode(%d)\n",
+      driverName, functionName, value);
+    pDetector_->SetReadoutMode((ReadoutModes)value);
+  }
+  if (all || pendingSettings_.count(ADAcquireTime)) {
+    getDoubleParam(ADAcquireTime, &acquireTime);
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s::%s calling DexelaDetector::SetExposureTime(%f)\n",
+      driverName, functionName, acquireTime*1000.);
+    pDetector_->SetExposureTime((float)(acquireTime * 1000.));
+  }
+  if (onBoardLinearization_) {
+    if (all || pendingSettings_.count(DEX_OnBoardLinearization)) {
+      getIntegerParam(DEX_OnBoardLinearization, &value);
+      pDetector_->ToggleOnBoardLinearization(value != 0);
+    }
+    setIntegerParam(DEX_OnBoardLinearization, pDetector_->GetOnBoardLinearizationState() ? 1 : 0);
+  } else {
+    setIntegerParam(DEX_OnBoardLinearization, 0);
+  }
+  if (onBoardXTalk_) {
+    if (all || pendingSettings_.count(DEX_OnBoardXTalk)) {
+      getIntegerParam(DEX_OnBoardXTalk, &value);
+      pDetector_->ToggleOnBoardXTalkCorrection(value != 0);
+    }
+    setIntegerParam(DEX_OnBoardXTalk, pDetector_->GetOnBoardXTalkCorrectionState() ? 1 : 0);
+  } else {
+    setIntegerParam(DEX_OnBoardXTalk, 0);
+  }
+  if (roiSupported_ && (all || pendingSettings_.count(DEX_ROIMargin))) {
+    getIntegerParam(DEX_ROIMargin, &value);
+    pDetector_->SetROIMarginEnabled(value != 0);
+    setIntegerParam(DEX_ROIMargin, pDetector_->IsROIMarginEnabled() ? 1 : 0);
+  }
+  if (all || pendingSettings_.count(DEX_PixelFrameCounter)) {
+    getIntegerParam(DEX_PixelFrameCounter, &value);
+    pDetector_->SetPixelFrameCounter(value != 0);
+  }
+  if (pendingSettings_.count(DEX_HDRMode)) {
+    getIntegerParam(DEX_HDRMode, &value);
+    if (value && (pDetector_->QueryExposureMode(Preprogrammed_exposure) != 1)) setIntegerParam(DEX_HDRMode, 0);
+  }
+  // The first time the ROI is the full frame unless it was written before the detector connected
+  if (!all && !pendingSettings_.count(ADMinX) && !pendingSettings_.count(ADMinY) &&
+      !pendingSettings_.count(ADSizeX) && !pendingSettings_.count(ADSizeY)) {
+    setIntegerParam(ADMinX, 0);
+    setIntegerParam(ADMinY, 0);
+    setIntegerParam(ADSizeX, sensorX_);
+    setIntegerParam(ADSizeY, sensorY_);
+  }
+  pendingSettings_.clear();
+  // This also reads the readout time
+  setROI();
+  selectCalibration(true);
+}
+
+/** Sends the binning and full well choices of the detector to the mbbo records.
+  * The records read the choices at iocInit, which may be before the detector is connected. Called with the lock
+  * held. */
+void Dexela::updateEnums(void)
+{
+  const int functions[2] = {DEX_BinningMode, DEX_FullWellMode};
+  char *strings[MAX_BINNING];
+  int values[MAX_BINNING];
+  int severities[MAX_BINNING];
+  int numChoices;
+  int i, j;
+
+  for (i=0; i<2; i++) {
+    for (j=0; j<MAX_BINNING; j++) strings[j] = NULL;
+    numChoices = getEnums(functions[i], strings, values, severities, MAX_BINNING);
+    if (numChoices >= 0) doCallbacksEnum(strings, values, severities, numChoices, functions[i], 0);
+    for (j=0; j<MAX_BINNING; j++) free(strings[j]);
+  }
 }
 
 //_____________________________________________________________________________________________
@@ -260,9 +875,14 @@ Dexela::~Dexela()
 {
   static const char *functionName = "~Dexela";
   
+  if (!pDetector_) return;
   asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
      "%s::%s calling DexelaDetector::CloseBoard()\n",driverName, functionName);
-  pDetector_->CloseBoard();
+  try {
+    pDetector_->CloseBoard();
+  } catch (DexelaException &e) {
+    reportError(functionName, e);
+  }
 }
 
 
@@ -287,7 +907,9 @@ void Dexela::report(FILE *fp, int details)
       fprintf(fp, "  Number of rows:    %d\n", sensorX_);
       fprintf(fp, "  Number of columns: %d\n", sensorY_);
       fprintf(fp, "  Data type:         %d\n", dataType);
-      fprintf(fp, "  Frames allocated:  %d\n", pDetector_->GetNumBuffers());
+      fprintf(fp, "  Connected:         %s\n", connected_ ? "yes" : "no");
+      fprintf(fp, "  Frames allocated:  %d\n", numBuffers_);
+      if (pDetector_) pDetector_->report(fp);
     }
     if (details > 1) reportSensors(fp, details);
 
@@ -299,242 +921,1375 @@ void Dexela::report(FILE *fp, int details)
 }
 
 //_____________________________________________________________________________________________
-/** Report information about all local and network Dexela detectors */
+/** Report information about all local and network Dexela detectors.
+  * The detectors are not enumerated again, this is the list shared by all the drivers. */
 void Dexela::reportSensors(FILE *fp, int details)
 {
-  int numDevices;
-  DevInfo devInfo;
+#if DEX_HAVE_SDK
   static const char *functionName = "reportSensors";
-  int i;
-  
+
   try {
-    numDevices = pBusScanner_->EnumerateDevices();
-    fprintf(fp, "Total sensors in system: %d\n", numDevices);
-    // Iterate through all devices and display information
-    for (i=0; i<numDevices; i++) {
-      fprintf(fp, "Device: %d\n", i);
-      devInfo = pBusScanner_->GetDevice(i);
-      fprintf(fp, "   Model number: %d\n", devInfo.model);
-      fprintf(fp, "  Serial number: %d\n", devInfo.serialNum);
-      fprintf(fp, "      Interface: %s\n", devInfo.iface ? "GigE" : "CameraLink");
-    }
+    DexelaBus::report(fp);
   } catch (DexelaException &e) {
     reportError(functionName, e);
   }
+#else
+  fprintf(fp, "  Built without the Dexela SDK, only simulated detectors can be used\n");
+#endif
 }
 
 //_____________________________________________________________________________________________
-// Callback function that is called by from ::newFrameCallback for each frame
+// Callback function that is called by from ::newFrameCallback for each frame.
+// This runs on the SDK callback thread, so it only queues the frame for the frame processing threads.
 void Dexela::newFrameCallback(int frameCounter, int bufferNumber)
 {
-  void          *pData;
-  NDArrayInfo   arrayInfo;
-  int           arrayCounter;
-  int           imageCounter;
-  int           arrayCallbacks;
-  int           numImages;
-  int           imageMode;
+  dexFrameMessage_t msg;
+  double fittedTime;
+  static const char *functionName = "newFrameCallback";
+
+  // The time stamp is taken first so it does not include any of the processing
+  epicsTimeGetCurrent(&msg.callbackTime);
+
+  asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+    "%s:%s: frameCounter=%d, bufferNumber=%d\n",
+    driverName, functionName, frameCounter, bufferNumber);
+
+  msg.frameCounter = frameCounter;
+  msg.bufferNumber = bufferNumber;
+  msg.sequence     = frameSequence_;
+  msg.generation   = acquireGeneration_;
+  msg.queueTime    = dexTimeNow();
+  // Frames the SDK did not deliver show up as a jump in the frame counter.
+  // If the counter goes backwards the detector was restarted, so just start counting again.
+  msg.gap = queueDropped_;
+  if ((nextFrameCounter_ >= 0) && (frameCounter > nextFrameCounter_)) {
+    msg.gap += frameCounter - nextFrameCounter_;
+  }
+  if (nextFrameCounter_ < 0) hdrFirstFrame_ = frameCounter;
+  nextFrameCounter_ = frameCounter + 1;
+  // The detector cycles through the preprogrammed exposures, so the frame counter gives the exposure even when
+  // frames were dropped
+  msg.exposureIndex = 0;
+  if (hdrNumExposures_ > 0) {
+    msg.exposureIndex = ((frameCounter - hdrFirstFrame_) % hdrNumExposures_ + hdrNumExposures_) % hdrNumExposures_;
+  }
+  msg.timeStamp = msg.callbackTime;
+  msg.fitted = 0;
+  if (fitTimeStamps_ &&
+      timeStampFit_.add(frameCounter, epicsTimeDiffInSeconds(&msg.callbackTime, &fitOrigin_), &fittedTime)) {
+    msg.timeStamp = fitOrigin_;
+    epicsTimeAddSeconds(&msg.timeStamp, fittedTime);
+    msg.fitted = 1;
+  }
+  // The SDK writes the next frame into the oldest buffer, so the frames waiting in the queue and those the
+  // threads are still reading must leave it one buffer, or they would be read after being overwritten
+  framesToPublish_++;
+  if ((++framesInFlight_ >= numBuffers_) ||
+      (epicsMessageQueueTrySend(frameQueue_, &msg, sizeof(msg)) != 0)) {
+    framesInFlight_--;
+    framesToPublish_--;
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: frame processing too slow, dropping frame %d in buffer %d\n",
+      driverName, functionName, frameCounter, bufferNumber);
+    queueDropped_ = msg.gap + 1;
+    return;
+  }
+  queueDropped_ = 0;
+  frameSequence_++;
+}
+
+//_____________________________________________________________________________________________
+
+static void frameTaskC(void *drvPvt)
+{
+  Dexela *pDexela = (Dexela *)drvPvt;
+  pDexela->frameTask();
+}
+
+/** Frame processing thread.  Several of these run in parallel, each one reads a frame from the SDK buffer,
+  * corrects it and hands it to publishFrame(), which does the callbacks in the order the frames arrived. */
+void Dexela::frameTask(void)
+{
+  dexFrameMessage_t msg;
+  NDArray *pImage;
+  // Each thread reuses the same DexImage and saturation mask so there is no allocation per frame
+  DexImage frameImage;
+  std::vector<epicsUInt8> saturatedMask;
+
+  while (1) {
+    epicsMessageQueueReceive(frameQueue_, &msg, sizeof(msg));
+    if (msg.bufferNumber < 0) break;
+    pImage = processFrame(&msg, frameImage, saturatedMask);
+    // The SDK buffer has been read, so it can be reused. publishFrame() decrements framesToPublish_.
+    framesInFlight_--;
+    publishFrame(&msg, pImage);
+  }
+  epicsEventSignal(frameTaskExitEvent_);
+}
+
+//_____________________________________________________________________________________________
+
+static void statusTaskC(void *drvPvt)
+{
+  Dexela *pDexela = (Dexela *)drvPvt;
+  pDexela->statusTask();
+}
+
+/** Status thread.  While acquiring it copies the frame counters to the parameters and does the parameter
+  * callbacks DEXStatusRate times per second, so the clients are not updated at the frame rate.
+  * publishFrame() still does the callbacks when acquisition ends so the final values are always published. */
+void Dexela::statusTask(void)
+{
+  double statusRate;
+  int acquiring;
+
+  lock();
+  while (1) {
+    getIntegerParam(ADAcquire, &acquiring);
+    getDoubleParam(DEX_StatusRate, &statusRate);
+    unlock();
+    if (acquiring && (statusRate > 0)) {
+      epicsEventWaitWithTimeout(statusEvent_, 1. / statusRate);
+    } else {
+      epicsEventWait(statusEvent_);
+    }
+    lock();
+    updateFrameCounters();
+    callParamCallbacks();
+  }
+}
+
+//_____________________________________________________________________________________________
+
+/** Starts the frame processing threads.
+  * \param[in] numThreads Number of threads to start, clipped to the range 1 to DEX_MAX_THREADS */
+void Dexela::startFrameThreads(int numThreads)
+{
+  char taskName[64];
+  int i;
+  static const char *functionName = "startFrameThreads";
+
+  if (numThreads < 1) numThreads = 1;
+  if (numThreads > DEX_MAX_THREADS) numThreads = DEX_MAX_THREADS;
+  for (i=0; i<numThreads; i++) {
+    epicsSnprintf(taskName, sizeof(taskName), "%s_frame%d", portName, i);
+    if (epicsThreadCreate(taskName,
+                          epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)frameTaskC,
+                          this) == NULL) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s error creating frame processing thread %d\n",
+        driverName, functionName, i);
+      break;
+    }
+    numFrameThreads_++;
+  }
+  setIntegerParam(DEX_NumThreads, numFrameThreads_);
+}
+
+/** Stops all of the frame processing threads and waits for them to exit.
+  * This must be called with the lock held and not acquiring. The frames still queued are from the last
+  * acquisition and are discarded. The lock is released before the threads are told to stop, because they may
+  * need it to finish the frame they are working on. */
+void Dexela::stopFrameThreads(void)
+{
+  dexFrameMessage_t msg;
+  int i;
+
+  while (epicsMessageQueueTryReceive(frameQueue_, &msg, sizeof(msg)) >= 0) {
+    if (msg.bufferNumber >= 0) {
+      framesInFlight_--;
+      framesToPublish_--;
+    }
+  }
+  unlock();
+  msg.bufferNumber = -1;
+  for (i=0; i<numFrameThreads_; i++) {
+    epicsMessageQueueSend(frameQueue_, &msg, sizeof(msg));
+  }
+  for (i=0; i<numFrameThreads_; i++) {
+    epicsEventWait(frameTaskExitEvent_);
+  }
+  lock();
+  numFrameThreads_ = 0;
+}
+
+//_____________________________________________________________________________________________
+
+/** Reads, unscrambles and corrects one frame.
+  * The parameters are read from the configuration snapshot, so normal frames are read and corrected without the
+  * lock and several frames can be processed in parallel. The lock is only taken to stop the acquisition after the
+  * last frame, and for the offset and gain calibration frames.
+  * \param[in] pMsg The frame message from newFrameCallback
+  * \param[in] dataImage DexImage owned by the calling thread, used when the frame must be processed by the SDK
+  * \param[in] saturatedMask Mask owned by the calling thread, used for the saturated pixels of HDR frames
+  * Returns the NDArray to publish, or NULL if the frame is not to be published. */
+NDArray* Dexela::processFrame(dexFrameMessage_t *pMsg, DexImage &dataImage, std::vector<epicsUInt8> &saturatedMask)
+{
+  void          *pData = NULL;
   int           numOffsetFrames;
   int           offsetCounter;
-  int           offsetAvailable;
-  int           useOffset;
   int           numGainFrames;
   int           gainCounter;
+  int           offsetAvailable;
   int           gainAvailable;
   int           useGain;
-  int           useDefectMap;
-  int           frameType;
-  int           acquiring;
-  int           darkOffset;
-  size_t        dims[2];
-  NDArray       *pImage;
+  int           correct;
+  int           pixelCounter = -1;
+  int           offset;
+  int           expected;
+  bool          useNative;
+  size_t        bytesCopied = 0;
+  size_t        numSaturated = 0;
+  DexelaFrameTimer timer;
+  std::shared_ptr<const dexConfig_t> pConfig;
+  std::shared_ptr<DexelaCalibrationSet> pCalibration;
+  std::shared_ptr<DexelaCorrection> pCorrection;
+  std::shared_ptr<DexelaDefectCorrection> pDefectCorrection;
+  NDArrayInfo   arrayInfo;
+  NDArray       *pImage = NULL;
   NDDataType_t  dataType = NDUInt16;
-  epicsTimeStamp currentTime;
-  DexImage      dataImage;
-  static const char *functionName = "newFrameCallback";
-    
-  asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-    "%s:%s: entry ...\n",
-    driverName, functionName);
+  int           bufferNumber = pMsg->bufferNumber;
+  static const char *functionName = "processFrame";
+
+  timer.set(DexStageQueue, dexTimeNow() - pMsg->queueTime);
+  // The snapshot and the calibration set it holds are immutable, so they can be used without the lock
+  pConfig = std::atomic_load(&pConfig_);
+  const dexConfig_t &config = *pConfig;
+  // At high rates we can be called for a few extra frames after acquisition is done
+  if (!config.acquiring || (pMsg->generation != config.generation)) {
+    return NULL;
+  }
+  // Each exposure of an HDR cycle has its own calibration
+  if (config.hdrNumExposures > 0) {
+    pCalibration = config.pHDRCalibration[pMsg->exposureIndex];
+    offsetAvailable = pCalibration->pOffset ? 1 : 0;
+    gainAvailable = pCalibration->pGain ? 1 : 0;
+  } else {
+    pCalibration = config.pCalibration;
+    offsetAvailable = config.offsetAvailable;
+    gainAvailable = config.gainAvailable;
+  }
+  pCorrection = pCalibration->pCorrection;
+  pDefectCorrection = pCalibration->pDefectCorrection;
+
+  if (config.frameType != ADFrameNormal) {
+    lock();
+    // The acquisition may have been stopped or restarted since the snapshot was taken
+    if (pMsg->generation != acquireGeneration_) {
+      unlock();
+      return NULL;
+    }
+    try {
+      switch (config.frameType) {
+        case ADFrameBackground:
+          getIntegerParam(DEX_NumOffsetFrames,    &numOffsetFrames);
+          getIntegerParam(DEX_CurrentOffsetFrame, &offsetCounter);
+          // Frames still in flight when the acquisition was stopped are not part of the calibration
+          if (offsetCounter >= numOffsetFrames) break;
+
+          pData = readCalibrationFrame(bufferNumber, offsetImage_, offsetCounter, dataImage);
+          offsetCounter++;
+          setIntegerParam(DEX_CurrentOffsetFrame, offsetCounter);
+          // If this is the last offset image then compute the median image and raise a flag to the 
+          // user that offset data is available
+          if (offsetCounter == numOffsetFrames) {
+            setIntegerParam(ADAcquire, 0);
+            acquireStop();
+            finishCalibration(offsetImage_, dataImage, DEX_AcquireOffset);
+            offsetImage_.SetImageType(Offset);
+            storeCalibration(std::make_shared<DexelaCalibrationImage>(std::make_shared<DexImage>(offsetImage_)),
+                             NULL, NULL);
+            pData = offsetImage_.GetDataPointerToPlane();
+            setIntegerParam(DEX_AcquireOffset, 0);
+            publishConfig();
+          }
+          if (config.arrayCallbacks) pImage = copyToArray(pData, dataType, pMsg, config);
+          break;
+
+        case ADFrameFlatField:
+          getIntegerParam(DEX_NumGainFrames,    &numGainFrames);
+          getIntegerParam(DEX_CurrentGainFrame, &gainCounter);
+          if (gainCounter >= numGainFrames) break;
+
+          pData = readCalibrationFrame(bufferNumber, gainImage_, gainCounter, dataImage);
+          gainCounter++;
+          setIntegerParam(DEX_CurrentGainFrame, gainCounter);
+          // If this is the last offset image then compute the flood image and raise a flag to the 
+          // user that offset data is available
+          if (gainCounter >= numGainFrames) {
+            setIntegerParam(ADAcquire, 0);
+            acquireStop();
+            finishCalibration(gainImage_, dataImage, DEX_AcquireGain);
+#if DEX_HAVE_SDK
+            gainImage_.FixFlood();
+#endif
+            gainImage_.SetImageType(Gain);
+            storeCalibration(NULL, std::make_shared<DexelaCalibrationImage>(std::make_shared<DexImage>(gainImage_)),
+                             NULL);
+            dataType = (gainImage_.GetImagePixelType() == flt) ? NDFloat32 : NDUInt16;
+            pData = gainImage_.GetDataPointerToPlane();
+            setIntegerParam(DEX_AcquireGain, 0);
+            publishConfig();
+          }
+          if (config.arrayCallbacks) pImage = copyToArray(pData, dataType, pMsg, config);
+          break;
+      }
+    } catch (DexelaException &e) {
+      reportError(functionName, e);
+    }
+    unlock();
+    return pImage;
+  }
 
-  lock();
-  
+  if (!countImage(config)) return NULL;
+  arrayCounter_++;
+  useNative = (config.correctionEngine == DEXCorrectionNative) && pCorrection;
+  if (useNative) correct = offsetAvailable && config.useOffset && pCorrection->hasOffset();
+  else           correct = offsetAvailable && config.useOffset && pCalibration->pOffset;
+  useGain = config.useGain && gainAvailable;
   try {
-    getIntegerParam(ADFrameType,         &frameType);
-    getIntegerParam(DEX_OffsetAvailable, &offsetAvailable);
-    getIntegerParam(DEX_UseOffset,       &useOffset);
-    getIntegerParam(DEX_GainAvailable,   &gainAvailable);
-    getIntegerParam(DEX_UseGain,         &useGain);
-    getIntegerParam(DEX_UseDefectMap,    &useDefectMap);
-    getIntegerParam(ADAcquire,           &acquiring);
-    // At high rates we can be called for a few extra frames after acquisition is done
-    if (!acquiring) goto done;
-
-    switch (frameType) {
-      case ADFrameBackground:
-        getIntegerParam(DEX_NumOffsetFrames,    &numOffsetFrames);
-        getIntegerParam(DEX_CurrentOffsetFrame, &offsetCounter);
-
+    if (!config.arrayCallbacks) {
+      // Nothing will be done with the frame so there is no need to read it
+    }
+    else if (onBoardUnscrambling_ && (!correct || useNative)) {
+      // The detector has already unscrambled the frame, so read it directly into the NDArray
+      // and do any corrections in place
+      pImage = allocArray(dataType, pMsg, config);
+      if (pImage) {
         asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-          "%s::%s calling DexelaDetector::ReadBuffer(%d, %p, %d)\n",
-          driverName, functionName, bufferNumber, offsetImage_, offsetCounter);
-        pDetector_->ReadBuffer(bufferNumber, offsetImage_, offsetCounter);
-
-        pData = offsetImage_.GetDataPointerToPlane(offsetCounter);
-        offsetCounter++;
-        setIntegerParam(DEX_CurrentOffsetFrame, offsetCounter);
-        // If this is the last offset image then compute the median image and raise a flag to the 
-        // user that offset data is available
-        if (offsetCounter == numOffsetFrames) {
-          offsetImage_.FindMedianofPlanes();
-          offsetImage_.UnscrambleImage();
-          offsetImage_.SetImageType(Offset);
-          setIntegerParam(DEX_OffsetAvailable, 1);
-          pData = offsetImage_.GetDataPointerToPlane();
-          setIntegerParam(DEX_AcquireOffset, 0);
-          setIntegerParam(ADAcquire, 0);
-          acquireStop();
+          "%s::%s calling DexelaDetector::ReadBuffer(%d, %p)\n",
+          driverName, functionName, bufferNumber, pImage->pData);
+        timer.start();
+        pDetector_->ReadBuffer(bufferNumber, (byte *)pImage->pData);
+        timer.stop(DexStageRead);
+        if (config.usePixelCounter) pixelCounter = ((epicsUInt16 *)pImage->pData)[0];
+        // HDR saturation is decided on the raw counts, before they are corrected in place
+        if (config.hdrNumExposures > 0) {
+          saturatedMask.resize(pImage->dims[0].size * pImage->dims[1].size);
+          numSaturated = DexelaHDR::findSaturated((epicsUInt16 *)pImage->pData, saturatedMask.size(),
+                                                  config.hdrSaturation, &saturatedMask[0]);
+          timer.stop(DexStageCorrect);
         }
-        break;
-
-      case ADFrameFlatField:
-        getIntegerParam(DEX_NumGainFrames,    &numGainFrames);
-        getIntegerParam(DEX_CurrentGainFrame, &gainCounter);
-
-        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-          "%s::%s calling DexelaDetector::ReadBuffer(%d, %p, %d)\n",
-          driverName, functionName, bufferNumber, gainImage_, gainCounter);
-        pDetector_->ReadBuffer(bufferNumber, gainImage_, gainCounter);
-
-        pData = gainImage_.GetDataPointerToPlane(gainCounter);
-        gainCounter++;
-        setIntegerParam(DEX_CurrentGainFrame, gainCounter);
-        // If this is the last offset image then compute the flood image and raise a flag to the 
-        // user that offset data is available
-        if (gainCounter >= numGainFrames) {
-          gainImage_.FindMedianofPlanes();
-          gainImage_.UnscrambleImage();
-          gainImage_.FixFlood();
-          gainImage_.SetImageType(Gain);
-          setIntegerParam(DEX_GainAvailable, 1);
-          dataType = NDFloat32;
-          pData = gainImage_.GetDataPointerToPlane();
-          setIntegerParam(DEX_AcquireGain, 0);
-          setIntegerParam(ADAcquire, 0);
-          acquireStop();
+        if (correct && correctionMatches("offset", pCorrection->getSizeX(), pCorrection->getSizeY(), pImage)) {
+          pCorrection->apply((epicsUInt16 *)pImage->pData, (epicsUInt16 *)pImage->pData, config.darkOffset,
+                             useGain != 0);
+          timer.stop(DexStageCorrect);
         }
-        break;
-
-      case ADFrameNormal:
-        getIntegerParam(ADImageMode, &imageMode);
-        getIntegerParam(ADNumImages, &numImages);
-        getIntegerParam(ADNumImagesCounter, &imageCounter);
-        // In SDK prior to 1.0.0.5 the following line was needed or performance suffered
-        // because it needed to read values from detector registers
-//      dataImage.SetImageParameters(binningMode_, modelNumber_);
+      }
+    }
+    else {
+      // In SDK prior to 1.0.0.5 the following line was needed or performance suffered
+      // because it needed to read values from detector registers
+//    dataImage.SetImageParameters(binningMode_, modelNumber_);
 
-        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-          "%s::%s calling DexelaDetector::ReadBuffer(%d, %p)\n",
-          driverName, functionName, bufferNumber, dataImage);
-        pDetector_->ReadBuffer(bufferNumber, dataImage);
-
-        if ((imageMode == ADImageSingle) ||
-            ((imageMode == ADImageMultiple) && 
-             (imageCounter >= numImages-1))) {
-          acquireStop();
-          setIntegerParam(ADAcquire, 0);
-        }
-        imageCounter++;
-        setIntegerParam(ADNumImagesCounter, imageCounter);
-        getIntegerParam(NDArrayCounter, &arrayCounter);
-        arrayCounter++;
-        setIntegerParam(NDArrayCounter, arrayCounter);
+      asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+        "%s::%s calling DexelaDetector::ReadBuffer(%d, %p)\n",
+        driverName, functionName, bufferNumber, &dataImage);
+      timer.start();
+      pDetector_->ReadBuffer(bufferNumber, dataImage);
+      timer.stop(DexStageRead);
+      if (config.usePixelCounter) pixelCounter = ((epicsUInt16 *)dataImage.GetDataPointerToPlane())[0];
+      // The detector may already have unscrambled the frame, then it only needs to be marked as sorted
+      if (onBoardUnscrambling_) {
+        dataImage.SetSortedFlag(true);
+      } else {
         dataImage.UnscrambleImage();
-        dataImage.SetImageType(Data);
-
+        timer.stop(DexStageUnscramble);
+      }
+      // HDR saturation is decided on the raw counts, before they are corrected
+      if (config.hdrNumExposures > 0) {
+        saturatedMask.resize((size_t)dataImage.GetImageXdim() * dataImage.GetImageYdim());
+        numSaturated = DexelaHDR::findSaturated((epicsUInt16 *)dataImage.GetDataPointerToPlane(),
+                                                saturatedMask.size(), config.hdrSaturation, &saturatedMask[0]);
+        timer.stop(DexStageCorrect);
+      }
+      dataImage.SetImageType(Data);
+
+      pImage = allocArray(dataType, pMsg, config);
+      timer.start();
+      if (pImage && correct && useNative) {
+        /** Correct for detector offset and gain, writing the result directly into the NDArray */
+        if (correctionMatches("offset", pCorrection->getSizeX(), pCorrection->getSizeY(), pImage)) {
+          pCorrection->apply((epicsUInt16 *)dataImage.GetDataPointerToPlane(), (epicsUInt16 *)pImage->pData,
+                             config.darkOffset, useGain != 0);
+          timer.stop(DexStageCorrect);
+        }
+      }
+      else if (pImage) {
         /** Correct for detector offset and gain as necessary */
-        if (offsetAvailable && useOffset && !offsetImage_.IsEmpty()) {
-          getIntegerParam(DEX_OffsetConstant, &darkOffset);
-          dataImage.SetDarkOffset(darkOffset);
-          dataImage.LoadDarkImage(offsetImage_);
-          if (gainAvailable && useGain && !gainImage_.IsEmpty()) {
-            dataImage.LoadFloodImage(gainImage_);
+        if (correct) {
+          dataImage.SetDarkOffset(config.darkOffset);
+          dataImage.LoadDarkImage(pCalibration->pOffset->getDexImage());
+          if (useGain && pCalibration->pGain) {
+            dataImage.LoadFloodImage(pCalibration->pGain->getDexImage());
             dataImage.FloodCorrection();
           } else {
             dataImage.SubtractDark();
           }
+          timer.stop(DexStageCorrect);
         }
+        pImage->getInfo(&arrayInfo);
+        memcpy(pImage->pData, dataImage.GetDataPointerToPlane(), arrayInfo.totalBytes);
+        bytesCopied = arrayInfo.totalBytes;
+        timer.stop(DexStageCopy);
+      }
+    }
 
-        /** Correct for dead pixels as necessary */
-        pData = dataImage.GetDataPointerToPlane();
-        break;
+    /** Correct for dead pixels as necessary */
+    if (pImage && config.useDefectMap && pDefectCorrection &&
+        correctionMatches("defect map", pDefectCorrection->getSizeX(), pDefectCorrection->getSizeY(), pImage)) {
+      timer.start();
+      pDefectCorrection->apply((epicsUInt16 *)pImage->pData, config.defectClasses);
+      timer.stop(DexStageCorrect);
     }
 
-    getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
-    if (arrayCallbacks) {
-      /* Update the image */
-      /* We save the most recent image buffer so it can be used in the read() function.
-       * Now release it before getting a new version. */
-      if (this->pArrays[0])
-          this->pArrays[0]->release();
+    /** Mark the pixels that were saturated in the raw frame so the HDR fusion takes them from a shorter exposure */
+    if (pImage && (numSaturated > 0) && (pImage->dims[0].size * pImage->dims[1].size == saturatedMask.size())) {
+      timer.start();
+      DexelaHDR::markSaturated(&saturatedMask[0], saturatedMask.size(), (epicsUInt16 *)pImage->pData);
+      timer.stop(DexStageCorrect);
+    }
 
-      /* Allocate the array */
-      dims[0] = pDetector_->GetBufferXdim();
-      asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-        "%s::%s called DexelaDetector::GetBufferYdim() returned dims[0]=%d\n",
-        driverName, functionName, dims[0]);
+    /** Bin in software as necessary, after the corrections so the calibrations stay at full resolution */
+    if (pImage && ((config.softwareBinX > 1) || (config.softwareBinY > 1))) {
+      timer.start();
+      pImage = binArray(pImage, DexelaBinning(config.softwareBinX, config.softwareBinY,
+                                              (DexBinOperation_t)config.softwareBinOperation,
+                                              (DexBinType_t)config.softwareBinDataType));
+      timer.stop(DexStageBin);
+    }
+    if (pImage) {
+      if (pixelCounter >= 0) {
+        pImage->pAttributeList->add("DexPixelFrameCounter", "Frame counter in the first pixel",
+                                    NDAttrInt32, &pixelCounter);
+      }
+      latency_.add(timer);
+    }
+  } catch (DexelaException &e) {
+    reportError(functionName, e);
+    if (pImage) pImage->release();
+    pImage = NULL;
+  }
+  bytesCopied_ = (int)bytesCopied;
+  if (pixelCounter >= 0) {
+    // The 16-bit pixel counter differs from the SDK frame counter by a constant during an acquisition
+    offset = (pixelCounter - pMsg->frameCounter) & 0xFFFF;
+    expected = -1;
+    if (!pixelCounterOffset_.compare_exchange_strong(expected, offset) && (offset != expected)) {
+      pixelCounterErrors_++;
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s pixel frame counter %d does not match frame counter %d\n",
+        driverName, functionName, pixelCounter, pMsg->frameCounter);
+    }
+  }
+  return pImage;
+}
 
-      dims[1] = pDetector_->GetBufferYdim();
-      asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-        "%s::%s called DexelaDetector::GetBufferYdim() returned dims[1]=%d\n",
-        driverName, functionName, dims[1]);
+//_____________________________________________________________________________________________
 
-      this->pArrays[0] = pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
-      if (this->pArrays[0] == NULL) {
-        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-          "%s:%s: error allocating buffer\n",
-          driverName, functionName);
-        goto done;
+/** Counts a normal frame, and stops the acquisition when it is the last one of a single or multiple acquisition.
+  * Called without the lock, the lock is only taken to stop the acquisition.
+  * \param[in] config The configuration snapshot the frame is processed with
+  * Returns false if the frame is beyond the number of images and is not to be published. */
+bool Dexela::countImage(const dexConfig_t &config)
+{
+  int limit = INT_MAX;
+  int imageCounter;
+  int acquiring;
+
+  // A single HDR acquisition takes one whole cycle, otherwise NumImages is the number of detector frames
+  if (config.imageMode == ADImageSingle)   limit = (config.hdrNumExposures > 0) ? config.hdrNumExposures : 1;
+  if (config.imageMode == ADImageMultiple) limit = config.numImages;
+  // Frames processed in parallel must not take the counter past the limit
+  imageCounter = imageCounter_;
+  do {
+    if (imageCounter >= limit) return false;
+  } while (!imageCounter_.compare_exchange_weak(imageCounter, imageCounter + 1));
+  if (imageCounter + 1 == limit) {
+    lock();
+    getIntegerParam(ADAcquire, &acquiring);
+    if (acquiring && (config.generation == acquireGeneration_)) {
+      acquireStop();
+      setIntegerParam(ADAcquire, 0);
+      publishConfig();
+    }
+    unlock();
+  }
+  return true;
+}
+
+//_____________________________________________________________________________________________
+
+/** Reads one offset or gain calibration frame. Called with the lock held.
+  * With the median estimator every frame is kept as a plane of calibImage. The streaming estimators read the
+  * frame into dataImage and add it to pEstimator_, so the memory does not depend on the number of frames.
+  * \param[in] bufferNumber The SDK buffer containing the frame
+  * \param[in] calibImage offsetImage_ or gainImage_
+  * \param[in] frameNumber Number of the frame within the calibration
+  * \param[in] dataImage DexImage owned by the calling thread
+  * Returns a pointer to the (scrambled) frame data. */
+void* Dexela::readCalibrationFrame(int bufferNumber, DexImage &calibImage, int frameNumber, DexImage &dataImage)
+{
+  size_t numPixels;
+  static const char *functionName = "readCalibrationFrame";
+
+  if (!pEstimator_) {
+    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+      "%s::%s calling DexelaDetector::ReadBuffer(%d, %p, %d)\n",
+      driverName, functionName, bufferNumber, &calibImage, frameNumber);
+    pDetector_->ReadBuffer(bufferNumber, calibImage, frameNumber);
+    numPixels = (size_t)calibImage.GetImageXdim() * calibImage.GetImageYdim();
+    setDoubleParam(DEX_CalibrationMemory, (frameNumber + 1) * numPixels * sizeof(epicsUInt16) / 1.e6);
+    return calibImage.GetDataPointerToPlane(frameNumber);
+  }
+
+  asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+    "%s::%s calling DexelaDetector::ReadBuffer(%d, %p)\n",
+    driverName, functionName, bufferNumber, &dataImage);
+  pDetector_->ReadBuffer(bufferNumber, dataImage);
+  numPixels = (size_t)dataImage.GetImageXdim() * dataImage.GetImageYdim();
+  if ((dataImage.GetImagePixelType() != u16) || (numPixels != pEstimator_->getNumPixels())) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s frame is not a 16-bit image of %lu pixels, not used for calibration\n",
+      driverName, functionName, (unsigned long)pEstimator_->getNumPixels());
+  } else {
+    pEstimator_->add((epicsUInt16 *)dataImage.GetDataPointerToPlane());
+  }
+  setDoubleParam(DEX_CalibrationMemory, pEstimator_->getMemorySize() / 1.e6);
+  return dataImage.GetDataPointerToPlane();
+}
+
+/** Combines the calibration frames into calibImage and unscrambles it if the detector has not.
+  * Called with the lock held and the acquisition stopped. The lock is released while the frames are combined, so
+  * the port and the other frame processing threads are not held up; calibrationFinishing_ keeps a new
+  * calibration or acquisition from starting until then.
+  * \param[in] calibImage offsetImage_ or gainImage_
+  * \param[in] dataImage DexImage containing the last frame, used as the template for the streaming estimators
+  * \param[in] command DEX_AcquireOffset or DEX_AcquireGain */
+void Dexela::finishCalibration(DexImage &calibImage, DexImage &dataImage, int command)
+{
+  epicsTimeStamp startTime, endTime;
+  DexImage medianImage;
+  std::vector<const epicsUInt16 *> planes;
+  int plane;
+  static const char *functionName = "finishCalibration";
+
+  epicsTimeGetCurrent(&startTime);
+  if (!pMedianPool_ || (pMedianPool_->getNumThreads() != numFrameThreads_)) {
+    pMedianPool_.reset(new DexelaMedianPool(numFrameThreads_));
+  }
+  calibrationFinishing_ = command;
+  unlock();
+  try {
+    if (!pEstimator_ && (calibrationEstimator_ == DexEstimatorMedian) && (calibImage.GetImagePixelType() == u16)) {
+      // The median image has the size and image parameters of one plane of the stack
+      medianImage = calibImage.GetImagePlane(0);
+      for (plane=0; plane<calibImage.GetImageDepth(); plane++) {
+        planes.push_back((epicsUInt16 *)calibImage.GetDataPointerToPlane(plane));
       }
-      pImage = this->pArrays[0];
-      pImage->getInfo(&arrayInfo);
-      // Copy the data from the input to the output
-      memcpy(pImage->pData, pData, arrayInfo.totalBytes);
-
-      setIntegerParam(NDArraySize,  (int)arrayInfo.totalBytes);
-      setIntegerParam(NDArraySizeX, (int)pImage->dims[0].size);
-      setIntegerParam(NDArraySizeY, (int)pImage->dims[1].size);
-
-      /* Put the frame number and time stamp into the buffer */
-      pImage->uniqueId = frameCounter;
-      epicsTimeGetCurrent(&currentTime);
-      pImage->timeStamp = currentTime.secPastEpoch + currentTime.nsec / 1.e9;
-      updateTimeStamp(&pImage->epicsTS);
-
-      /* Get any attributes that have been defined for this driver */
-      getAttributes(pImage->pAttributeList);
-
-      /* Call the NDArray callback */
-      asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
-        "%s:%s: calling imageData callback\n", 
-        driverName, functionName);
-      doCallbacksGenericPointer(pImage, NDArrayData, 0);
+      pMedianPool_->compute(&planes[0], (int)planes.size(),
+                            (size_t)calibImage.GetImageXdim() * calibImage.GetImageYdim(),
+                            (epicsUInt16 *)medianImage.GetDataPointerToPlane());
+      calibImage = medianImage;
+    }
+    else if (!pEstimator_) {
+      calibImage.FindMedianofPlanes();
+    } else {
+      // dataImage has the size and image parameters of the frames, so the result is written into a copy of it
+      calibImage = dataImage;
+      pEstimator_->getResult((epicsUInt16 *)calibImage.GetDataPointerToPlane());
+      pEstimator_.reset();
     }
+    if (onBoardUnscrambling_) calibImage.SetSortedFlag(true);
+    else                      calibImage.UnscrambleImage();
+  } catch (DexelaException &) {
+    lock();
+    calibrationFinishing_ = -1;
+    throw;
+  }
+  lock();
+  calibrationFinishing_ = -1;
+  epicsTimeGetCurrent(&endTime);
+  setDoubleParam(DEX_CalibrationFinishTime, epicsTimeDiffInSeconds(&endTime, &startTime) * 1000.);
+  setDoubleParam(DEX_CalibrationTotalTime, epicsTimeDiffInSeconds(&endTime, &calibrationStartTime_));
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s::%s combining the frames took %f ms\n",
+    driverName, functionName, epicsTimeDiffInSeconds(&endTime, &startTime) * 1000.);
+}
 
-    done:
+/** Creates the streaming estimator for a new offset or gain calibration, or none for the median */
+void Dexela::startCalibration(void)
+{
+  int estimator;
+  double clipSigma;
+  size_t numPixels;
+
+  getIntegerParam(DEX_CalibrationEstimator, &estimator);
+  getDoubleParam(DEX_CalibrationClipSigma, &clipSigma);
+  calibrationEstimator_ = estimator;
+  epicsTimeGetCurrent(&calibrationStartTime_);
+  pEstimator_.reset();
+  setDoubleParam(DEX_CalibrationMemory, 0.);
+  if ((estimator == DexEstimatorMedian) || (estimator == DexEstimatorSDKMedian)) return;
+  numPixels = (size_t)pDetector_->GetBufferXdim() * pDetector_->GetBufferYdim();
+  pEstimator_.reset(new DexelaStreamingEstimator((DexEstimator_t)estimator, numPixels, clipSigma));
+}
 
-    // Do callbacks on parameters
-    callParamCallbacks();
+//_____________________________________________________________________________________________
 
-  } catch (DexelaException &e) {
-    reportError(functionName, e);
+/** Allocates an NDArray for the current frame size and sets its uniqueId, time stamps and frame attributes.
+  * \param[in] dataType Data type of the frame
+  * \param[in] pMsg The frame message from newFrameCallback */
+NDArray* Dexela::allocArray(NDDataType_t dataType, dexFrameMessage_t *pMsg, const dexConfig_t &config)
+{
+  size_t        dims[2];
+  NDArray       *pImage;
+  double        callbackTime;
+  double        fittedTime;
+  static const char *functionName = "allocArray";
+
+  /* Allocate the array, the buffer size was read from the detector when the snapshot was built */
+  dims[0] = config.bufferSizeX;
+  dims[1] = config.bufferSizeY;
+
+  pImage = arrayPool_.alloc(2, dims, dataType);
+  if (pImage == NULL) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: error allocating buffer\n",
+      driverName, functionName);
+    return NULL;
+  }
+
+  /* Put the frame number and the time the frame arrived into the buffer */
+  pImage->uniqueId = pMsg->frameCounter;
+  pImage->timeStamp = pMsg->timeStamp.secPastEpoch + pMsg->timeStamp.nsec / 1.e9;
+  pImage->epicsTS = pMsg->timeStamp;
+  callbackTime = pMsg->callbackTime.secPastEpoch + pMsg->callbackTime.nsec / 1.e9;
+  pImage->pAttributeList->add("DexCallbackTime", "Time of the SDK callback", NDAttrFloat64, &callbackTime);
+  if (pMsg->fitted) {
+    fittedTime = pImage->timeStamp;
+    pImage->pAttributeList->add("DexFittedTime", "Arrival time fitted to the frame counter", NDAttrFloat64,
+                                &fittedTime);
+  }
+  pImage->pAttributeList->add("DexFrameGap", "Frames missing before this frame", NDAttrInt32, &pMsg->gap);
+  return pImage;
+}
+
+/** Allocates an NDArray for the current frame size and copies the frame into it.
+  * \param[in] pData Pointer to the frame data
+  * \param[in] dataType Data type of the frame
+  * \param[in] pMsg The frame message from newFrameCallback */
+NDArray* Dexela::copyToArray(void *pData, NDDataType_t dataType, dexFrameMessage_t *pMsg, const dexConfig_t &config)
+{
+  NDArrayInfo   arrayInfo;
+  NDArray       *pImage;
+
+  pImage = allocArray(dataType, pMsg, config);
+  if (pImage == NULL) return NULL;
+  pImage->getInfo(&arrayInfo);
+  // Copy the data from the input to the output
+  memcpy(pImage->pData, pData, arrayInfo.totalBytes);
+  return pImage;
+}
+
+/** Bins a frame in software into a new NDArray with the same uniqueId, time stamps and attributes.
+  * The input NDArray is released. Returns NULL if the binned NDArray cannot be allocated.
+  * \param[in] pImage The corrected frame
+  * \param[in] binning The binning factors, operation and output data type */
+NDArray* Dexela::binArray(NDArray *pImage, const DexelaBinning &binning)
+{
+  int sizeX = (int)pImage->dims[0].size;
+  int sizeY = (int)pImage->dims[1].size;
+  size_t dims[2];
+  NDArray *pBinned;
+  static const char *functionName = "binArray";
+
+  dims[0] = binning.getOutputSizeX(sizeX);
+  dims[1] = binning.getOutputSizeY(sizeY);
+  pBinned = arrayPool_.alloc(2, dims, binDataTypes[binning.getType()]);
+  if (pBinned == NULL) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: error allocating buffer\n",
+      driverName, functionName);
+    pImage->release();
+    return NULL;
+  }
+  pBinned->dims[0].binning = binning.getBinX();
+  pBinned->dims[1].binning = binning.getBinY();
+  pBinned->uniqueId = pImage->uniqueId;
+  pBinned->timeStamp = pImage->timeStamp;
+  pBinned->epicsTS = pImage->epicsTS;
+  pImage->pAttributeList->copy(pBinned->pAttributeList);
+  binning.apply((epicsUInt16 *)pImage->pData, sizeX, sizeY, pBinned->pData);
+  pImage->release();
+  return pBinned;
+}
+
+/** Checks that a correction is the same size as the frame.
+  * \param[in] correctionName Name of the correction for the error message
+  * \param[in] sizeX Width of the correction
+  * \param[in] sizeY Height of the correction
+  * \param[in] pImage The frame to be corrected */
+bool Dexela::correctionMatches(const char *correctionName, int sizeX, int sizeY, NDArray *pImage)
+{
+  static const char *functionName = "correctionMatches";
+
+  if ((sizeX == (int)pImage->dims[0].size) && (sizeY == (int)pImage->dims[1].size)) return true;
+  asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+    "%s::%s %s size (%d, %d) does not match frame size (%d, %d), not correcting\n",
+    driverName, functionName, correctionName, sizeX, sizeY,
+    (int)pImage->dims[0].size, (int)pImage->dims[1].size);
+  return false;
+}
+
+//_____________________________________________________________________________________________
+
+/** Publishes the frames in the order in which they arrived from the SDK.
+  * Frames that finish out of order are held until all earlier frames have been published. The ordering, HDR fusion
+  * and accumulation are serialized by publishMutex_ without the lock, because they work on whole frames. The frames
+  * they complete are queued in order in readyArrays_, and the lock is only taken for the callbacks and parameters.
+  * \param[in] pMsg The frame message from newFrameCallback
+  * \param[in] pImage The processed frame, or NULL if this frame is not to be published */
+void Dexela::publishFrame(dexFrameMessage_t *pMsg, NDArray *pImage)
+{
+  std::shared_ptr<const dexConfig_t> pConfig = std::atomic_load(&pConfig_);
+  std::map<int, dexPendingFrame_t>::iterator it;
+  dexPendingFrame_t frame;
+  epicsUInt64 accumulateStart;
+  epicsUInt64 fuseStart;
+  int acquiring;
+  double statusRate;
+  bool published;
+
+  epicsMutexLock(publishMutex_);
+  // Frames from a previous acquisition are discarded. resetFramePipeline() changes the generation with
+  // publishMutex_ held.
+  if (pMsg->generation != acquireGeneration_) {
+    if (pImage) pImage->release();
+  } else {
+    frame.pArray = pImage;
+    frame.queueTime = pMsg->queueTime;
+    frame.gap = pMsg->gap;
+    frame.exposureIndex = pMsg->exposureIndex;
+    pendingArrays_[pMsg->sequence] = frame;
+  }
+  while ((it = pendingArrays_.find(nextPublishSequence_)) != pendingArrays_.end()) {
+    frame = it->second;
+    pImage = frame.pArray;
+    pendingArrays_.erase(it);
+    nextPublishSequence_++;
+    if (frame.gap > 0) {
+      droppedFrames_ += frame.gap;
+      lastGap_ = frame.gap;
+    }
+    if (!pImage) continue;
+    if (hdrNumExposures_ > 0) {
+      // Only the fused frame is published when the cycle is complete
+      fuseStart = dexTimeNow();
+      pImage = fuseHDRFrame(pImage, frame.exposureIndex);
+      latency_.add(DexStageFuse, dexTimeNow() - fuseStart);
+      if (!pImage) continue;
+    }
+    if (pConfig->numAccumulate > 1) {
+      // The frames are added in the order they arrived, only the completed sum is published
+      accumulateStart = dexTimeNow();
+      pImage = accumulateFrame(pImage, frame.gap, pConfig->numAccumulate, pConfig->accumulateDataType);
+      latency_.add(DexStageAccumulate, dexTimeNow() - accumulateStart);
+      if (!pImage) continue;
+    }
+    queueReadyArray(pImage, frame.queueTime);
+  }
+  epicsMutexUnlock(publishMutex_);
+
+  lock();
+  framesToPublish_--;
+  // Another thread may already have published the frames this one queued
+  published = publishReadyArrays();
+  // A partial sum is published when the acquisition ends, by the last frame that was still in the pipeline
+  if (flushAccumulation()) published = true;
+  getIntegerParam(ADAcquire, &acquiring);
+  // Make the statistics of the whole acquisition available when it ends
+  if (published && !acquiring) updateLatencyParams();
+
+  // While acquiring the status thread does the callbacks on parameters at DEXStatusRate, the final values are
+  // published here
+  getDoubleParam(DEX_StatusRate, &statusRate);
+  if (!acquiring || (statusRate <= 0)) {
+    updateFrameCounters();
+    callParamCallbacks();
   }
   unlock();
-  asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-    "%s:%s: exit\n",
+}
+
+/** Queues a completed frame or sum for publishReadyArrays(). Called with publishMutex_ held, so the arrays are
+  * queued in the order the frames arrived.
+  * \param[in] pImage The NDArray to publish
+  * \param[in] queueTime dexTimeNow() when the SDK callback queued the last frame in the NDArray */
+void Dexela::queueReadyArray(NDArray *pImage, epicsUInt64 queueTime)
+{
+  dexPendingFrame_t ready;
+
+  ready.pArray = pImage;
+  ready.queueTime = queueTime;
+  ready.gap = 0;
+  ready.exposureIndex = 0;
+  epicsMutexLock(readyMutex_);
+  readyArrays_.push_back(ready);
+  epicsMutexUnlock(readyMutex_);
+}
+
+/** Does the callbacks for the arrays queued by queueReadyArray(), in order. Called with the lock held, which
+  * serializes the callbacks. Returns true if any array was published. */
+bool Dexela::publishReadyArrays(void)
+{
+  dexPendingFrame_t ready;
+  bool published = false;
+
+  while (1) {
+    epicsMutexLock(readyMutex_);
+    if (readyArrays_.empty()) {
+      epicsMutexUnlock(readyMutex_);
+      break;
+    }
+    ready = readyArrays_.front();
+    readyArrays_.pop_front();
+    epicsMutexUnlock(readyMutex_);
+    publishArray(ready.pArray, ready.queueTime);
+    published = true;
+  }
+  return published;
+}
+
+/** Copies the counters of the frame processing threads to the parameters. Called with the lock held. */
+void Dexela::updateFrameCounters(void)
+{
+  setIntegerParam(ADNumImagesCounter,      imageCounter_);
+  setIntegerParam(NDArrayCounter,          arrayCounter_);
+  setIntegerParam(DEX_BytesCopied,         bytesCopied_);
+  setIntegerParam(DEX_PixelCounterErrors,  pixelCounterErrors_);
+  setIntegerParam(DEX_DroppedFrames,       droppedFrames_);
+  setIntegerParam(DEX_LastGap,             lastGap_);
+  setIntegerParam(DEX_NumAccumulated,      numAccumulated_);
+  setIntegerParam(DEX_HDRIncompleteCycles, hdrIncompleteCycles_);
+}
+
+/** Does the NDArray callbacks for a frame or an accumulated sum. Called with the lock held.
+  * \param[in] pImage The NDArray to publish
+  * \param[in] queueTime dexTimeNow() when the SDK callback queued the last frame in the NDArray */
+void Dexela::publishArray(NDArray *pImage, epicsUInt64 queueTime)
+{
+  NDArrayInfo arrayInfo;
+  epicsUInt64 callbackStart, now;
+  static const char *functionName = "publishArray";
+
+  /* We save the most recent image buffer so it can be used in the read() function.
+   * Now release it before saving the new one. */
+  if (this->pArrays[0])
+      this->pArrays[0]->release();
+  this->pArrays[0] = pImage;
+  pImage->getInfo(&arrayInfo);
+  setIntegerParam(NDArraySize,  (int)arrayInfo.totalBytes);
+  setIntegerParam(NDArraySizeX, (int)pImage->dims[0].size);
+  setIntegerParam(NDArraySizeY, (int)pImage->dims[1].size);
+  setIntegerParam(NDDataType,   pImage->dataType);
+
+  /* Get any attributes that have been defined for this driver */
+  getAttributes(pImage->pAttributeList);
+
+  /* Call the NDArray callback */
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s:%s: calling imageData callback\n", 
     driverName, functionName);
+  callbackStart = dexTimeNow();
+  doCallbacksGenericPointer(pImage, NDArrayData, 0);
+  now = dexTimeNow();
+  latency_.add(DexStageCallbacks, now - callbackStart);
+  latency_.add(DexStageTotal, now - queueTime);
+  if (latency_.frameDone(now, DEX_LATENCY_UPDATE_INTERVAL)) updateLatencyParams();
+}
+
+/** Adds a frame to the accumulated sum and releases it. Called with publishMutex_ held, in the order the frames
+  * arrived.
+  * The sum has the uniqueId, time stamps and attributes of its first frame.
+  * Returns the sum when it has numAccumulate frames, otherwise NULL.
+  * \param[in] pImage The corrected frame
+  * \param[in] gap Number of frames missing before this frame
+  * \param[in] numAccumulate Number of frames in each sum
+  * \param[in] dataType DEXAccumulateUInt32 or DEXAccumulateFloat32; floating point frames always use Float32 */
+NDArray* Dexela::accumulateFrame(NDArray *pImage, int gap, int numAccumulate, int dataType)
+{
+  NDDataType_t sumType = ((dataType == DEXAccumulateFloat32) || (pImage->dataType == NDFloat32)) ? NDFloat32 : NDUInt32;
+  NDArrayInfo arrayInfo;
+  size_t dims[2];
+  size_t numPixels;
+  static const char *functionName = "accumulateFrame";
+
+  if (pAccumulated_ && ((pAccumulated_->dims[0].size != pImage->dims[0].size) ||
+                        (pAccumulated_->dims[1].size != pImage->dims[1].size) ||
+                        (pAccumulated_->dataType != sumType))) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: frame size or data type changed, discarding the sum of %d frames\n",
+      driverName, functionName, (int)numAccumulated_);
+    pAccumulated_->release();
+    pAccumulated_ = NULL;
+  }
+  if (!pAccumulated_) {
+    dims[0] = pImage->dims[0].size;
+    dims[1] = pImage->dims[1].size;
+    pAccumulated_ = arrayPool_.alloc(2, dims, sumType);
+    if (pAccumulated_ == NULL) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: error allocating buffer\n",
+        driverName, functionName);
+      pImage->release();
+      return NULL;
+    }
+    pAccumulated_->getInfo(&arrayInfo);
+    memset(pAccumulated_->pData, 0, arrayInfo.totalBytes);
+    pAccumulated_->dims[0].binning = pImage->dims[0].binning;
+    pAccumulated_->dims[1].binning = pImage->dims[1].binning;
+    pAccumulated_->uniqueId = pImage->uniqueId;
+    pAccumulated_->timeStamp = pImage->timeStamp;
+    pAccumulated_->epicsTS = pImage->epicsTS;
+    pImage->pAttributeList->copy(pAccumulated_->pAttributeList);
+    numAccumulated_ = 0;
+    accumulatedGap_ = 0;
+    firstAccumulatedFrame_ = pImage->uniqueId;
+  }
+
+  numPixels = pImage->dims[0].size * pImage->dims[1].size;
+  switch (pImage->dataType) {
+    case NDUInt16:
+      if (sumType == NDUInt32) accumulator_.add((epicsUInt16 *)pImage->pData, (epicsUInt32 *)pAccumulated_->pData, numPixels);
+      else                     accumulator_.add((epicsUInt16 *)pImage->pData, (float *)pAccumulated_->pData, numPixels);
+      break;
+    case NDUInt32:
+      if (sumType == NDUInt32) accumulator_.add((epicsUInt32 *)pImage->pData, (epicsUInt32 *)pAccumulated_->pData, numPixels);
+      else                     accumulator_.add((epicsUInt32 *)pImage->pData, (float *)pAccumulated_->pData, numPixels);
+      break;
+    case NDFloat32:
+      accumulator_.add((float *)pImage->pData, (float *)pAccumulated_->pData, numPixels);
+      break;
+    default:
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: cannot accumulate data type %d\n",
+        driverName, functionName, pImage->dataType);
+      pImage->release();
+      return NULL;
+  }
+  numAccumulated_++;
+  accumulatedGap_ += gap;
+  lastAccumulatedFrame_ = pImage->uniqueId;
+  pImage->release();
+  if (numAccumulated_ < numAccumulate) return NULL;
+  return finishAccumulation();
+}
+
+/** Returns the accumulated sum with the attributes that describe it and starts a new sum.
+  * Called with publishMutex_ held. Returns NULL if no frames have been accumulated. */
+NDArray* Dexela::finishAccumulation(void)
+{
+  NDArray *pSum = pAccumulated_;
+  int numAccumulated = numAccumulated_;
+
+  if (!pSum) return NULL;
+  pSum->pAttributeList->add("DexAccumulatedFrames", "Number of frames in the sum", NDAttrInt32, &numAccumulated);
+  pSum->pAttributeList->add("DexFirstFrameCounter", "Frame counter of the first frame in the sum", NDAttrInt32,
+                            &firstAccumulatedFrame_);
+  pSum->pAttributeList->add("DexLastFrameCounter", "Frame counter of the last frame in the sum", NDAttrInt32,
+                            &lastAccumulatedFrame_);
+  pSum->pAttributeList->add("DexFrameGap", "Frames missing before and within the sum", NDAttrInt32,
+                            &accumulatedGap_);
+  pAccumulated_ = NULL;
+  numAccumulated_ = 0;
+  return pSum;
+}
+
+/** Publishes the partial sum when acquisition has stopped and no frames are left to add to it.
+  * Called with the lock held by publishFrame() for each frame, and by writeInt32() when acquisition is stopped,
+  * which would otherwise leave the sum unpublished if no frames were in the pipeline. framesToPublish_ is only
+  * decremented with the lock held, so exactly one of them sees it reach 0. No frame is then left for the publish
+  * stage, so publishMutex_ is not held for long. Returns true if a sum was published. */
+bool Dexela::flushAccumulation(void)
+{
+  NDArray *pSum = NULL;
+  int acquiring;
+
+  getIntegerParam(ADAcquire, &acquiring);
+  if (acquiring || (framesToPublish_ > 0)) return false;
+  epicsMutexLock(publishMutex_);
+  if (pendingArrays_.empty()) pSum = finishAccumulation();
+  if (pSum) queueReadyArray(pSum, dexTimeNow());
+  epicsMutexUnlock(publishMutex_);
+  if (!pSum) return false;
+  publishReadyArrays();
+  setIntegerParam(DEX_NumAccumulated, 0);
+  return true;
+}
+
+/** Limits DEX_NumAccumulate so a UInt32 sum cannot overflow. Called with the lock held.
+  * 16-bit frames allow DEX_MAX_ACCUMULATE frames, frames software-binned to UInt32 allow fewer because each
+  * pixel can be up to 65535 times the bin size. Float32 sums cannot overflow. */
+void Dexela::limitNumAccumulate(void)
+{
+  int numAccumulate;
+  int accumulateDataType;
+  int binX, binY, binOperation, binDataType;
+  epicsUInt32 maxValue = 65535;
+  int maxAccumulate = DEX_MAX_ACCUMULATE;
+
+  getIntegerParam(DEX_NumAccumulate,        &numAccumulate);
+  getIntegerParam(DEX_AccumulateDataType,   &accumulateDataType);
+  getIntegerParam(DEX_SoftwareBinX,         &binX);
+  getIntegerParam(DEX_SoftwareBinY,         &binY);
+  getIntegerParam(DEX_SoftwareBinOperation, &binOperation);
+  getIntegerParam(DEX_SoftwareBinDataType,  &binDataType);
+  if ((accumulateDataType == DEXAccumulateUInt32) && ((binX > 1) || (binY > 1)) && (binDataType == DexBinUInt32)) {
+    maxValue = DexelaBinning(binX, binY, (DexBinOperation_t)binOperation, DexBinUInt32).getMaxValue();
+  }
+  if ((epicsUInt32)maxAccumulate > 0xFFFFFFFFu / maxValue) maxAccumulate = (int)(0xFFFFFFFFu / maxValue);
+  if (numAccumulate < 1) setIntegerParam(DEX_NumAccumulate, 1);
+  if (numAccumulate > maxAccumulate) setIntegerParam(DEX_NumAccumulate, maxAccumulate);
+}
+
+//_____________________________________________________________________________________________
+
+/** Prepares the HDR cycle of an acquisition from the HDR parameters, or disables HDR for the acquisition.
+  * The calibration of each exposure time is taken from the calibration library, or is the active calibration if
+  * the exposure time is the one it was taken at. Called by resetFramePipeline() with the lock and publishMutex_
+  * held, so no frame is being fused. */
+void Dexela::setupHDR(void)
+{
+  DexelaCalibrationKey key = currentCalibrationKey();
+  double exposureTimes[DEX_MAX_HDR_EXPOSURES];
+  int hdrMode;
+  int numExposures;
+  int binX, binY;
+  int useOffset;
+  int darkOffset;
+  int misses;
+  int i;
+  static const char *functionName = "setupHDR";
+
+  hdrNumExposures_ = 0;
+  for (i=0; i<DEX_MAX_HDR_EXPOSURES; i++) hdrCalibration_[i].reset();
+  getIntegerParam(DEX_HDRMode, &hdrMode);
+  if (!hdrMode) return;
+
+  getIntegerParam(DEX_SoftwareBinX, &binX);
+  getIntegerParam(DEX_SoftwareBinY, &binY);
+  if ((binX > 1) || (binY > 1)) {
+    // The fusion needs the full resolution UInt16 frames, and binning is done before the cycle is complete
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s HDR cannot be used with software binning, HDR is disabled\n",
+      driverName, functionName);
+    setIntegerParam(DEX_HDRMode, 0);
+    return;
+  }
+  getIntegerParam(DEX_HDRNumExposures, &numExposures);
+  getIntegerParam(DEX_UseOffset,       &useOffset);
+  getIntegerParam(DEX_OffsetConstant,  &darkOffset);
+  for (i=0; i<numExposures; i++) {
+    getDoubleParam(DEX_HDRExposure[i], &exposureTimes[i]);
+    key.exposureUs = (int)(exposureTimes[i] * 1e6 + 0.5);
+    hdrCalibration_[i] = findCalibration(key);
+    if (!hdrCalibration_[i]->pOffset && (key.exposureUs == activeKey_.exposureUs)) {
+      hdrCalibration_[i] = pCalibration_;
+    }
+    if (!hdrCalibration_[i]->pOffset) {
+      getIntegerParam(DEX_CalibrationMisses, &misses);
+      setIntegerParam(DEX_CalibrationMisses, misses+1);
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s no offset for HDR exposure %d, %s\n",
+        driverName, functionName, i+1, key.toString().c_str());
+    }
+  }
+  hdr_.setExposures(numExposures, exposureTimes);
+  // The offset correction adds the offset constant to every pixel
+  hdr_.setPedestal(useOffset ? darkOffset : 0);
+  hdrNumExposures_ = numExposures;
+}
+
+/** Adds a frame to the current HDR cycle and releases it. Called with publishMutex_ held, in the order the frames
+  * arrived. A cycle with missing frames is discarded when the next cycle starts.
+  * \param[in] pImage Corrected frame
+  * \param[in] exposureIndex Position of the frame in the cycle
+  * Returns the fused Float32 NDArray when the cycle is complete, otherwise NULL. */
+NDArray* Dexela::fuseHDRFrame(NDArray *pImage, int exposureIndex)
+{
+  const epicsUInt16 *pFrames[DEX_MAX_HDR_EXPOSURES];
+  NDArray *pFused;
+  size_t dims[2];
+  int i;
+  static const char *functionName = "fuseHDRFrame";
+
+  if (pImage->dataType != NDUInt16) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: HDR frames must be UInt16, not data type %d\n",
+      driverName, functionName, pImage->dataType);
+    pImage->release();
+    return NULL;
+  }
+  if ((exposureIndex == 0) || pHDRFrames_[exposureIndex]) {
+    for (i=0; i<hdrNumExposures_; i++) {
+      if (pHDRFrames_[i]) break;
+    }
+    if (i < hdrNumExposures_) hdrIncompleteCycles_++;
+    releaseHDRFrames();
+  }
+  for (i=0; i<hdrNumExposures_; i++) {
+    if (pHDRFrames_[i] && ((pHDRFrames_[i]->dims[0].size != pImage->dims[0].size) ||
+                           (pHDRFrames_[i]->dims[1].size != pImage->dims[1].size))) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s:%s: frame size changed within an HDR cycle\n",
+        driverName, functionName);
+      releaseHDRFrames();
+      break;
+    }
+  }
+  pHDRFrames_[exposureIndex] = pImage;
+  for (i=0; i<hdrNumExposures_; i++) {
+    if (!pHDRFrames_[i]) return NULL;
+    pFrames[i] = (const epicsUInt16 *)pHDRFrames_[i]->pData;
+  }
+
+  dims[0] = pImage->dims[0].size;
+  dims[1] = pImage->dims[1].size;
+  pFused = arrayPool_.alloc(2, dims, NDFloat32);
+  if (pFused) {
+    // The fused frame has the frame counter, time stamp and attributes of the first exposure of the cycle
+    pFused->dims[0].binning = pHDRFrames_[0]->dims[0].binning;
+    pFused->dims[1].binning = pHDRFrames_[0]->dims[1].binning;
+    pFused->uniqueId = pHDRFrames_[0]->uniqueId;
+    pFused->timeStamp = pHDRFrames_[0]->timeStamp;
+    pFused->epicsTS = pHDRFrames_[0]->epicsTS;
+    pHDRFrames_[0]->pAttributeList->copy(pFused->pAttributeList);
+    pFused->pAttributeList->add("DexHDRExposures", "Number of exposures fused into the frame", NDAttrInt32,
+                                &hdrNumExposures_);
+    hdr_.fuse(pFrames, dims[0] * dims[1], (float *)pFused->pData);
+  } else {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s:%s: error allocating buffer\n",
+      driverName, functionName);
+  }
+  releaseHDRFrames();
+  return pFused;
 }
 
+/** Releases the frames of the current HDR cycle. Called with publishMutex_ held. */
+void Dexela::releaseHDRFrames(void)
+{
+  int i;
+
+  for (i=0; i<DEX_MAX_HDR_EXPOSURES; i++) {
+    if (pHDRFrames_[i]) pHDRFrames_[i]->release();
+    pHDRFrames_[i] = NULL;
+  }
+}
+
+/** Discards any frames waiting to be published, prepares the HDR cycle and starts a new acquisition sequence.
+  * Frames from earlier acquisitions that are still in the queue are then ignored. Called with the lock held.
+  * publishMutex_ is held while the pipeline is changed, which waits for a frame that is being fused or accumulated.
+  * \param[in] useHDR Set up the HDR cycle from the HDR parameters, otherwise HDR is disabled for the acquisition */
+void Dexela::resetFramePipeline(bool useHDR)
+{
+  std::map<int, dexPendingFrame_t>::iterator it;
+  std::deque<dexPendingFrame_t>::iterator ready;
+
+  epicsMutexLock(publishMutex_);
+  for (it = pendingArrays_.begin(); it != pendingArrays_.end(); ++it) {
+    if (it->second.pArray) it->second.pArray->release();
+  }
+  pendingArrays_.clear();
+  epicsMutexLock(readyMutex_);
+  for (ready = readyArrays_.begin(); ready != readyArrays_.end(); ++ready) {
+    ready->pArray->release();
+  }
+  readyArrays_.clear();
+  epicsMutexUnlock(readyMutex_);
+  if (pAccumulated_) pAccumulated_->release();
+  pAccumulated_ = NULL;
+  numAccumulated_ = 0;
+  setIntegerParam(DEX_NumAccumulated, 0);
+  releaseHDRFrames();
+  hdrIncompleteCycles_ = 0;
+  setIntegerParam(DEX_HDRIncompleteCycles, 0);
+  if (useHDR) {
+    setupHDR();
+  } else {
+    hdrNumExposures_ = 0;
+  }
+  latency_.reset();
+  updateLatencyParams();
+  nextFrameCounter_ = -1;
+  queueDropped_ = 0;
+  pixelCounterOffset_ = -1;
+  pixelCounterErrors_ = 0;
+  fitTimeStamps_ = false;
+  timeStampFit_.reset();
+  epicsTimeGetCurrent(&fitOrigin_);
+  droppedFrames_ = 0;
+  lastGap_ = 0;
+  setIntegerParam(DEX_DroppedFrames, 0);
+  setIntegerParam(DEX_LastGap, 0);
+  setIntegerParam(DEX_PixelCounterErrors, 0);
+  acquireGeneration_++;
+  frameSequence_ = 0;
+  nextPublishSequence_ = 0;
+  epicsMutexUnlock(publishMutex_);
+  // The frames of the new acquisition must see its generation and parameters
+  publishConfig();
+  if (statusEvent_) epicsEventSignal(statusEvent_);
+}
+
+//_____________________________________________________________________________________________
+
+/** Builds a new configuration snapshot from the parameter library and publishes it to the frame processing threads.
+  * Called with the lock held whenever one of the parameters in dexConfig_t may have changed. The buffer size is read
+  * from the detector here, so the frame processing threads never need to ask the SDK for it. */
+void Dexela::publishConfig(void)
+{
+  std::shared_ptr<const dexConfig_t> pOldConfig = std::atomic_load(&pConfig_);
+  std::shared_ptr<dexConfig_t> pConfig = std::make_shared<dexConfig_t>(*pOldConfig);
+  int i;
+  static const char *functionName = "publishConfig";
+
+  getIntegerParam(ADAcquire,                &pConfig->acquiring);
+  getIntegerParam(ADFrameType,              &pConfig->frameType);
+  getIntegerParam(ADImageMode,              &pConfig->imageMode);
+  getIntegerParam(ADNumImages,              &pConfig->numImages);
+  getIntegerParam(NDArrayCallbacks,         &pConfig->arrayCallbacks);
+  getIntegerParam(DEX_OffsetAvailable,      &pConfig->offsetAvailable);
+  getIntegerParam(DEX_UseOffset,            &pConfig->useOffset);
+  getIntegerParam(DEX_GainAvailable,        &pConfig->gainAvailable);
+  getIntegerParam(DEX_UseGain,              &pConfig->useGain);
+  getIntegerParam(DEX_UseDefectMap,         &pConfig->useDefectMap);
+  getIntegerParam(DEX_OffsetConstant,       &pConfig->darkOffset);
+  getIntegerParam(DEX_CorrectionEngine,     &pConfig->correctionEngine);
+  getIntegerParam(DEX_DefectClasses,        &pConfig->defectClasses);
+  getIntegerParam(DEX_PixelFrameCounter,    &pConfig->usePixelCounter);
+  getIntegerParam(DEX_SoftwareBinX,         &pConfig->softwareBinX);
+  getIntegerParam(DEX_SoftwareBinY,         &pConfig->softwareBinY);
+  getIntegerParam(DEX_SoftwareBinOperation, &pConfig->softwareBinOperation);
+  getIntegerParam(DEX_SoftwareBinDataType,  &pConfig->softwareBinDataType);
+  pConfig->generation = acquireGeneration_;
+  // The sum of an acquisition is accumulated with the settings it started with, including the frames that are
+  // still in the pipeline when it stops
+  if (!pOldConfig->acquiring || (pConfig->generation != pOldConfig->generation)) {
+    getIntegerParam(DEX_NumAccumulate,      &pConfig->numAccumulate);
+    getIntegerParam(DEX_AccumulateDataType, &pConfig->accumulateDataType);
+  }
+  pConfig->pCalibration = pCalibration_;
+  pConfig->hdrNumExposures = hdrNumExposures_;
+  getIntegerParam(DEX_HDRSaturation, &pConfig->hdrSaturation);
+  for (i=0; i<DEX_MAX_HDR_EXPOSURES; i++) pConfig->pHDRCalibration[i] = hdrCalibration_[i];
+  // The previous size is kept if the detector cannot be read
+  if (connected_) {
+    try {
+      pConfig->bufferSizeX = pDetector_->GetBufferXdim();
+      pConfig->bufferSizeY = pDetector_->GetBufferYdim();
+      asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+        "%s::%s called DexelaDetector::GetBufferXdim() and GetBufferYdim(), returned %d, %d\n",
+        driverName, functionName, (int)pConfig->bufferSizeX, (int)pConfig->bufferSizeY);
+    } catch (DexelaException &e) {
+      reportError(functionName, e);
+    }
+  }
+  std::atomic_store(&pConfig_, std::shared_ptr<const dexConfig_t>(pConfig));
+}
+
+/** Allocates and releases the NDArrays that the acquisition about to start will need, so the NDArrayPool already
+  * has their memory when the first frames arrive. DEX_NumPreallocate arrays of the frame size, and of the software
+  * binned size if binning is enabled, are allocated, and two fused frames and two sums if HDR and accumulation
+  * are enabled.
+  * Also resets the pool counters, so they only count the allocations of the acquisition. Called with the lock held. */
+void Dexela::preallocateArrays(void)
+{
+  std::vector<NDArray *> arrays;
+  // resetFramePipeline() has just published the snapshot of this acquisition
+  std::shared_ptr<const dexConfig_t> pConfig = std::atomic_load(&pConfig_);
+  size_t dims[2];
+  int numArrays, lockArrays;
+  int numFailed = 0;
+  int i;
+  NDDataType_t dataType = NDUInt16;
+  static const char *functionName = "preallocateArrays";
+
+  getIntegerParam(DEX_NumPreallocate, &numArrays);
+  getIntegerParam(DEX_LockArrays,     &lockArrays);
+  arrayPool_.setLockMemory(lockArrays != 0);
+  if (numArrays > 0) {
+    dims[0] = pConfig->bufferSizeX;
+    dims[1] = pConfig->bufferSizeY;
+    for (i=0; i<numArrays; i++) arrays.push_back(arrayPool_.alloc(2, dims, dataType));
+    // Calibration frames are not binned or accumulated
+    if ((pConfig->frameType == ADFrameNormal) && ((pConfig->softwareBinX > 1) || (pConfig->softwareBinY > 1))) {
+      DexelaBinning binning(pConfig->softwareBinX, pConfig->softwareBinY,
+                            (DexBinOperation_t)pConfig->softwareBinOperation,
+                            (DexBinType_t)pConfig->softwareBinDataType);
+      dims[0] = binning.getOutputSizeX((int)dims[0]);
+      dims[1] = binning.getOutputSizeY((int)dims[1]);
+      dataType = binDataTypes[binning.getType()];
+      for (i=0; i<numArrays; i++) arrays.push_back(arrayPool_.alloc(2, dims, dataType));
+    }
+    if ((pConfig->frameType == ADFrameNormal) && (pConfig->hdrNumExposures > 0)) {
+      dataType = NDFloat32;
+      for (i=0; i<2; i++) arrays.push_back(arrayPool_.alloc(2, dims, dataType));
+    }
+    if ((pConfig->frameType == ADFrameNormal) && (pConfig->numAccumulate > 1)) {
+      dataType = ((pConfig->accumulateDataType == DEXAccumulateFloat32) || (dataType == NDFloat32)) ?
+                 NDFloat32 : NDUInt32;
+      for (i=0; i<2; i++) arrays.push_back(arrayPool_.alloc(2, dims, dataType));
+    }
+    // The arrays are only released once they have all been allocated, so each one has its own memory.
+    // Memory that was already in the pool is locked here, alloc() only locks new memory.
+    for (i=0; i<(int)arrays.size(); i++) {
+      if (!arrays[i]) {
+        numFailed++;
+        continue;
+      }
+      if (lockArrays) arrayPool_.lockArray(arrays[i]);
+      arrays[i]->release();
+    }
+    asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s::%s preallocated %d arrays, %d needed new memory\n",
+      driverName, functionName, (int)arrays.size() - numFailed, arrayPool_.getMisses());
+    if (numFailed > 0) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s could not allocate %d arrays, increase maxMemory\n",
+        driverName, functionName, numFailed);
+    }
+    if (arrayPool_.getLockFailures() > 0) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s could not lock the memory of %d arrays\n",
+        driverName, functionName, arrayPool_.getLockFailures());
+    }
+  }
+  arrayPool_.resetCounters();
+  setIntegerParam(DEX_PoolHits, 0);
+  setIntegerParam(DEX_PoolMisses, 0);
+}
+
+/** Copies the frame rate, the latency percentiles, the time stamp fit and the NDArray pool counters to the
+  * parameter library. Called with the lock held. */
+void Dexela::updateLatencyParams(void)
+{
+  int stage;
+
+  setIntegerParam(DEX_PoolHits, arrayPool_.getHits());
+  setIntegerParam(DEX_PoolMisses, arrayPool_.getMisses());
+  setDoubleParam(DEX_FrameRate, latency_.getFrameRate());
+  setDoubleParam(DEX_FittedPeriod, timeStampFit_.getPeriod() * 1000.);
+  setDoubleParam(DEX_TimeStampJitter, timeStampFit_.getJitter() * 1000.);
+  for (stage=0; stage<DexNumStages; stage++) {
+    const DexelaHistogram &histogram = latency_.getHistogram((DexStage_t)stage);
+    setDoubleParam(DEX_LatencyP50[stage], histogram.getPercentile(0.50) * 1000.);
+    setDoubleParam(DEX_LatencyP99[stage], histogram.getPercentile(0.99) * 1000.);
+    setDoubleParam(DEX_LatencyMax[stage], histogram.getMax() * 1000.);
+  }
+}
 
 //_____________________________________________________________________________________________
 /** Called when asyn clients call pasynInt32->write().
@@ -546,6 +2301,8 @@ asynStatus Dexela::writeInt32(asynUser *pasynUser, epicsInt32 value)
 {
   int function = pasynUser->reason;
   int acquiring;
+  int hdrMode;
+  int binX, binY;
   int status = asynSuccess;
   static const char *functionName = "writeInt32";
 
@@ -556,7 +2313,32 @@ asynStatus Dexela::writeInt32(asynUser *pasynUser, epicsInt32 value)
      * status at the end, but that's OK */
     status = setIntegerParam(function, value);
 
-    if (function == ADAcquire) {
+    if (!connected_ &&
+        ((function == DEX_BinningMode) || (function == DEX_FullWellMode) || (function == DEX_ReadoutMode) ||
+         (function == ADMinX) || (function == ADMinY) || (function == ADSizeX) || (function == ADSizeY) ||
+         (function == DEX_HDRMode) || (function == DEX_OnBoardLinearization) || (function == DEX_OnBoardXTalk) ||
+         (function == DEX_ROIMargin) || (function == DEX_PixelFrameCounter))) {
+      // The setting is applied by restoreSettings() when the detector connects
+      pendingSettings_.insert(function);
+    }
+    else if (!connected_ &&
+             (((function == ADAcquire) && value) || (function == DEX_AcquireOffset) ||
+              (function == DEX_AcquireGain) || (function == DEX_SoftwareTrigger))) {
+      setIntegerParam(function, 0);
+      status = asynError;
+    }
+    else if ((calibrationFinishing_ >= 0) &&
+             (((function == ADAcquire) && value) || (function == DEX_AcquireOffset) ||
+              (function == DEX_AcquireGain))) {
+      // The frames of the last calibration are still being combined without the lock
+      setIntegerParam(function, (function == calibrationFinishing_) ? 1 : 0);
+      status = asynError;
+    }
+    else if (function == DEX_Reconnect) {
+      if (value) connectionLost();
+      setIntegerParam(DEX_Reconnect, 0);
+    }
+    else if (function == ADAcquire) {
       // Start acquisition
       if (value && !acquiring) {
         acquireStart();
@@ -564,6 +2346,9 @@ asynStatus Dexela::writeInt32(asynUser *pasynUser, epicsInt32 value)
       // Stop acquisition
       if (!value && acquiring) {
         acquireStop();
+        // Frames still being processed or waiting to be published publish the partial sum when the last of them
+        // has been added to it
+        flushAccumulation();
       }
     }
     else if (function == DEX_AcquireOffset) {
@@ -582,6 +2367,8 @@ asynStatus Dexela::writeInt32(asynUser *pasynUser, epicsInt32 value)
         "%s::%s calling DexelaDetector::SetBinningMode(%d)\n",
         driverName, functionName, binningMode_);
       pDetector_->SetBinningMode(binningMode_);
+      // The ROI and the readout time depend on the binning
+      setROI();
     }
     else if (function == DEX_FullWellMode) {
       asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
@@ -600,21 +2387,129 @@ asynStatus Dexela::writeInt32(asynUser *pasynUser, epicsInt32 value)
         "%s::%s calling DexelaDetector::SetReadoutMode()\n",
         driverName, functionName);
       pDetector_->SetReadoutMode((ReadoutModes)value);
+      updateReadoutTime();
+    }
+    else if ((function == ADMinX) || (function == ADMinY) || (function == ADSizeX) || (function == ADSizeY)) {
+      setROI();
+    }
+    else if ((function == DEX_SoftwareBinX) || (function == DEX_SoftwareBinY)) {
+      // Software binning cannot be used with HDR
+      getIntegerParam(DEX_HDRMode, &hdrMode);
+      if (hdrMode && (value > 1)) {
+        setIntegerParam(function, 1);
+        status = asynError;
+      }
+      limitNumAccumulate();
+    }
+    else if ((function == DEX_NumAccumulate) || (function == DEX_AccumulateDataType) ||
+             (function == DEX_SoftwareBinOperation) || (function == DEX_SoftwareBinDataType)) {
+      limitNumAccumulate();
+    }
+    else if (function == DEX_HDRMode) {
+      // The HDR fusion needs full resolution UInt16 frames, so software binning must be 1x1
+      getIntegerParam(DEX_SoftwareBinX, &binX);
+      getIntegerParam(DEX_SoftwareBinY, &binY);
+      // The HDR cycle needs the preprogrammed exposure mode
+      asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+        "%s::%s calling DexelaDetector::QueryExposureMode(Preprogrammed_exposure)\n",
+        driverName, functionName);
+      if (value && ((binX > 1) || (binY > 1) || (pDetector_->QueryExposureMode(Preprogrammed_exposure) != 1))) {
+        setIntegerParam(DEX_HDRMode, 0);
+        status = asynError;
+      }
+    }
+    else if (function == DEX_CorrectionEngine) {
+      // Without the SDK the frames can only be corrected by DexelaCorrection
+      if (!DEX_HAVE_SDK && (value != DEXCorrectionNative)) setIntegerParam(DEX_CorrectionEngine, DEXCorrectionNative);
+    }
+    else if (function == DEX_HDRNumExposures) {
+      if (value < 2) setIntegerParam(DEX_HDRNumExposures, 2);
+      if (value > DEX_MAX_HDR_EXPOSURES) setIntegerParam(DEX_HDRNumExposures, DEX_MAX_HDR_EXPOSURES);
+    }
+    else if (function == DEX_OnBoardLinearization) {
+      if (onBoardLinearization_) {
+        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+          "%s::%s calling DexelaDetector::ToggleOnBoardLinearization(%d)\n",
+          driverName, functionName, value);
+        pDetector_->ToggleOnBoardLinearization(value != 0);
+        setIntegerParam(DEX_OnBoardLinearization, pDetector_->GetOnBoardLinearizationState() ? 1 : 0);
+      } else {
+        setIntegerParam(DEX_OnBoardLinearization, 0);
+        if (value) status = asynError;
+      }
+    }
+    else if (function == DEX_OnBoardXTalk) {
+      if (onBoardXTalk_) {
+        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+          "%s::%s calling DexelaDetector::ToggleOnBoardXTalkCorrection(%d)\n",
+          driverName, functionName, value);
+        pDetector_->ToggleOnBoardXTalkCorrection(value != 0);
+        setIntegerParam(DEX_OnBoardXTalk, pDetector_->GetOnBoardXTalkCorrectionState() ? 1 : 0);
+      } else {
+        setIntegerParam(DEX_OnBoardXTalk, 0);
+        if (value) status = asynError;
+      }
+    }
+    else if (function == DEX_ROIMargin) {
+      if (roiSupported_) {
+        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+          "%s::%s calling DexelaDetector::SetROIMarginEnabled(%d)\n",
+          driverName, functionName, value);
+        pDetector_->SetROIMarginEnabled(value != 0);
+        setIntegerParam(DEX_ROIMargin, pDetector_->IsROIMarginEnabled() ? 1 : 0);
+        updateReadoutTime();
+      } else {
+        setIntegerParam(DEX_ROIMargin, 0);
+      }
     }
     else if (function == DEX_LoadOffsetFile) {
-      loadOffsetFile();
+      if (value) status = queueCalibrationIO(DEXLoadOffsetFile, function);
     }
     else if (function == DEX_SaveOffsetFile) {
-      saveOffsetFile();
+      if (value) status = queueCalibrationIO(DEXSaveOffsetFile, function);
     }
     else if (function == DEX_LoadGainFile) {
-      loadGainFile();
+      if (value) status = queueCalibrationIO(DEXLoadGainFile, function);
     }
     else if (function == DEX_SaveGainFile) {
-      saveGainFile();
+      if (value) status = queueCalibrationIO(DEXSaveGainFile, function);
     }
     else if (function == DEX_LoadDefectMapFile) {
-      loadDefectMapFile();
+      if (value) status = queueCalibrationIO(DEXLoadDefectMapFile, function);
+    }
+    else if (function == DEX_PixelFrameCounter) {
+      asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+        "%s::%s calling DexelaDetector::SetPixelFrameCounter(%d)\n",
+        driverName, functionName, value);
+      pDetector_->SetPixelFrameCounter(value != 0);
+    }
+    else if (function == DEX_ResetLatency) {
+      latency_.reset();
+      updateLatencyParams();
+    }
+    else if (function == DEX_LoadCalibrationLibrary) {
+      if (value) status = queueCalibrationIO(DEXLoadCalibrationLibrary, function);
+    }
+    else if ((function == DEX_UseCalibrationLibrary) || (function == DEX_UseDarkModel)) {
+      selectCalibration(true);
+    }
+    else if (function == DEX_FitDarkModel) {
+      if (value) fitDarkModel();
+      setIntegerParam(DEX_FitDarkModel, 0);
+    }
+    else if (function == DEX_SaveDarkModel) {
+      if (value) status = queueCalibrationIO(DEXSaveDarkModel, function);
+    }
+    else if (function == DEX_NumThreads) {
+      // The number of threads can only be changed when not acquiring
+      if (!frameQueue_) {
+        // The threads are started with this number when the detector connects
+      } else if (!acquiring) {
+        stopFrameThreads();
+        startFrameThreads(value);
+      } else {
+        setIntegerParam(DEX_NumThreads, numFrameThreads_);
+      }
     }
 
     else {
@@ -624,7 +2519,17 @@ asynStatus Dexela::writeInt32(asynUser *pasynUser, epicsInt32 value)
       }
     }
 
+    // Switch to the calibration for the new detector mode
+    if (connected_ &&
+        ((function == DEX_BinningMode) || (function == DEX_FullWellMode) || (function == DEX_ReadoutMode) ||
+         (function == ADMinX) || (function == ADMinY) || (function == ADSizeX) || (function == ADSizeY))) {
+      selectCalibration(false);
+    }
+    // The frame processing threads count the arrays in arrayCounter_, so writing NDArrayCounter must reset it too
+    if (function == NDArrayCounter) arrayCounter_ = value;
+
     /* Do callbacks so higher layers see any changes */
+    publishConfig();
     callParamCallbacks();
   } catch (DexelaException &e) {
     reportError(functionName, e);
@@ -660,11 +2565,21 @@ asynStatus Dexela::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
     /* Set the parameter and readback in the parameter library.  This may be overwritten but that's OK */
     status = setDoubleParam(function, value);
 
-    if (function == ADAcquireTime) {
+    if ((function == ADAcquireTime) && !connected_) {
+      // The exposure time is applied by restoreSettings() when the detector connects
+      pendingSettings_.insert(function);
+    }
+    else if (function == ADAcquireTime) {
       asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
         "%s::%s calling DexelaDetector::SetExposureTime(%f)\n",
         driverName, functionName, value*1000.);
       pDetector_->SetExposureTime((float)(value * 1000.));
+      selectCalibration(false);
+    }
+    else if (function == DEX_StatusRate) {
+      if (value < 0) setDoubleParam(DEX_StatusRate, 0.);
+      // Wake the status thread so it uses the new rate
+      if (statusEvent_) epicsEventSignal(statusEvent_);
     }
     else {
       /* If this parameter belongs to a base class call its method */
@@ -674,6 +2589,7 @@ asynStatus Dexela::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
     }
 
     /* Do callbacks so higher layers see any changes */
+    publishConfig();
     callParamCallbacks();
   } catch (DexelaException &e) {
     reportError(functionName, e);
@@ -691,6 +2607,29 @@ asynStatus Dexela::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
 }
 
 
+//_____________________________________________________________________________________________
+
+/** Called when asyn clients call pasynOctet->write().
+  * Writing the corrections directory queues loading the calibration library from it.
+  * For all parameters it sets the value in the parameter library and calls any registered callbacks.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Address of the string to write.
+  * \param[in] nChars Number of characters to write.
+  * \param[out] nActual Number of characters actually written. */
+asynStatus Dexela::writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual)
+{
+  int function = pasynUser->reason;
+  asynStatus status;
+
+  status = ADDriver::writeOctet(pasynUser, value, nChars, nActual);
+  if ((status == asynSuccess) && (function == DEX_CorrectionsDirectory)) {
+    queueCalibrationIO(DEXLoadCalibrationLibrary, DEX_LoadCalibrationLibrary);
+    callParamCallbacks();
+  }
+  return status;
+}
+
+
 //_____________________________________________________________________________________________
 /** Called when asyn clients call pasynEnum->read().
   * Sets the enum values and strings for DEX_BinningMode, DEX_FullWellMode, and ADTriggerMode
@@ -704,6 +2643,26 @@ asynStatus Dexela::readEnum(asynUser *pasynUser, char *strings[], int values[],
                             size_t nElements, size_t *nIn)
 {
   int function = pasynUser->reason;
+  int numChoices;
+
+  // The binning and full well choices are read from the detector, updateEnums() sends them once it connects
+  if (!connected_ && ((function == DEX_BinningMode) || (function == DEX_FullWellMode))) {
+    *nIn = 0;
+    return asynError;
+  }
+  numChoices = getEnums(function, strings, values, severities, nElements);
+  if (numChoices < 0) {
+    *nIn = 0;
+    return asynError;
+  }
+  *nIn = numChoices;
+  return asynSuccess;   
+}
+
+/** Fills in the choices of an enum parameter.
+  * Returns the number of choices, or -1 if the parameter is not an enum of this driver. */
+int Dexela::getEnums(int function, char *strings[], int values[], int severities[], size_t nElements)
+{
   int i, j=0;
   int exists;
 
@@ -742,11 +2701,9 @@ asynStatus Dexela::readEnum(asynUser *pasynUser, char *strings[], int values[],
     }
   }
   else {
-    *nIn = 0;
-    return asynError;
+    return -1;
   }
-  *nIn = j;
-  return asynSuccess;   
+  return j;
 }
 
 
@@ -759,13 +2716,16 @@ void Dexela::acquireStart(void)
   int numImages;
   int imagesPerTrigger;
   int triggerMode;
+  int timeStampFit;
   double acquireTime;
   double acquirePeriod;
   double gapTime;
   ExposureTriggerSource triggerSource;
   ExposureModes exposureMode;
   double pulseFrequency;
-  int status = asynSuccess;
+  double hdrExposure;
+  float hdrExposuresMs[DEX_MAX_HDR_EXPOSURES];
+  int i;
   static const char *triggerSourceStrings[] = {"Ext_neg_edge_trig",
                                                "Internal_Software",
                                                "Ext_Duration_Trig"};
@@ -787,7 +2747,16 @@ void Dexela::acquireStart(void)
 
     setIntegerParam(ADFrameType, ADFrameNormal);
     setIntegerParam(ADNumImagesCounter, 0);
+    imageCounter_ = 0;
     setIntegerParam(ADStatus, ADStatusAcquire);
+    resetFramePipeline(true);
+    preallocateArrays();
+
+    // The arrival times can only be fitted when the frames are periodic
+    getIntegerParam(DEX_TimeStampFit, &timeStampFit);
+    fitTimeStamps_ = timeStampFit && (imageMode != ADImageSingle) &&
+                     ((triggerMode == DEXInternalFreeRun) || (triggerMode == DEXInternalFixedRate) ||
+                      (triggerMode == DEXExternalEdgeSingle) || (triggerMode == DEXExternalEdgeMulti));
 
     // Set the defaults which may be overridden below
     triggerSource = Internal_Software;
@@ -841,6 +2810,19 @@ void Dexela::acquireStart(void)
     pDetector_->SetTriggerSource(triggerSource);
 
     if (imageMode == ADImageSingle) exposureMode = Expose_and_read;
+    if (hdrNumExposures_ > 0) {
+      // The detector cycles through the preprogrammed exposures, each trigger takes a whole cycle
+      exposureMode = Preprogrammed_exposure;
+      if (imagesPerTrigger == 1) imagesPerTrigger = hdrNumExposures_;
+      for (i=0; i<hdrNumExposures_; i++) {
+        getDoubleParam(DEX_HDRExposure[i], &hdrExposure);
+        hdrExposuresMs[i] = (float)(hdrExposure * 1000.);
+      }
+      asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+         "%s::%s calling DexelaDetector::SetPreProgrammedExposureTimes(%p, %d)\n",
+         driverName, functionName, hdrExposuresMs, hdrNumExposures_);
+      pDetector_->SetPreProgrammedExposureTimes(hdrExposuresMs, hdrNumExposures_);
+    }
     asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
        "%s::%s calling DexelaDetector::SetExposureMode(%s)\n",
        driverName, functionName, exposureModeStrings[exposureMode]);
@@ -877,6 +2859,14 @@ void Dexela::acquireStart(void)
     switch (imageMode) {
 
       case ADImageSingle:
+        if (hdrNumExposures_ > 0) {
+          // Snap only takes one frame, an HDR image needs a whole cycle
+          asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+             "%s::%s calling DexelaDetector::GoLiveSeq(%d, %d, %d)\n",
+             driverName, functionName, 0, numBuffers_, hdrNumExposures_);
+          pDetector_->GoLiveSeq(0, numBuffers_-1, hdrNumExposures_);
+          break;
+        }
         asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
            "%s::%s calling DexelaDetector::Snap(%d, %d)\n",
            driverName, functionName, snapBuffer_, (int)((acquireTime + 1)*1000.));
@@ -955,8 +2945,12 @@ void Dexela::acquireOffsetImage(void)
     setIntegerParam(DEX_CurrentOffsetFrame, 0);
     setIntegerParam(DEX_OffsetAvailable, 0);
     setIntegerParam(ADAcquire, 1);
+    // Calibrations are taken at the acquire time, not with the HDR exposures
+    resetFramePipeline(false);
+    preallocateArrays();
     
     offsetImage_ = DexImage();
+    startCalibration();
 
     // Make sure the shutter is closed
     setShutter(ADShutterClosed);
@@ -1001,7 +2995,10 @@ void Dexela::acquireGainImage(void)
     setIntegerParam(DEX_CurrentGainFrame, 0);
     setIntegerParam(DEX_GainAvailable, 0);
     setIntegerParam(ADAcquire, 1);
+    resetFramePipeline(false);
+    preallocateArrays();
     gainImage_ = DexImage();
+    startCalibration();
 
     // Make sure the shutter is open
     setShutter(ADShutterOpen);
@@ -1033,108 +3030,853 @@ void Dexela::acquireGainImage(void)
 
 //_____________________________________________________________________________________________
 
-/** Saves an offset file */
-asynStatus Dexela::saveOffsetFile(void)
+/** Applies ADMinX, ADMinY, ADSizeX and ADSizeY to the detector ROI, in unbinned pixels, and sets them to the
+  * ROI the detector actually uses. The full frame disables the ROI. If the detector does not support an ROI,
+  * or it is acquiring, the ROI is not changed. Called with the lock held. */
+void Dexela::setROI(void)
 {
-  char filePath[256];
-  char fileName[256];
-  static const char *functionName = "saveOffsetFile";
+  int minX, minY, sizeX, sizeY;
+  int startColumn, startRow, width, height;
+  int acquiring;
+  bool enable;
+  static const char *functionName = "setROI";
+
+  getIntegerParam(ADMinX,    &minX);
+  getIntegerParam(ADMinY,    &minY);
+  getIntegerParam(ADSizeX,   &sizeX);
+  getIntegerParam(ADSizeY,   &sizeY);
+  getIntegerParam(ADAcquire, &acquiring);
+  if (minX < 0) minX = 0;
+  if (minX > sensorX_-1) minX = sensorX_-1;
+  if (minY < 0) minY = 0;
+  if (minY > sensorY_-1) minY = sensorY_-1;
+  if (sizeX < 1) sizeX = 1;
+  if (sizeX > sensorX_-minX) sizeX = sensorX_-minX;
+  if (sizeY < 1) sizeY = 1;
+  if (sizeY > sensorY_-minY) sizeY = sensorY_-minY;
+  startColumn = 0;
+  startRow = 0;
+  width = sensorX_;
+  height = sensorY_;
 
   try {
-    getStringParam(DEX_CorrectionsDirectory, sizeof(filePath), filePath);
-    getStringParam(DEX_OffsetFile, sizeof(fileName), fileName);
-    strcat(filePath, fileName);
+    if (roiSupported_) {
+      if (!acquiring) {
+        enable = (minX != 0) || (minY != 0) || (sizeX != sensorX_) || (sizeY != sensorY_);
+        if (enable) {
+          asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+            "%s::%s calling DexelaDetector::SetROIArea(%d, %d, %d, %d)\n",
+            driverName, functionName, sizeX, sizeY, minY, minX);
+          pDetector_->SetROIArea(sizeX, sizeY, minY, minX);
+        }
+        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+          "%s::%s calling DexelaDetector::SetROIEnabled(%d)\n",
+          driverName, functionName, enable);
+        pDetector_->SetROIEnabled(enable);
+      }
+      // The detector may round the ROI, so read back what it will use
+      if (pDetector_->IsROIEnabled()) {
+        pDetector_->GetROIArea(width, height, startRow, startColumn);
+      }
+    }
+  } catch (DexelaException &e) {
+    reportError(functionName, e);
+  }
+  setIntegerParam(ADMinX,  startColumn);
+  setIntegerParam(ADMinY,  startRow);
+  setIntegerParam(ADSizeX, width);
+  setIntegerParam(ADSizeY, height);
+  updateReadoutTime();
+  measureHostUnscramble();
+}
 
-    if (offsetImage_.IsEmpty()) return asynError;
-    offsetImage_.WriteImage(filePath);
+/** Reads the readout time of the current binning, ROI and readout mode from the detector */
+void Dexela::updateReadoutTime(void)
+{
+  static const char *functionName = "updateReadoutTime";
+
+  try {
+    setDoubleParam(DEX_ReadoutTime, pDetector_->GetReadOutTime());
   } catch (DexelaException &e) {
     reportError(functionName, e);
   }
-  return asynSuccess;
 }
 
+/** Times the host unscrambling of one frame of the current binning and ROI, which is the host CPU time per frame
+  * saved when the detector unscrambles the frames itself. Called with the lock held. */
+void Dexela::measureHostUnscramble(void)
+{
+  DexImage image;
+  int minX, minY, sizeX, sizeY;
+  bool roiEnabled;
+  epicsUInt64 startTime;
+  static const char *functionName = "measureHostUnscramble";
+
+  // The host unscrambling needs the SDK
+  if (!onBoardUnscrambling_ || !DEX_HAVE_SDK) {
+    setDoubleParam(DEX_HostTimeSaved, 0.);
+    return;
+  }
+  getIntegerParam(ADMinX,  &minX);
+  getIntegerParam(ADMinY,  &minY);
+  getIntegerParam(ADSizeX, &sizeX);
+  getIntegerParam(ADSizeY, &sizeY);
+  try {
+    roiEnabled = (minX != 0) || (minY != 0) || (sizeX != sensorX_) || (sizeY != sensorY_);
+    image.Build(modelNumber_, binningMode_, 1, u16, pDetector_->GetSensorVersion(),
+                pDetector_->GetSliceInterlacing(), roiEnabled, minX, minY, sizeX, sizeY);
+    startTime = dexTimeNow();
+    image.UnscrambleImage();
+    setDoubleParam(DEX_HostTimeSaved, (dexTimeNow() - startTime) / 1.e6);
+  } catch (DexelaException &e) {
+    reportError(functionName, e);
+  }
+}
 
 //_____________________________________________________________________________________________
 
-/** Loads an offset file */
-asynStatus Dexela::loadOffsetFile (void)
+/** Builds the native correction from an offset and an optional gain image. It is built again whenever either
+  * image changes, because the gain is computed from the flood minus the offset.
+  * Returns NULL if there is no offset image. */
+std::shared_ptr<DexelaCorrection> Dexela::buildCorrection(const DexelaCalibrationImage *pOffset,
+                                                          const DexelaCalibrationImage *pGain)
 {
-  char filePath[256];
-  char fileName[256];
-  static const char *functionName = "loadOffsetFile";
+  std::shared_ptr<DexelaCorrection> pCorrection;
+  int sizeX, sizeY;
+  static const char *functionName = "buildCorrection";
+
+  if (!pOffset) return pCorrection;
+  sizeX = pOffset->getSizeX();
+  sizeY = pOffset->getSizeY();
+  pCorrection = std::make_shared<DexelaCorrection>(sizeX, sizeY);
+  if (pOffset->getPixelType() == flt) {
+    pCorrection->setOffset((const float *)pOffset->getData());
+  } else {
+    pCorrection->setOffset((const epicsUInt16 *)pOffset->getData());
+  }
+  if (pGain) {
+    if ((pGain->getSizeX() != sizeX) || (pGain->getSizeY() != sizeY)) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s gain size (%d, %d) does not match offset size (%d, %d), gain not used\n",
+        driverName, functionName, pGain->getSizeX(), pGain->getSizeY(), sizeX, sizeY);
+    } else if (pGain->getPixelType() == flt) {
+      pCorrection->setGain((const float *)pGain->getData());
+    } else {
+      pCorrection->setGain((const epicsUInt16 *)pGain->getData());
+    }
+  }
+  return pCorrection;
+}
 
-  try {
-    getStringParam(DEX_CorrectionsDirectory, sizeof(filePath), filePath);
-    getStringParam(DEX_OffsetFile, sizeof(fileName), fileName);
-    strcat(filePath, fileName);
+//_____________________________________________________________________________________________
 
-    offsetImage_.ReadImage(filePath);
-  } catch (DexelaException &e) {
-    reportError(functionName, e);
+/** Compiles a defect map into the list of defective pixels and their neighbors.
+  * This scans the whole map once so that correcting each frame only touches the defective pixels.
+  * Returns NULL if the map is not a 16-bit image. */
+std::shared_ptr<DexelaDefectCorrection> Dexela::compileDefectMap(const DexelaCalibrationImage &defectMap)
+{
+  std::shared_ptr<DexelaDefectCorrection> pDefectCorrection;
+  static const char *functionName = "compileDefectMap";
+
+  if (defectMap.getPixelType() != u16) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s defect map must be a 16-bit image\n",
+      driverName, functionName);
+    return pDefectCorrection;
   }
-  return asynSuccess;
+  pDefectCorrection = std::make_shared<DexelaDefectCorrection>(
+                        (const epicsUInt16 *)defectMap.getData(), defectMap.getSizeX(), defectMap.getSizeY());
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s::%s %d bad pixels, %d cluster pixels, %d column pixels\n",
+    driverName, functionName,
+    (int)pDefectCorrection->getNumDefects(DexDefectBadPixel),
+    (int)pDefectCorrection->getNumDefects(DexDefectCluster),
+    (int)pDefectCorrection->getNumDefects(DexDefectColumn));
+  return pDefectCorrection;
 }
+
 //_____________________________________________________________________________________________
 
-/** Saves a gain file */
-asynStatus Dexela::saveGainFile(void)
+/** Returns the calibration library key for the current detector mode */
+DexelaCalibrationKey Dexela::currentCalibrationKey(void)
 {
-  char filePath[256];
-  char fileName[256];
-  static const char *functionName = "saveGainFile";
+  DexelaCalibrationKey key;
+  double acquireTime;
+
+  getIntegerParam(DEX_BinningMode,  &key.binning);
+  getIntegerParam(DEX_FullWellMode, &key.fullWell);
+  getIntegerParam(DEX_ReadoutMode,  &key.readoutMode);
+  getDoubleParam (ADAcquireTime,    &acquireTime);
+  getIntegerParam(ADMinX,           &key.minX);
+  getIntegerParam(ADMinY,           &key.minY);
+  getIntegerParam(ADSizeX,          &key.sizeX);
+  getIntegerParam(ADSizeY,          &key.sizeY);
+  key.exposureUs = (int)(acquireTime * 1e6 + 0.5);
+  return key;
+}
+
+/** Returns the calibration set for a detector mode from the calibration library.
+  * If the library has no offset for the mode and the dark model is enabled, the offset is computed from the dark
+  * model of the mode. If the key has an ROI and there is still no offset or no defect map for it, they are cropped
+  * from the full frame calibration of the same mode. Called with the lock held. */
+std::shared_ptr<DexelaCalibrationSet> Dexela::findCalibration(const DexelaCalibrationKey &key)
+{
+  std::shared_ptr<DexelaCalibrationSet> pCalibration = calibrationLibrary_.find(key);
+  std::shared_ptr<DexelaCalibrationSet> pFullFrame;
+  DexelaCalibrationKey fullFrameKey = key;
+
+  synthesizeOffset(key, *pCalibration);
+  fullFrameKey.minX = 0;
+  fullFrameKey.minY = 0;
+  fullFrameKey.sizeX = sensorX_;
+  fullFrameKey.sizeY = sensorY_;
+  if (key == fullFrameKey) return pCalibration;
+  if (pCalibration->pOffset && pCalibration->pDefectMap) return pCalibration;
+  pFullFrame = calibrationLibrary_.find(fullFrameKey);
+  if (!pCalibration->pOffset) synthesizeOffset(fullFrameKey, *pFullFrame);
+  if (!pCalibration->pOffset && pFullFrame->pOffset) {
+    pCalibration->pOffset = cropCalibrationImage(pFullFrame->pOffset, key);
+    pCalibration->pGain = cropCalibrationImage(pFullFrame->pGain, key);
+    pCalibration->pCorrection = buildCorrection(pCalibration->pOffset.get(), pCalibration->pGain.get());
+    pCalibration->offsetSynthesized = pFullFrame->offsetSynthesized;
+  }
+  if (!pCalibration->pDefectMap && pFullFrame->pDefectMap) {
+    pCalibration->pDefectMap = cropCalibrationImage(pFullFrame->pDefectMap, key);
+    if (pCalibration->pDefectMap) pCalibration->pDefectCorrection = compileDefectMap(*pCalibration->pDefectMap);
+  }
+  return pCalibration;
+}
 
+/** Computes the offset of a calibration set from the dark model of its mode if it has no offset and the dark
+  * model is enabled. The synthesized offset is not stored in the library, so it always follows the latest model.
+  * Called with the lock held.
+  * \param[in] key Detector mode with the exposure time of the offset
+  * \param[in,out] calibration Calibration set for the key */
+void Dexela::synthesizeOffset(const DexelaCalibrationKey &key, DexelaCalibrationSet &calibration)
+{
+  std::shared_ptr<const DexelaDarkModel> pModel;
+  std::shared_ptr<DexImage> pOffset;
+  epicsUInt64 startTime;
+  int useDarkModel;
+  static const char *functionName = "synthesizeOffset";
+
+  getIntegerParam(DEX_UseDarkModel, &useDarkModel);
+  if (!useDarkModel || calibration.pOffset) return;
+  pModel = calibrationLibrary_.findDarkModel(key);
+  if (!pModel) return;
   try {
-    getStringParam(DEX_CorrectionsDirectory, sizeof(filePath), filePath);
-    getStringParam(DEX_GainFile, sizeof(fileName), fileName);
-    strcat(filePath, fileName);
+    startTime = dexTimeNow();
+    pOffset = std::make_shared<DexImage>();
+    pOffset->Build(pModel->getSizeX(), pModel->getSizeY(), 1, u16);
+    pOffset->SetImageType(Offset);
+    pModel->synthesize(key.exposureUs / 1e6, (epicsUInt16 *)pOffset->GetDataPointerToPlane());
+    setDoubleParam(DEX_SynthesizeTime, (dexTimeNow() - startTime) / 1.e6);
+  } catch (DexelaException &e) {
+    reportError(functionName, e);
+    return;
+  }
+  calibration.pOffset = std::make_shared<DexelaCalibrationImage>(pOffset);
+  calibration.pCorrection = buildCorrection(calibration.pOffset.get(), calibration.pGain.get());
+  calibration.offsetSynthesized = true;
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s::%s synthesized offset for %s from dark model\n",
+    driverName, functionName, key.toString().c_str());
+}
 
-    if (gainImage_.IsEmpty()) return asynError;
-    gainImage_.WriteImage(filePath);
+/** Returns a copy of the ROI of a key cut out of a full frame calibration image, or NULL if there is no image.
+  * The ROI is in unbinned pixels, so it is scaled by the size of the image, which is binned.
+  * \param[in] pFullFrame Full frame offset, gain or defect map
+  * \param[in] key Detector mode with the ROI to cut out */
+std::shared_ptr<const DexelaCalibrationImage> Dexela::cropCalibrationImage(
+  const std::shared_ptr<const DexelaCalibrationImage> &pFullFrame, const DexelaCalibrationKey &key)
+{
+  std::shared_ptr<const DexelaCalibrationImage> pCropped;
+  std::shared_ptr<DexImage> pImage;
+  int sizeX, sizeY;
+  static const char *functionName = "cropCalibrationImage";
+
+  if (!pFullFrame) return pCropped;
+  try {
+    sizeX = pFullFrame->getSizeX();
+    sizeY = pFullFrame->getSizeY();
+    // A mapped full frame is copied only for the crop, so the library does not keep a copy of it
+    pImage = pFullFrame->copyDexImage();
+    pImage->GetSubImage(key.minX * sizeX / sensorX_, key.minY * sizeY / sensorY_,
+                        key.sizeX * sizeX / sensorX_, key.sizeY * sizeY / sensorY_);
+    pCropped = std::make_shared<DexelaCalibrationImage>(pImage);
+    asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s::%s cropped %d x %d calibration to %d x %d for %s\n",
+      driverName, functionName, sizeX, sizeY, pCropped->getSizeX(), pCropped->getSizeY(),
+      key.toString().c_str());
   } catch (DexelaException &e) {
     reportError(functionName, e);
+    pCropped.reset();
+  }
+  return pCropped;
+}
+
+//_____________________________________________________________________________________________
+
+/** Stores new calibration images for the current detector mode in the calibration library and makes them active.
+  * Images that are NULL are left unchanged. Called with the lock held.
+  * \param[in] pOffset New offset image or NULL
+  * \param[in] pGain New gain image or NULL
+  * \param[in] pDefectMap New defect map or NULL */
+asynStatus Dexela::storeCalibration(const std::shared_ptr<const DexelaCalibrationImage> &pOffset,
+                                    const std::shared_ptr<const DexelaCalibrationImage> &pGain,
+                                    const std::shared_ptr<const DexelaCalibrationImage> &pDefectMap)
+{
+  std::shared_ptr<DexelaCalibrationSet> pCalibration = updateCalibrationSet(*pCalibration_, pOffset, pGain, pDefectMap);
+
+  if (!pCalibration) return asynError;
+  installCalibration(currentCalibrationKey(), pCalibration, pOffset || pGain, pDefectMap != NULL);
+  return asynSuccess;
+}
+
+/** Returns a copy of a calibration set with new calibration images and the corrections built from them.
+  * Images that are NULL are left unchanged. This does not use the parameters or the library, so the corrections,
+  * which take a pass over every pixel, can be built without the lock.
+  * Returns NULL if the defect map cannot be compiled.
+  * \param[in] calibration Calibration set to copy
+  * \param[in] pOffset New offset image or NULL
+  * \param[in] pGain New gain image or NULL
+  * \param[in] pDefectMap New defect map or NULL */
+std::shared_ptr<DexelaCalibrationSet> Dexela::updateCalibrationSet(
+  const DexelaCalibrationSet &calibration, const std::shared_ptr<const DexelaCalibrationImage> &pOffset,
+  const std::shared_ptr<const DexelaCalibrationImage> &pGain,
+  const std::shared_ptr<const DexelaCalibrationImage> &pDefectMap)
+{
+  std::shared_ptr<DexelaCalibrationSet> pCalibration = std::make_shared<DexelaCalibrationSet>(calibration);
+
+  if (pDefectMap) {
+    pCalibration->pDefectCorrection = compileDefectMap(*pDefectMap);
+    if (!pCalibration->pDefectCorrection) return std::shared_ptr<DexelaCalibrationSet>();
+    pCalibration->pDefectMap = pDefectMap;
+  }
+  if (pOffset || pGain) {
+    if (pOffset) {
+      pCalibration->pOffset = pOffset;
+      pCalibration->offsetSynthesized = false;
+    }
+    if (pGain) pCalibration->pGain = pGain;
+    pCalibration->pCorrection = buildCorrection(pCalibration->pOffset.get(), pCalibration->pGain.get());
+  }
+  return pCalibration;
+}
+
+/** Stores a calibration set in the calibration library and makes it active. Called with the lock held.
+  * \param[in] key Detector mode of the set
+  * \param[in] pCalibration The calibration set
+  * \param[in] offsetGain Store the offset and gain of the set
+  * \param[in] defectMap Store the defect map of the set */
+void Dexela::installCalibration(const DexelaCalibrationKey &key,
+                                const std::shared_ptr<DexelaCalibrationSet> &pCalibration,
+                                bool offsetGain, bool defectMap)
+{
+  if (defectMap)  calibrationLibrary_.storeDefectMap(key, *pCalibration);
+  if (offsetGain) calibrationLibrary_.storeOffsetGain(key, *pCalibration);
+  activateCalibration(pCalibration, key);
+}
+
+//_____________________________________________________________________________________________
+
+/** Fits the dark model of the current detector mode from all the offsets in the calibration library that were
+  * acquired in this mode, at any exposure time, and stores it in the library. Synthesized offsets are not in the
+  * library, so they are never fitted. Called with the lock held. */
+asynStatus Dexela::fitDarkModel(void)
+{
+  DexelaCalibrationKey key = currentCalibrationKey();
+  std::vector<DexelaCalibrationKey> keys;
+  std::shared_ptr<DexelaDarkModel> pModel;
+  std::shared_ptr<const DexelaCalibrationImage> pOffset;
+  size_t i;
+  static const char *functionName = "fitDarkModel";
+
+  calibrationLibrary_.getOffsets(key, keys);
+  for (i=0; i<keys.size(); i++) {
+    pOffset = calibrationLibrary_.getOffsetGain(keys[i]).pOffset;
+    if (!pModel) pModel = std::make_shared<DexelaDarkModel>(pOffset->getSizeX(), pOffset->getSizeY());
+    if ((pOffset->getSizeX() != pModel->getSizeX()) || (pOffset->getSizeY() != pModel->getSizeY())) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s offset %s has a different size, not used\n",
+        driverName, functionName, keys[i].toString().c_str());
+      continue;
+    }
+    if (pOffset->getPixelType() == flt) {
+      pModel->add((const float *)pOffset->getData(), keys[i].exposureUs / 1e6);
+    } else {
+      pModel->add((const epicsUInt16 *)pOffset->getData(), keys[i].exposureUs / 1e6);
+    }
+  }
+  if (!pModel || !pModel->fit()) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+      "%s::%s the dark model needs offsets at 2 or more exposure times for %s, library has %d\n",
+      driverName, functionName, key.mode().toString().c_str(), (int)keys.size());
+    return asynError;
+  }
+  calibrationLibrary_.storeDarkModel(key, pModel);
+  setIntegerParam(DEX_DarkModelOffsets, pModel->getNumOffsets());
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s::%s fitted dark model for %s from %d offsets\n",
+    driverName, functionName, key.mode().toString().c_str(), pModel->getNumOffsets());
+  selectCalibration(true);
+  return asynSuccess;
+}
+
+/** Saves the bias and dark current planes of the dark model of the detector mode the save was queued in to the
+  * corrections directory, named so that loadCalibrationLibrary() reads them back.
+  * Called by calibrationIOTask() without the lock. Throws DexelaException if the files cannot be written. */
+asynStatus Dexela::saveDarkModel(const dexCalibrationIO_t &io, std::string &message)
+{
+  std::shared_ptr<const DexelaDarkModel> pModel = io.pDarkModel;
+  size_t numPixels;
+  std::shared_ptr<DexImage> pBias = std::make_shared<DexImage>();
+  std::shared_ptr<DexImage> pRate = std::make_shared<DexImage>();
+  std::string biasName = io.path + io.key.fileName(DexCalibrationDarkBias, io.extension);
+  std::string rateName = io.path + io.key.fileName(DexCalibrationDarkRate, io.extension);
+
+  if (!pModel) {
+    message = "No dark model for " + io.key.mode().toString();
+    return asynError;
   }
+  numPixels = (size_t)pModel->getSizeX() * pModel->getSizeY();
+  pBias->Build(pModel->getSizeX(), pModel->getSizeY(), 1, flt);
+  pRate->Build(pModel->getSizeX(), pModel->getSizeY(), 1, flt);
+  memcpy(pBias->GetDataPointerToPlane(), pModel->getBias(), numPixels * sizeof(float));
+  memcpy(pRate->GetDataPointerToPlane(), pModel->getRate(), numPixels * sizeof(float));
+  DexelaCalibrationImage(pBias).write(biasName.c_str(), DexCalibrationDarkBias, io.key.mode(),
+                                      io.model, io.serialNumber);
+  DexelaCalibrationImage(pRate).write(rateName.c_str(), DexCalibrationDarkRate, io.key.mode(),
+                                      io.model, io.serialNumber);
+  message = "Saved " + biasName + " and " + rateName;
   return asynSuccess;
 }
 
+//_____________________________________________________________________________________________
+
+/** Switches to the calibration set for the current detector mode if the calibration library is enabled.
+  * If the library has no calibration for the mode the corrections are disabled rather than using the calibration
+  * of another mode. If the library is not enabled the calibration only follows changes of the ROI, cropped from
+  * the full frame calibration of the active mode. Called with the lock held whenever a parameter that is part of
+  * the key changes.
+  * \param[in] force Select the set even if the mode has not changed, used after the library has been reloaded */
+void Dexela::selectCalibration(bool force)
+{
+  DexelaCalibrationKey key = currentCalibrationKey();
+  std::shared_ptr<DexelaCalibrationSet> pCalibration;
+  int useLibrary;
+  int misses;
+  static const char *functionName = "selectCalibration";
+
+  getIntegerParam(DEX_UseCalibrationLibrary, &useLibrary);
+  if (!useLibrary) {
+    if ((key.minX == activeKey_.minX) && (key.minY == activeKey_.minY) &&
+        (key.sizeX == activeKey_.sizeX) && (key.sizeY == activeKey_.sizeY)) return;
+    key.binning     = activeKey_.binning;
+    key.fullWell    = activeKey_.fullWell;
+    key.readoutMode = activeKey_.readoutMode;
+    key.exposureUs  = activeKey_.exposureUs;
+  }
+  if (!force && !(key < activeKey_) && !(activeKey_ < key)) return;
+  pCalibration = findCalibration(key);
+  if (!pCalibration->pOffset && !pCalibration->pGain && !pCalibration->pDefectMap) {
+    getIntegerParam(DEX_CalibrationMisses, &misses);
+    setIntegerParam(DEX_CalibrationMisses, misses+1);
+    asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+      "%s::%s no calibration for %s\n",
+      driverName, functionName, key.toString().c_str());
+  }
+  activateCalibration(pCalibration, key);
+}
 
 //_____________________________________________________________________________________________
 
-/** Loads a gain file */
-asynStatus Dexela::loadGainFile (void)
+/** Makes a calibration set active and updates the parameters that describe it. Called with the lock held.
+  * The frame processing threads keep using the previous set until they start their next frame. */
+void Dexela::activateCalibration(std::shared_ptr<DexelaCalibrationSet> pCalibration, const DexelaCalibrationKey &key)
 {
-  char filePath[256];
-  char fileName[256];
-  static const char *functionName = "loadGainFile";
+  pCalibration_ = pCalibration;
+  activeKey_ = key;
+  setStringParam (DEX_CalibrationKey, key.toString().c_str());
+  setIntegerParam(DEX_OffsetAvailable, pCalibration->pOffset ? 1 : 0);
+  setIntegerParam(DEX_GainAvailable, pCalibration->pGain ? 1 : 0);
+  setIntegerParam(DEX_DefectMapAvailable, pCalibration->pDefectCorrection ? 1 : 0);
+  setIntegerParam(DEX_NumDefects,
+                  pCalibration->pDefectCorrection ? (int)pCalibration->pDefectCorrection->getNumDefects() : 0);
+  setIntegerParam(DEX_CalibrationLibrarySize, (int)calibrationLibrary_.size());
+  setIntegerParam(DEX_DarkModelAvailable, calibrationLibrary_.findDarkModel(key) ? 1 : 0);
+  setIntegerParam(DEX_OffsetSynthesized, pCalibration->offsetSynthesized ? 1 : 0);
+  publishConfig();
+}
 
-  try {
-    getStringParam(DEX_CorrectionsDirectory, sizeof(filePath), filePath);
-    getStringParam(DEX_GainFile, sizeof(fileName), fileName);
-    strcat(filePath, fileName);
+//_____________________________________________________________________________________________
 
-    gainImage_.ReadImage(filePath);
-  } catch (DexelaException &e) {
-    reportError(functionName, e);
+/** Loads every file in the corrections directory that follows the calibration library naming convention.
+  * A file replaces the calibration already in the library for its mode, calibrations of other modes that were
+  * acquired but not saved are kept. The files are read and the corrections are built without the lock, which is
+  * only taken to store them in the library. Called by calibrationIOTask() without the lock. */
+asynStatus Dexela::loadCalibrationLibrary(const dexCalibrationIO_t &io, std::string &message)
+{
+  const char *directory = io.path.c_str();
+  std::vector<std::string> fileNames;
+  std::map<DexelaCalibrationKey, DexelaCalibrationSet> offsetGain;
+  std::map<DexelaCalibrationKey, DexelaCalibrationSet> defectMaps;
+  std::map<DexelaCalibrationKey, DexelaCalibrationSet>::iterator it;
+  // The bias and dark current planes of each dark model, combined once both have been read
+  typedef std::shared_ptr<const DexelaCalibrationImage> imagePtr_t;
+  std::map<DexelaCalibrationKey, std::pair<imagePtr_t, imagePtr_t> > darkModels;
+  std::map<DexelaCalibrationKey, std::pair<imagePtr_t, imagePtr_t> >::iterator dm;
+  std::map<DexelaCalibrationKey, std::shared_ptr<const DexelaDarkModel> > models;
+  std::map<DexelaCalibrationKey, std::shared_ptr<const DexelaDarkModel> >::iterator mt;
+  std::set<std::string> nativeFiles;
+  std::string baseName;
+  std::shared_ptr<DexelaDarkModel> pModel;
+  imagePtr_t pRate;
+  imagePtr_t pImage;
+  DexelaCalibrationSet calibration;
+  DexCalibrationType_t type;
+  DexelaCalibrationKey key;
+  size_t i;
+  int numLoaded = 0;
+  int numErrors = 0;
+  char text[256];
+  static const char *functionName = "loadCalibrationLibrary";
+
+  DexelaCalibrationLibrary::listFiles(directory, fileNames);
+  // A calibration that has been converted to the native format is not read again from the SDK format
+  for (i=0; i<fileNames.size(); i++) {
+    if (DexelaCalibrationFile::isNativeFile(fileNames[i].c_str())) {
+      nativeFiles.insert(fileNames[i].substr(0, fileNames[i].rfind('.')));
+    }
   }
-  return asynSuccess;
+  for (i=0; i<fileNames.size(); i++) {
+    if (!DexelaCalibrationKey::parseFileName(fileNames[i].c_str(), &type, &key)) continue;
+    baseName = fileNames[i].substr(0, fileNames[i].rfind('.'));
+    if (!DexelaCalibrationFile::isNativeFile(fileNames[i].c_str()) && nativeFiles.count(baseName)) continue;
+    try {
+      pImage = readCalibrationImage(std::string(directory) + fileNames[i], io.serialNumber);
+      if (pImage->isMapped() &&
+          ((pImage->getFile()->getType() != type) || !(pImage->getFile()->getKey() == key))) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+          "%s::%s header of %s does not match its name, not used\n",
+          driverName, functionName, fileNames[i].c_str());
+        numErrors++;
+        continue;
+      }
+      if (type == DexCalibrationDefectMap) {
+        calibration.pDefectCorrection = compileDefectMap(*pImage);
+        if (!calibration.pDefectCorrection) {
+          numErrors++;
+          continue;
+        }
+        calibration.pDefectMap = pImage;
+        defectMaps[key] = calibration;
+      } else if (type == DexCalibrationDarkBias) {
+        darkModels[key].first = pImage;
+      } else if (type == DexCalibrationDarkRate) {
+        darkModels[key].second = pImage;
+      } else if (type == DexCalibrationOffset) {
+        offsetGain[key].pOffset = pImage;
+      } else {
+        offsetGain[key].pGain = pImage;
+      }
+      numLoaded++;
+    } catch (DexelaException &e) {
+      reportError(functionName, e);
+      numErrors++;
+    }
+  }
+  // The offset and gain of a mode are combined into one correction once both have been read
+  for (it=offsetGain.begin(); it!=offsetGain.end(); ++it) {
+    it->second.pCorrection = buildCorrection(it->second.pOffset.get(), it->second.pGain.get());
+  }
+  for (dm=darkModels.begin(); dm!=darkModels.end(); ++dm) {
+    pImage = dm->second.first;
+    pRate = dm->second.second;
+    if (!pImage || !pRate || (pImage->getPixelType() != flt) || (pRate->getPixelType() != flt) ||
+        (pRate->getSizeX() != pImage->getSizeX()) || (pRate->getSizeY() != pImage->getSizeY())) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s dark model %s needs floating point bias and rate files of the same size\n",
+        driverName, functionName, dm->first.toString().c_str());
+      numErrors++;
+      continue;
+    }
+    pModel = std::make_shared<DexelaDarkModel>(pImage->getSizeX(), pImage->getSizeY());
+    pModel->setModel((const float *)pImage->getData(), (const float *)pRate->getData());
+    models[dm->first] = pModel;
+  }
+
+  lock();
+  for (it=offsetGain.begin(); it!=offsetGain.end(); ++it) {
+    // A mode with only an offset or only a gain file keeps the other one that is already in the library
+    calibration = calibrationLibrary_.getOffsetGain(it->first);
+    if (it->second.pOffset) calibration.pOffset = it->second.pOffset;
+    if (it->second.pGain)   calibration.pGain   = it->second.pGain;
+    calibration.pCorrection = it->second.pCorrection;
+    if ((calibration.pOffset != it->second.pOffset) || (calibration.pGain != it->second.pGain)) {
+      calibration.pCorrection = buildCorrection(calibration.pOffset.get(), calibration.pGain.get());
+    }
+    calibrationLibrary_.storeOffsetGain(it->first, calibration);
+  }
+  for (it=defectMaps.begin(); it!=defectMaps.end(); ++it) {
+    calibrationLibrary_.storeDefectMap(it->first, it->second);
+  }
+  for (mt=models.begin(); mt!=models.end(); ++mt) {
+    calibrationLibrary_.storeDarkModel(mt->first, mt->second);
+  }
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s::%s loaded %d calibration files from %s, library has %d entries\n",
+    driverName, functionName, numLoaded, directory, (int)calibrationLibrary_.size());
+  setIntegerParam(DEX_CalibrationLibrarySize, (int)calibrationLibrary_.size());
+  selectCalibration(true);
+  unlock();
+  if (numErrors) {
+    epicsSnprintf(text, sizeof(text), "Loaded %d files, %d could not be used", numLoaded, numErrors);
+  } else {
+    epicsSnprintf(text, sizeof(text), "Loaded %d files", numLoaded);
+  }
+  message = text;
+  return numErrors ? asynError : asynSuccess;
 }
+
 //_____________________________________________________________________________________________
 
-/** Loads a defect file */
-asynStatus Dexela::loadDefectMapFile()
+/** Returns the path of a calibration file in the corrections directory.
+  * If the file name parameter is empty the calibration library file name for the key is used. */
+std::string Dexela::calibrationFilePath(int fileNameParam, DexCalibrationType_t type, const DexelaCalibrationKey &key)
 {
-  char filePath[256];
+  char directory[256];
   char fileName[256];
-  static const char *functionName = "loadDefectFile";
 
-  try {
-    getStringParam(DEX_CorrectionsDirectory, sizeof(filePath), filePath);
-    getStringParam(DEX_DefectMapFile, sizeof(fileName), fileName);
-    strcat(filePath, fileName);
+  getStringParam(DEX_CorrectionsDirectory, sizeof(directory), directory);
+  getStringParam(fileNameParam, sizeof(fileName), fileName);
+  if (!fileName[0]) return std::string(directory) + key.fileName(type, calibrationFileExtension());
+  return std::string(directory) + fileName;
+}
 
-    defectMapImage_.ReadImage(filePath);
-  } catch (DexelaException &e) {
-    reportError(functionName, e);
+/** Returns the extension of the calibration files that are named from the detector mode */
+const char *Dexela::calibrationFileExtension(void)
+{
+  int format;
+
+  getIntegerParam(DEX_CalibrationFileFormat, &format);
+  return (format == DEXCalibrationFileNative) ? DEX_CALIBRATION_FILE_EXTENSION : ".smv";
+}
+
+/** Reads a calibration file. Native files are mapped, other files are read with DexImage::ReadImage.
+  * Throws DexelaException if the file cannot be read.
+  * \param[in] fileName Path of the file
+  * \param[in] serialNumber Serial number of the detector, 0 if unknown */
+std::shared_ptr<const DexelaCalibrationImage> Dexela::readCalibrationImage(const std::string &fileName,
+                                                                           int serialNumber)
+{
+  std::shared_ptr<const DexelaCalibrationFile> pFile;
+  std::shared_ptr<DexImage> pImage;
+  static const char *functionName = "readCalibrationImage";
+
+  if (!DexelaCalibrationFile::isNativeFile(fileName.c_str())) {
+    pImage = std::make_shared<DexImage>();
+    pImage->ReadImage(fileName.c_str());
+    return std::make_shared<DexelaCalibrationImage>(pImage);
+  }
+  pFile = DexelaCalibrationFile::open(fileName.c_str());
+  // Calibrations depend on the sensor, so a file from another detector is probably a mistake
+  if ((pFile->getSerialNumber() != 0) && (serialNumber != 0) && (pFile->getSerialNumber() != serialNumber)) {
+    asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+      "%s::%s %s is from detector %d, this is detector %d\n",
+      driverName, functionName, fileName.c_str(), pFile->getSerialNumber(), serialNumber);
+  }
+  return std::make_shared<DexelaCalibrationImage>(pFile);
+}
+
+//_____________________________________________________________________________________________
+
+/** Queues a calibration file operation for calibrationIOTask(). Called with the lock held.
+  * The file names, the detector mode and the images to save are taken now, so the operation is not affected by
+  * parameters that change while it waits. The command parameter stays 1 until the operation is done, so a busy
+  * record writing it completes then.
+  * \param[in] operation The operation
+  * \param[in] command Parameter of the command that requested it */
+asynStatus Dexela::queueCalibrationIO(DEXCalibrationIO_t operation, int command)
+{
+  dexCalibrationIO_t io;
+  char directory[256];
+  static const char *functionName = "queueCalibrationIO";
+
+  io.operation = operation;
+  io.command = command;
+  io.extension = calibrationFileExtension();
+  io.key = currentCalibrationKey();
+  io.model = modelNumber_;
+  io.serialNumber = serialNumber_;
+  io.queueTime = dexTimeNow();
+  getStringParam(DEX_CorrectionsDirectory, sizeof(directory), directory);
+  switch (operation) {
+    case DEXLoadOffsetFile:
+      io.path = calibrationFilePath(DEX_OffsetFile, DexCalibrationOffset, io.key);
+      break;
+    case DEXLoadGainFile:
+      io.path = calibrationFilePath(DEX_GainFile, DexCalibrationGain, io.key);
+      break;
+    case DEXLoadDefectMapFile:
+      io.path = calibrationFilePath(DEX_DefectMapFile, DexCalibrationDefectMap, io.key);
+      break;
+    case DEXSaveOffsetFile:
+      // The active calibration is saved, which is of another mode than the parameters if the library is disabled
+      io.key = activeKey_;
+      io.path = calibrationFilePath(DEX_OffsetFile, DexCalibrationOffset, io.key);
+      io.pImage = pCalibration_->pOffset;
+      break;
+    case DEXSaveGainFile:
+      io.key = activeKey_;
+      io.path = calibrationFilePath(DEX_GainFile, DexCalibrationGain, io.key);
+      io.pImage = pCalibration_->pGain;
+      break;
+    case DEXLoadCalibrationLibrary:
+      io.path = directory;
+      break;
+    case DEXSaveDarkModel:
+      io.path = directory;
+      io.pDarkModel = calibrationLibrary_.findDarkModel(io.key);
+      break;
+  }
+  calibrationIOQueue_.push_back(io);
+  setIntegerParam(command, 1);
+  setIntegerParam(DEX_CalibrationIOBusy, 1);
+  epicsEventSignal(calibrationIOEvent_);
+  asynPrint(pasynUserSelf, ASYN_TRACE_FLOW,
+    "%s::%s queued operation %d for %s, %d operations queued\n",
+    driverName, functionName, operation, io.path.c_str(), (int)calibrationIOQueue_.size());
+  return asynSuccess;
+}
+
+static void calibrationIOTaskC(void *drvPvt)
+{
+  Dexela *pDexela = (Dexela *)drvPvt;
+  pDexela->calibrationIOTask();
+}
+
+/** Calibration I/O thread.  It does the queued calibration file operations in order, reading and writing the
+  * files without the lock. When an operation is done it publishes whether it succeeded, a message and the time
+  * from when it was queued, and sets its command parameter back to 0. */
+void Dexela::calibrationIOTask(void)
+{
+  dexCalibrationIO_t io;
+  std::string message;
+  asynStatus status;
+  bool pending;
+  size_t i;
+  static const char *functionName = "calibrationIOTask";
+
+  lock();
+  while (1) {
+    while (calibrationIOQueue_.empty()) {
+      unlock();
+      epicsEventWait(calibrationIOEvent_);
+      lock();
+    }
+    // The operation stays at the front of the queue until it is done, so its command is known to be busy
+    io = calibrationIOQueue_.front();
+    unlock();
+    message.clear();
+    try {
+      switch (io.operation) {
+        case DEXLoadOffsetFile:
+        case DEXLoadGainFile:
+        case DEXLoadDefectMapFile:
+          status = loadCalibrationFile(io, message);
+          break;
+        case DEXSaveOffsetFile:
+        case DEXSaveGainFile:
+          status = saveCalibrationFile(io, message);
+          break;
+        case DEXLoadCalibrationLibrary:
+          status = loadCalibrationLibrary(io, message);
+          break;
+        case DEXSaveDarkModel:
+          status = saveDarkModel(io, message);
+          break;
+        default:
+          status = asynError;
+          break;
+      }
+    } catch (DexelaException &e) {
+      reportError(functionName, e);
+      message = io.path + ": " + e.what();
+      status = asynError;
+    }
+    if (status) {
+      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+        "%s::%s error, %s\n",
+        driverName, functionName, message.c_str());
+    }
+    lock();
+    calibrationIOQueue_.pop_front();
+    pending = false;
+    for (i=0; i<calibrationIOQueue_.size(); i++) {
+      if (calibrationIOQueue_[i].command == io.command) pending = true;
+    }
+    if (!pending) setIntegerParam(io.command, 0);
+    setIntegerParam(DEX_CalibrationIOBusy, calibrationIOQueue_.empty() ? 0 : 1);
+    setIntegerParam(DEX_CalibrationIOStatus, status ? DEXCalibrationIOError : DEXCalibrationIOSuccess);
+    setStringParam (DEX_CalibrationIOMessage, message.c_str());
+    setDoubleParam (DEX_CalibrationIOTime, (dexTimeNow() - io.queueTime) / 1.e9);
+    callParamCallbacks();
+  }
+}
+
+/** Loads an offset, gain or defect map file as the calibration of the detector mode the load was queued in.
+  * The file is read and the corrections are built without the lock, in a copy of the active calibration set that
+  * is then swapped in, so the frame processing threads change to the new calibration between two frames.
+  * Called by calibrationIOTask() without the lock. Throws DexelaException if the file cannot be read. */
+asynStatus Dexela::loadCalibrationFile(const dexCalibrationIO_t &io, std::string &message)
+{
+  std::shared_ptr<const DexelaCalibrationImage> pImage;
+  std::shared_ptr<const DexelaCalibrationImage> pOffset;
+  std::shared_ptr<const DexelaCalibrationImage> pGain;
+  std::shared_ptr<const DexelaCalibrationImage> pDefectMap;
+  std::shared_ptr<DexelaCalibrationSet> pActive;
+  std::shared_ptr<DexelaCalibrationSet> pCalibration;
+  asynStatus status = asynSuccess;
+
+  pImage = readCalibrationImage(io.path, io.serialNumber);
+  if (io.operation == DEXLoadOffsetFile)    pOffset = pImage;
+  else if (io.operation == DEXLoadGainFile) pGain = pImage;
+  else                                      pDefectMap = pImage;
+  lock();
+  pActive = pCalibration_;
+  unlock();
+  pCalibration = updateCalibrationSet(*pActive, pOffset, pGain, pDefectMap);
+  lock();
+  if (!pCalibration) {
+    message = io.path + ": defect map must be a 16-bit image";
+    status = asynError;
+  } else if (!(currentCalibrationKey() == io.key)) {
+    message = io.path + ": detector mode changed while the file was loaded";
+    status = asynError;
+  } else {
+    // Another calibration became active while this one was built, so it is built again from that one
+    if (pCalibration_ != pActive) pCalibration = updateCalibrationSet(*pCalibration_, pOffset, pGain, pDefectMap);
+    installCalibration(io.key, pCalibration, pDefectMap == NULL, pDefectMap != NULL);
+    message = "Loaded " + io.path;
+  }
+  unlock();
+  return status;
+}
+
+/** Saves the offset or gain that was active when the save was queued. Calibration images are never modified once
+  * they are in a calibration set, so they are written without the lock.
+  * Called by calibrationIOTask() without the lock. Throws DexelaException if the file cannot be written. */
+asynStatus Dexela::saveCalibrationFile(const dexCalibrationIO_t &io, std::string &message)
+{
+  DexCalibrationType_t type = (io.operation == DEXSaveOffsetFile) ? DexCalibrationOffset : DexCalibrationGain;
+
+  if (!io.pImage) {
+    message = (type == DexCalibrationOffset) ? "No offset to save" : "No gain to save";
+    return asynError;
   }
+  io.pImage->write(io.path.c_str(), type, io.key, io.model, io.serialNumber);
+  message = "Saved " + io.path;
   return asynSuccess;
 }
 
@@ -1148,22 +3890,66 @@ static const iocshArg DexelaConfigArg2 = {"maxBuffers", iocshArgInt};
 static const iocshArg DexelaConfigArg3 = {"maxMemory",  iocshArgInt};
 static const iocshArg DexelaConfigArg4 = {"priority",   iocshArgInt};
 static const iocshArg DexelaConfigArg5 = {"stackSize",  iocshArgInt};
+static const iocshArg DexelaConfigArg6 = {"serialNumber", iocshArgInt};
 static const iocshArg * const DexelaConfigArgs[] =  {&DexelaConfigArg0,
                                                      &DexelaConfigArg1,
                                                      &DexelaConfigArg2,
                                                      &DexelaConfigArg3,
                                                      &DexelaConfigArg4,
-                                                     &DexelaConfigArg5};
-static const iocshFuncDef configDexela = {"DexelaConfig", 6, DexelaConfigArgs};
+                                                     &DexelaConfigArg5,
+                                                     &DexelaConfigArg6};
+static const iocshFuncDef configDexela = {"DexelaConfig", 7, DexelaConfigArgs};
 static void configDexelaCallFunc(const iocshArgBuf *args)
 {
   DexelaConfig(args[0].sval, args[1].ival, args[2].ival,
-               args[3].ival, args[4].ival, args[5].ival);
+               args[3].ival, args[4].ival, args[5].ival, args[6].ival);
+}
+
+/* DexelaOpenBoards */
+static const iocshArg DexelaOpenBoardsArg0 = {"serialNumbers", iocshArgString};
+static const iocshArg * const DexelaOpenBoardsArgs[] = {&DexelaOpenBoardsArg0};
+static const iocshFuncDef openBoardsDexela = {"DexelaOpenBoards", 1, DexelaOpenBoardsArgs};
+static void openBoardsDexelaCallFunc(const iocshArgBuf *args)
+{
+  DexelaOpenBoards(args[0].sval);
+}
+
+/* DexelaSimConfig */
+static const iocshArg DexelaSimConfigArg0 = {"serialNumber", iocshArgInt};
+static const iocshArg DexelaSimConfigArg1 = {"model",        iocshArgInt};
+static const iocshArg DexelaSimConfigArg2 = {"sizeX",        iocshArgInt};
+static const iocshArg DexelaSimConfigArg3 = {"sizeY",        iocshArgInt};
+static const iocshArg DexelaSimConfigArg4 = {"signalRate",   iocshArgDouble};
+static const iocshArg * const DexelaSimConfigArgs[] = {&DexelaSimConfigArg0,
+                                                       &DexelaSimConfigArg1,
+                                                       &DexelaSimConfigArg2,
+                                                       &DexelaSimConfigArg3,
+                                                       &DexelaSimConfigArg4};
+static const iocshFuncDef simConfigDexela = {"DexelaSimConfig", 5, DexelaSimConfigArgs};
+static void simConfigDexelaCallFunc(const iocshArgBuf *args)
+{
+  DexelaSimConfig(args[0].ival, args[1].ival, args[2].ival, args[3].ival, args[4].dval);
+}
+
+/* DexelaSimInject */
+static const iocshArg DexelaSimInjectArg0 = {"serialNumber",  iocshArgInt};
+static const iocshArg DexelaSimInjectArg1 = {"dropFraction",  iocshArgDouble};
+static const iocshArg DexelaSimInjectArg2 = {"errorFraction", iocshArgDouble};
+static const iocshArg * const DexelaSimInjectArgs[] = {&DexelaSimInjectArg0,
+                                                       &DexelaSimInjectArg1,
+                                                       &DexelaSimInjectArg2};
+static const iocshFuncDef simInjectDexela = {"DexelaSimInject", 3, DexelaSimInjectArgs};
+static void simInjectDexelaCallFunc(const iocshArgBuf *args)
+{
+  DexelaSimInject(args[0].ival, args[1].dval, args[2].dval);
 }
 
 static void DexelaRegister(void)
 {
   iocshRegister(&configDexela, configDexelaCallFunc);
+  iocshRegister(&openBoardsDexela, openBoardsDexelaCallFunc);
+  iocshRegister(&simConfigDexela, simConfigDexelaCallFunc);
+  iocshRegister(&simInjectDexela, simInjectDexelaCallFunc);
 }
 
 extern "C" {
@@ -16,8 +16,33 @@
 
 #define DRIVER_VERSION "2.4"
 
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
+#include <epicsMessageQueue.h>
+
 #include "ADDriver.h"
 #include "DexelaDetector.h"
+#include "DexelaDevice.h"
+#include "DexelaCorrection.h"
+#include "DexelaDefectCorrection.h"
+#include "DexelaCalibration.h"
+#include "DexelaCalibrationLibrary.h"
+#include "DexelaCalibrationFile.h"
+#include "DexelaLatency.h"
+#include "DexelaTimeStampFit.h"
+#include "DexelaBinning.h"
+#include "DexelaAccumulator.h"
+#include "DexelaArrayPool.h"
+#include "DexelaHDR.h"
 
 #define DEX_BinningModeString                "DEX_BINNING_MODE"
 #define DEX_FullWellModeString               "DEX_FULL_WELL_MODE"
@@ -45,6 +70,223 @@
 #define DEX_LoadDefectMapFileString          "DEX_LOAD_DEFECT_MAP_FILE"
 #define DEX_SoftwareTriggerString            "DEX_SOFTWARE_TRIGGER"
 #define DEX_ReadoutModeString                "DEX_READOUT_MODE"
+#define DEX_NumThreadsString                 "DEX_NUM_THREADS"
+#define DEX_BytesCopiedString                "DEX_BYTES_COPIED"
+#define DEX_CorrectionEngineString           "DEX_CORRECTION_ENGINE"
+#define DEX_CorrectionSIMDString             "DEX_CORRECTION_SIMD"
+#define DEX_DefectClassesString              "DEX_DEFECT_CLASSES"
+#define DEX_NumDefectsString                 "DEX_NUM_DEFECTS"
+#define DEX_CalibrationEstimatorString       "DEX_CALIBRATION_ESTIMATOR"
+#define DEX_CalibrationClipSigmaString       "DEX_CALIBRATION_CLIP_SIGMA"
+#define DEX_CalibrationMemoryString          "DEX_CALIBRATION_MEMORY"
+#define DEX_CalibrationFinishTimeString      "DEX_CALIBRATION_FINISH_TIME"
+#define DEX_CalibrationTotalTimeString       "DEX_CALIBRATION_TOTAL_TIME"
+#define DEX_UseCalibrationLibraryString      "DEX_USE_CALIBRATION_LIBRARY"
+#define DEX_LoadCalibrationLibraryString     "DEX_LOAD_CALIBRATION_LIBRARY"
+#define DEX_CalibrationLibrarySizeString     "DEX_CALIBRATION_LIBRARY_SIZE"
+#define DEX_CalibrationKeyString             "DEX_CALIBRATION_KEY"
+#define DEX_CalibrationMissesString          "DEX_CALIBRATION_MISSES"
+#define DEX_FrameRateString                  "DEX_FRAME_RATE"
+#define DEX_ResetLatencyString               "DEX_RESET_LATENCY"
+#define DEX_DroppedFramesString              "DEX_DROPPED_FRAMES"
+#define DEX_LastGapString                    "DEX_LAST_GAP"
+#define DEX_PixelFrameCounterString          "DEX_PIXEL_FRAME_COUNTER"
+#define DEX_PixelCounterErrorsString         "DEX_PIXEL_COUNTER_ERRORS"
+#define DEX_TimeStampFitString               "DEX_TIMESTAMP_FIT"
+#define DEX_FittedPeriodString               "DEX_FITTED_PERIOD"
+#define DEX_TimeStampJitterString            "DEX_TIMESTAMP_JITTER"
+#define DEX_SoftwareBinXString               "DEX_SOFTWARE_BIN_X"
+#define DEX_SoftwareBinYString               "DEX_SOFTWARE_BIN_Y"
+#define DEX_SoftwareBinOperationString       "DEX_SOFTWARE_BIN_OPERATION"
+#define DEX_SoftwareBinDataTypeString        "DEX_SOFTWARE_BIN_DATA_TYPE"
+#define DEX_ROISupportedString               "DEX_ROI_SUPPORTED"
+#define DEX_ROIMarginString                  "DEX_ROI_MARGIN"
+#define DEX_ReadoutTimeString                "DEX_READOUT_TIME"
+#define DEX_OnBoardUnscramblingString        "DEX_ON_BOARD_UNSCRAMBLING"
+#define DEX_OnBoardLinearizationString       "DEX_ON_BOARD_LINEARIZATION"
+#define DEX_OnBoardXTalkString               "DEX_ON_BOARD_XTALK"
+#define DEX_HostTimeSavedString              "DEX_HOST_TIME_SAVED"
+#define DEX_NumAccumulateString              "DEX_NUM_ACCUMULATE"
+#define DEX_AccumulateDataTypeString         "DEX_ACCUMULATE_DATA_TYPE"
+#define DEX_NumAccumulatedString             "DEX_NUM_ACCUMULATED"
+#define DEX_NumPreallocateString             "DEX_NUM_PREALLOCATE"
+#define DEX_LockArraysString                 "DEX_LOCK_ARRAYS"
+#define DEX_PoolHitsString                   "DEX_POOL_HITS"
+#define DEX_PoolMissesString                 "DEX_POOL_MISSES"
+#define DEX_StatusRateString                 "DEX_STATUS_RATE"
+#define DEX_HDRModeString                    "DEX_HDR_MODE"
+#define DEX_HDRNumExposuresString            "DEX_HDR_NUM_EXPOSURES"
+#define DEX_HDRSaturationString              "DEX_HDR_SATURATION"
+#define DEX_HDRIncompleteCyclesString        "DEX_HDR_INCOMPLETE_CYCLES"
+#define DEX_UseDarkModelString               "DEX_USE_DARK_MODEL"
+#define DEX_FitDarkModelString               "DEX_FIT_DARK_MODEL"
+#define DEX_SaveDarkModelString              "DEX_SAVE_DARK_MODEL"
+#define DEX_DarkModelAvailableString         "DEX_DARK_MODEL_AVAILABLE"
+#define DEX_DarkModelOffsetsString           "DEX_DARK_MODEL_OFFSETS"
+#define DEX_OffsetSynthesizedString          "DEX_OFFSET_SYNTHESIZED"
+#define DEX_SynthesizeTimeString             "DEX_SYNTHESIZE_TIME"
+#define DEX_ConnectionStateString            "DEX_CONNECTION_STATE"
+#define DEX_ReconnectString                  "DEX_RECONNECT"
+#define DEX_ReconnectsString                 "DEX_RECONNECTS"
+#define DEX_CalibrationFileFormatString      "DEX_CALIBRATION_FILE_FORMAT"
+#define DEX_CalibrationIOBusyString          "DEX_CALIBRATION_IO_BUSY"
+#define DEX_CalibrationIOStatusString        "DEX_CALIBRATION_IO_STATUS"
+#define DEX_CalibrationIOMessageString       "DEX_CALIBRATION_IO_MESSAGE"
+#define DEX_CalibrationIOTimeString          "DEX_CALIBRATION_IO_TIME"
+// The HDR exposure time parameters are DEX_HDR_EXPOSURE_1 to DEX_HDR_EXPOSURE_4, in seconds
+// The latency parameters are DEX_<STAGE>_LATENCY_P50, _P99 and _MAX for each DexStage_t, in ms
+
+/** Maximum number of frame processing threads */
+#define DEX_MAX_THREADS 16
+/** Default number of frame processing threads */
+#define DEX_DEFAULT_THREADS 4
+/** Interval at which the frame rate and latency parameters are updated while acquiring, in seconds */
+#define DEX_LATENCY_UPDATE_INTERVAL 1.0
+/** Default rate at which the status parameters are published while acquiring, in Hz */
+#define DEX_DEFAULT_STATUS_RATE 10.0
+/** Delay before the first attempt to reconnect to the detector, in seconds. It doubles after each failure. */
+#define DEX_RECONNECT_MIN_DELAY 1.0
+/** Maximum delay between attempts to reconnect to the detector, in seconds */
+#define DEX_RECONNECT_MAX_DELAY 60.0
+/** Time constant of the fit of frame arrival times, in frames */
+#define DEX_TIMESTAMP_FIT_FRAMES 1000
+
+/** Maximum number of frames in an accumulated sum, so 16-bit frames cannot overflow the 32-bit sum.
+  * limitNumAccumulate() lowers it for 32-bit software-binned frames. */
+#define DEX_MAX_ACCUMULATE 65536
+
+/** The Dexela SDK is only available on Windows. Elsewhere the driver is built with the DexImage and DexelaException
+  * stand-ins in dexelaSupport/os/Linux, only simulated detectors can be used and the frames are corrected by
+  * DexelaCorrection. */
+#ifdef _WIN32
+  #define DEX_HAVE_SDK 1
+#else
+  #define DEX_HAVE_SDK 0
+#endif
+
+/** Values of ADTriggerMode */
+typedef enum {
+  DEXInternalFreeRun,
+  DEXInternalFixedRate,
+  DEXInternalSoftware,
+  DEXExternalEdgeSingle,
+  DEXExternalEdgeMulti,
+  DEXExternalBulb
+} DEXTriggerMode_t;
+
+/** States of the connection to the detector */
+typedef enum {
+  DEXDisconnected,
+  DEXConnecting,
+  DEXConnected
+} DEXConnectionState_t;
+
+/** Data types of the accumulated sum */
+typedef enum {
+  DEXAccumulateUInt32,
+  DEXAccumulateFloat32
+} DEXAccumulateDataType_t;
+
+/** Implementations of the offset and gain correction */
+typedef enum {
+  DEXCorrectionSDK,
+  DEXCorrectionNative
+} DEXCorrectionEngine_t;
+
+/** Formats of the calibration files that the driver names from the detector mode */
+typedef enum {
+  DEXCalibrationFileSMV,
+  DEXCalibrationFileNative    /**< Memory mapped DexelaCalibrationFile */
+} DEXCalibrationFileFormat_t;
+
+/** Calibration file operations, done by the calibration I/O thread */
+typedef enum {
+  DEXLoadOffsetFile,
+  DEXSaveOffsetFile,
+  DEXLoadGainFile,
+  DEXSaveGainFile,
+  DEXLoadDefectMapFile,
+  DEXLoadCalibrationLibrary,
+  DEXSaveDarkModel
+} DEXCalibrationIO_t;
+
+/** Result of the last calibration file operation */
+typedef enum {
+  DEXCalibrationIOSuccess,
+  DEXCalibrationIOError
+} DEXCalibrationIOStatus_t;
+
+/** Calibration file operation waiting for the calibration I/O thread.
+  * Everything the operation needs from the parameters is captured under the lock when it is queued, so the
+  * files are read and written without the lock. */
+typedef struct {
+  DEXCalibrationIO_t operation;
+  int command;                /**< Parameter of the command, set to 0 when the operation is done */
+  std::string path;           /**< File to read or write, or the corrections directory */
+  const char *extension;      /**< Extension of the dark model files */
+  DexelaCalibrationKey key;   /**< Detector mode when the operation was queued */
+  int model;                  /**< Model number of the detector */
+  int serialNumber;           /**< Serial number of the detector */
+  std::shared_ptr<const DexelaCalibrationImage> pImage;  /**< Image to save */
+  std::shared_ptr<const DexelaDarkModel> pDarkModel;     /**< Dark model to save */
+  epicsUInt64 queueTime;      /**< dexTimeNow() when the operation was queued */
+} dexCalibrationIO_t;
+
+/** Message passed from the SDK callback to the frame processing threads */
+typedef struct {
+  int frameCounter;   /**< Frame counter passed to the SDK callback */
+  int bufferNumber;   /**< SDK buffer holding the frame, -1 tells the thread to exit */
+  int sequence;       /**< Order in which the frame must be published */
+  int generation;     /**< Acquisition this frame belongs to */
+  epicsUInt64 queueTime; /**< dexTimeNow() when the SDK callback queued the frame */
+  int gap;            /**< Number of frames missing before this one */
+  epicsTimeStamp callbackTime; /**< Time at entry to the SDK callback */
+  epicsTimeStamp timeStamp;    /**< Time stamp of the NDArray, the fitted time if there is one */
+  int fitted;         /**< timeStamp is the fitted arrival time */
+  int exposureIndex;  /**< Position of the frame in the HDR cycle, 0 if HDR is disabled */
+} dexFrameMessage_t;
+
+/** Processed frame waiting for the earlier frames to be published */
+typedef struct {
+  NDArray     *pArray;      /**< The frame, NULL if it is not to be published */
+  epicsUInt64 queueTime;    /**< dexTimeNow() when the SDK callback queued the frame */
+  int         gap;          /**< Number of frames missing before this one */
+  int         exposureIndex; /**< Position of the frame in the HDR cycle */
+} dexPendingFrame_t;
+
+/** Parameters used by the frame processing threads.
+  * A new snapshot is built under the lock whenever one of them may have changed and swapped in with
+  * std::atomic_store, so a frame is processed with one std::atomic_load instead of a getIntegerParam call for each
+  * of them under the lock. A snapshot is never modified after it is published. */
+typedef struct {
+  int acquiring;
+  int generation;          /**< Acquisition the snapshot belongs to */
+  int frameType;
+  int imageMode;
+  int numImages;
+  int arrayCallbacks;
+  int offsetAvailable;
+  int useOffset;
+  int gainAvailable;
+  int useGain;
+  int useDefectMap;
+  int darkOffset;
+  int correctionEngine;
+  int defectClasses;
+  int usePixelCounter;
+  int softwareBinX;
+  int softwareBinY;
+  int softwareBinOperation;
+  int softwareBinDataType;
+  int numAccumulate;       /**< Kept from the start of the acquisition */
+  int accumulateDataType;  /**< Kept from the start of the acquisition */
+  size_t bufferSizeX;      /**< DexelaDetector::GetBufferXdim() */
+  size_t bufferSizeY;      /**< DexelaDetector::GetBufferYdim() */
+  std::shared_ptr<DexelaCalibrationSet> pCalibration;
+  int hdrNumExposures;     /**< Exposures in the HDR cycle, 0 if HDR is disabled */
+  int hdrSaturation;       /**< DEX_HDRSaturation, raw counts */
+  std::shared_ptr<DexelaCalibrationSet> pHDRCalibration[DEX_MAX_HDR_EXPOSURES]; /**< Calibration of each exposure */
+} dexConfig_t;
 
 
 /** Driver for the Perkin Elmer Dexela CMOS flat panel detectors */
@@ -54,11 +296,12 @@ class Dexela : public ADDriver
 public:
   Dexela(const char *portName, int detIndex, 
          int maxBuffers, size_t maxMemory,
-         int priority, int stackSize);
+         int priority, int stackSize, int serialNumber);
 
   /* These are the methods that we override from ADDriver */
   virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
   virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+  virtual asynStatus writeOctet(asynUser *pasynUser, const char *value, size_t nChars, size_t *nActual);
   virtual asynStatus readEnum(asynUser *pasynUser, char *strings[], int values[], int severities[], 
                               size_t nElements, size_t *nIn);
   void report(FILE *fp, int details);
@@ -66,6 +309,10 @@ public:
   // These should really be private, but they are called from C so must be public
   void acquireStopTask(void);
   void newFrameCallback(int frameCounter, int bufferNumber);
+  void frameTask(void);
+  void statusTask(void);
+  void connectTask(void);
+  void calibrationIOTask(void);
 
   ~Dexela();
 
@@ -97,15 +344,85 @@ protected:
   int DEX_LoadDefectMapFile;
   int DEX_SoftwareTrigger;
   int DEX_ReadoutMode;
+  int DEX_NumThreads;
+  int DEX_BytesCopied;
+  int DEX_CorrectionEngine;
+  int DEX_CorrectionSIMD;
+  int DEX_DefectClasses;
+  int DEX_NumDefects;
+  int DEX_CalibrationEstimator;
+  int DEX_CalibrationClipSigma;
+  int DEX_CalibrationMemory;
+  int DEX_CalibrationFinishTime;
+  int DEX_CalibrationTotalTime;
+  int DEX_UseCalibrationLibrary;
+  int DEX_LoadCalibrationLibrary;
+  int DEX_CalibrationLibrarySize;
+  int DEX_CalibrationKey;
+  int DEX_CalibrationMisses;
+  int DEX_FrameRate;
+  int DEX_ResetLatency;
+  int DEX_DroppedFrames;
+  int DEX_LastGap;
+  int DEX_PixelFrameCounter;
+  int DEX_PixelCounterErrors;
+  int DEX_TimeStampFit;
+  int DEX_FittedPeriod;
+  int DEX_TimeStampJitter;
+  int DEX_SoftwareBinX;
+  int DEX_SoftwareBinY;
+  int DEX_SoftwareBinOperation;
+  int DEX_SoftwareBinDataType;
+  int DEX_ROISupported;
+  int DEX_ROIMargin;
+  int DEX_ReadoutTime;
+  int DEX_OnBoardUnscrambling;
+  int DEX_OnBoardLinearization;
+  int DEX_OnBoardXTalk;
+  int DEX_HostTimeSaved;
+  int DEX_NumAccumulate;
+  int DEX_AccumulateDataType;
+  int DEX_NumAccumulated;
+  int DEX_NumPreallocate;
+  int DEX_LockArrays;
+  int DEX_PoolHits;
+  int DEX_PoolMisses;
+  int DEX_StatusRate;
+  int DEX_HDRMode;
+  int DEX_HDRNumExposures;
+  int DEX_HDRSaturation;
+  int DEX_HDRIncompleteCycles;
+  int DEX_UseDarkModel;
+  int DEX_FitDarkModel;
+  int DEX_SaveDarkModel;
+  int DEX_DarkModelAvailable;
+  int DEX_DarkModelOffsets;
+  int DEX_OffsetSynthesized;
+  int DEX_SynthesizeTime;
+  int DEX_ConnectionState;
+  int DEX_Reconnect;
+  int DEX_Reconnects;
+  int DEX_CalibrationFileFormat;
+  int DEX_CalibrationIOBusy;
+  int DEX_CalibrationIOStatus;
+  int DEX_CalibrationIOMessage;
+  int DEX_CalibrationIOTime;
+  int DEX_HDRExposure[DEX_MAX_HDR_EXPOSURES];
+  int DEX_LatencyP50[DexNumStages];
+  int DEX_LatencyP99[DexNumStages];
+  int DEX_LatencyMax[DexNumStages];
 
 
 private:
-  DexelaDetector *pDetector_;
+  DexelaDevice   *pDetector_;             /**< NULL until the first connection, then kept when reconnecting */
   DevInfo        devInfo_;
-  BusScanner     *pBusScanner_;
+  int            detIndex_;
+  int            requestedSerialNumber_;  /**< Serial number passed to DexelaConfig, 0 to use detIndex_ */
+  std::atomic<bool> connected_;           /**< The detector is open, cleared by connectionLost() from any thread */
+  epicsEventId   connectEvent_;           /**< Wakes connectTask() when the connection is lost */
+  std::set<int>  pendingSettings_;        /**< Settings written while disconnected, applied when connected */
   DexImage       offsetImage_;
   DexImage       gainImage_;
-  DexImage       defectMapImage_;
   int            sensorX_;
   int            sensorY_;
   char           modelName_[80];
@@ -115,18 +432,143 @@ private:
   bins           binningMode_;
   int            snapBuffer_;
   int            numBuffers_;
+  bool           onBoardUnscrambling_;
+  bool           roiSupported_;
+  bool           onBoardLinearization_;  /**< The detector can linearize the frames */
+  bool           onBoardXTalk_;          /**< The detector can correct the crosstalk */
+  std::shared_ptr<DexelaCalibrationSet> pCalibration_;
+  DexelaCalibrationLibrary calibrationLibrary_;
+  DexelaCalibrationKey activeKey_;
+  std::unique_ptr<DexelaStreamingEstimator> pEstimator_;
+  std::unique_ptr<DexelaMedianPool> pMedianPool_;
+  int            calibrationFinishing_;   /**< DEX_AcquireOffset or DEX_AcquireGain while finishCalibration() is
+                                               combining the frames without the lock, -1 otherwise */
+  int            calibrationEstimator_;
+  epicsTimeStamp calibrationStartTime_;
+  std::deque<dexCalibrationIO_t> calibrationIOQueue_; /**< Operations for calibrationIOTask(), the first one is
+                                                           the one being done. Only accessed with the lock. */
+  epicsEventId   calibrationIOEvent_;     /**< Wakes calibrationIOTask() when an operation is queued */
+
+  // Frame processing pipeline
+  epicsMessageQueueId    frameQueue_;
+  epicsEventId           frameTaskExitEvent_;
+  epicsEventId           statusEvent_;           /**< Wakes statusTask() when acquisition starts or the rate changes */
+  int                    numFrameThreads_;
+  // Written under the lock when acquisition starts and read by the SDK callback thread without it
+  std::atomic<int>       frameSequence_;
+  std::atomic<int>       acquireGeneration_;
+  int                    nextPublishSequence_;
+  std::atomic<int>       nextFrameCounter_;      /**< Expected SDK frame counter, -1 at the start of acquisition */
+  std::atomic<int>       queueDropped_;          /**< Frames dropped because too many were in flight */
+  std::atomic<int>       framesInFlight_;        /**< Frames queued or being read by the frame processing threads */
+  std::atomic<int>       framesToPublish_;       /**< Frames queued, being processed or waiting for publishFrame().
+                                                       Only decremented with the lock held */
+  std::shared_ptr<const dexConfig_t> pConfig_; /**< Only accessed with std::atomic_load and std::atomic_store */
+  // Counters updated by the frame processing threads without the lock, publishFrame() copies them to the parameters
+  std::atomic<int>       imageCounter_;
+  std::atomic<int>       arrayCounter_;
+  std::atomic<int>       bytesCopied_;
+  std::atomic<int>       pixelCounterOffset_;    /**< Pixel frame counter minus SDK frame counter, -1 if unknown */
+  std::atomic<int>       pixelCounterErrors_;
+  DexelaTimeStampFit     timeStampFit_;
+  bool                   fitTimeStamps_;
+  epicsTimeStamp         fitOrigin_;
+  // The ordering, HDR and accumulation state below is protected by publishMutex_. The lock may be held when it is
+  // taken, but publishMutex_ is never held when taking the lock.
+  epicsMutexId           publishMutex_;
+  std::map<int, dexPendingFrame_t> pendingArrays_;
+  epicsMutexId           readyMutex_;            /**< Protects readyArrays_, held only to queue and remove arrays */
+  std::deque<dexPendingFrame_t> readyArrays_;    /**< Completed frames and sums waiting for publishReadyArrays() */
+  DexelaLatency          latency_;
+  DexelaAccumulator      accumulator_;
+  DexelaArrayPool        arrayPool_;
+  NDArray                *pAccumulated_;         /**< Sum of the frames accumulated so far, NULL if none */
+  std::atomic<int>       numAccumulated_;
+  // Counters updated in the publish stage without the lock, updateFrameCounters() copies them to the parameters
+  std::atomic<int>       droppedFrames_;
+  std::atomic<int>       lastGap_;
+  std::atomic<int>       hdrIncompleteCycles_;
+  int                    accumulatedGap_;        /**< Frames missing before and within the sum */
+  int                    firstAccumulatedFrame_;
+  int                    lastAccumulatedFrame_;
+  // HDR acquisition
+  int                    hdrNumExposures_;       /**< Exposures in the HDR cycle of this acquisition, 0 if disabled */
+  int                    hdrFirstFrame_;         /**< SDK frame counter of the first frame of the acquisition */
+  DexelaHDR              hdr_;
+  NDArray                *pHDRFrames_[DEX_MAX_HDR_EXPOSURES]; /**< Frames of the current cycle, NULL if missing */
+  std::shared_ptr<DexelaCalibrationSet> hdrCalibration_[DEX_MAX_HDR_EXPOSURES];
 
+  void startFrameThreads(int numThreads);
+  void stopFrameThreads(void);
+  NDArray *processFrame(dexFrameMessage_t *pMsg, DexImage &dataImage, std::vector<epicsUInt8> &saturatedMask);
+  NDArray *allocArray(NDDataType_t dataType, dexFrameMessage_t *pMsg, const dexConfig_t &config);
+  NDArray *copyToArray(void *pData, NDDataType_t dataType, dexFrameMessage_t *pMsg, const dexConfig_t &config);
+  bool countImage(const dexConfig_t &config);
+  NDArray *binArray(NDArray *pImage, const DexelaBinning &binning);
+  bool correctionMatches(const char *correctionName, int sizeX, int sizeY, NDArray *pImage);
+  void publishFrame(dexFrameMessage_t *pMsg, NDArray *pImage);
+  void publishArray(NDArray *pImage, epicsUInt64 queueTime);
+  void queueReadyArray(NDArray *pImage, epicsUInt64 queueTime);
+  bool publishReadyArrays(void);
+  NDArray *accumulateFrame(NDArray *pImage, int gap, int numAccumulate, int dataType);
+  NDArray *finishAccumulation(void);
+  bool flushAccumulation(void);
+  void limitNumAccumulate(void);
+  void setupHDR(void);
+  NDArray *fuseHDRFrame(NDArray *pImage, int exposureIndex);
+  void releaseHDRFrames(void);
+  void resetFramePipeline(bool useHDR);
+  void publishConfig(void);
+  void updateFrameCounters(void);
+  void preallocateArrays(void);
+  void updateLatencyParams(void);
   void reportSensors(FILE *fp, int details);
   void reportError(const char *functionName, DexelaException &e);
+  void connectionLost(void);
+  bool connectDetector(void);
+  DexelaDevice *openDetector(DexelaDevice *pDetector);
+  void initDetector(void);
+  void restoreSettings(bool all);
+  void updateEnums(void);
+  int getEnums(int function, char *strings[], int values[], int severities[], size_t nElements);
   void acquireStart(void);
   void acquireStop(void);
   void acquireOffsetImage(void);
   void acquireGainImage(void);
-  asynStatus loadOffsetFile(void);
-  asynStatus saveOffsetFile(void);
-  asynStatus loadGainFile(void);
-  asynStatus saveGainFile(void);
-  asynStatus loadDefectMapFile();
+  void setROI(void);
+  void updateReadoutTime(void);
+  void measureHostUnscramble(void);
+  void startCalibration(void);
+  void *readCalibrationFrame(int bufferNumber, DexImage &calibImage, int frameNumber, DexImage &dataImage);
+  void finishCalibration(DexImage &calibImage, DexImage &dataImage, int command);
+  std::shared_ptr<DexelaCorrection> buildCorrection(const DexelaCalibrationImage *pOffset,
+                                                    const DexelaCalibrationImage *pGain);
+  std::shared_ptr<DexelaDefectCorrection> compileDefectMap(const DexelaCalibrationImage &defectMap);
+  DexelaCalibrationKey currentCalibrationKey(void);
+  std::shared_ptr<DexelaCalibrationSet> findCalibration(const DexelaCalibrationKey &key);
+  std::shared_ptr<const DexelaCalibrationImage> cropCalibrationImage(
+    const std::shared_ptr<const DexelaCalibrationImage> &pFullFrame, const DexelaCalibrationKey &key);
+  void synthesizeOffset(const DexelaCalibrationKey &key, DexelaCalibrationSet &calibration);
+  asynStatus fitDarkModel(void);
+  asynStatus storeCalibration(const std::shared_ptr<const DexelaCalibrationImage> &pOffset,
+                              const std::shared_ptr<const DexelaCalibrationImage> &pGain,
+                              const std::shared_ptr<const DexelaCalibrationImage> &pDefectMap);
+  std::shared_ptr<DexelaCalibrationSet> updateCalibrationSet(
+    const DexelaCalibrationSet &calibration, const std::shared_ptr<const DexelaCalibrationImage> &pOffset,
+    const std::shared_ptr<const DexelaCalibrationImage> &pGain,
+    const std::shared_ptr<const DexelaCalibrationImage> &pDefectMap);
+  void installCalibration(const DexelaCalibrationKey &key, const std::shared_ptr<DexelaCalibrationSet> &pCalibration,
+                          bool offsetGain, bool defectMap);
+  void selectCalibration(bool force);
+  void activateCalibration(std::shared_ptr<DexelaCalibrationSet> pCalibration, const DexelaCalibrationKey &key);
+  asynStatus loadCalibrationLibrary(const dexCalibrationIO_t &io, std::string &message);
+  std::string calibrationFilePath(int fileNameParam, DexCalibrationType_t type, const DexelaCalibrationKey &key);
+  const char *calibrationFileExtension(void);
+  std::shared_ptr<const DexelaCalibrationImage> readCalibrationImage(const std::string &fileName, int serialNumber);
+  asynStatus queueCalibrationIO(DEXCalibrationIO_t operation, int command);
+  asynStatus loadCalibrationFile(const dexCalibrationIO_t &io, std::string &message);
+  asynStatus saveCalibrationFile(const dexCalibrationIO_t &io, std::string &message);
+  asynStatus saveDarkModel(const dexCalibrationIO_t &io, std::string &message);
 };
 
 #endif
@@ -0,0 +1,170 @@
+/* DexelaAccumulator.cpp
+ *
+ * Sums of Dexela frames.
+ *
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define DEX_X86_SIMD
+  #define DEX_TARGET_AVX2   __attribute__((target("avx2")))
+  #define DEX_TARGET_AVX512 __attribute__((target("avx512f")))
+  #include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  #define DEX_X86_SIMD
+  #define DEX_TARGET_AVX2
+  #define DEX_TARGET_AVX512
+  #include <immintrin.h>
+#endif
+
+#include "DexelaAccumulator.h"
+
+//_____________________________________________________________________________________________
+
+/** Scalar kernel, also used for the pixels at the end of the frame that do not fill a SIMD register */
+template <typename In, typename Sum>
+static void addScalar(const In *pIn, Sum *pSum, size_t n)
+{
+  size_t i;
+
+  for (i=0; i<n; i++) pSum[i] += (Sum)pIn[i];
+}
+
+#ifdef DEX_X86_SIMD
+
+/** AVX2 kernel for 32-bit integer sums, 16 pixels per iteration */
+DEX_TARGET_AVX2
+static void addAVX2(const epicsUInt16 *pIn, epicsUInt32 *pSum, size_t n)
+{
+  __m256i raw;
+  size_t i;
+
+  for (i=0; i+16<=n; i+=16) {
+    raw = _mm256_loadu_si256((const __m256i *)(pIn + i));
+    _mm256_storeu_si256((__m256i *)(pSum + i),
+                        _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(pSum + i)),
+                                         _mm256_cvtepu16_epi32(_mm256_castsi256_si128(raw))));
+    _mm256_storeu_si256((__m256i *)(pSum + i + 8),
+                        _mm256_add_epi32(_mm256_loadu_si256((const __m256i *)(pSum + i + 8)),
+                                         _mm256_cvtepu16_epi32(_mm256_extracti128_si256(raw, 1))));
+  }
+  addScalar(pIn + i, pSum + i, n - i);
+}
+
+/** AVX2 kernel for floating point sums, 16 pixels per iteration */
+DEX_TARGET_AVX2
+static void addAVX2(const epicsUInt16 *pIn, float *pSum, size_t n)
+{
+  __m256i raw;
+  size_t i;
+
+  for (i=0; i+16<=n; i+=16) {
+    raw = _mm256_loadu_si256((const __m256i *)(pIn + i));
+    _mm256_storeu_ps(pSum + i,
+                     _mm256_add_ps(_mm256_loadu_ps(pSum + i),
+                                   _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(raw)))));
+    _mm256_storeu_ps(pSum + i + 8,
+                     _mm256_add_ps(_mm256_loadu_ps(pSum + i + 8),
+                                   _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(raw, 1)))));
+  }
+  addScalar(pIn + i, pSum + i, n - i);
+}
+
+/** AVX-512 kernel for 32-bit integer sums, 16 pixels per iteration */
+DEX_TARGET_AVX512
+static void addAVX512(const epicsUInt16 *pIn, epicsUInt32 *pSum, size_t n)
+{
+  size_t i;
+
+  for (i=0; i+16<=n; i+=16) {
+    _mm512_storeu_si512((void *)(pSum + i),
+                        _mm512_add_epi32(_mm512_loadu_si512((const void *)(pSum + i)),
+                                         _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(pIn + i)))));
+  }
+  addScalar(pIn + i, pSum + i, n - i);
+}
+
+/** AVX-512 kernel for floating point sums, 16 pixels per iteration */
+DEX_TARGET_AVX512
+static void addAVX512(const epicsUInt16 *pIn, float *pSum, size_t n)
+{
+  size_t i;
+
+  for (i=0; i+16<=n; i+=16) {
+    _mm512_storeu_ps(pSum + i,
+                     _mm512_add_ps(_mm512_loadu_ps(pSum + i),
+                                   _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(
+                                     _mm256_loadu_si256((const __m256i *)(pIn + i))))));
+  }
+  addScalar(pIn + i, pSum + i, n - i);
+}
+
+#endif
+
+//_____________________________________________________________________________________________
+
+DexelaAccumulator::DexelaAccumulator()
+{
+  // The CPU does not change, so it is only queried once
+  static const DexSIMDLevel_t maxLevel = DexelaCorrection::maxSIMDLevel();
+
+  simdLevel_ = maxLevel;
+}
+
+/** Sets the SIMD instruction set, it is limited to what this CPU supports */
+void DexelaAccumulator::setSIMDLevel(DexSIMDLevel_t level)
+{
+  DexSIMDLevel_t maxLevel = DexelaCorrection::maxSIMDLevel();
+
+  simdLevel_ = (level > maxLevel) ? maxLevel : level;
+}
+
+/** Adds n pixels of a 16-bit frame to a 32-bit integer sum */
+void DexelaAccumulator::add(const epicsUInt16 *pIn, epicsUInt32 *pSum, size_t n) const
+{
+  switch (simdLevel_) {
+#ifdef DEX_X86_SIMD
+    case DexSIMDAVX512:
+      addAVX512(pIn, pSum, n);
+      break;
+    case DexSIMDAVX2:
+      addAVX2(pIn, pSum, n);
+      break;
+#endif
+    default:
+      addScalar(pIn, pSum, n);
+      break;
+  }
+}
+
+/** Adds n pixels of a 16-bit frame to a floating point sum */
+void DexelaAccumulator::add(const epicsUInt16 *pIn, float *pSum, size_t n) const
+{
+  switch (simdLevel_) {
+#ifdef DEX_X86_SIMD
+    case DexSIMDAVX512:
+      addAVX512(pIn, pSum, n);
+      break;
+    case DexSIMDAVX2:
+      addAVX2(pIn, pSum, n);
+      break;
+#endif
+    default:
+      addScalar(pIn, pSum, n);
+      break;
+  }
+}
+
+void DexelaAccumulator::add(const epicsUInt32 *pIn, epicsUInt32 *pSum, size_t n) const
+{
+  addScalar(pIn, pSum, n);
+}
+
+void DexelaAccumulator::add(const epicsUInt32 *pIn, float *pSum, size_t n) const
+{
+  addScalar(pIn, pSum, n);
+}
+
+void DexelaAccumulator::add(const float *pIn, float *pSum, size_t n) const
+{
+  addScalar(pIn, pSum, n);
+}
@@ -0,0 +1,40 @@
+/* DexelaAccumulator.h
+ *
+ * Sums of Dexela frames.
+ *
+ * Adding 16-bit frames into 32-bit integer or floating point sums is memory bound, so the kernels use AVX2 or
+ * AVX-512 when the CPU supports them to convert and add 16 pixels per instruction.
+ *
+ */
+
+#ifndef DexelaAccumulator_H
+#define DexelaAccumulator_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "DexelaCorrection.h"
+
+/** Adds frames into a sum, pixel by pixel.
+  * The 16-bit inputs use the SIMD kernels, the 32-bit inputs are only needed for frames that have been binned in
+  * software and use scalar loops. */
+class DexelaAccumulator
+{
+public:
+  DexelaAccumulator();
+
+  void add(const epicsUInt16 *pIn, epicsUInt32 *pSum, size_t n) const;
+  void add(const epicsUInt16 *pIn, float *pSum, size_t n) const;
+  void add(const epicsUInt32 *pIn, epicsUInt32 *pSum, size_t n) const;
+  void add(const epicsUInt32 *pIn, float *pSum, size_t n) const;
+  void add(const float *pIn, float *pSum, size_t n) const;
+
+  void setSIMDLevel(DexSIMDLevel_t level);
+  DexSIMDLevel_t getSIMDLevel() const { return simdLevel_; }
+
+private:
+  DexSIMDLevel_t simdLevel_;
+};
+
+#endif
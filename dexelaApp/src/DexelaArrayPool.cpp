@@ -0,0 +1,80 @@
+/* DexelaArrayPool.cpp
+ *
+ * Allocation of the driver's NDArrays from the NDArrayPool.
+ *
+ */
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <sys/mman.h>
+#endif
+
+#include "DexelaArrayPool.h"
+
+DexelaArrayPool::DexelaArrayPool()
+  : pPool_(NULL), lockMemory_(false), hits_(0), misses_(0), lockFailures_(0)
+{
+  mutex_ = epicsMutexMustCreate();
+}
+
+DexelaArrayPool::~DexelaArrayPool()
+{
+  epicsMutexDestroy(mutex_);
+}
+
+/** Allocates an NDArray from the pool.
+  * It is a hit if the pool reused memory it already had, and a miss if the pool's number of buffers or memory size
+  * changed because it had to allocate new memory. The allocations through this class are serialized so each one
+  * sees only its own change; an allocation by another user of the pool at the same moment can be counted as a miss.
+  * The new memory of a miss is locked in RAM if setLockMemory(true) has been called.
+  * Returns NULL if the pool cannot allocate the array. */
+NDArray* DexelaArrayPool::alloc(int ndims, size_t *dims, NDDataType_t dataType)
+{
+  NDArray *pArray;
+  int numBuffers;
+  size_t memorySize;
+  bool miss;
+
+  epicsMutexLock(mutex_);
+  numBuffers = pPool_->getNumBuffers();
+  memorySize = pPool_->getMemorySize();
+  pArray = pPool_->alloc(ndims, dims, dataType, 0, NULL);
+  miss = (pPool_->getNumBuffers() != numBuffers) || (pPool_->getMemorySize() != memorySize);
+  epicsMutexUnlock(mutex_);
+  if (pArray == NULL) return NULL;
+  if (!miss) {
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    return pArray;
+  }
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  if (lockMemory_) lockArray(pArray);
+  return pArray;
+}
+
+/** Locks the memory of an array in RAM.
+  * alloc() only locks new memory, so this is used for the arrays whose memory was already in the pool when locking
+  * was enabled. Locking memory that is already locked does nothing. */
+void DexelaArrayPool::lockArray(NDArray *pArray)
+{
+  if (!lockBuffer(pArray->pData, pArray->dataSize)) {
+    lockFailures_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void DexelaArrayPool::resetCounters()
+{
+  hits_.store(0, std::memory_order_relaxed);
+  misses_.store(0, std::memory_order_relaxed);
+  lockFailures_.store(0, std::memory_order_relaxed);
+}
+
+/** Locks memory in RAM. This is limited by the working set size on Windows and RLIMIT_MEMLOCK on Linux. */
+bool DexelaArrayPool::lockBuffer(void *pData, size_t size)
+{
+#ifdef _WIN32
+  return VirtualLock(pData, size) != 0;
+#else
+  return mlock(pData, size) == 0;
+#endif
+}
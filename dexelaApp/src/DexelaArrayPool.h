@@ -0,0 +1,49 @@
+/* DexelaArrayPool.h
+ *
+ * Allocation of the driver's NDArrays from the NDArrayPool.
+ *
+ * The NDArrayPool keeps released arrays on a free list and reuses them, so allocating and releasing the arrays an
+ * acquisition needs before it starts means the frames never wait for malloc. This class counts the allocations
+ * that reused memory already in the pool and the ones that needed new memory, which it sees as a change in the
+ * pool's number of buffers or memory size, and can lock the memory of the arrays in RAM so it is never paged out.
+ *
+ */
+
+#ifndef DexelaArrayPool_H
+#define DexelaArrayPool_H
+
+#include <stddef.h>
+#include <atomic>
+
+#include <epicsMutex.h>
+#include <NDArray.h>
+
+/** Allocates NDArrays from an NDArrayPool, counting the allocations that needed new memory.
+  * alloc() can be called from any thread. */
+class DexelaArrayPool
+{
+public:
+  DexelaArrayPool();
+  ~DexelaArrayPool();
+
+  void setPool(NDArrayPool *pPool) { pPool_ = pPool; }
+  NDArray *alloc(int ndims, size_t *dims, NDDataType_t dataType);
+  void lockArray(NDArray *pArray);
+  void setLockMemory(bool lockMemory) { lockMemory_ = lockMemory; }
+  void resetCounters();
+  int getHits() const { return hits_.load(std::memory_order_relaxed); }
+  int getMisses() const { return misses_.load(std::memory_order_relaxed); }
+  int getLockFailures() const { return lockFailures_.load(std::memory_order_relaxed); }
+
+private:
+  NDArrayPool *pPool_;
+  epicsMutexId mutex_;
+  std::atomic<bool> lockMemory_;
+  std::atomic<int> hits_;
+  std::atomic<int> misses_;
+  std::atomic<int> lockFailures_;
+
+  bool lockBuffer(void *pData, size_t size);
+};
+
+#endif
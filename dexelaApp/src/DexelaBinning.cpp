@@ -0,0 +1,94 @@
+/* DexelaBinning.cpp
+ *
+ * Software binning of corrected Dexela frames.
+ *
+ * Each output row is built by adding binY input rows into a row of 32-bit sums, which is where almost all of the
+ * time goes and is done with the DexelaAccumulator kernels, and then adding binX adjacent sums.
+ *
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "DexelaBinning.h"
+
+//_____________________________________________________________________________________________
+
+/** Constructor
+  * \param[in] binX Binning factor in X, clipped to the range 1 to DEX_MAX_SOFTWARE_BIN
+  * \param[in] binY Binning factor in Y, clipped to the range 1 to DEX_MAX_SOFTWARE_BIN
+  * \param[in] operation Sum or mean of the pixels in each bin
+  * \param[in] type Data type of the binned frame */
+DexelaBinning::DexelaBinning(int binX, int binY, DexBinOperation_t operation, DexBinType_t type)
+  : binX_(binX), binY_(binY), operation_(operation), type_(type)
+{
+  if (binX_ < 1) binX_ = 1;
+  if (binX_ > DEX_MAX_SOFTWARE_BIN) binX_ = DEX_MAX_SOFTWARE_BIN;
+  if (binY_ < 1) binY_ = 1;
+  if (binY_ > DEX_MAX_SOFTWARE_BIN) binY_ = DEX_MAX_SOFTWARE_BIN;
+}
+
+/** Bins a frame.
+  * \param[in] pIn Corrected frame, sizeX*sizeY pixels
+  * \param[in] sizeX Frame width in pixels
+  * \param[in] sizeY Frame height in pixels
+  * \param[out] pOut Binned frame, getOutputSizeX(sizeX)*getOutputSizeY(sizeY) pixels of getType() */
+void DexelaBinning::apply(const epicsUInt16 *pIn, int sizeX, int sizeY, void *pOut) const
+{
+  int outSizeX = getOutputSizeX(sizeX);
+  int outSizeY = getOutputSizeY(sizeY);
+  size_t numUsed = (size_t)outSizeX * binX_;
+  epicsUInt32 binPixels = binX_ * binY_;
+  bool mean = (operation_ == DexBinMean);
+  epicsUInt32 half = binPixels / 2;
+  // Dividing by multiplying is exact here because the sums are below 2^28 and the fractional part of the quotient
+  // is a multiple of 1/binPixels, so the small constant only corrects the rounding error of the reciprocal
+  double reciprocal = 1. / binPixels;
+  float scale = mean ? 1.f / binPixels : 1.f;
+  std::vector<epicsUInt32> rowSum(numUsed);
+  std::vector<epicsUInt32> binSum(outSizeX);
+  epicsUInt32 *pRowSum = &rowSum[0];
+  epicsUInt32 *pBinSum = &binSum[0];
+  epicsUInt16 *pOut16;
+  epicsUInt32 *pOut32;
+  float *pOutFloat;
+  epicsUInt32 value;
+  int x, y, i, k;
+
+  for (y=0; y<outSizeY; y++) {
+    std::fill(rowSum.begin(), rowSum.end(), 0);
+    for (k=0; k<binY_; k++) {
+      accumulator_.add(pIn + ((size_t)y * binY_ + k) * sizeX, pRowSum, numUsed);
+    }
+    // Adding the columns in the inner loop keeps it free of branches
+    if (binX_ == 1) {
+      pBinSum = pRowSum;
+    } else {
+      for (x=0; x<outSizeX; x++) pBinSum[x] = pRowSum[(size_t)x * binX_];
+      for (i=1; i<binX_; i++) {
+        for (x=0; x<outSizeX; x++) pBinSum[x] += pRowSum[(size_t)x * binX_ + i];
+      }
+    }
+    switch (type_) {
+      case DexBinUInt16:
+        pOut16 = (epicsUInt16 *)pOut + (size_t)y * outSizeX;
+        for (x=0; x<outSizeX; x++) {
+          value = mean ? (epicsUInt32)((pBinSum[x] + half) * reciprocal + 1e-6) : pBinSum[x];
+          pOut16[x] = (epicsUInt16)((value > 65535) ? 65535 : value);
+        }
+        break;
+      case DexBinUInt32:
+        pOut32 = (epicsUInt32 *)pOut + (size_t)y * outSizeX;
+        if (!mean) {
+          std::copy(pBinSum, pBinSum + outSizeX, pOut32);
+          break;
+        }
+        for (x=0; x<outSizeX; x++) pOut32[x] = (epicsUInt32)((pBinSum[x] + half) * reciprocal + 1e-6);
+        break;
+      case DexBinFloat32:
+        pOutFloat = (float *)pOut + (size_t)y * outSizeX;
+        for (x=0; x<outSizeX; x++) pOutFloat[x] = (float)pBinSum[x] * scale;
+        break;
+    }
+  }
+}
@@ -0,0 +1,64 @@
+/* DexelaBinning.h
+ *
+ * Software binning of corrected Dexela frames.
+ *
+ * This bins by any factor in X and Y, including factors the detector cannot bin in hardware, and can write
+ * 32-bit or floating point sums so they do not overflow.
+ *
+ */
+
+#ifndef DexelaBinning_H
+#define DexelaBinning_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+#include "DexelaAccumulator.h"
+
+/** Maximum software binning factor in each direction, so the sums always fit in 32 bits */
+#define DEX_MAX_SOFTWARE_BIN 64
+
+/** How the pixels in a bin are combined */
+typedef enum {
+  DexBinSum,
+  DexBinMean
+} DexBinOperation_t;
+
+/** Data type of the binned frame */
+typedef enum {
+  DexBinUInt16,       /**< Sums saturate at 65535, means are rounded */
+  DexBinUInt32,
+  DexBinFloat32
+} DexBinType_t;
+
+/** Bins 16-bit frames by binX x binY pixels.
+  * Pixels at the right and bottom edges that do not fill a whole bin are dropped. */
+class DexelaBinning
+{
+public:
+  DexelaBinning(int binX, int binY, DexBinOperation_t operation, DexBinType_t type);
+
+  int getBinX() const { return binX_; }
+  int getBinY() const { return binY_; }
+  int getOutputSizeX(int sizeX) const { return sizeX / binX_; }
+  int getOutputSizeY(int sizeY) const { return sizeY / binY_; }
+  DexBinType_t getType() const { return type_; }
+  /** Largest value of a binned pixel */
+  epicsUInt32 getMaxValue() const
+    { return ((type_ == DexBinUInt16) || (operation_ == DexBinMean)) ? 65535 : 65535u * binX_ * binY_; }
+
+  void apply(const epicsUInt16 *pIn, int sizeX, int sizeY, void *pOut) const;
+
+  void setSIMDLevel(DexSIMDLevel_t level) { accumulator_.setSIMDLevel(level); }
+  DexSIMDLevel_t getSIMDLevel() const { return accumulator_.getSIMDLevel(); }
+
+private:
+  int binX_;
+  int binY_;
+  DexBinOperation_t operation_;
+  DexBinType_t type_;
+  DexelaAccumulator accumulator_;
+};
+
+#endif
@@ -0,0 +1,244 @@
+/* DexelaBus.cpp
+ *
+ * Detectors on the bus, shared by all the Dexela drivers in the IOC.
+ *
+ */
+
+#include <algorithm>
+#include <map>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsThread.h>
+#include <epicsStdio.h>
+
+#include "BusScanner.h"
+#include "DexelaException.h"
+#include "DexelaBus.h"
+
+static const char *driverName = "DexelaBus";
+
+typedef struct {
+  epicsMutexId mutex;
+  bool scanned;
+  std::vector<DevInfo> devices;
+  std::map<int, DexelaDetector *> openDetectors;  /**< Detectors opened by openBoards() and not yet taken */
+} busState_t;
+
+/** Work of one thread of openBoards() */
+typedef struct {
+  DevInfo devInfo;
+  DexelaDetector *pDetector;
+  epicsEventId doneEvent;
+} openJob_t;
+
+static busState_t *pBus = NULL;
+static epicsThreadOnceId busOnce = EPICS_THREAD_ONCE_INIT;
+
+static void busInit(void *)
+{
+  pBus = new busState_t;
+  pBus->mutex = epicsMutexMustCreate();
+  pBus->scanned = false;
+}
+
+static bool compareSerialNumbers(const DevInfo &a, const DevInfo &b)
+{
+  return a.serialNum < b.serialNum;
+}
+
+/** Enumerates the detectors if they have not been enumerated yet. Called with the mutex held. */
+static void scanLocked(bool force)
+{
+  BusScanner scanner;
+  int numDevices;
+  int i;
+
+  if (pBus->scanned && !force) return;
+  pBus->devices.clear();
+  numDevices = scanner.EnumerateDevices();
+  for (i=0; i<numDevices; i++) pBus->devices.push_back(scanner.GetDevice(i));
+  std::sort(pBus->devices.begin(), pBus->devices.end(), compareSerialNumbers);
+  pBus->scanned = true;
+}
+
+/** Runs scanLocked() with the mutex held, exceptions are passed on to the caller */
+static void scan(bool force)
+{
+  epicsThreadOnce(&busOnce, busInit, NULL);
+  epicsMutexLock(pBus->mutex);
+  try {
+    scanLocked(force);
+  } catch (DexelaException &) {
+    epicsMutexUnlock(pBus->mutex);
+    throw;
+  }
+  epicsMutexUnlock(pBus->mutex);
+}
+
+//_____________________________________________________________________________________________
+
+/** Returns the number of detectors, enumerating them the first time it is called */
+int DexelaBus::getNumDevices()
+{
+  int numDevices;
+
+  scan(false);
+  epicsMutexLock(pBus->mutex);
+  numDevices = (int)pBus->devices.size();
+  epicsMutexUnlock(pBus->mutex);
+  return numDevices;
+}
+
+/** Enumerates the detectors again, for detectors that were switched on after the first enumeration.
+  * Returns the number of detectors. */
+int DexelaBus::rescan()
+{
+  int numDevices;
+
+  scan(true);
+  epicsMutexLock(pBus->mutex);
+  numDevices = (int)pBus->devices.size();
+  epicsMutexUnlock(pBus->mutex);
+  return numDevices;
+}
+
+/** Returns the detector at an index in the list sorted by serial number.
+  * Returns false if there is no detector at the index. */
+bool DexelaBus::getDevice(int index, DevInfo *pDevInfo)
+{
+  bool found = false;
+
+  scan(false);
+  epicsMutexLock(pBus->mutex);
+  if ((index >= 0) && (index < (int)pBus->devices.size())) {
+    *pDevInfo = pBus->devices[index];
+    found = true;
+  }
+  epicsMutexUnlock(pBus->mutex);
+  return found;
+}
+
+/** Returns the detector with a serial number. Returns false if it is not on the bus. */
+bool DexelaBus::findDevice(int serialNumber, DevInfo *pDevInfo)
+{
+  bool found = false;
+  size_t i;
+
+  scan(false);
+  epicsMutexLock(pBus->mutex);
+  for (i=0; i<pBus->devices.size(); i++) {
+    if (pBus->devices[i].serialNum == serialNumber) {
+      *pDevInfo = pBus->devices[i];
+      found = true;
+      break;
+    }
+  }
+  epicsMutexUnlock(pBus->mutex);
+  return found;
+}
+
+static void openThreadC(void *pPvt)
+{
+  openJob_t *pJob = (openJob_t *)pPvt;
+  static const char *functionName = "openBoards";
+
+  try {
+    pJob->pDetector = new DexelaDetector(pJob->devInfo);
+    pJob->pDetector->OpenBoard();
+  } catch (DexelaException &e) {
+    printf("%s::%s error opening detector %d: %s\n", driverName, functionName, pJob->devInfo.serialNum, e.what());
+    delete pJob->pDetector;
+    pJob->pDetector = NULL;
+  }
+  epicsEventSignal(pJob->doneEvent);
+}
+
+/** Opens several detectors in parallel, one thread each, and keeps them until the drivers take them.
+  * Detectors that are already open or not on the bus are skipped.
+  * \param[in] serialNumbers Serial numbers of the detectors, all the detectors on the bus if empty
+  * Returns the number of detectors that were opened. */
+int DexelaBus::openBoards(const std::vector<int> &serialNumbers)
+{
+  std::vector<openJob_t> jobs;
+  std::vector<int> serials = serialNumbers;
+  char threadName[32];
+  DevInfo devInfo;
+  int numOpened = 0;
+  size_t i;
+
+  scan(false);
+  epicsMutexLock(pBus->mutex);
+  if (serials.empty()) {
+    for (i=0; i<pBus->devices.size(); i++) serials.push_back(pBus->devices[i].serialNum);
+  }
+  epicsMutexUnlock(pBus->mutex);
+  for (i=0; i<serials.size(); i++) {
+    if (!findDevice(serials[i], &devInfo)) {
+      printf("%s::openBoards detector %d not found\n", driverName, serials[i]);
+      continue;
+    }
+    if (std::find(serials.begin(), serials.begin() + i, serials[i]) != serials.begin() + i) continue;
+    epicsMutexLock(pBus->mutex);
+    if (pBus->openDetectors.find(serials[i]) == pBus->openDetectors.end()) {
+      jobs.resize(jobs.size() + 1);
+      jobs.back().devInfo = devInfo;
+      jobs.back().pDetector = NULL;
+    }
+    epicsMutexUnlock(pBus->mutex);
+  }
+  // The vector is not resized after this, so the threads can be given pointers to its elements
+  for (i=0; i<jobs.size(); i++) {
+    jobs[i].doneEvent = epicsEventMustCreate(epicsEventEmpty);
+    epicsSnprintf(threadName, sizeof(threadName), "DexOpen%d", jobs[i].devInfo.serialNum);
+    if (!epicsThreadCreate(threadName, epicsThreadPriorityMedium,
+                           epicsThreadGetStackSize(epicsThreadStackMedium), openThreadC, &jobs[i])) {
+      openThreadC(&jobs[i]);
+    }
+  }
+  for (i=0; i<jobs.size(); i++) {
+    epicsEventMustWait(jobs[i].doneEvent);
+    epicsEventDestroy(jobs[i].doneEvent);
+    if (!jobs[i].pDetector) continue;
+    epicsMutexLock(pBus->mutex);
+    pBus->openDetectors[jobs[i].devInfo.serialNum] = jobs[i].pDetector;
+    epicsMutexUnlock(pBus->mutex);
+    numOpened++;
+  }
+  return numOpened;
+}
+
+/** Returns the detector with a serial number if openBoards() opened it, and forgets it.
+  * Returns NULL if it was not opened, the caller then opens it itself. */
+DexelaDetector *DexelaBus::takeDetector(int serialNumber)
+{
+  std::map<int, DexelaDetector *>::iterator it;
+  DexelaDetector *pDetector = NULL;
+
+  epicsThreadOnce(&busOnce, busInit, NULL);
+  epicsMutexLock(pBus->mutex);
+  it = pBus->openDetectors.find(serialNumber);
+  if (it != pBus->openDetectors.end()) {
+    pDetector = it->second;
+    pBus->openDetectors.erase(it);
+  }
+  epicsMutexUnlock(pBus->mutex);
+  return pDetector;
+}
+
+/** Prints the detectors from the last enumeration, without enumerating them again */
+void DexelaBus::report(FILE *fp)
+{
+  size_t i;
+
+  scan(false);
+  epicsMutexLock(pBus->mutex);
+  fprintf(fp, "Total sensors in system: %d\n", (int)pBus->devices.size());
+  for (i=0; i<pBus->devices.size(); i++) {
+    fprintf(fp, "Device: %d\n", (int)i);
+    fprintf(fp, "   Model number: %d\n", pBus->devices[i].model);
+    fprintf(fp, "  Serial number: %d\n", pBus->devices[i].serialNum);
+    fprintf(fp, "      Interface: %s\n", pBus->devices[i].iface ? "GigE" : "CameraLink");
+  }
+  epicsMutexUnlock(pBus->mutex);
+}
@@ -0,0 +1,33 @@
+/* DexelaBus.h
+ *
+ * Detectors on the bus, shared by all the Dexela drivers in the IOC.
+ *
+ * Enumerating the detectors takes seconds when there are GigE interfaces, so it is done once and the list is
+ * kept for the life of the IOC. The list is sorted by serial number, so the index of a detector does not depend
+ * on the order in which the interfaces answered. Several detectors can be opened in parallel before the drivers
+ * are created, each driver then takes its detector that is already open.
+ *
+ */
+
+#ifndef DexelaBus_H
+#define DexelaBus_H
+
+#include <stdio.h>
+#include <vector>
+
+#include "DexelaDetector.h"
+
+/** Process-wide list of the detectors on the bus. All the methods can be called from any thread. */
+class DexelaBus
+{
+public:
+  static int getNumDevices();
+  static int rescan();
+  static bool getDevice(int index, DevInfo *pDevInfo);
+  static bool findDevice(int serialNumber, DevInfo *pDevInfo);
+  static int openBoards(const std::vector<int> &serialNumbers);
+  static DexelaDetector *takeDetector(int serialNumber);
+  static void report(FILE *fp);
+};
+
+#endif
@@ -0,0 +1,423 @@
+/* DexelaCalibration.cpp
+ *
+ * Estimators used to combine the frames of an offset or gain calibration.
+ *
+ * The approximate median uses the P-square algorithm (R. Jain and I. Chlamtac, Communications of the ACM 28, 1076
+ * (1985)), which keeps 5 markers per pixel whatever the number of frames. The clipped mean uses the same markers
+ * to reject samples far from the running median, estimating sigma from the interquartile range so that outliers
+ * in the first frames do not widen the clipping window.
+ *
+ * DexelaMedianPool computes the exact median of a plane-major stack. Each thread copies a tile of
+ * MEDIAN_BLOCK_PIXELS pixels from every plane into a buffer that stays in cache, and finds the median of all the
+ * pixels of the tile together one bit at a time, from the most significant down: a bit is set in the result if
+ * fewer than half the samples are below the result with that bit set. This is exact, has no data dependent
+ * branches, and the loops over the pixels of the tile have a fixed length so the compiler vectorizes them.
+ *
+ */
+
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include <epicsThread.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsStdio.h>
+
+#include "DexelaCalibration.h"
+
+/** Ratio of the interquartile range to sigma for a normal distribution */
+#define IQR_PER_SIGMA 1.349f
+
+/** Number of pixels in a median tile. With 200 planes the tile is 100 kB. */
+#define MEDIAN_BLOCK_PIXELS 256
+/** Number of tiles a median thread takes from the shared counter at a time */
+#define MEDIAN_BLOCKS_PER_CHUNK 16
+
+static epicsUInt16 roundPixel(double value)
+{
+  if (value < 0.) return 0;
+  if (value > 65535.) return 65535;
+  return (epicsUInt16)(value + 0.5);
+}
+
+/** Insertion sort for the few samples kept before the P-square markers are initialized */
+static void sortSamples(float *pSamples, int numSamples)
+{
+  int i, j;
+  float value;
+
+  for (i=1; i<numSamples; i++) {
+    value = pSamples[i];
+    for (j=i; (j > 0) && (pSamples[j-1] > value); j--) pSamples[j] = pSamples[j-1];
+    pSamples[j] = value;
+  }
+}
+
+//_____________________________________________________________________________________________
+
+/** Constructor.
+  * \param[in] estimator The estimator to use; DexEstimatorMedian is not a streaming estimator and is not allowed
+  * \param[in] numPixels Number of pixels in each frame
+  * \param[in] clipSigma Samples further than this many standard deviations from the running median are rejected
+  *            by the clipped mean. 0 disables the rejection. */
+DexelaStreamingEstimator::DexelaStreamingEstimator(DexEstimator_t estimator, size_t numPixels, double clipSigma)
+  : estimator_(estimator), numPixels_(numPixels), numFrames_(0), clipSigma_((float)clipSigma)
+{
+  switch (estimator_) {
+    case DexEstimatorClippedMean:
+      sum_.assign(numPixels_, 0);
+      count_.assign(numPixels_, 0);
+      markers_.resize(numPixels_);
+      break;
+    case DexEstimatorApproxMedian:
+      markers_.resize(numPixels_);
+      break;
+    default:
+      estimator_ = DexEstimatorMean;
+      sum_.assign(numPixels_, 0);
+      break;
+  }
+}
+
+/** Returns the number of bytes of per-pixel state */
+size_t DexelaStreamingEstimator::getMemorySize() const
+{
+  return (sum_.size() + count_.size()) * sizeof(epicsUInt32) + markers_.size() * sizeof(psquare);
+}
+
+/** Adds one frame to the estimate */
+void DexelaStreamingEstimator::add(const epicsUInt16 *pFrame)
+{
+  size_t i;
+  float *q;
+
+  numFrames_++;
+  switch (estimator_) {
+    case DexEstimatorMean:
+      for (i=0; i<numPixels_; i++) sum_[i] += pFrame[i];
+      break;
+
+    case DexEstimatorClippedMean:
+      for (i=0; i<numPixels_; i++) {
+        addPSquare(markers_[i], pFrame[i]);
+        q = markers_[i].height;
+        // The first samples are only clipped once there are enough to initialize the markers
+        if (numFrames_ < 5) continue;
+        if (numFrames_ == 5) {
+          clipSamples(q, 5, sum_[i], count_[i]);
+        }
+        else if (accept(pFrame[i], q[2], q[1], q[3])) {
+          sum_[i] += pFrame[i];
+          count_[i]++;
+        }
+      }
+      break;
+
+    case DexEstimatorApproxMedian:
+      for (i=0; i<numPixels_; i++) addPSquare(markers_[i], pFrame[i]);
+      break;
+
+    default:
+      break;
+  }
+}
+
+/** Adds one sample to the P-square markers of a pixel. numFrames_ already includes the sample. */
+void DexelaStreamingEstimator::addPSquare(psquare &p, float value) const
+{
+  static const float increment[3] = {0.25f, 0.5f, 0.75f};
+  float *q = p.height;
+  float n[5], desired, d, parabolic;
+  int i, k;
+
+  // The first 5 samples initialize the markers
+  if (numFrames_ <= 5) {
+    q[numFrames_-1] = value;
+    if (numFrames_ == 5) {
+      sortSamples(q, 5);
+      for (i=0; i<3; i++) p.position[i] = i+1;
+    }
+    return;
+  }
+
+  // Find the cell containing the sample, extending the extreme markers if necessary
+  if (value < q[0]) {
+    q[0] = value;
+    k = 0;
+  }
+  else if (value >= q[4]) {
+    q[4] = value;
+    k = 3;
+  }
+  else {
+    for (k=0; value >= q[k+1]; k++);
+  }
+  for (i=k; i<3; i++) p.position[i]++;
+
+  n[0] = 0.f;
+  for (i=0; i<3; i++) n[i+1] = (float)p.position[i];
+  n[4] = (float)(numFrames_ - 1);
+
+  // Move the middle markers towards their desired positions
+  for (i=1; i<=3; i++) {
+    desired = (numFrames_ - 1) * increment[i-1];
+    d = desired - n[i];
+    if (((d >= 1.f) && (n[i+1] - n[i] > 1.f)) || ((d <= -1.f) && (n[i-1] - n[i] < -1.f))) {
+      d = (d > 0.f) ? 1.f : -1.f;
+      parabolic = q[i] + d / (n[i+1] - n[i-1]) *
+                  ((n[i] - n[i-1] + d) * (q[i+1] - q[i]) / (n[i+1] - n[i]) +
+                   (n[i+1] - n[i] - d) * (q[i] - q[i-1]) / (n[i] - n[i-1]));
+      if ((q[i-1] < parabolic) && (parabolic < q[i+1])) {
+        q[i] = parabolic;
+      } else {
+        k = i + (int)d;
+        q[i] += d * (q[k] - q[i]) / (n[k] - n[i]);
+      }
+      n[i] += d;
+      p.position[i-1] += (int)d;
+    }
+  }
+}
+
+/** Returns true if a sample is within clipSigma_ standard deviations of the median */
+bool DexelaStreamingEstimator::accept(float value, float median, float lowerQuartile, float upperQuartile) const
+{
+  float sigma = (upperQuartile - lowerQuartile) / IQR_PER_SIGMA;
+
+  if (clipSigma_ <= 0.f) return true;
+  // Never clip tighter than 1 count so a pixel with very little noise keeps its samples
+  if (sigma < 1.f) sigma = 1.f;
+  return fabsf(value - median) <= clipSigma_ * sigma;
+}
+
+/** Adds the accepted samples of a sorted set to the clipped mean of a pixel */
+void DexelaStreamingEstimator::clipSamples(const float *pSorted, int numSamples,
+                                           epicsUInt32 &sum, epicsUInt32 &count) const
+{
+  float median = 0.5f * (pSorted[(numSamples-1)/2] + pSorted[numSamples/2]);
+  int i;
+
+  for (i=0; i<numSamples; i++) {
+    if (accept(pSorted[i], median, pSorted[numSamples/4], pSorted[(3*numSamples)/4])) {
+      sum += (epicsUInt32)pSorted[i];
+      count++;
+    }
+  }
+}
+
+/** Writes the estimate for each pixel, rounded to 16 bits */
+void DexelaStreamingEstimator::getResult(epicsUInt16 *pOut) const
+{
+  size_t i;
+  float samples[5];
+  epicsUInt32 sum, count;
+
+  for (i=0; i<numPixels_; i++) {
+    if (numFrames_ == 0) {
+      pOut[i] = 0;
+      continue;
+    }
+    switch (estimator_) {
+      case DexEstimatorMean:
+        pOut[i] = roundPixel((double)sum_[i] / numFrames_);
+        break;
+      case DexEstimatorClippedMean:
+        sum = sum_[i];
+        count = count_[i];
+        if (numFrames_ < 5) {
+          std::copy(markers_[i].height, markers_[i].height + numFrames_, samples);
+          sortSamples(samples, numFrames_);
+          clipSamples(samples, numFrames_, sum, count);
+        }
+        pOut[i] = count ? roundPixel((double)sum / count) : roundPixel(markers_[i].height[2]);
+        break;
+      case DexEstimatorApproxMedian:
+        if (numFrames_ >= 5) {
+          pOut[i] = roundPixel(markers_[i].height[2]);
+        } else {
+          // Exact median of the samples received so far
+          std::copy(markers_[i].height, markers_[i].height + numFrames_, samples);
+          sortSamples(samples, numFrames_);
+          pOut[i] = roundPixel(0.5 * (samples[(numFrames_-1)/2] + samples[numFrames_/2]));
+        }
+        break;
+      default:
+        pOut[i] = 0;
+        break;
+    }
+  }
+}
+
+//_____________________________________________________________________________________________
+
+/** Finds the median of each pixel of a tile.
+  * For an even number of planes this is the mean of the two middle samples, rounded up.
+  * \param[in] pTile numPlanes rows of MEDIAN_BLOCK_PIXELS samples
+  * \param[in] numPlanes Number of planes
+  * \param[out] pOut The median of each pixel */
+static void medianTile(const epicsUInt16 *pTile, int numPlanes, epicsUInt16 *pOut)
+{
+  epicsUInt16 lower[MEDIAN_BLOCK_PIXELS];
+  epicsUInt16 count[MEDIAN_BLOCK_PIXELS];
+  epicsUInt16 above[MEDIAN_BLOCK_PIXELS];
+  const epicsUInt16 *pPlane;
+  epicsUInt16 bit, candidate;
+  int rank = (numPlanes - 1) / 2;
+  int i, plane, b;
+
+  // Find the sample of the given rank, the lower median for an even number of planes
+  for (i=0; i<MEDIAN_BLOCK_PIXELS; i++) lower[i] = 0;
+  for (b=15; b>=0; b--) {
+    bit = (epicsUInt16)(1 << b);
+    for (i=0; i<MEDIAN_BLOCK_PIXELS; i++) count[i] = 0;
+    for (plane=0; plane<numPlanes; plane++) {
+      pPlane = pTile + (size_t)plane * MEDIAN_BLOCK_PIXELS;
+      for (i=0; i<MEDIAN_BLOCK_PIXELS; i++) {
+        candidate = lower[i] | bit;
+        count[i] += (pPlane[i] < candidate);
+      }
+    }
+    for (i=0; i<MEDIAN_BLOCK_PIXELS; i++) {
+      if (count[i] <= rank) lower[i] |= bit;
+    }
+  }
+  if (numPlanes & 1) {
+    for (i=0; i<MEDIAN_BLOCK_PIXELS; i++) pOut[i] = lower[i];
+    return;
+  }
+
+  // The upper median is the lower median if it occurs more than once, otherwise the smallest sample above it
+  for (i=0; i<MEDIAN_BLOCK_PIXELS; i++) {
+    count[i] = 0;
+    above[i] = 0xFFFF;
+  }
+  for (plane=0; plane<numPlanes; plane++) {
+    pPlane = pTile + (size_t)plane * MEDIAN_BLOCK_PIXELS;
+    for (i=0; i<MEDIAN_BLOCK_PIXELS; i++) {
+      count[i] += (pPlane[i] <= lower[i]);
+      candidate = (pPlane[i] > lower[i]) ? pPlane[i] : 0xFFFF;
+      above[i] = std::min(above[i], candidate);
+    }
+  }
+  for (i=0; i<MEDIAN_BLOCK_PIXELS; i++) {
+    if (count[i] > rank + 1) above[i] = lower[i];
+    pOut[i] = (epicsUInt16)(((int)lower[i] + (int)above[i] + 1) / 2);
+  }
+}
+
+/** Computes the median of tiles of pixels until the job is finished */
+void DexelaMedianPool::medianTiles()
+{
+  int numPlanes = numPlanes_;
+  std::vector<epicsUInt16> tile((size_t)MEDIAN_BLOCK_PIXELS * numPlanes, 0);
+  epicsUInt16 out[MEDIAN_BLOCK_PIXELS];
+  size_t first, last, start, numPixels;
+  int plane;
+
+  while (1) {
+    epicsMutexLock(mutex_);
+    first = nextPixel_;
+    nextPixel_ += (size_t)MEDIAN_BLOCK_PIXELS * MEDIAN_BLOCKS_PER_CHUNK;
+    epicsMutexUnlock(mutex_);
+    if (first >= numPixels_) break;
+    last = std::min(first + (size_t)MEDIAN_BLOCK_PIXELS * MEDIAN_BLOCKS_PER_CHUNK, numPixels_);
+
+    for (start=first; start<last; start+=MEDIAN_BLOCK_PIXELS) {
+      // The last tile of the frame may be partly filled, the rest of the tile is ignored
+      numPixels = std::min((size_t)MEDIAN_BLOCK_PIXELS, last - start);
+      for (plane=0; plane<numPlanes; plane++) {
+        std::copy(pPlanes_[plane] + start, pPlanes_[plane] + start + numPixels,
+                  &tile[(size_t)plane * MEDIAN_BLOCK_PIXELS]);
+      }
+      medianTile(&tile[0], numPlanes, out);
+      std::copy(out, out + numPixels, pOut_ + start);
+    }
+  }
+}
+
+static void medianThreadC(void *pPvt)
+{
+  DexelaMedianPool::worker_t *pWorker = (DexelaMedianPool::worker_t *)pPvt;
+
+  pWorker->pPool->workerTask(pWorker);
+}
+
+/** Constructor. Creates the threads, which wait for compute() to be called.
+  * \param[in] numThreads Number of threads to use, including the thread that calls compute() */
+DexelaMedianPool::DexelaMedianPool(int numThreads)
+  : numThreads_(numThreads < 1 ? 1 : numThreads), exiting_(false),
+    pPlanes_(NULL), numPlanes_(0), numPixels_(0), pOut_(NULL), nextPixel_(0)
+{
+  char threadName[32];
+  int i;
+
+  mutex_ = epicsMutexMustCreate();
+  workers_.resize(numThreads_ - 1);
+  for (i=0; i<numThreads_-1; i++) {
+    workers_[i].pPool = this;
+    workers_[i].startEvent = epicsEventMustCreate(epicsEventEmpty);
+    workers_[i].doneEvent = epicsEventMustCreate(epicsEventEmpty);
+    epicsSnprintf(threadName, sizeof(threadName), "DexMedian%d", i);
+    // The other threads do the work of a thread that could not be created
+    workers_[i].running = epicsThreadCreate(threadName, epicsThreadPriorityMedium,
+                                            epicsThreadGetStackSize(epicsThreadStackMedium), medianThreadC,
+                                            &workers_[i]) != NULL;
+  }
+}
+
+/** Destructor. Stops the threads and waits for them to exit. */
+DexelaMedianPool::~DexelaMedianPool()
+{
+  size_t i;
+
+  exiting_ = true;
+  for (i=0; i<workers_.size(); i++) {
+    if (workers_[i].running) {
+      epicsEventSignal(workers_[i].startEvent);
+      epicsEventMustWait(workers_[i].doneEvent);
+    }
+    epicsEventDestroy(workers_[i].startEvent);
+    epicsEventDestroy(workers_[i].doneEvent);
+  }
+  epicsMutexDestroy(mutex_);
+}
+
+/** Thread that computes its share of each median until the pool is deleted */
+void DexelaMedianPool::workerTask(worker_t *pWorker)
+{
+  while (1) {
+    epicsEventMustWait(pWorker->startEvent);
+    if (exiting_) break;
+    medianTiles();
+    epicsEventSignal(pWorker->doneEvent);
+  }
+  epicsEventSignal(pWorker->doneEvent);
+}
+
+/** Computes the exact median of a stack of 16-bit planes with all the threads of the pool.
+  * Only one thread may call this at a time.
+  * \param[in] pPlanes Pointers to the planes
+  * \param[in] numPlanes Number of planes, at most 65535
+  * \param[in] numPixels Number of pixels in each plane
+  * \param[out] pOut The median of each pixel; for an even number of planes the mean of the two middle values */
+void DexelaMedianPool::compute(const epicsUInt16 *const *pPlanes, int numPlanes, size_t numPixels,
+                               epicsUInt16 *pOut)
+{
+  size_t i;
+
+  if ((numPlanes <= 0) || (numPlanes > 65535)) return;
+  pPlanes_ = pPlanes;
+  numPlanes_ = numPlanes;
+  numPixels_ = numPixels;
+  pOut_ = pOut;
+  nextPixel_ = 0;
+  // The events order the job fields before the workers read them
+  for (i=0; i<workers_.size(); i++) {
+    if (workers_[i].running) epicsEventSignal(workers_[i].startEvent);
+  }
+  medianTiles();
+  for (i=0; i<workers_.size(); i++) {
+    if (workers_[i].running) epicsEventMustWait(workers_[i].doneEvent);
+  }
+}
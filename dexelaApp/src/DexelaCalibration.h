@@ -0,0 +1,98 @@
+/* DexelaCalibration.h
+ *
+ * Estimators used to combine the frames of an offset or gain calibration.
+ *
+ * The streaming estimators update their per-pixel state as each frame arrives, so their memory does not grow
+ * with the number of frames and the result is available as soon as the last frame has been added.
+ * The exact median is computed by DexelaMedianPool once all the frames have been read.
+ *
+ */
+
+#ifndef DexelaCalibration_H
+#define DexelaCalibration_H
+
+#include <stddef.h>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsTypes.h>
+
+/** Methods of combining the calibration frames */
+typedef enum {
+  DexEstimatorMedian,         /**< Exact median computed by DexelaMedianPool, every frame is kept until the end */
+  DexEstimatorMean,           /**< Streaming mean */
+  DexEstimatorClippedMean,    /**< Streaming mean of the samples close to the running median */
+  DexEstimatorApproxMedian,   /**< Streaming P-square estimate of the median */
+  DexEstimatorSDKMedian       /**< Exact median computed by DexImage::FindMedianofPlanes */
+} DexEstimator_t;
+
+/** Threads that compute the exact median of a stack of 16-bit planes.
+  * The threads are created once and wait for work, so combining the frames of a calibration does not create any. */
+class DexelaMedianPool
+{
+public:
+  /** A thread of the pool */
+  typedef struct {
+    DexelaMedianPool *pPool;
+    epicsEventId startEvent;    /**< Signalled when there is a median to compute or the pool is deleted */
+    epicsEventId doneEvent;     /**< Signalled when the thread has finished its share */
+    bool running;
+  } worker_t;
+
+  explicit DexelaMedianPool(int numThreads);
+  ~DexelaMedianPool();
+
+  void compute(const epicsUInt16 *const *pPlanes, int numPlanes, size_t numPixels, epicsUInt16 *pOut);
+  int getNumThreads() const { return numThreads_; }
+  void workerTask(worker_t *pWorker);
+
+private:
+  int numThreads_;
+  std::vector<worker_t> workers_;
+  epicsMutexId mutex_;          /**< Protects nextPixel_ */
+  bool exiting_;
+  // The median being computed
+  const epicsUInt16 *const *pPlanes_;
+  int numPlanes_;
+  size_t numPixels_;
+  epicsUInt16 *pOut_;
+  size_t nextPixel_;
+
+  void medianTiles();
+};
+
+/** Streaming per-pixel estimator for 16-bit frames */
+class DexelaStreamingEstimator
+{
+public:
+  DexelaStreamingEstimator(DexEstimator_t estimator, size_t numPixels, double clipSigma);
+
+  void add(const epicsUInt16 *pFrame);
+  void getResult(epicsUInt16 *pOut) const;
+  DexEstimator_t getEstimator() const { return estimator_; }
+  size_t getNumPixels() const { return numPixels_; }
+  int getNumFrames() const { return numFrames_; }
+  size_t getMemorySize() const;
+
+private:
+  /** P-square markers for one pixel. The positions of the first and last markers are implicit. */
+  struct psquare {
+    float height[5];
+    epicsInt32 position[3];
+  };
+
+  DexEstimator_t estimator_;
+  size_t numPixels_;
+  int numFrames_;
+  float clipSigma_;
+  std::vector<epicsUInt32> sum_;      /**< Mean and clipped mean: sum of the accepted samples */
+  std::vector<epicsUInt32> count_;    /**< Clipped mean: number of accepted samples */
+  std::vector<psquare> markers_;      /**< Approximate median and clipped mean */
+
+  void addPSquare(psquare &p, float value) const;
+  void clipSamples(const float *pSorted, int numSamples, epicsUInt32 &sum, epicsUInt32 &count) const;
+  bool accept(float value, float median, float lowerQuartile, float upperQuartile) const;
+};
+
+#endif
@@ -0,0 +1,399 @@
+/* DexelaCalibrationFile.cpp
+ *
+ * Native calibration file format, which is mapped into memory rather than read.
+ *
+ * Files are written to a temporary name and then renamed, so an IOC that has the old file mapped keeps its
+ * contents and a file is never seen half written. On Windows a file that is mapped cannot be replaced, so a
+ * loaded calibration must be saved under another name.
+ *
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include <string>
+#include <vector>
+
+#include "DexelaException.h"
+#include "DexelaCalibrationFile.h"
+
+#define DEX_CALIBRATION_FILE_VERSION 1
+#define DEX_BYTE_ORDER 0x01020304
+static const char calibrationMagic[8] = {'D', 'E', 'X', 'C', 'A', 'L', 0, 0};
+
+/** Rounds a size up to a multiple of DEX_CALIBRATION_FILE_ALIGNMENT */
+static size_t alignSize(size_t size)
+{
+  return (size + DEX_CALIBRATION_FILE_ALIGNMENT - 1) & ~(size_t)(DEX_CALIBRATION_FILE_ALIGNMENT - 1);
+}
+
+//_____________________________________________________________________________________________
+
+DexelaCalibrationFile::DexelaCalibrationFile()
+  : pHeader_(NULL), pBase_(NULL), size_(0)
+#ifdef _WIN32
+    , hFile_(INVALID_HANDLE_VALUE), hMapping_(NULL)
+#endif
+{
+}
+
+DexelaCalibrationFile::~DexelaCalibrationFile()
+{
+  unmap();
+}
+
+void DexelaCalibrationFile::unmap()
+{
+#ifdef _WIN32
+  if (pBase_) UnmapViewOfFile(pBase_);
+  if (hMapping_) CloseHandle(hMapping_);
+  if (hFile_ != INVALID_HANDLE_VALUE) CloseHandle(hFile_);
+  hMapping_ = NULL;
+  hFile_ = INVALID_HANDLE_VALUE;
+#else
+  if (pBase_) munmap((void *)pBase_, size_);
+#endif
+  pBase_ = NULL;
+  pHeader_ = NULL;
+  size_ = 0;
+}
+
+/** Maps a native calibration file read-only and checks its header and checksum.
+  * Checking the checksum reads the whole file once, which is far quicker than parsing it, and the pages stay in
+  * the file cache for the corrections that are built from it. */
+std::shared_ptr<const DexelaCalibrationFile> DexelaCalibrationFile::open(const char *fileName)
+{
+  std::shared_ptr<DexelaCalibrationFile> pFile(new DexelaCalibrationFile());
+
+#ifdef _WIN32
+  LARGE_INTEGER fileSize;
+
+  pFile->hFile_ = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+  if (pFile->hFile_ == INVALID_HANDLE_VALUE) {
+    throwNewEr("Cannot open calibration file", BAD_FILE_IO, (int)GetLastError(), "");
+  }
+  if (!GetFileSizeEx(pFile->hFile_, &fileSize) || (fileSize.QuadPart < (LONGLONG)sizeof(dexCalibrationHeader_t))) {
+    throwNewEr("Calibration file is too short", BAD_FILE_IO, 0, "");
+  }
+  pFile->size_ = (size_t)fileSize.QuadPart;
+  pFile->hMapping_ = CreateFileMappingA(pFile->hFile_, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!pFile->hMapping_) {
+    throwNewEr("Cannot map calibration file", BAD_FILE_IO, (int)GetLastError(), "");
+  }
+  pFile->pBase_ = (const char *)MapViewOfFile(pFile->hMapping_, FILE_MAP_READ, 0, 0, 0);
+  if (!pFile->pBase_) {
+    throwNewEr("Cannot map calibration file", BAD_FILE_IO, (int)GetLastError(), "");
+  }
+#else
+  struct stat fileStat;
+  void *pBase;
+  int fd;
+
+  fd = ::open(fileName, O_RDONLY);
+  if (fd < 0) {
+    throwNewEr("Cannot open calibration file", BAD_FILE_IO, errno, "");
+  }
+  if ((fstat(fd, &fileStat) != 0) || (fileStat.st_size < (off_t)sizeof(dexCalibrationHeader_t))) {
+    ::close(fd);
+    throwNewEr("Calibration file is too short", BAD_FILE_IO, 0, "");
+  }
+  // The mapping keeps the file open, so the descriptor is not needed after this
+  pBase = mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (pBase == MAP_FAILED) {
+    throwNewEr("Cannot map calibration file", BAD_FILE_IO, errno, "");
+  }
+  pFile->pBase_ = (const char *)pBase;
+  pFile->size_ = (size_t)fileStat.st_size;
+#endif
+  pFile->pHeader_ = (const dexCalibrationHeader_t *)pFile->pBase_;
+  pFile->validate();
+  return pFile;
+}
+
+/** Checks that the header describes a file this driver can use and that the planes match the checksum */
+void DexelaCalibrationFile::validate() const
+{
+  const dexCalibrationHeader_t &header = *pHeader_;
+  epicsUInt64 sum1 = 0, sum2 = 0;
+  size_t pixelBytes = pixelSize(getPixelType());
+  size_t planeSize;
+
+  if (memcmp(header.magic, calibrationMagic, sizeof(calibrationMagic)) != 0) {
+    throwNewEr("Not a native calibration file", BAD_FILE_IO, 0, "");
+  }
+  if ((header.version != DEX_CALIBRATION_FILE_VERSION) || (header.byteOrder != DEX_BYTE_ORDER) ||
+      (header.headerSize != sizeof(dexCalibrationHeader_t))) {
+    throwNewEr("Unsupported calibration file version or byte order", BAD_FILE_IO, 0, "");
+  }
+  if ((header.type < DexCalibrationOffset) || (header.type > DexCalibrationDarkRate) ||
+      (header.sizeX <= 0) || (header.sizeY <= 0) || (header.numPlanes <= 0) || (pixelBytes == 0)) {
+    throwNewEr("Invalid calibration file header", BAD_FILE_IO, 0, "");
+  }
+  // Each size is compared with what is left of the file before it is multiplied, so a corrupt header cannot
+  // overflow the products and pass
+  if ((size_t)header.sizeX > size_ / pixelBytes / (size_t)header.sizeY) {
+    throwNewEr("Invalid calibration file layout", BAD_FILE_IO, 0, "");
+  }
+  planeSize = (size_t)header.sizeX * header.sizeY * pixelBytes;
+  if ((header.planeOffset % DEX_CALIBRATION_FILE_ALIGNMENT) || (header.planeStride % DEX_CALIBRATION_FILE_ALIGNMENT) ||
+      (header.planeOffset < header.headerSize) || (header.planeStride < planeSize) ||
+      (header.planeOffset > size_) ||
+      (header.planeStride > (size_ - header.planeOffset) / (epicsUInt64)header.numPlanes)) {
+    throwNewEr("Invalid calibration file layout", BAD_FILE_IO, 0, "");
+  }
+  addChecksum(pBase_ + header.planeOffset, (size_t)(header.planeStride * header.numPlanes), sum1, sum2);
+  if (((sum2 << 32) | sum1) != header.checksum) {
+    throwNewEr("Calibration file checksum error", BAD_FILE_IO, 0, "");
+  }
+}
+
+/** Writes a native calibration file
+  * \param[in] fileName Name of the file, which is replaced if it exists
+  * \param[in] type Type of calibration
+  * \param[in] key Mode the calibration was acquired in
+  * \param[in] model Model number of the detector, 0 if unknown
+  * \param[in] serialNumber Serial number of the detector, 0 if unknown
+  * \param[in] pixelType u16 or flt
+  * \param[in] sizeX Plane width in pixels
+  * \param[in] sizeY Plane height in pixels
+  * \param[in] pPlanes numPlanes pointers to the planes
+  * \param[in] numPlanes Number of planes */
+void DexelaCalibrationFile::write(const char *fileName, DexCalibrationType_t type, const DexelaCalibrationKey &key,
+                                  int model, int serialNumber, pType pixelType, int sizeX, int sizeY,
+                                  const void *const *pPlanes, int numPlanes)
+{
+  dexCalibrationHeader_t header;
+  size_t planeSize = (size_t)sizeX * sizeY * pixelSize(pixelType);
+  // Whole 32-bit words of each plane, the rest of the plane and the padding are checksummed from tail
+  size_t wordBytes = planeSize & ~(size_t)(sizeof(epicsUInt32) - 1);
+  std::vector<char> tail;
+  std::vector<char> padding;
+  std::string tempName = std::string(fileName) + ".tmp";
+  epicsUInt64 sum1 = 0, sum2 = 0;
+  bool ok = true;
+  FILE *fp;
+  int error;
+  int i;
+
+  if ((planeSize == 0) || (numPlanes <= 0)) {
+    throwNewEr("Invalid calibration image", BAD_FILE_IO, 0, "");
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, calibrationMagic, sizeof(calibrationMagic));
+  header.version      = DEX_CALIBRATION_FILE_VERSION;
+  header.headerSize   = sizeof(header);
+  header.byteOrder    = DEX_BYTE_ORDER;
+  header.type         = type;
+  header.pixelType    = pixelType;
+  header.sizeX        = sizeX;
+  header.sizeY        = sizeY;
+  header.numPlanes    = numPlanes;
+  header.model        = model;
+  header.serialNumber = serialNumber;
+  header.binning      = key.binning;
+  header.fullWell     = key.fullWell;
+  header.readoutMode  = key.readoutMode;
+  header.exposureUs   = key.exposureUs;
+  header.minX         = key.minX;
+  header.minY         = key.minY;
+  header.roiSizeX     = key.sizeX;
+  header.roiSizeY     = key.sizeY;
+  header.planeOffset  = alignSize(sizeof(header));
+  header.planeStride  = alignSize(planeSize);
+  for (i=0; i<numPlanes; i++) {
+    tail.assign((size_t)header.planeStride - wordBytes, 0);
+    memcpy(&tail[0], (const char *)pPlanes[i] + wordBytes, planeSize - wordBytes);
+    addChecksum(pPlanes[i], wordBytes, sum1, sum2);
+    addChecksum(&tail[0], tail.size(), sum1, sum2);
+  }
+  header.checksum = (sum2 << 32) | sum1;
+
+  fp = fopen(tempName.c_str(), "wb");
+  if (!fp) {
+    throwNewEr("Cannot create calibration file", BAD_FILE_IO, errno, "");
+  }
+  ok = (fwrite(&header, sizeof(header), 1, fp) == 1);
+  padding.assign((size_t)(header.planeOffset - sizeof(header)), 0);
+  if (ok && !padding.empty()) ok = (fwrite(&padding[0], padding.size(), 1, fp) == 1);
+  padding.assign((size_t)(header.planeStride - planeSize), 0);
+  for (i=0; ok && (i<numPlanes); i++) {
+    ok = (fwrite(pPlanes[i], planeSize, 1, fp) == 1);
+    if (ok && !padding.empty()) ok = (fwrite(&padding[0], padding.size(), 1, fp) == 1);
+  }
+  if (fclose(fp) != 0) ok = false;
+  if (!ok) {
+    remove(tempName.c_str());
+    throwNewEr("Error writing calibration file", BAD_FILE_IO, errno, "");
+  }
+#ifdef _WIN32
+  // Windows cannot replace a file that is mapped, by this IOC or another one, and the old file is then left as it
+  // was. Unmapping it here would pull the calibration from under the corrections that use it, so it is reported
+  // with its own message instead.
+  if (!MoveFileExA(tempName.c_str(), fileName, MOVEFILE_REPLACE_EXISTING)) {
+    error = (int)GetLastError();
+    remove(tempName.c_str());
+    if ((error == ERROR_ACCESS_DENIED) || (error == ERROR_SHARING_VIOLATION) || (error == ERROR_USER_MAPPED_FILE)) {
+      throwNewEr("Cannot replace a calibration file that is loaded by an IOC, save it under another name",
+                 BAD_FILE_IO, error, "");
+    }
+    throwNewEr("Cannot replace calibration file", BAD_FILE_IO, error, "");
+  }
+#else
+  if (rename(tempName.c_str(), fileName) != 0) {
+    error = errno;
+    remove(tempName.c_str());
+    throwNewEr("Cannot replace calibration file", BAD_FILE_IO, error, "");
+  }
+#endif
+}
+
+/** Returns true if the file name has the extension of the native calibration files */
+bool DexelaCalibrationFile::isNativeFile(const char *fileName)
+{
+  size_t length = strlen(fileName);
+  size_t extensionLength = strlen(DEX_CALIBRATION_FILE_EXTENSION);
+
+  return (length >= extensionLength) &&
+         (strcmp(fileName + length - extensionLength, DEX_CALIBRATION_FILE_EXTENSION) == 0);
+}
+
+/** Returns the mode that the calibration was acquired in */
+DexelaCalibrationKey DexelaCalibrationFile::getKey() const
+{
+  DexelaCalibrationKey key;
+
+  key.binning     = pHeader_->binning;
+  key.fullWell    = pHeader_->fullWell;
+  key.readoutMode = pHeader_->readoutMode;
+  key.exposureUs  = pHeader_->exposureUs;
+  key.minX        = pHeader_->minX;
+  key.minY        = pHeader_->minY;
+  key.sizeX       = pHeader_->roiSizeX;
+  key.sizeY       = pHeader_->roiSizeY;
+  return key;
+}
+
+/** Returns a plane, which is aligned to DEX_CALIBRATION_FILE_ALIGNMENT bytes */
+const void *DexelaCalibrationFile::getPlane(int plane) const
+{
+  if ((plane < 0) || (plane >= pHeader_->numPlanes)) return NULL;
+  return pBase_ + pHeader_->planeOffset + pHeader_->planeStride * plane;
+}
+
+/** Adds 32-bit words to a Fletcher-64 checksum. size must be a multiple of 4 bytes.
+  * \param[in] pData Data to add
+  * \param[in] size Size of the data in bytes
+  * \param[in,out] sum1 First sum, 0 at the start
+  * \param[in,out] sum2 Second sum, 0 at the start. The checksum is (sum2 << 32) | sum1. */
+void DexelaCalibrationFile::addChecksum(const void *pData, size_t size, epicsUInt64 &sum1, epicsUInt64 &sum2)
+{
+  const epicsUInt32 *pWords = (const epicsUInt32 *)pData;
+  size_t numWords = size / sizeof(epicsUInt32);
+  size_t i, blockEnd;
+
+  // The sums cannot overflow 64 bits within a block of 1024 words, so the modulo is only taken once per block
+  for (i=0; i<numWords; ) {
+    blockEnd = (numWords - i > 1024) ? i + 1024 : numWords;
+    for (; i<blockEnd; i++) {
+      sum1 += pWords[i];
+      sum2 += sum1;
+    }
+    sum1 %= 0xffffffff;
+    sum2 %= 0xffffffff;
+  }
+}
+
+/** Returns the size of a pixel in bytes, 0 for the pixel types the calibrations do not use */
+size_t DexelaCalibrationFile::pixelSize(pType pixelType)
+{
+  switch (pixelType) {
+    case u16: return sizeof(epicsUInt16);
+    case flt: return sizeof(float);
+    default:  return 0;
+  }
+}
+
+//_____________________________________________________________________________________________
+
+/** Constructor for a calibration that is already in a DexImage */
+DexelaCalibrationImage::DexelaCalibrationImage(const std::shared_ptr<DexImage> &pImage)
+  : pImage_(pImage)
+{
+  mutex_ = epicsMutexMustCreate();
+  sizeX_ = pImage->GetImageXdim();
+  sizeY_ = pImage->GetImageYdim();
+  pixelType_ = pImage->GetImagePixelType();
+  pData_ = pImage->GetDataPointerToPlane();
+}
+
+/** Constructor for a plane of a mapped native calibration file */
+DexelaCalibrationImage::DexelaCalibrationImage(const std::shared_ptr<const DexelaCalibrationFile> &pFile, int plane)
+  : pFile_(pFile)
+{
+  mutex_ = epicsMutexMustCreate();
+  sizeX_ = pFile->getSizeX();
+  sizeY_ = pFile->getSizeY();
+  pixelType_ = pFile->getPixelType();
+  pData_ = pFile->getPlane(plane);
+}
+
+DexelaCalibrationImage::~DexelaCalibrationImage()
+{
+  epicsMutexDestroy(mutex_);
+}
+
+/** Returns the calibration as a DexImage, for the SDK corrections and for writing it in the SDK file formats.
+  * The copy of a mapped plane is kept, so it is only made once. */
+DexImage &DexelaCalibrationImage::getDexImage() const
+{
+  epicsMutexLock(mutex_);
+  try {
+    if (!pImage_) pImage_ = copyDexImage();
+  } catch (...) {
+    epicsMutexUnlock(mutex_);
+    throw;
+  }
+  epicsMutexUnlock(mutex_);
+  return *pImage_;
+}
+
+/** Returns a new DexImage with a copy of the calibration */
+std::shared_ptr<DexImage> DexelaCalibrationImage::copyDexImage() const
+{
+  static const DexImageTypes imageTypes[] = {Offset, Gain, Defect, Data, Data};
+  std::shared_ptr<DexImage> pImage;
+
+  if (!pFile_) return std::make_shared<DexImage>(*pImage_);
+  pImage = std::make_shared<DexImage>();
+  pImage->Build(sizeX_, sizeY_, 1, pixelType_);
+  pImage->SetImageType(imageTypes[pFile_->getType()]);
+  memcpy(pImage->GetDataPointerToPlane(), pData_,
+         (size_t)sizeX_ * sizeY_ * ((pixelType_ == flt) ? sizeof(float) : sizeof(epicsUInt16)));
+  return pImage;
+}
+
+/** Writes the calibration to a file. The native format is used if the name ends in DEX_CALIBRATION_FILE_EXTENSION,
+  * otherwise the format is chosen by DexImage::WriteImage from the extension. */
+void DexelaCalibrationImage::write(const char *fileName, DexCalibrationType_t type, const DexelaCalibrationKey &key,
+                                   int model, int serialNumber) const
+{
+  const void *pPlanes[1] = {pData_};
+
+  if (DexelaCalibrationFile::isNativeFile(fileName)) {
+    DexelaCalibrationFile::write(fileName, type, key, model, serialNumber, pixelType_, sizeX_, sizeY_, pPlanes, 1);
+  } else {
+    getDexImage().WriteImage(fileName);
+  }
+}
@@ -0,0 +1,125 @@
+/* DexelaCalibrationFile.h
+ *
+ * Native calibration file format, which is mapped into memory rather than read.
+ *
+ * A file is a fixed header with the detector and the mode the calibration was acquired in, followed by the raw
+ * pixel planes, each starting on a 64-byte boundary, so the planes can be used where they are mapped. Loading a
+ * file does not copy it, and IOCs that load the same file share its pages in the operating system file cache.
+ *
+ */
+
+#ifndef DexelaCalibrationFile_H
+#define DexelaCalibrationFile_H
+
+#include <stddef.h>
+#include <memory>
+
+#include <epicsMutex.h>
+#include <epicsTypes.h>
+
+#include "DexImage.h"
+#include "DexelaCalibrationLibrary.h"
+
+/** Extension of the native calibration files */
+#define DEX_CALIBRATION_FILE_EXTENSION ".dexcal"
+/** Alignment of the planes in the file, in bytes */
+#define DEX_CALIBRATION_FILE_ALIGNMENT 64
+
+/** Header of a native calibration file, 128 bytes in the byte order of the computer that wrote it */
+typedef struct {
+  char        magic[8];       /**< "DEXCAL" */
+  epicsUInt32 version;
+  epicsUInt32 headerSize;     /**< sizeof(dexCalibrationHeader_t) */
+  epicsUInt32 byteOrder;      /**< 0x01020304 */
+  epicsInt32  type;           /**< DexCalibrationType_t */
+  epicsInt32  pixelType;      /**< pType, u16 or flt */
+  epicsInt32  sizeX;          /**< Plane width in pixels */
+  epicsInt32  sizeY;          /**< Plane height in pixels */
+  epicsInt32  numPlanes;
+  epicsInt32  model;          /**< Model number of the detector, 0 if unknown */
+  epicsInt32  serialNumber;   /**< Serial number of the detector, 0 if unknown */
+  epicsInt32  binning;        /**< DexelaCalibrationKey, -1 for the fields the type does not depend on */
+  epicsInt32  fullWell;
+  epicsInt32  readoutMode;
+  epicsInt32  exposureUs;
+  epicsInt32  minX;
+  epicsInt32  minY;
+  epicsInt32  roiSizeX;
+  epicsInt32  roiSizeY;
+  epicsUInt64 planeOffset;    /**< Offset of the first plane from the start of the file, a multiple of 64 */
+  epicsUInt64 planeStride;    /**< Bytes from the start of one plane to the next, a multiple of 64 */
+  epicsUInt64 checksum;       /**< Fletcher-64 checksum of the planes, including the padding */
+  epicsUInt64 reserved[3];
+} dexCalibrationHeader_t;
+
+/** A native calibration file mapped read-only into memory.
+  * Throws DexelaException with the BAD_FILE_IO code if a file cannot be read or written. */
+class DexelaCalibrationFile
+{
+public:
+  ~DexelaCalibrationFile();
+
+  static std::shared_ptr<const DexelaCalibrationFile> open(const char *fileName);
+  static void write(const char *fileName, DexCalibrationType_t type, const DexelaCalibrationKey &key,
+                    int model, int serialNumber, pType pixelType, int sizeX, int sizeY,
+                    const void *const *pPlanes, int numPlanes);
+  static bool isNativeFile(const char *fileName);
+
+  DexCalibrationType_t getType() const { return (DexCalibrationType_t)pHeader_->type; }
+  DexelaCalibrationKey getKey() const;
+  pType getPixelType() const { return (pType)pHeader_->pixelType; }
+  int getSizeX() const { return pHeader_->sizeX; }
+  int getSizeY() const { return pHeader_->sizeY; }
+  int getNumPlanes() const { return pHeader_->numPlanes; }
+  int getModel() const { return pHeader_->model; }
+  int getSerialNumber() const { return pHeader_->serialNumber; }
+  const void *getPlane(int plane = 0) const;
+
+private:
+  DexelaCalibrationFile();
+
+  const dexCalibrationHeader_t *pHeader_;
+  const char *pBase_;
+  size_t size_;
+#ifdef _WIN32
+  void *hFile_;
+  void *hMapping_;
+#endif
+
+  void unmap();
+  void validate() const;
+  static void addChecksum(const void *pData, size_t size, epicsUInt64 &sum1, epicsUInt64 &sum2);
+  static size_t pixelSize(pType pixelType);
+};
+
+/** One plane of a calibration, held either as a DexImage or as a plane of a mapped native file.
+  * The SDK corrections need a DexImage, which is copied from a mapped plane the first time it is asked for. */
+class DexelaCalibrationImage
+{
+public:
+  explicit DexelaCalibrationImage(const std::shared_ptr<DexImage> &pImage);
+  explicit DexelaCalibrationImage(const std::shared_ptr<const DexelaCalibrationFile> &pFile, int plane = 0);
+  ~DexelaCalibrationImage();
+
+  int getSizeX() const { return sizeX_; }
+  int getSizeY() const { return sizeY_; }
+  pType getPixelType() const { return pixelType_; }
+  const void *getData() const { return pData_; }
+  bool isMapped() const { return pFile_ != NULL; }
+  const DexelaCalibrationFile *getFile() const { return pFile_.get(); }
+  DexImage &getDexImage() const;
+  std::shared_ptr<DexImage> copyDexImage() const;
+  void write(const char *fileName, DexCalibrationType_t type, const DexelaCalibrationKey &key,
+             int model, int serialNumber) const;
+
+private:
+  std::shared_ptr<const DexelaCalibrationFile> pFile_;
+  mutable std::shared_ptr<DexImage> pImage_;
+  epicsMutexId mutex_;
+  int sizeX_;
+  int sizeY_;
+  pType pixelType_;
+  const void *pData_;
+};
+
+#endif
@@ -0,0 +1,248 @@
+/* DexelaCalibrationLibrary.cpp
+ *
+ * Library of offset, gain, defect map and dark model calibrations keyed by detector mode.
+ *
+ * Calibration files are named from the key, for example
+ *   offset_bin0_well0_ro0_exp100000us_roi0_0_3888_3072.smv
+ *   gain_bin0_well0_ro0_exp100000us_roi0_0_3888_3072.smv
+ *   defect_bin0_roi0_0_3888_3072.smv
+ *   darkbias_bin0_well0_ro0_roi0_0_3888_3072.smv
+ *   darkrate_bin0_well0_ro0_roi0_0_3888_3072.smv
+ * Any file extension that DexImage::ReadImage understands can be used, or .dexcal for the native format that is
+ * mapped into memory (DexelaCalibrationFile.h).
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+  #include <windows.h>
+#else
+  #include <dirent.h>
+#endif
+
+#include <epicsStdio.h>
+
+#include "DexelaCalibrationLibrary.h"
+
+#define NUM_TYPES 5
+static const char *typeNames[NUM_TYPES] = {"offset", "gain", "defect", "darkbias", "darkrate"};
+
+DexelaCalibrationKey::DexelaCalibrationKey()
+  : binning(0), fullWell(0), readoutMode(0), exposureUs(0), minX(0), minY(0), sizeX(0), sizeY(0)
+{
+}
+
+/** Returns the key with only the binning and ROI, which is used for the defect maps */
+DexelaCalibrationKey DexelaCalibrationKey::geometry() const
+{
+  DexelaCalibrationKey key = *this;
+
+  key.fullWell = -1;
+  key.readoutMode = -1;
+  key.exposureUs = -1;
+  return key;
+}
+
+/** Returns the key without the exposure time, which is used for the dark models */
+DexelaCalibrationKey DexelaCalibrationKey::mode() const
+{
+  DexelaCalibrationKey key = *this;
+
+  key.exposureUs = -1;
+  return key;
+}
+
+std::string DexelaCalibrationKey::toString() const
+{
+  char buffer[128];
+
+  if (fullWell < 0) {
+    epicsSnprintf(buffer, sizeof(buffer), "bin%d_roi%d_%d_%d_%d", binning, minX, minY, sizeX, sizeY);
+  } else if (exposureUs < 0) {
+    epicsSnprintf(buffer, sizeof(buffer), "bin%d_well%d_ro%d_roi%d_%d_%d_%d",
+                  binning, fullWell, readoutMode, minX, minY, sizeX, sizeY);
+  } else {
+    epicsSnprintf(buffer, sizeof(buffer), "bin%d_well%d_ro%d_exp%dus_roi%d_%d_%d_%d",
+                  binning, fullWell, readoutMode, exposureUs, minX, minY, sizeX, sizeY);
+  }
+  return buffer;
+}
+
+/** Returns the name of the file for one type of calibration with this key */
+std::string DexelaCalibrationKey::fileName(DexCalibrationType_t type, const char *extension) const
+{
+  DexelaCalibrationKey key = *this;
+
+  if (type == DexCalibrationDefectMap) key = geometry();
+  else if ((type == DexCalibrationDarkBias) || (type == DexCalibrationDarkRate)) key = mode();
+
+  return std::string(typeNames[type]) + "_" + key.toString() + extension;
+}
+
+/** Parses a calibration file name.
+  * Returns false if the name does not follow the library naming convention. */
+bool DexelaCalibrationKey::parseFileName(const char *fileName, DexCalibrationType_t *pType,
+                                         DexelaCalibrationKey *pKey)
+{
+  DexelaCalibrationKey key;
+  size_t length;
+  int type, numChars = 0;
+
+  for (type=0; type<NUM_TYPES; type++) {
+    length = strlen(typeNames[type]);
+    if ((strncmp(fileName, typeNames[type], length) == 0) && (fileName[length] == '_')) break;
+  }
+  if (type == NUM_TYPES) return false;
+  fileName += strlen(typeNames[type]) + 1;
+  if (type == DexCalibrationDefectMap) {
+    if (sscanf(fileName, "bin%d_roi%d_%d_%d_%d%n",
+               &key.binning, &key.minX, &key.minY, &key.sizeX, &key.sizeY, &numChars) != 5) return false;
+    key = key.geometry();
+  } else if ((type == DexCalibrationDarkBias) || (type == DexCalibrationDarkRate)) {
+    if (sscanf(fileName, "bin%d_well%d_ro%d_roi%d_%d_%d_%d%n",
+               &key.binning, &key.fullWell, &key.readoutMode,
+               &key.minX, &key.minY, &key.sizeX, &key.sizeY, &numChars) != 7) return false;
+    key = key.mode();
+  } else {
+    if (sscanf(fileName, "bin%d_well%d_ro%d_exp%dus_roi%d_%d_%d_%d%n",
+               &key.binning, &key.fullWell, &key.readoutMode, &key.exposureUs,
+               &key.minX, &key.minY, &key.sizeX, &key.sizeY, &numChars) != 8) return false;
+  }
+  // Only the extension may follow the key
+  if ((fileName[numChars] != '.') || strchr(fileName + numChars + 1, '_')) return false;
+  *pType = (DexCalibrationType_t)type;
+  *pKey = key;
+  return true;
+}
+
+bool DexelaCalibrationKey::operator<(const DexelaCalibrationKey &other) const
+{
+  const int a[8] = {binning, fullWell, readoutMode, exposureUs, minX, minY, sizeX, sizeY};
+  const int b[8] = {other.binning, other.fullWell, other.readoutMode, other.exposureUs,
+                    other.minX, other.minY, other.sizeX, other.sizeY};
+  int i;
+
+  for (i=0; i<8; i++) {
+    if (a[i] != b[i]) return a[i] < b[i];
+  }
+  return false;
+}
+
+//_____________________________________________________________________________________________
+
+/** Returns the calibration set for a detector mode, which is empty if the mode has not been calibrated */
+std::shared_ptr<DexelaCalibrationSet> DexelaCalibrationLibrary::find(const DexelaCalibrationKey &key) const
+{
+  std::shared_ptr<DexelaCalibrationSet> pSet = std::make_shared<DexelaCalibrationSet>(getOffsetGain(key));
+  std::map<DexelaCalibrationKey, DexelaCalibrationSet>::const_iterator it = defectMaps_.find(key.geometry());
+
+  if (it != defectMaps_.end()) {
+    pSet->pDefectMap = it->second.pDefectMap;
+    pSet->pDefectCorrection = it->second.pDefectCorrection;
+  }
+  return pSet;
+}
+
+/** Returns true if there is an offset, gain or defect map for a detector mode */
+bool DexelaCalibrationLibrary::contains(const DexelaCalibrationKey &key) const
+{
+  return (offsetGain_.find(key) != offsetGain_.end()) || (defectMaps_.find(key.geometry()) != defectMaps_.end());
+}
+
+/** Returns the offset and gain for a detector mode, without the defect map */
+DexelaCalibrationSet DexelaCalibrationLibrary::getOffsetGain(const DexelaCalibrationKey &key) const
+{
+  std::map<DexelaCalibrationKey, DexelaCalibrationSet>::const_iterator it = offsetGain_.find(key);
+
+  if (it == offsetGain_.end()) return DexelaCalibrationSet();
+  return it->second;
+}
+
+/** Stores the offset, gain and native correction of a set */
+void DexelaCalibrationLibrary::storeOffsetGain(const DexelaCalibrationKey &key, const DexelaCalibrationSet &set)
+{
+  DexelaCalibrationSet &entry = offsetGain_[key];
+
+  entry.pOffset = set.pOffset;
+  entry.pGain = set.pGain;
+  entry.pCorrection = set.pCorrection;
+}
+
+/** Stores the defect map and defect correction of a set for the geometry of the key */
+void DexelaCalibrationLibrary::storeDefectMap(const DexelaCalibrationKey &key, const DexelaCalibrationSet &set)
+{
+  DexelaCalibrationSet &entry = defectMaps_[key.geometry()];
+
+  entry.pDefectMap = set.pDefectMap;
+  entry.pDefectCorrection = set.pDefectCorrection;
+}
+
+/** Returns the dark model for the mode of a key, or NULL if there is none */
+std::shared_ptr<const DexelaDarkModel> DexelaCalibrationLibrary::findDarkModel(const DexelaCalibrationKey &key) const
+{
+  std::map<DexelaCalibrationKey, std::shared_ptr<const DexelaDarkModel> >::const_iterator it =
+    darkModels_.find(key.mode());
+
+  if (it == darkModels_.end()) return std::shared_ptr<const DexelaDarkModel>();
+  return it->second;
+}
+
+/** Stores a fitted dark model for the mode of the key */
+void DexelaCalibrationLibrary::storeDarkModel(const DexelaCalibrationKey &key,
+                                              const std::shared_ptr<const DexelaDarkModel> &pModel)
+{
+  darkModels_[key.mode()] = pModel;
+}
+
+/** Lists the keys of all the offsets in the library that have the same mode as a key, at any exposure time */
+void DexelaCalibrationLibrary::getOffsets(const DexelaCalibrationKey &key,
+                                          std::vector<DexelaCalibrationKey> &keys) const
+{
+  std::map<DexelaCalibrationKey, DexelaCalibrationSet>::const_iterator it;
+  DexelaCalibrationKey mode = key.mode();
+
+  keys.clear();
+  for (it=offsetGain_.begin(); it!=offsetGain_.end(); ++it) {
+    if (it->second.pOffset && (it->first.mode() == mode)) keys.push_back(it->first);
+  }
+}
+
+void DexelaCalibrationLibrary::clear()
+{
+  offsetGain_.clear();
+  defectMaps_.clear();
+  darkModels_.clear();
+}
+
+/** Lists the names of the files in a directory that follow the library naming convention */
+void DexelaCalibrationLibrary::listFiles(const char *directory, std::vector<std::string> &fileNames)
+{
+  DexCalibrationType_t type;
+  DexelaCalibrationKey key;
+
+  fileNames.clear();
+#ifdef _WIN32
+  WIN32_FIND_DATAA findData;
+  HANDLE hFind;
+  std::string pattern = std::string(directory) + "*";
+
+  hFind = FindFirstFileA(pattern.c_str(), &findData);
+  if (hFind == INVALID_HANDLE_VALUE) return;
+  do {
+    if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+    if (DexelaCalibrationKey::parseFileName(findData.cFileName, &type, &key)) fileNames.push_back(findData.cFileName);
+  } while (FindNextFileA(hFind, &findData));
+  FindClose(hFind);
+#else
+  DIR *pDir = opendir((directory && directory[0]) ? directory : ".");
+  struct dirent *pEntry;
+
+  if (!pDir) return;
+  while ((pEntry = readdir(pDir)) != NULL) {
+    if (DexelaCalibrationKey::parseFileName(pEntry->d_name, &type, &key)) fileNames.push_back(pEntry->d_name);
+  }
+  closedir(pDir);
+#endif
+}
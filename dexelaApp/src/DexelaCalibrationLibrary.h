@@ -0,0 +1,100 @@
+/* DexelaCalibrationLibrary.h
+ *
+ * Library of offset, gain, defect map and dark model calibrations keyed by detector mode.
+ *
+ * Each calibration set is immutable once it has been stored, so the driver switches calibrations by replacing
+ * a shared_ptr and frames that are being processed keep the set they started with.
+ *
+ */
+
+#ifndef DexelaCalibrationLibrary_H
+#define DexelaCalibrationLibrary_H
+
+#include <stddef.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DexImage.h"
+#include "DexelaCorrection.h"
+#include "DexelaDarkModel.h"
+#include "DexelaDefectCorrection.h"
+
+class DexelaCalibrationImage;
+
+/** Types of calibration file in the library */
+typedef enum {
+  DexCalibrationOffset,
+  DexCalibrationGain,
+  DexCalibrationDefectMap,
+  DexCalibrationDarkBias,     /**< Bias plane of a dark model */
+  DexCalibrationDarkRate      /**< Dark current plane of a dark model */
+} DexCalibrationType_t;
+
+/** Detector mode that a calibration was acquired in. The ROI is in unbinned pixels. */
+class DexelaCalibrationKey
+{
+public:
+  DexelaCalibrationKey();
+
+  int binning;
+  int fullWell;
+  int readoutMode;
+  int exposureUs;
+  int minX;
+  int minY;
+  int sizeX;
+  int sizeY;
+
+  DexelaCalibrationKey geometry() const;
+  DexelaCalibrationKey mode() const;
+  std::string toString() const;
+  std::string fileName(DexCalibrationType_t type, const char *extension = ".smv") const;
+  static bool parseFileName(const char *fileName, DexCalibrationType_t *pType, DexelaCalibrationKey *pKey);
+  bool operator<(const DexelaCalibrationKey &other) const;
+  bool operator==(const DexelaCalibrationKey &other) const { return !(*this < other) && !(other < *this); }
+};
+
+/** Offset, gain and defect map for one detector mode, and the native corrections built from them.
+  * Any of them may be missing. */
+class DexelaCalibrationSet
+{
+public:
+  DexelaCalibrationSet() : offsetSynthesized(false) {}
+
+  std::shared_ptr<const DexelaCalibrationImage> pOffset;
+  std::shared_ptr<const DexelaCalibrationImage> pGain;
+  std::shared_ptr<const DexelaCalibrationImage> pDefectMap;
+  std::shared_ptr<DexelaCorrection> pCorrection;
+  std::shared_ptr<DexelaDefectCorrection> pDefectCorrection;
+  bool offsetSynthesized;     /**< The offset was computed from a dark model rather than acquired */
+};
+
+/** The calibration sets for all the detector modes that have been calibrated.
+  * Offsets and gains are stored for the full key. Defect maps do not depend on the exposure, full well or readout
+  * mode, so they are stored for the geometry of the key (binning and ROI) and shared by all the modes with that
+  * geometry. Dark models cover all the exposure times, so they are stored for the mode of the key. */
+class DexelaCalibrationLibrary
+{
+public:
+  std::shared_ptr<DexelaCalibrationSet> find(const DexelaCalibrationKey &key) const;
+  bool contains(const DexelaCalibrationKey &key) const;
+  DexelaCalibrationSet getOffsetGain(const DexelaCalibrationKey &key) const;
+  void storeOffsetGain(const DexelaCalibrationKey &key, const DexelaCalibrationSet &set);
+  void storeDefectMap(const DexelaCalibrationKey &key, const DexelaCalibrationSet &set);
+  std::shared_ptr<const DexelaDarkModel> findDarkModel(const DexelaCalibrationKey &key) const;
+  void storeDarkModel(const DexelaCalibrationKey &key, const std::shared_ptr<const DexelaDarkModel> &pModel);
+  void getOffsets(const DexelaCalibrationKey &key, std::vector<DexelaCalibrationKey> &keys) const;
+  void clear();
+  size_t size() const { return offsetGain_.size() + defectMaps_.size() + darkModels_.size(); }
+
+  static void listFiles(const char *directory, std::vector<std::string> &fileNames);
+
+private:
+  std::map<DexelaCalibrationKey, DexelaCalibrationSet> offsetGain_;
+  std::map<DexelaCalibrationKey, DexelaCalibrationSet> defectMaps_;
+  std::map<DexelaCalibrationKey, std::shared_ptr<const DexelaDarkModel> > darkModels_;
+};
+
+#endif
@@ -0,0 +1,257 @@
+/* DexelaCorrection.cpp
+ *
+ * Offset and gain correction of Dexela frames.
+ *
+ * The scalar, AVX2 and AVX-512 kernels produce identical results: the arithmetic is done in 32-bit integers,
+ * the gain is applied in single precision, and the result is rounded to nearest with the default
+ * floating point rounding mode before being saturated to 16 bits.
+ *
+ */
+
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define DEX_X86_SIMD
+  #define DEX_TARGET_AVX2   __attribute__((target("avx2")))
+  #define DEX_TARGET_AVX512 __attribute__((target("avx512f")))
+  #include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  #define DEX_X86_SIMD
+  #define DEX_TARGET_AVX2
+  #define DEX_TARGET_AVX512
+  #include <intrin.h>
+  #include <immintrin.h>
+#endif
+
+#include "DexelaCorrection.h"
+
+//_____________________________________________________________________________________________
+
+/** Scalar kernel, also used for the pixels at the end of the frame that do not fill a SIMD register */
+static void correctScalar(const epicsUInt16 *pIn, const epicsUInt16 *pOffset, const float *pGain,
+                          int offsetConstant, epicsUInt16 *pOut, size_t n)
+{
+  size_t i;
+  int value;
+  float scaled;
+
+  for (i=0; i<n; i++) {
+    value = (int)pIn[i] - (int)pOffset[i] + offsetConstant;
+    if (pGain) {
+      scaled = (float)value * pGain[i];
+      if (scaled > 65535.f) scaled = 65535.f;
+      if (scaled < 0.f) scaled = 0.f;
+      value = (int)lrintf(scaled);
+    }
+    if (value < 0) value = 0;
+    if (value > 65535) value = 65535;
+    pOut[i] = (epicsUInt16)value;
+  }
+}
+
+#ifdef DEX_X86_SIMD
+
+/** AVX2 kernel, 16 pixels per iteration */
+DEX_TARGET_AVX2
+static void correctAVX2(const epicsUInt16 *pIn, const epicsUInt16 *pOffset, const float *pGain,
+                        int offsetConstant, epicsUInt16 *pOut, size_t n)
+{
+  const __m256i constant = _mm256_set1_epi32(offsetConstant);
+  const __m256 maxValue = _mm256_set1_ps(65535.f);
+  __m256i raw, offset, lo, hi;
+  size_t i;
+
+  for (i=0; i+16<=n; i+=16) {
+    raw    = _mm256_loadu_si256((const __m256i *)(pIn + i));
+    offset = _mm256_loadu_si256((const __m256i *)(pOffset + i));
+    lo = _mm256_sub_epi32(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(raw)),
+                          _mm256_cvtepu16_epi32(_mm256_castsi256_si128(offset)));
+    hi = _mm256_sub_epi32(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(raw, 1)),
+                          _mm256_cvtepu16_epi32(_mm256_extracti128_si256(offset, 1)));
+    lo = _mm256_add_epi32(lo, constant);
+    hi = _mm256_add_epi32(hi, constant);
+    if (pGain) {
+      lo = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(lo), _mm256_loadu_ps(pGain + i)),
+                                            maxValue));
+      hi = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(hi), _mm256_loadu_ps(pGain + i + 8)),
+                                            maxValue));
+    }
+    // packus saturates to 0-65535 but works within 128-bit lanes, so the permute restores the pixel order
+    _mm256_storeu_si256((__m256i *)(pOut + i),
+                        _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xD8));
+  }
+  correctScalar(pIn + i, pOffset + i, pGain ? pGain + i : NULL, offsetConstant, pOut + i, n - i);
+}
+
+/** AVX-512 kernel, 16 pixels per iteration */
+DEX_TARGET_AVX512
+static void correctAVX512(const epicsUInt16 *pIn, const epicsUInt16 *pOffset, const float *pGain,
+                          int offsetConstant, epicsUInt16 *pOut, size_t n)
+{
+  const __m512i constant = _mm512_set1_epi32(offsetConstant);
+  const __m512i zero = _mm512_setzero_si512();
+  const __m512 maxValue = _mm512_set1_ps(65535.f);
+  __m512i value;
+  size_t i;
+
+  for (i=0; i+16<=n; i+=16) {
+    value = _mm512_sub_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(pIn + i))),
+                             _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(pOffset + i))));
+    value = _mm512_add_epi32(value, constant);
+    if (pGain) {
+      value = _mm512_cvtps_epi32(_mm512_min_ps(_mm512_mul_ps(_mm512_cvtepi32_ps(value), _mm512_loadu_ps(pGain + i)),
+                                               maxValue));
+    }
+    // cvtusepi32 treats the input as unsigned, so negative values must be clipped first
+    value = _mm512_max_epi32(value, zero);
+    _mm256_storeu_si256((__m256i *)(pOut + i), _mm512_cvtusepi32_epi16(value));
+  }
+  correctScalar(pIn + i, pOffset + i, pGain ? pGain + i : NULL, offsetConstant, pOut + i, n - i);
+}
+
+#endif
+
+//_____________________________________________________________________________________________
+
+/** Returns the best SIMD instruction set supported by this CPU and operating system */
+DexSIMDLevel_t DexelaCorrection::maxSIMDLevel()
+{
+#if defined(DEX_X86_SIMD) && defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return DexSIMDAVX512;
+  if (__builtin_cpu_supports("avx2")) return DexSIMDAVX2;
+#elif defined(DEX_X86_SIMD)
+  int regs[4];
+  unsigned long long xcr0;
+
+  __cpuid(regs, 0);
+  if (regs[0] < 7) return DexSIMDScalar;
+  __cpuid(regs, 1);
+  // The OS must save the AVX registers (OSXSAVE and AVX bits)
+  if ((regs[2] & (3 << 27)) != (3 << 27)) return DexSIMDScalar;
+  xcr0 = _xgetbv(0);
+  if ((xcr0 & 0x6) != 0x6) return DexSIMDScalar;
+  __cpuidex(regs, 7, 0);
+  if ((regs[1] & (1 << 16)) && ((xcr0 & 0xE6) == 0xE6)) return DexSIMDAVX512;
+  if (regs[1] & (1 << 5)) return DexSIMDAVX2;
+#endif
+  return DexSIMDScalar;
+}
+
+const char *DexelaCorrection::SIMDLevelName(DexSIMDLevel_t level)
+{
+  switch (level) {
+    case DexSIMDAVX512: return "AVX-512";
+    case DexSIMDAVX2:   return "AVX2";
+    default:            return "Scalar";
+  }
+}
+
+//_____________________________________________________________________________________________
+
+/** Constructor.
+  * \param[in] sizeX Frame width in pixels
+  * \param[in] sizeY Frame height in pixels */
+DexelaCorrection::DexelaCorrection(int sizeX, int sizeY)
+  : sizeX_(sizeX), sizeY_(sizeY), simdLevel_(maxSIMDLevel())
+{
+}
+
+/** Selects the instruction set used by apply(). Levels the CPU does not support are reduced to the best one it does. */
+void DexelaCorrection::setSIMDLevel(DexSIMDLevel_t level)
+{
+  DexSIMDLevel_t maxLevel = maxSIMDLevel();
+  simdLevel_ = (level > maxLevel) ? maxLevel : level;
+}
+
+/** Sets the offset image, which must be unscrambled and sizeX*sizeY pixels.
+  * The gain depends on the offset, so it is cleared and must be set again. */
+void DexelaCorrection::setOffset(const epicsUInt16 *pOffset)
+{
+  offset_.assign(pOffset, pOffset + getNumPixels());
+  gain_.clear();
+}
+
+/** Sets the offset image from floating point data, rounding to the nearest integer */
+void DexelaCorrection::setOffset(const float *pOffset)
+{
+  size_t i, numPixels = getNumPixels();
+  float value;
+
+  offset_.resize(numPixels);
+  for (i=0; i<numPixels; i++) {
+    value = pOffset[i];
+    if (value < 0.f) value = 0.f;
+    if (value > 65535.f) value = 65535.f;
+    offset_[i] = (epicsUInt16)lrintf(value);
+  }
+  gain_.clear();
+}
+
+/** Computes the gain for each pixel as mean(flood - offset)/(flood - offset), like DexImage::FloodCorrection().
+  * The flood is the raw median of the flood frames, so the offset is subtracted first, otherwise the offset
+  * non-uniformity would be flat-fielded into the data. Pixels with no flood signal get a gain of 1. */
+template <typename epicsType>
+static void computeGain(const epicsType *pFlood, const std::vector<epicsUInt16> &offset, size_t numPixels,
+                        std::vector<float> &gain)
+{
+  size_t i, numGood = 0;
+  double sum = 0., mean, signal;
+
+  gain.resize(numPixels);
+  for (i=0; i<numPixels; i++) {
+    signal = (double)pFlood[i] - (offset.empty() ? 0. : offset[i]);
+    if (signal > 0) {
+      sum += signal;
+      numGood++;
+    }
+    // The signal is kept in the gain until the mean is known
+    gain[i] = (float)signal;
+  }
+  mean = numGood ? sum / numGood : 1.;
+  for (i=0; i<numPixels; i++) {
+    gain[i] = (gain[i] > 0) ? (float)(mean / gain[i]) : 1.f;
+  }
+}
+
+/** Sets the flood image from which the per-pixel gain is computed.
+  * The offset must be set first, because it is subtracted from the flood. */
+void DexelaCorrection::setGain(const float *pFlood)
+{
+  computeGain(pFlood, offset_, getNumPixels(), gain_);
+}
+
+/** Sets the flood image from 16-bit data */
+void DexelaCorrection::setGain(const epicsUInt16 *pFlood)
+{
+  computeGain(pFlood, offset_, getNumPixels(), gain_);
+}
+
+//_____________________________________________________________________________________________
+
+/** Corrects one frame. pIn and pOut may point to the same buffer.
+  * The offset must have been set; the gain is only applied if useGain is true and a gain has been set.
+  * \param[in] pIn Unscrambled frame, sizeX*sizeY pixels
+  * \param[out] pOut Corrected frame
+  * \param[in] offsetConstant Constant added to each pixel after subtracting the offset
+  * \param[in] useGain Apply the gain correction */
+void DexelaCorrection::apply(const epicsUInt16 *pIn, epicsUInt16 *pOut, int offsetConstant, bool useGain) const
+{
+  const float *pGain = (useGain && hasGain()) ? &gain_[0] : NULL;
+  size_t numPixels = getNumPixels();
+
+  if (!hasOffset()) return;
+  switch (simdLevel_) {
+#ifdef DEX_X86_SIMD
+    case DexSIMDAVX512:
+      correctAVX512(pIn, &offset_[0], pGain, offsetConstant, pOut, numPixels);
+      break;
+    case DexSIMDAVX2:
+      correctAVX2(pIn, &offset_[0], pGain, offsetConstant, pOut, numPixels);
+      break;
+#endif
+    default:
+      correctScalar(pIn, &offset_[0], pGain, offsetConstant, pOut, numPixels);
+      break;
+  }
+}
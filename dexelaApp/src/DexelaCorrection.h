@@ -0,0 +1,59 @@
+/* DexelaCorrection.h
+ *
+ * Offset and gain correction of Dexela frames.
+ *
+ * This replaces DexImage::SubtractDark() and DexImage::FloodCorrection() with a single pass over the frame
+ * using AVX2 or AVX-512 when the CPU supports them.
+ *
+ */
+
+#ifndef DexelaCorrection_H
+#define DexelaCorrection_H
+
+#include <stddef.h>
+#include <vector>
+
+#include <epicsTypes.h>
+
+/** SIMD instruction sets that the correction kernels can use */
+typedef enum {
+  DexSIMDScalar,
+  DexSIMDAVX2,
+  DexSIMDAVX512
+} DexSIMDLevel_t;
+
+/** Offset and gain correction for 16-bit frames.
+  * Each output pixel is clamp((raw - offset + offsetConstant) * gain, 0, 65535), rounded to the nearest integer.
+  * The gain is the mean of the offset-subtracted flood image divided by the offset-subtracted flood image.
+  * The results are defined by this formula and are not meant to be bit-identical to the SDK corrections. */
+class DexelaCorrection
+{
+public:
+  DexelaCorrection(int sizeX, int sizeY);
+
+  void setOffset(const epicsUInt16 *pOffset);
+  void setOffset(const float *pOffset);
+  void setGain(const float *pFlood);
+  void setGain(const epicsUInt16 *pFlood);
+  bool hasOffset() const { return !offset_.empty(); }
+  bool hasGain() const { return !gain_.empty(); }
+  int getSizeX() const { return sizeX_; }
+  int getSizeY() const { return sizeY_; }
+  size_t getNumPixels() const { return (size_t)sizeX_ * sizeY_; }
+
+  void apply(const epicsUInt16 *pIn, epicsUInt16 *pOut, int offsetConstant, bool useGain) const;
+
+  void setSIMDLevel(DexSIMDLevel_t level);
+  DexSIMDLevel_t getSIMDLevel() const { return simdLevel_; }
+  static DexSIMDLevel_t maxSIMDLevel();
+  static const char *SIMDLevelName(DexSIMDLevel_t level);
+
+private:
+  int sizeX_;
+  int sizeY_;
+  DexSIMDLevel_t simdLevel_;
+  std::vector<epicsUInt16> offset_;
+  std::vector<float> gain_;
+};
+
+#endif
@@ -0,0 +1,183 @@
+// DexelaCorrectionBench.cpp : Benchmark and consistency check of the offset and gain correction kernels.
+//
+// Usage:
+//   DexelaCorrectionBench [sizeX sizeY numFrames]
+//     Corrects synthetic frames with each SIMD kernel the CPU supports and checks that they agree with
+//     the scalar kernel.
+//   DexelaCorrectionBench -files dataFile offsetFile [gainFile] [offsetConstant] [numFrames]
+//     Corrects a recorded, unscrambled data frame with the SDK (DexImage::SubtractDark/FloodCorrection)
+//     and with the driver kernels, and reports the timings and any pixels that differ.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <epicsTime.h>
+
+#include "DexImage.h"
+#include "DexelaException.h"
+#include "DexelaCorrection.h"
+
+using namespace std;
+
+static double elapsed(epicsTimeStamp *pStart)
+{
+  epicsTimeStamp now;
+  epicsTimeGetCurrent(&now);
+  return epicsTimeDiffInSeconds(&now, pStart);
+}
+
+static size_t compare(const epicsUInt16 *pA, const epicsUInt16 *pB, size_t n, int *pMaxDiff)
+{
+  size_t i, numDiff = 0;
+  int diff;
+
+  *pMaxDiff = 0;
+  for (i=0; i<n; i++) {
+    diff = abs((int)pA[i] - (int)pB[i]);
+    if (diff) numDiff++;
+    if (diff > *pMaxDiff) *pMaxDiff = diff;
+  }
+  return numDiff;
+}
+
+/** Times the driver kernels on one frame and compares them to a reference result */
+static void runKernels(DexelaCorrection &correction, const epicsUInt16 *pIn, const epicsUInt16 *pReference,
+                       int offsetConstant, bool useGain, int numFrames, double referenceTime)
+{
+  size_t numPixels = correction.getNumPixels();
+  vector<epicsUInt16> out(numPixels);
+  epicsTimeStamp start;
+  double seconds;
+  size_t numDiff;
+  int maxDiff;
+  int level, i;
+
+  for (level=DexSIMDScalar; level<=DexelaCorrection::maxSIMDLevel(); level++) {
+    correction.setSIMDLevel((DexSIMDLevel_t)level);
+    epicsTimeGetCurrent(&start);
+    for (i=0; i<numFrames; i++) {
+      correction.apply(pIn, &out[0], offsetConstant, useGain);
+    }
+    seconds = elapsed(&start) / numFrames;
+    numDiff = compare(&out[0], pReference, numPixels, &maxDiff);
+    printf("  %-8s %8.3f ms/frame  %8.1f Mpixel/s  speedup %5.2f  differing pixels %lu (max %d)\n",
+           DexelaCorrection::SIMDLevelName((DexSIMDLevel_t)level), seconds*1000., numPixels/seconds/1.e6,
+           referenceTime/seconds, (unsigned long)numDiff, maxDiff);
+  }
+}
+
+static int benchSynthetic(int sizeX, int sizeY, int numFrames)
+{
+  size_t numPixels = (size_t)sizeX * sizeY;
+  vector<epicsUInt16> raw(numPixels), offset(numPixels), flood(numPixels), reference(numPixels);
+  DexelaCorrection correction(sizeX, sizeY);
+  epicsTimeStamp start;
+  double scalarTime;
+  int useGain, i;
+  size_t j;
+
+  srand(1);
+  for (j=0; j<numPixels; j++) {
+    offset[j] = (epicsUInt16)(100 + rand() % 400);
+    raw[j]    = (epicsUInt16)(offset[j] + rand() % 16000);
+    flood[j]  = (epicsUInt16)(8000 + rand() % 4000);
+  }
+  // Include the cases that saturate at both ends
+  raw[0] = 0;
+  raw[numPixels-1] = 65535;
+  correction.setOffset(&offset[0]);
+  correction.setGain(&flood[0]);
+
+  for (useGain=0; useGain<=1; useGain++) {
+    printf("%s correction, %d x %d, %d frames\n", useGain ? "Offset+gain" : "Offset", sizeX, sizeY, numFrames);
+    correction.setSIMDLevel(DexSIMDScalar);
+    epicsTimeGetCurrent(&start);
+    for (i=0; i<numFrames; i++) {
+      correction.apply(&raw[0], &reference[0], 100, useGain != 0);
+    }
+    scalarTime = elapsed(&start) / numFrames;
+    runKernels(correction, &raw[0], &reference[0], 100, useGain != 0, numFrames, scalarTime);
+  }
+  return 0;
+}
+
+static int benchFiles(const char *dataFile, const char *offsetFile, const char *gainFile,
+                      int offsetConstant, int numFrames)
+{
+  try {
+    DexImage data(dataFile);
+    DexImage offset(offsetFile);
+    DexImage gain;
+    DexImage sdkImage;
+    int sizeX = data.GetImageXdim();
+    int sizeY = data.GetImageYdim();
+    size_t numPixels = (size_t)sizeX * sizeY;
+    vector<epicsUInt16> raw(numPixels);
+    DexelaCorrection correction(sizeX, sizeY);
+    epicsTimeStamp start;
+    double sdkTime;
+    int i;
+
+    if (gainFile) gain.ReadImage(gainFile);
+    if ((data.GetImagePixelType() != u16) || (offset.GetImageXdim() != sizeX) || (offset.GetImageYdim() != sizeY)) {
+      printf("Data must be 16-bit and the offset must be the same size\n");
+      return -1;
+    }
+    memcpy(&raw[0], data.GetDataPointerToPlane(), numPixels * sizeof(epicsUInt16));
+    if (offset.GetImagePixelType() == flt) correction.setOffset((float *)offset.GetDataPointerToPlane());
+    else                                   correction.setOffset((epicsUInt16 *)offset.GetDataPointerToPlane());
+    if (gainFile) {
+      if (gain.GetImagePixelType() == flt) correction.setGain((float *)gain.GetDataPointerToPlane());
+      else                                 correction.setGain((epicsUInt16 *)gain.GetDataPointerToPlane());
+    }
+
+    // The SDK corrects in place, so each iteration starts from a fresh copy of the data
+    epicsTimeGetCurrent(&start);
+    for (i=0; i<numFrames; i++) {
+      sdkImage = data;
+      sdkImage.SetDarkOffset(offsetConstant);
+      sdkImage.LoadDarkImage(offset);
+      if (gainFile) {
+        sdkImage.LoadFloodImage(gain);
+        sdkImage.FloodCorrection();
+      } else {
+        sdkImage.SubtractDark();
+      }
+    }
+    sdkTime = elapsed(&start) / numFrames;
+    printf("%s correction of %s, %d x %d, %d frames\n", gainFile ? "Offset+gain" : "Offset", dataFile,
+           sizeX, sizeY, numFrames);
+    printf("  %-8s %8.3f ms/frame  %8.1f Mpixel/s\n", "SDK", sdkTime*1000., numPixels/sdkTime/1.e6);
+    runKernels(correction, &raw[0], (epicsUInt16 *)sdkImage.GetDataPointerToPlane(), offsetConstant,
+               gainFile != NULL, numFrames, sdkTime);
+  }
+  catch (DexelaException &ex) {
+    printf("Exception: %s, function: %s\n", ex.what(), ex.GetFunctionName());
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  if ((argc >= 4) && (strcmp(argv[1], "-files") == 0)) {
+    const char *gainFile = NULL;
+    int offsetConstant = 0;
+    int numFrames = 10;
+    if (argc > 4) gainFile = argv[4];
+    if ((gainFile) && (strcmp(gainFile, "-") == 0)) gainFile = NULL;
+    if (argc > 5) offsetConstant = atoi(argv[5]);
+    if (argc > 6) numFrames = atoi(argv[6]);
+    return benchFiles(argv[2], argv[3], gainFile, offsetConstant, numFrames);
+  }
+  if ((argc == 2) || (argc == 3)) {
+    printf("Usage: %s [sizeX sizeY numFrames]\n", argv[0]);
+    printf("       %s -files dataFile offsetFile [gainFile|-] [offsetConstant] [numFrames]\n", argv[0]);
+    return -1;
+  }
+  return benchSynthetic(argc > 1 ? atoi(argv[1]) : 3888,
+                        argc > 2 ? atoi(argv[2]) : 3072,
+                        argc > 3 ? atoi(argv[3]) : 20);
+}
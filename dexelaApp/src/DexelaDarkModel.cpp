@@ -0,0 +1,198 @@
+/* DexelaDarkModel.cpp
+ *
+ * Exposure time dependent model of the detector offset.
+ *
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define DEX_X86_SIMD
+  #define DEX_TARGET_AVX2   __attribute__((target("avx2")))
+  #define DEX_TARGET_AVX512 __attribute__((target("avx512f")))
+  #include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  #define DEX_X86_SIMD
+  #define DEX_TARGET_AVX2
+  #define DEX_TARGET_AVX512
+  #include <immintrin.h>
+#endif
+
+#include <math.h>
+#include <algorithm>
+
+#include "DexelaDarkModel.h"
+
+//_____________________________________________________________________________________________
+
+/** Scalar kernel, also used for the pixels at the end of the frame that do not fill a SIMD register.
+  * lrintf rounds to nearest even like the SIMD conversions, so all the kernels give the same result. */
+static void synthesizeScalar(const float *pBias, const float *pRate, float t, epicsUInt16 *pOut, size_t n)
+{
+  float value;
+  size_t i;
+
+  for (i=0; i<n; i++) {
+    value = pBias[i] + pRate[i] * t;
+    value = std::min(std::max(value, 0.f), 65535.f);
+    pOut[i] = (epicsUInt16)lrintf(value);
+  }
+}
+
+#ifdef DEX_X86_SIMD
+
+/** AVX2 kernel, 16 pixels per iteration */
+DEX_TARGET_AVX2
+static void synthesizeAVX2(const float *pBias, const float *pRate, float t, epicsUInt16 *pOut, size_t n)
+{
+  const __m256 time = _mm256_set1_ps(t);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 maxValue = _mm256_set1_ps(65535.f);
+  __m256 lo, hi;
+  size_t i;
+
+  for (i=0; i+16<=n; i+=16) {
+    lo = _mm256_add_ps(_mm256_loadu_ps(pBias + i), _mm256_mul_ps(_mm256_loadu_ps(pRate + i), time));
+    hi = _mm256_add_ps(_mm256_loadu_ps(pBias + i + 8), _mm256_mul_ps(_mm256_loadu_ps(pRate + i + 8), time));
+    lo = _mm256_min_ps(_mm256_max_ps(lo, zero), maxValue);
+    hi = _mm256_min_ps(_mm256_max_ps(hi, zero), maxValue);
+    // packus works within 128-bit lanes, so the 64-bit blocks are put back in order afterwards
+    _mm256_storeu_si256((__m256i *)(pOut + i),
+                        _mm256_permute4x64_epi64(_mm256_packus_epi32(_mm256_cvtps_epi32(lo), _mm256_cvtps_epi32(hi)),
+                                                 0xD8));
+  }
+  synthesizeScalar(pBias + i, pRate + i, t, pOut + i, n - i);
+}
+
+/** AVX-512 kernel, 16 pixels per iteration */
+DEX_TARGET_AVX512
+static void synthesizeAVX512(const float *pBias, const float *pRate, float t, epicsUInt16 *pOut, size_t n)
+{
+  const __m512 time = _mm512_set1_ps(t);
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 maxValue = _mm512_set1_ps(65535.f);
+  __m512 value;
+  size_t i;
+
+  for (i=0; i+16<=n; i+=16) {
+    value = _mm512_add_ps(_mm512_loadu_ps(pBias + i), _mm512_mul_ps(_mm512_loadu_ps(pRate + i), time));
+    value = _mm512_min_ps(_mm512_max_ps(value, zero), maxValue);
+    _mm256_storeu_si256((__m256i *)(pOut + i), _mm512_cvtusepi32_epi16(_mm512_cvtps_epi32(value)));
+  }
+  synthesizeScalar(pBias + i, pRate + i, t, pOut + i, n - i);
+}
+
+#endif
+
+//_____________________________________________________________________________________________
+
+/** Constructor
+  * \param[in] sizeX Width of the offsets in pixels
+  * \param[in] sizeY Height of the offsets in pixels */
+DexelaDarkModel::DexelaDarkModel(int sizeX, int sizeY)
+  : sizeX_(sizeX), sizeY_(sizeY), numOffsets_(0), fitted_(false),
+    bias_((size_t)sizeX * sizeY, 0.f), rate_((size_t)sizeX * sizeY, 0.f), sumT_(0.), sumTT_(0.)
+{
+  // The CPU does not change, so it is only queried once
+  static const DexSIMDLevel_t maxLevel = DexelaCorrection::maxSIMDLevel();
+
+  simdLevel_ = maxLevel;
+}
+
+/** Sets the SIMD instruction set, it is limited to what this CPU supports */
+void DexelaDarkModel::setSIMDLevel(DexSIMDLevel_t level)
+{
+  DexSIMDLevel_t maxLevel = DexelaCorrection::maxSIMDLevel();
+
+  simdLevel_ = (level > maxLevel) ? maxLevel : level;
+}
+
+/** Adds an offset to the fit. It cannot be called after fit().
+  * \param[in] pOffset Offset image, sizeX*sizeY pixels
+  * \param[in] exposureTime Exposure time of the offset in seconds */
+void DexelaDarkModel::add(const epicsUInt16 *pOffset, double exposureTime)
+{
+  addOffset(pOffset, exposureTime);
+}
+
+/** Adds an offset that was averaged in floating point to the fit */
+void DexelaDarkModel::add(const float *pOffset, double exposureTime)
+{
+  addOffset(pOffset, exposureTime);
+}
+
+template <typename T>
+void DexelaDarkModel::addOffset(const T *pOffset, double exposureTime)
+{
+  float t = (float)exposureTime;
+  float *pSumY = &bias_[0];
+  float *pSumTY = &rate_[0];
+  size_t numPixels = bias_.size();
+  size_t i;
+
+  if (fitted_) return;
+  for (i=0; i<numPixels; i++) {
+    pSumY[i] += (float)pOffset[i];
+    pSumTY[i] += t * (float)pOffset[i];
+  }
+  sumT_ += exposureTime;
+  sumTT_ += exposureTime * exposureTime;
+  numOffsets_++;
+}
+
+/** Fits the bias and rate of each pixel by least squares from the offsets that have been added.
+  * Returns false if there are not offsets at two or more different exposure times. */
+bool DexelaDarkModel::fit()
+{
+  float *pBias = &bias_[0];
+  float *pRate = &rate_[0];
+  size_t numPixels = bias_.size();
+  double meanT, varianceT;
+  float slope, meanY;
+  size_t i;
+
+  if (fitted_) return true;
+  if (numOffsets_ < 2) return false;
+  meanT = sumT_ / numOffsets_;
+  varianceT = sumTT_ / numOffsets_ - meanT * meanT;
+  // Less than 1 us of spread means all the offsets were taken at the same exposure time
+  if (varianceT < 1e-12) return false;
+  for (i=0; i<numPixels; i++) {
+    meanY = pBias[i] / numOffsets_;
+    slope = (float)((pRate[i] / numOffsets_ - meanT * meanY) / varianceT);
+    pBias[i] = (float)(meanY - slope * meanT);
+    pRate[i] = slope;
+  }
+  fitted_ = true;
+  return true;
+}
+
+/** Sets a model that has already been fitted, for example one read from files.
+  * \param[in] pBias Bias of each pixel in counts
+  * \param[in] pRate Dark current rate of each pixel in counts per second */
+void DexelaDarkModel::setModel(const float *pBias, const float *pRate)
+{
+  std::copy(pBias, pBias + bias_.size(), bias_.begin());
+  std::copy(pRate, pRate + rate_.size(), rate_.begin());
+  fitted_ = true;
+}
+
+/** Computes the offset for an exposure time, rounded and clipped to the range of 16-bit pixels.
+  * \param[in] exposureTime Exposure time in seconds
+  * \param[out] pOffset Offset image, sizeX*sizeY pixels */
+void DexelaDarkModel::synthesize(double exposureTime, epicsUInt16 *pOffset) const
+{
+  float t = (float)exposureTime;
+
+  switch (simdLevel_) {
+#ifdef DEX_X86_SIMD
+    case DexSIMDAVX512:
+      synthesizeAVX512(&bias_[0], &rate_[0], t, pOffset, bias_.size());
+      break;
+    case DexSIMDAVX2:
+      synthesizeAVX2(&bias_[0], &rate_[0], t, pOffset, bias_.size());
+      break;
+#endif
+    default:
+      synthesizeScalar(&bias_[0], &rate_[0], t, pOffset, bias_.size());
+      break;
+  }
+}
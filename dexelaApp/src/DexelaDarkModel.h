@@ -0,0 +1,60 @@
+/* DexelaDarkModel.h
+ *
+ * Exposure time dependent model of the detector offset.
+ *
+ * The offset of each pixel is a bias plus a dark current rate times the exposure time. The model is fitted from
+ * offsets taken at two or more exposure times, so the offset for any other exposure time can be computed instead
+ * of acquired.
+ *
+ */
+
+#ifndef DexelaDarkModel_H
+#define DexelaDarkModel_H
+
+#include <stddef.h>
+#include <vector>
+
+#include <epicsTypes.h>
+
+#include "DexelaCorrection.h"
+
+/** Per-pixel linear model of the offset, offset = bias + rate * exposure time.
+  * The offsets are added one at a time into per-pixel sums, so fitting the model reads each offset once and only
+  * needs two floats per pixel however many offsets there are. */
+class DexelaDarkModel
+{
+public:
+  DexelaDarkModel(int sizeX, int sizeY);
+
+  int getSizeX() const { return sizeX_; }
+  int getSizeY() const { return sizeY_; }
+  int getNumOffsets() const { return numOffsets_; }
+  bool isFitted() const { return fitted_; }
+  const float *getBias() const { return &bias_[0]; }
+  const float *getRate() const { return &rate_[0]; }
+
+  void add(const epicsUInt16 *pOffset, double exposureTime);
+  void add(const float *pOffset, double exposureTime);
+  bool fit();
+  void setModel(const float *pBias, const float *pRate);
+  void synthesize(double exposureTime, epicsUInt16 *pOffset) const;
+
+  void setSIMDLevel(DexSIMDLevel_t level);
+  DexSIMDLevel_t getSIMDLevel() const { return simdLevel_; }
+
+private:
+  template <typename T> void addOffset(const T *pOffset, double exposureTime);
+
+  int sizeX_;
+  int sizeY_;
+  int numOffsets_;
+  bool fitted_;
+  // Until the model is fitted bias_ holds the sum of the offsets and rate_ the sum of exposure time * offset
+  std::vector<float> bias_;
+  std::vector<float> rate_;
+  double sumT_;
+  double sumTT_;
+  DexSIMDLevel_t simdLevel_;
+};
+
+#endif
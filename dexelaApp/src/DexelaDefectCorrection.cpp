@@ -0,0 +1,158 @@
+/* DexelaDefectCorrection.cpp
+ *
+ * Defect pixel correction of Dexela frames.
+ *
+ * Each defective pixel is replaced by a weighted average of good pixels only, so the correction can be done in
+ * place and the order in which the defects are corrected does not matter.
+ *
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "DexelaDefectCorrection.h"
+
+static const DexDefectClass_t defectClasses[3] = {DexDefectBadPixel, DexDefectCluster, DexDefectColumn};
+
+/** Converts a defect map label to a defect class */
+static DexDefectClass_t labelClass(epicsUInt16 label)
+{
+  switch (label) {
+    case 11: return DexDefectCluster;
+    case 12: return DexDefectColumn;
+    default: return DexDefectBadPixel;
+  }
+}
+
+//_____________________________________________________________________________________________
+
+/** Constructor, compiles the defect map.
+  * \param[in] pMap Unscrambled defect map, 0 for good pixels and the defect label for bad ones
+  * \param[in] sizeX Map width in pixels
+  * \param[in] sizeY Map height in pixels */
+DexelaDefectCorrection::DexelaDefectCorrection(const epicsUInt16 *pMap, int sizeX, int sizeY)
+  : sizeX_(sizeX), sizeY_(sizeY)
+{
+  int c, x, y;
+  size_t index, first, k;
+  float sum;
+
+  firstNeighbor_.push_back(0);
+  for (c=0; c<3; c++) {
+    ranges_[c].first = target_.size();
+    for (y=0; y<sizeY; y++) {
+      for (x=0; x<sizeX; x++) {
+        index = (size_t)y * sizeX + x;
+        if (!pMap[index] || (labelClass(pMap[index]) != defectClasses[c])) continue;
+        switch (defectClasses[c]) {
+          case DexDefectBadPixel:
+            compilePixel(pMap, x, y, 1, 2, 1);
+            break;
+          case DexDefectCluster:
+            // Clusters use a wider neighborhood so the interior of the cluster is not filled from a single pixel
+            compilePixel(pMap, x, y, 1, 4, 3);
+            break;
+          case DexDefectColumn:
+            compileColumn(pMap, x, y);
+            break;
+        }
+        // A defect with no good neighbors is left uncorrected
+        first = firstNeighbor_.back();
+        if (neighbor_.size() == first) continue;
+        // Normalize so the weights of each defect add up to 1
+        sum = 0.f;
+        for (k=first; k<weight_.size(); k++) sum += weight_[k];
+        for (k=first; k<weight_.size(); k++) weight_[k] /= sum;
+        target_.push_back((epicsUInt32)index);
+        firstNeighbor_.push_back((epicsUInt32)neighbor_.size());
+      }
+    }
+    ranges_[c].last = target_.size();
+  }
+}
+
+/** Adds a good neighbor to the defect being compiled */
+void DexelaDefectCorrection::addNeighbor(int x, int y, float weight)
+{
+  neighbor_.push_back((epicsUInt32)((size_t)y * sizeX_ + x));
+  weight_.push_back(weight);
+}
+
+/** Compiles a bad pixel or cluster pixel using the good pixels in square rings around it.
+  * Rings are added until at least minNeighbors good pixels have been found or maxRadius is reached.
+  * Neighbors are weighted by the inverse of their distance. */
+void DexelaDefectCorrection::compilePixel(const epicsUInt16 *pMap, int x, int y, int minRadius, int maxRadius,
+                                          size_t minNeighbors)
+{
+  int r, dx, dy, nx, ny;
+  size_t first = firstNeighbor_.back();
+
+  for (r=1; r<=maxRadius; r++) {
+    for (dy=-r; dy<=r; dy++) {
+      for (dx=-r; dx<=r; dx++) {
+        if ((abs(dx) != r) && (abs(dy) != r)) continue;
+        nx = x + dx;
+        ny = y + dy;
+        if ((nx < 0) || (nx >= sizeX_) || (ny < 0) || (ny >= sizeY_)) continue;
+        if (pMap[(size_t)ny * sizeX_ + nx]) continue;
+        addNeighbor(nx, ny, 1.f / sqrtf((float)(dx*dx + dy*dy)));
+      }
+    }
+    if ((r >= minRadius) && (neighbor_.size() - first >= minNeighbors)) break;
+  }
+}
+
+/** Compiles a pixel in a bad column by interpolating between the nearest good pixels to the left and right */
+void DexelaDefectCorrection::compileColumn(const epicsUInt16 *pMap, int x, int y)
+{
+  const epicsUInt16 *pRow = pMap + (size_t)y * sizeX_;
+  int left, right;
+
+  for (left=x-1; (left >= 0) && pRow[left]; left--);
+  for (right=x+1; (right < sizeX_) && pRow[right]; right++);
+  if (left >= 0) addNeighbor(left, y, 1.f / (x - left));
+  if (right < sizeX_) addNeighbor(right, y, 1.f / (right - x));
+}
+
+//_____________________________________________________________________________________________
+
+int DexelaDefectCorrection::classIndex(DexDefectClass_t defectClass) const
+{
+  int c;
+
+  for (c=0; c<3; c++) {
+    if (defectClasses[c] == defectClass) return c;
+  }
+  return -1;
+}
+
+/** Returns the number of compiled defects of one class */
+size_t DexelaDefectCorrection::getNumDefects(DexDefectClass_t defectClass) const
+{
+  int c = classIndex(defectClass);
+
+  if (c < 0) return 0;
+  return ranges_[c].last - ranges_[c].first;
+}
+
+/** Corrects the defects in one frame, in place.
+  * \param[in,out] pData Unscrambled frame, sizeX*sizeY pixels
+  * \param[in] classMask OR of the DexDefectClass_t values to correct */
+void DexelaDefectCorrection::apply(epicsUInt16 *pData, int classMask) const
+{
+  int c;
+  size_t d, k;
+  float sum;
+
+  for (c=0; c<3; c++) {
+    if (!(classMask & defectClasses[c])) continue;
+    for (d=ranges_[c].first; d<ranges_[c].last; d++) {
+      sum = 0.f;
+      for (k=firstNeighbor_[d]; k<firstNeighbor_[d+1]; k++) {
+        sum += weight_[k] * pData[neighbor_[k]];
+      }
+      if (sum > 65535.f) sum = 65535.f;
+      pData[target_[d]] = (epicsUInt16)(sum + 0.5f);
+    }
+  }
+}
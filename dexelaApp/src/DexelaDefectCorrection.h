@@ -0,0 +1,61 @@
+/* DexelaDefectCorrection.h
+ *
+ * Defect pixel correction of Dexela frames.
+ *
+ * The defect map is compiled once into a list of defective pixels, each with the indices and weights of the
+ * good pixels used to replace it, so correcting a frame only touches the defective pixels and their neighbors.
+ *
+ */
+
+#ifndef DexelaDefectCorrection_H
+#define DexelaDefectCorrection_H
+
+#include <stddef.h>
+#include <vector>
+
+#include <epicsTypes.h>
+
+/** Classes of defects that can be corrected. These use the same bits as enumDexDefCorOptimizeFlag
+  * in BadPixelCorrection.h so the same mask can be used for both. */
+typedef enum {
+  DexDefectBadPixel = 1,    /**< Isolated bad pixels, defect map label 1 */
+  DexDefectCluster  = 2,    /**< Clusters of bad pixels, defect map label 11 */
+  DexDefectColumn   = 8     /**< Bad columns, defect map label 12 */
+} DexDefectClass_t;
+
+#define DEX_DEFECT_ALL_CLASSES (DexDefectBadPixel | DexDefectCluster | DexDefectColumn)
+
+/** Sparse defect correction for 16-bit frames */
+class DexelaDefectCorrection
+{
+public:
+  DexelaDefectCorrection(const epicsUInt16 *pMap, int sizeX, int sizeY);
+
+  void apply(epicsUInt16 *pData, int classMask) const;
+  int getSizeX() const { return sizeX_; }
+  int getSizeY() const { return sizeY_; }
+  size_t getNumDefects() const { return target_.size(); }
+  size_t getNumDefects(DexDefectClass_t defectClass) const;
+
+private:
+  /** Range of defects of one class in target_ */
+  struct classRange {
+    size_t first;
+    size_t last;
+  };
+
+  int sizeX_;
+  int sizeY_;
+  classRange ranges_[3];
+  std::vector<epicsUInt32> target_;       /**< Index of each defective pixel */
+  std::vector<epicsUInt32> firstNeighbor_; /**< Start of each defect's neighbors in neighbor_, with one extra entry */
+  std::vector<epicsUInt32> neighbor_;     /**< Index of each good neighbor */
+  std::vector<float> weight_;             /**< Normalized weight of each good neighbor */
+
+  int classIndex(DexDefectClass_t defectClass) const;
+  void compilePixel(const epicsUInt16 *pMap, int x, int y, int minRadius, int maxRadius, size_t minNeighbors);
+  void compileColumn(const epicsUInt16 *pMap, int x, int y);
+  void addNeighbor(int x, int y, float weight);
+};
+
+#endif
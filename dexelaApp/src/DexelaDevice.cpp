@@ -0,0 +1,39 @@
+/* DexelaDevice.cpp
+ *
+ * Detector controlled through the Dexela SDK.
+ *
+ */
+
+#include "DexelaDevice.h"
+
+//_____________________________________________________________________________________________
+
+/** Constructor
+  * \param[in] pDetector The SDK detector, which is deleted with this object */
+DexelaSDKDevice::DexelaSDKDevice(DexelaDetector *pDetector)
+  : pDetector_(pDetector), callback_(NULL), pCallbackData_(NULL)
+{
+}
+
+DexelaSDKDevice::~DexelaSDKDevice()
+{
+  delete pDetector_;
+}
+
+/** Sets the function the SDK calls for each frame.
+  * The SDK callback data points to this object, so the function is passed this object rather than the
+  * DexelaDetector, and SetCallbackData() only changes what GetCallbackData() returns. */
+void DexelaSDKDevice::SetCallback(DexelaDeviceCallback func)
+{
+  callback_ = func;
+  pDetector_->SetCallbackData(this);
+  pDetector_->SetCallback(sdkCallback);
+}
+
+/** Called by the SDK for each frame */
+void DexelaSDKDevice::sdkCallback(int frameCounter, int bufferNumber, DexelaDetector *pDetector)
+{
+  DexelaSDKDevice *pDevice = (DexelaSDKDevice *)pDetector->GetCallbackData();
+
+  if (pDevice->callback_) pDevice->callback_(frameCounter, bufferNumber, pDevice);
+}
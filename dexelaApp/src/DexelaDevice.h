@@ -0,0 +1,180 @@
+/* DexelaDevice.h
+ *
+ * Interface between the driver and a detector, implemented by the Dexela SDK and by the simulated detector.
+ *
+ * The methods have the names and arguments of the DexelaDetector methods the driver calls, and throw
+ * DexelaException in the same way, so the driver does not need to know which implementation it is using.
+ *
+ */
+
+#ifndef DexelaDevice_H
+#define DexelaDevice_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "DexImage.h"
+#include "DexelaDetector.h"
+
+class DexelaDevice;
+
+/** Called from a thread of the device for each frame, with the frame counter and the buffer holding the frame */
+typedef void (*DexelaDeviceCallback)(int frameCounter, int bufferNumber, DexelaDevice *pDevice);
+
+/** The DexelaDetector calls used by the driver */
+class DexelaDevice
+{
+public:
+  virtual ~DexelaDevice() {}
+
+  virtual void OpenBoard() = 0;
+  virtual void CloseBoard() = 0;
+
+  virtual int GetBufferXdim() = 0;
+  virtual int GetBufferYdim() = 0;
+  virtual int GetNumBuffers() = 0;
+  virtual void ReadBuffer(int bufNum, byte *buffer) = 0;
+  virtual void ReadBuffer(int bufNum, DexImage &img, int iZ = 0) = 0;
+
+  virtual void SetFullWellMode(FullWellModes fwm) = 0;
+  virtual void SetExposureMode(ExposureModes mode) = 0;
+  virtual void SetExposureTime(float timems) = 0;
+  virtual void SetBinningMode(bins flag) = 0;
+  virtual void SetTriggerSource(ExposureTriggerSource ets) = 0;
+  virtual void SetNumOfExposures(int num) = 0;
+  virtual void SetGapTime(float timems) = 0;
+  virtual void SetReadoutMode(ReadoutModes mode) = 0;
+  virtual void SetPreProgrammedExposureTimes(const float *exposureTimes, size_t size) = 0;
+  virtual void SetPixelFrameCounter(bool isEnabled) = 0;
+
+  virtual bins GetBinningMode() = 0;
+  virtual int GetSerialNumber() = 0;
+  virtual int GetModelNumber() = 0;
+  virtual int GetSensorVersion() = 0;
+  virtual bool GetSliceInterlacing() = 0;
+  virtual float GetReadOutTime() = 0;
+  virtual unsigned short GetSensorWidth() = 0;
+  virtual unsigned short GetSensorHeight() = 0;
+
+  virtual int QueryExposureMode(ExposureModes mode) = 0;
+  virtual int QueryFullWellMode(FullWellModes fwm) = 0;
+  virtual int QueryBinningMode(bins flag) = 0;
+  virtual int QueryOnBoardUnscrambling() = 0;
+  virtual int QueryOnBoardLinearization() = 0;
+  virtual void ToggleOnBoardLinearization(bool onOff) = 0;
+  virtual bool GetOnBoardLinearizationState() = 0;
+  virtual int QueryOnBoardXTalkCorrection() = 0;
+  virtual void ToggleOnBoardXTalkCorrection(bool onOff) = 0;
+  virtual bool GetOnBoardXTalkCorrectionState() = 0;
+
+  virtual bool IsLive() = 0;
+  virtual void Snap(int buffer, int timeout) = 0;
+  virtual void GoLiveSeq(int start, int stop, int numBuf) = 0;
+  virtual void GoLiveSeq() = 0;
+  virtual void GoUnLive() = 0;
+  virtual void SoftwareTrigger() = 0;
+  virtual void EnablePulseGenerator(float frequency) = 0;
+  virtual void EnablePulseGenerator() = 0;
+  virtual void DisablePulseGenerator() = 0;
+  virtual void ToggleGenerator(BOOL onOff) = 0;
+
+  virtual void SetCallback(DexelaDeviceCallback func) = 0;
+  virtual void SetCallbackData(void *cbData) = 0;
+  virtual void *GetCallbackData() = 0;
+
+  virtual int QueryROI() = 0;
+  virtual void GetMaximumROISize(int &width, int &height) = 0;
+  virtual void SetROIArea(int width, int height, int startRow, int startColumn) = 0;
+  virtual void GetROIArea(int &width, int &height, int &startRow, int &startColumn) = 0;
+  virtual void SetROIEnabled(bool isEnabled) = 0;
+  virtual bool IsROIEnabled() = 0;
+  virtual void SetROIMarginEnabled(bool isEnabled) = 0;
+  virtual bool IsROIMarginEnabled() = 0;
+
+  /** Prints details that are not in the parameters, nothing for a real detector */
+  virtual void report(FILE * /*fp*/) {}
+};
+
+/** A detector controlled through the Dexela SDK. Every call is passed on to the DexelaDetector. */
+class DexelaSDKDevice : public DexelaDevice
+{
+public:
+  explicit DexelaSDKDevice(DexelaDetector *pDetector);
+  ~DexelaSDKDevice();
+
+  void OpenBoard() { pDetector_->OpenBoard(); }
+  void CloseBoard() { pDetector_->CloseBoard(); }
+
+  int GetBufferXdim() { return pDetector_->GetBufferXdim(); }
+  int GetBufferYdim() { return pDetector_->GetBufferYdim(); }
+  int GetNumBuffers() { return pDetector_->GetNumBuffers(); }
+  void ReadBuffer(int bufNum, byte *buffer) { pDetector_->ReadBuffer(bufNum, buffer); }
+  void ReadBuffer(int bufNum, DexImage &img, int iZ = 0) { pDetector_->ReadBuffer(bufNum, img, iZ); }
+
+  void SetFullWellMode(FullWellModes fwm) { pDetector_->SetFullWellMode(fwm); }
+  void SetExposureMode(ExposureModes mode) { pDetector_->SetExposureMode(mode); }
+  void SetExposureTime(float timems) { pDetector_->SetExposureTime(timems); }
+  void SetBinningMode(bins flag) { pDetector_->SetBinningMode(flag); }
+  void SetTriggerSource(ExposureTriggerSource ets) { pDetector_->SetTriggerSource(ets); }
+  void SetNumOfExposures(int num) { pDetector_->SetNumOfExposures(num); }
+  void SetGapTime(float timems) { pDetector_->SetGapTime(timems); }
+  void SetReadoutMode(ReadoutModes mode) { pDetector_->SetReadoutMode(mode); }
+  void SetPreProgrammedExposureTimes(const float *exposureTimes, size_t size)
+    { pDetector_->SetPreProgrammedExposureTimes(exposureTimes, size); }
+  void SetPixelFrameCounter(bool isEnabled) { pDetector_->SetPixelFrameCounter(isEnabled); }
+
+  bins GetBinningMode() { return pDetector_->GetBinningMode(); }
+  int GetSerialNumber() { return pDetector_->GetSerialNumber(); }
+  int GetModelNumber() { return pDetector_->GetModelNumber(); }
+  int GetSensorVersion() { return pDetector_->GetSensorVersion(); }
+  bool GetSliceInterlacing() { return pDetector_->GetSliceInterlacing(); }
+  float GetReadOutTime() { return pDetector_->GetReadOutTime(); }
+  unsigned short GetSensorWidth() { return pDetector_->GetSensorWidth(); }
+  unsigned short GetSensorHeight() { return pDetector_->GetSensorHeight(); }
+
+  int QueryExposureMode(ExposureModes mode) { return pDetector_->QueryExposureMode(mode); }
+  int QueryFullWellMode(FullWellModes fwm) { return pDetector_->QueryFullWellMode(fwm); }
+  int QueryBinningMode(bins flag) { return pDetector_->QueryBinningMode(flag); }
+  int QueryOnBoardUnscrambling() { return pDetector_->QueryOnBoardUnscrambling(); }
+  int QueryOnBoardLinearization() { return pDetector_->QueryOnBoardLinearization(); }
+  void ToggleOnBoardLinearization(bool onOff) { pDetector_->ToggleOnBoardLinearization(onOff); }
+  bool GetOnBoardLinearizationState() { return pDetector_->GetOnBoardLinearizationState(); }
+  int QueryOnBoardXTalkCorrection() { return pDetector_->QueryOnBoardXTalkCorrection(); }
+  void ToggleOnBoardXTalkCorrection(bool onOff) { pDetector_->ToggleOnBoardXTalkCorrection(onOff); }
+  bool GetOnBoardXTalkCorrectionState() { return pDetector_->GetOnBoardXTalkCorrectionState(); }
+
+  bool IsLive() { return pDetector_->IsLive(); }
+  void Snap(int buffer, int timeout) { pDetector_->Snap(buffer, timeout); }
+  void GoLiveSeq(int start, int stop, int numBuf) { pDetector_->GoLiveSeq(start, stop, numBuf); }
+  void GoLiveSeq() { pDetector_->GoLiveSeq(); }
+  void GoUnLive() { pDetector_->GoUnLive(); }
+  void SoftwareTrigger() { pDetector_->SoftwareTrigger(); }
+  void EnablePulseGenerator(float frequency) { pDetector_->EnablePulseGenerator(frequency); }
+  void EnablePulseGenerator() { pDetector_->EnablePulseGenerator(); }
+  void DisablePulseGenerator() { pDetector_->DisablePulseGenerator(); }
+  void ToggleGenerator(BOOL onOff) { pDetector_->ToggleGenerator(onOff); }
+
+  void SetCallback(DexelaDeviceCallback func);
+  void SetCallbackData(void *cbData) { pCallbackData_ = cbData; }
+  void *GetCallbackData() { return pCallbackData_; }
+
+  int QueryROI() { return pDetector_->QueryROI(); }
+  void GetMaximumROISize(int &width, int &height) { pDetector_->GetMaximumROISize(width, height); }
+  void SetROIArea(int width, int height, int startRow, int startColumn)
+    { pDetector_->SetROIArea(width, height, startRow, startColumn); }
+  void GetROIArea(int &width, int &height, int &startRow, int &startColumn)
+    { pDetector_->GetROIArea(width, height, startRow, startColumn); }
+  void SetROIEnabled(bool isEnabled) { pDetector_->SetROIEnabled(isEnabled); }
+  bool IsROIEnabled() { return pDetector_->IsROIEnabled(); }
+  void SetROIMarginEnabled(bool isEnabled) { pDetector_->SetROIMarginEnabled(isEnabled); }
+  bool IsROIMarginEnabled() { return pDetector_->IsROIMarginEnabled(); }
+
+private:
+  DexelaDetector *pDetector_;
+  DexelaDeviceCallback callback_;
+  void *pCallbackData_;
+
+  static void sdkCallback(int frameCounter, int bufferNumber, DexelaDetector *pDetector);
+};
+
+#endif
@@ -0,0 +1,93 @@
+/* DexelaHDR.cpp
+ *
+ * Fusion of preprogrammed exposure cycles into extended dynamic range frames.
+ *
+ */
+
+#include <algorithm>
+
+#include "DexelaHDR.h"
+
+//_____________________________________________________________________________________________
+
+DexelaHDR::DexelaHDR()
+  : numExposures_(0), pedestal_(0)
+{
+}
+
+/** Sets the exposure times of the cycle.
+  * \param[in] numExposures Number of exposures in the cycle, clipped to the range 1 to DEX_MAX_HDR_EXPOSURES
+  * \param[in] exposureTimes Exposure times in the order the detector takes them, in any unit */
+void DexelaHDR::setExposures(int numExposures, const double *exposureTimes)
+{
+  int i, j;
+
+  if (numExposures < 1) numExposures = 1;
+  if (numExposures > DEX_MAX_HDR_EXPOSURES) numExposures = DEX_MAX_HDR_EXPOSURES;
+  numExposures_ = numExposures;
+  for (i=0; i<numExposures_; i++) order_[i] = i;
+  // Insertion sort, longest exposure first
+  for (i=1; i<numExposures_; i++) {
+    for (j=i; (j>0) && (exposureTimes[order_[j]] > exposureTimes[order_[j-1]]); j--) {
+      std::swap(order_[j], order_[j-1]);
+    }
+  }
+  for (i=0; i<numExposures_; i++) {
+    scale_[i] = (exposureTimes[order_[i]] > 0) ? (float)(exposureTimes[order_[0]] / exposureTimes[order_[i]]) : 1.f;
+  }
+}
+
+/** Fuses one cycle.
+  * The pedestal (the offset constant added by the offset correction) is removed before the scaling and added back,
+  * so it is not scaled with the signal.
+  * \param[in] pFrames Corrected frames of the cycle with the saturated pixels marked, indexed in the order the
+  *            detector takes the exposures
+  * \param[in] numPixels Number of pixels in each frame
+  * \param[out] pOut Fused frame, numPixels pixels */
+void DexelaHDR::fuse(const epicsUInt16 *const *pFrames, size_t numPixels, float *pOut) const
+{
+  const epicsUInt16 *pSorted[DEX_MAX_HDR_EXPOSURES];
+  float pedestal = (float)pedestal_;
+  epicsUInt16 value;
+  size_t i;
+  int k;
+
+  for (k=0; k<numExposures_; k++) pSorted[k] = pFrames[order_[k]];
+  for (i=0; i<numPixels; i++) {
+    // Go to shorter exposures while the pixel is saturated
+    for (k=0; ((value = pSorted[k][i]) == DEX_HDR_SATURATED) && (k < numExposures_-1); k++);
+    pOut[i] = ((float)value - pedestal) * scale_[k] + pedestal;
+  }
+}
+
+/** Finds the saturated pixels of a raw frame.
+  * \param[in] pRaw Raw frame, before any correction
+  * \param[in] numPixels Number of pixels in the frame
+  * \param[in] saturation Raw counts at and above which a pixel is saturated
+  * \param[out] pMask 1 for each saturated pixel, 0 for the others
+  * Returns the number of saturated pixels. */
+size_t DexelaHDR::findSaturated(const epicsUInt16 *pRaw, size_t numPixels, int saturation, epicsUInt8 *pMask)
+{
+  size_t numSaturated = 0;
+  size_t i;
+
+  // Branch-free so the compiler vectorizes the loop
+  for (i=0; i<numPixels; i++) {
+    pMask[i] = (epicsUInt8)(pRaw[i] >= saturation);
+    numSaturated += pMask[i];
+  }
+  return numSaturated;
+}
+
+/** Sets the pixels of a corrected frame that were saturated in the raw frame to DEX_HDR_SATURATED.
+  * \param[in] pMask Mask from findSaturated()
+  * \param[in] numPixels Number of pixels in the frame
+  * \param[in,out] pFrame Corrected frame */
+void DexelaHDR::markSaturated(const epicsUInt8 *pMask, size_t numPixels, epicsUInt16 *pFrame)
+{
+  size_t i;
+
+  for (i=0; i<numPixels; i++) {
+    if (pMask[i]) pFrame[i] = DEX_HDR_SATURATED;
+  }
+}
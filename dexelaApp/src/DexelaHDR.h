@@ -0,0 +1,52 @@
+/* DexelaHDR.h
+ *
+ * Fusion of preprogrammed exposure cycles into extended dynamic range frames.
+ *
+ * In the Preprogrammed_exposure mode the detector cycles through up to 4 exposure times. The corrected frames of
+ * one cycle are fused into one floating point frame in the counts of the longest exposure, so pixels that saturate
+ * in the long exposures are measured by the shorter ones.
+ *
+ */
+
+#ifndef DexelaHDR_H
+#define DexelaHDR_H
+
+#include <stddef.h>
+
+#include <epicsTypes.h>
+
+/** Maximum number of preprogrammed exposures in an HDR cycle */
+#define DEX_MAX_HDR_EXPOSURES 4
+
+/** Corrected value that marks a pixel as saturated. markSaturated() sets the pixels that were saturated in the raw
+  * frame to it, and the correction clips to it. */
+#define DEX_HDR_SATURATED 65535
+
+/** Fuses the frames of one HDR cycle.
+  * Saturation is decided on the raw counts, before the offset and gain correction change them: findSaturated()
+  * is called on the raw frame and markSaturated() on the corrected one. Each pixel is then taken from the longest
+  * exposure in which it is not DEX_HDR_SATURATED, and is scaled by the ratio of the longest exposure time to the
+  * exposure time of that frame. If the pixel is saturated in all of the frames the scaled value of the shortest
+  * exposure is used. */
+class DexelaHDR
+{
+public:
+  DexelaHDR();
+
+  void setExposures(int numExposures, const double *exposureTimes);
+  void setPedestal(int pedestal) { pedestal_ = pedestal; }
+  int getNumExposures() const { return numExposures_; }
+
+  void fuse(const epicsUInt16 *const *pFrames, size_t numPixels, float *pOut) const;
+
+  static size_t findSaturated(const epicsUInt16 *pRaw, size_t numPixels, int saturation, epicsUInt8 *pMask);
+  static void markSaturated(const epicsUInt8 *pMask, size_t numPixels, epicsUInt16 *pFrame);
+
+private:
+  int numExposures_;
+  int order_[DEX_MAX_HDR_EXPOSURES];      /**< Exposure indices from the longest to the shortest exposure */
+  float scale_[DEX_MAX_HDR_EXPOSURES];    /**< Longest exposure time / exposure time, in the order of order_ */
+  int pedestal_;
+};
+
+#endif
@@ -0,0 +1,187 @@
+/* DexelaLatency.cpp
+ *
+ * Per-stage latency histograms for the frame processing path.
+ *
+ */
+
+#include <chrono>
+
+#include "DexelaLatency.h"
+
+/** Returns the monotonic time in nanoseconds */
+epicsUInt64 dexTimeNow()
+{
+  return (epicsUInt64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Stage names used in the latency parameter names, in the order of DexStage_t
+static const char *stageNames[DexNumStages] = {
+  "QUEUE", "READ", "UNSCRAMBLE", "CORRECT", "COPY", "BIN", "FUSE", "ACCUMULATE", "CALLBACKS", "TOTAL"
+};
+
+/** Returns the name of a stage used in the latency parameter names, e.g. "CORRECT" for DEX_CORRECT_LATENCY_P50 */
+const char *dexStageName(DexStage_t stage)
+{
+  return stageNames[stage];
+}
+
+//_____________________________________________________________________________________________
+
+DexelaHistogram::DexelaHistogram()
+{
+  reset();
+}
+
+int DexelaHistogram::bucketIndex(epicsUInt64 ns)
+{
+  int exponent = 0;
+  int index;
+
+  if (ns < 8) return (int)ns;
+  // Position of the most significant bit, then the next 3 bits select the bucket within the octave
+  while ((ns >> exponent) > 1) exponent++;
+  index = 8 + (exponent - 3) * 8 + (int)((ns >> (exponent - 3)) & 7);
+  if (index >= NUM_BUCKETS) index = NUM_BUCKETS - 1;
+  return index;
+}
+
+/** Returns the middle of a bucket in nanoseconds */
+double DexelaHistogram::bucketValue(int index)
+{
+  int exponent, sub;
+
+  if (index < 8) return index;
+  exponent = (index - 8) / 8 + 3;
+  sub = (index - 8) % 8;
+  return (double)(8 + sub) * (double)(1ULL << (exponent - 3)) + (double)(1ULL << (exponent - 3)) / 2.;
+}
+
+void DexelaHistogram::add(epicsUInt64 ns)
+{
+  epicsUInt64 max = max_.load(std::memory_order_relaxed);
+
+  counts_[bucketIndex(ns)].fetch_add(1, std::memory_order_relaxed);
+  while ((ns > max) && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed));
+}
+
+void DexelaHistogram::reset()
+{
+  int i;
+
+  for (i=0; i<NUM_BUCKETS; i++) counts_[i].store(0, std::memory_order_relaxed);
+  max_.store(0, std::memory_order_relaxed);
+}
+
+epicsUInt64 DexelaHistogram::getCount() const
+{
+  epicsUInt64 count = 0;
+  int i;
+
+  for (i=0; i<NUM_BUCKETS; i++) count += counts_[i].load(std::memory_order_relaxed);
+  return count;
+}
+
+/** Returns a percentile of the durations in seconds, 0 if the histogram is empty.
+  * \param[in] fraction The percentile as a fraction, e.g. 0.99 */
+double DexelaHistogram::getPercentile(double fraction) const
+{
+  epicsUInt64 count = getCount();
+  epicsUInt64 target, sum = 0;
+  double value, max = getMax();
+  int i;
+
+  if (count == 0) return 0.;
+  target = (epicsUInt64)(fraction * count + 0.5);
+  if (target < 1) target = 1;
+  for (i=0; i<NUM_BUCKETS; i++) {
+    sum += counts_[i].load(std::memory_order_relaxed);
+    if (sum >= target) break;
+  }
+  value = bucketValue(i) / 1e9;
+  return (value > max) ? max : value;
+}
+
+/** Returns the longest duration in seconds */
+double DexelaHistogram::getMax() const
+{
+  return max_.load(std::memory_order_relaxed) / 1e9;
+}
+
+//_____________________________________________________________________________________________
+
+DexelaFrameTimer::DexelaFrameTimer()
+  : last_(dexTimeNow()), used_(0)
+{
+  int i;
+
+  for (i=0; i<DexNumStages; i++) stageNs_[i] = 0;
+}
+
+/** Marks the start of a stage */
+void DexelaFrameTimer::start()
+{
+  last_ = dexTimeNow();
+}
+
+/** Adds the time since the start of the stage, or since the previous stage ended, to a stage */
+void DexelaFrameTimer::stop(DexStage_t stage)
+{
+  epicsUInt64 now = dexTimeNow();
+
+  stageNs_[stage] += now - last_;
+  used_ |= 1 << stage;
+  last_ = now;
+}
+
+/** Sets the time of a stage that was measured elsewhere */
+void DexelaFrameTimer::set(DexStage_t stage, epicsUInt64 ns)
+{
+  stageNs_[stage] = ns;
+  used_ |= 1 << stage;
+}
+
+//_____________________________________________________________________________________________
+
+DexelaLatency::DexelaLatency()
+  : windowStart_(dexTimeNow()), windowFrames_(0), frameRate_(0.)
+{
+}
+
+/** Adds the stages of one frame that were timed */
+void DexelaLatency::add(const DexelaFrameTimer &timer)
+{
+  int i;
+
+  for (i=0; i<DexNumStages; i++) {
+    if (timer.used((DexStage_t)i)) histograms_[i].add(timer.get((DexStage_t)i));
+  }
+}
+
+/** Clears the histograms and the frame rate, called at the start of each acquisition */
+void DexelaLatency::reset()
+{
+  int i;
+
+  for (i=0; i<DexNumStages; i++) histograms_[i].reset();
+  windowStart_ = dexTimeNow();
+  windowFrames_ = 0;
+  frameRate_ = 0.;
+}
+
+/** Counts a published frame for the frame rate. Not thread safe, called with the driver lock held.
+  * Returns true when the frame rate has been updated, which happens once per interval.
+  * \param[in] now dexTimeNow() when the frame was published
+  * \param[in] interval Length of the window over which the frame rate is averaged in seconds */
+bool DexelaLatency::frameDone(epicsUInt64 now, double interval)
+{
+  double elapsed;
+
+  windowFrames_++;
+  elapsed = (now - windowStart_) / 1e9;
+  if (elapsed < interval) return false;
+  frameRate_ = windowFrames_ / elapsed;
+  windowStart_ = now;
+  windowFrames_ = 0;
+  return true;
+}
@@ -0,0 +1,96 @@
+/* DexelaLatency.h
+ *
+ * Per-stage latency histograms for the frame processing path.
+ *
+ * Each stage of a frame is timed with the monotonic clock and added to a histogram with one relaxed atomic
+ * increment, so the frame processing threads never wait for each other and the timing can be left on.
+ *
+ */
+
+#ifndef DexelaLatency_H
+#define DexelaLatency_H
+
+#include <atomic>
+
+#include <epicsTypes.h>
+
+/** Stages of the frame processing path */
+typedef enum {
+  DexStageQueue,        /**< From the SDK callback until a frame processing thread starts the frame */
+  DexStageRead,         /**< DexelaDetector::ReadBuffer */
+  DexStageUnscramble,   /**< DexImage::UnscrambleImage */
+  DexStageCorrect,      /**< Offset, gain and defect corrections */
+  DexStageCopy,         /**< Copying the frame into the NDArray */
+  DexStageBin,          /**< Software binning */
+  DexStageFuse,         /**< Fusing the frames of an HDR cycle */
+  DexStageAccumulate,   /**< Adding the frame to the accumulated sum */
+  DexStageCallbacks,    /**< doCallbacksGenericPointer */
+  DexStageTotal,        /**< From the SDK callback until the callbacks return */
+  DexNumStages
+} DexStage_t;
+
+epicsUInt64 dexTimeNow();
+const char *dexStageName(DexStage_t stage);
+
+/** Histogram of durations in nanoseconds.
+  * Durations below 8 ns have their own bucket, above that there are 8 logarithmically spaced buckets per octave,
+  * so the percentiles are within 12.5%. */
+class DexelaHistogram
+{
+public:
+  DexelaHistogram();
+
+  void add(epicsUInt64 ns);
+  void reset();
+  epicsUInt64 getCount() const;
+  double getPercentile(double fraction) const;
+  double getMax() const;
+
+private:
+  enum { NUM_BUCKETS = 8 + 8*40 };
+  std::atomic<epicsUInt32> counts_[NUM_BUCKETS];
+  std::atomic<epicsUInt64> max_;
+
+  static int bucketIndex(epicsUInt64 ns);
+  static double bucketValue(int index);
+};
+
+/** Accumulates the time spent in each stage of one frame */
+class DexelaFrameTimer
+{
+public:
+  DexelaFrameTimer();
+
+  void start();
+  void stop(DexStage_t stage);
+  void set(DexStage_t stage, epicsUInt64 ns);
+  bool used(DexStage_t stage) const { return (used_ & (1 << stage)) != 0; }
+  epicsUInt64 get(DexStage_t stage) const { return stageNs_[stage]; }
+
+private:
+  epicsUInt64 last_;
+  epicsUInt64 stageNs_[DexNumStages];
+  int used_;
+};
+
+/** Latency histograms for all the stages, and the rate at which frames are published */
+class DexelaLatency
+{
+public:
+  DexelaLatency();
+
+  void add(const DexelaFrameTimer &timer);
+  void add(DexStage_t stage, epicsUInt64 ns) { histograms_[stage].add(ns); }
+  void reset();
+  const DexelaHistogram &getHistogram(DexStage_t stage) const { return histograms_[stage]; }
+  bool frameDone(epicsUInt64 now, double interval);
+  double getFrameRate() const { return frameRate_; }
+
+private:
+  DexelaHistogram histograms_[DexNumStages];
+  epicsUInt64 windowStart_;
+  int windowFrames_;
+  double frameRate_;
+};
+
+#endif
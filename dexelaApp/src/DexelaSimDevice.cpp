@@ -0,0 +1,950 @@
+/* DexelaSimDevice.cpp
+ *
+ * Simulated Dexela detector.
+ *
+ * The noise-free frame of each exposure is computed once per mode from a hash of the unbinned pixel
+ * coordinates, so the offset, gain and defects of a pixel are the same in every acquisition and in every ROI and
+ * binning, and calibrations taken on the simulator correct its frames. Each frame adds the noise from a random
+ * offset into a table, so producing a frame costs about as much as the copy out of a real SDK buffer.
+ *
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+
+#include <epicsStdio.h>
+#include <epicsThread.h>
+
+#include "DexelaException.h"
+#include "DexelaLatency.h"
+#include "DexelaSimDevice.h"
+
+/** Mean offset in counts */
+#define DEX_SIM_OFFSET 300.
+/** Peak to peak variation of the offset between pixels and between columns, in counts */
+#define DEX_SIM_OFFSET_SPREAD 80.
+#define DEX_SIM_COLUMN_SPREAD 30.
+/** Mean dark current in counts per second per unbinned pixel, in the low noise full well mode */
+#define DEX_SIM_DARK_RATE 20.
+/** Peak to peak variation of the pixel gain */
+#define DEX_SIM_GAIN_SPREAD 0.2
+/** Counts per electron in the high full well mode relative to the low noise mode */
+#define DEX_SIM_HIGH_WELL_GAIN 0.25
+/** Standard deviation of the read noise in counts, the noise is clipped to DEX_SIM_MAX_NOISE */
+#define DEX_SIM_READ_NOISE 4.
+#define DEX_SIM_MAX_NOISE 63
+/** Extra counts in the bad column */
+#define DEX_SIM_BAD_COLUMN 2000.
+/** Fraction of the pixels that are hot, and the fraction that are dead */
+#define DEX_SIM_DEFECT_FRACTION 1.e-4
+/** Readout time of one row of unbinned pixels in microseconds */
+#define DEX_SIM_ROW_TIME_US 12.5
+/** Length of the noise table beyond one frame, a frame starts at a random offset up to this */
+#define DEX_SIM_NOISE_MARGIN 65536
+/** Frames that are late by more than this many ns are not caught up, as if the detector had been waiting */
+#define DEX_SIM_MAX_LAG 100000000ULL
+
+static const char *driverName = "DexelaSimDevice";
+
+/** Sensor size of the models the simulator knows */
+static const struct {
+  int model;
+  int sizeX;
+  int sizeY;
+} simModels[] = {
+  {1207, 1536,  864},
+  {1512, 1944, 1536},
+  {2315, 3072, 1944},
+  {2923, 3888, 3072},
+};
+
+/** Simulated detectors created with DexelaSimConfig, for the life of the IOC */
+typedef struct {
+  epicsMutexId mutex;
+  std::map<int, DexelaSimDevice *> devices;
+  std::map<int, bool> taken;
+} simRegistry_t;
+
+static simRegistry_t *pRegistry = NULL;
+static epicsThreadOnceId registryOnce = EPICS_THREAD_ONCE_INIT;
+
+static void registryInit(void *)
+{
+  pRegistry = new simRegistry_t;
+  pRegistry->mutex = epicsMutexMustCreate();
+}
+
+/** Mixes the coordinates and a seed into 32 random bits, the same ones every time */
+static epicsUInt32 simHash(epicsUInt32 x, epicsUInt32 y, epicsUInt32 seed)
+{
+  epicsUInt32 h = seed * 0x9E3779B1u;
+
+  h ^= x * 0x85EBCA77u;
+  h = (h << 13) | (h >> 19);
+  h ^= y * 0xC2B2AE3Du;
+  h ^= h >> 15;
+  h *= 0x2C1B3C6Du;
+  h ^= h >> 12;
+  h *= 0x297A2D39u;
+  h ^= h >> 15;
+  return h;
+}
+
+/** Uniform value in [0, 1) from simHash() */
+static double simUniform(epicsUInt32 x, epicsUInt32 y, epicsUInt32 seed)
+{
+  return simHash(x, y, seed) / 4294967296.;
+}
+
+static void simTaskC(void *drvPvt)
+{
+  DexelaSimDevice *pDevice = (DexelaSimDevice *)drvPvt;
+  pDevice->simTask();
+}
+
+//_____________________________________________________________________________________________
+
+/** Creates a simulated detector that DexelaConfig can select with its serial number.
+  * Returns NULL if the serial number is already used or the size is not known for the model.
+  * \param[in] config The settings of the detector */
+DexelaSimDevice *DexelaSimDevice::create(const dexSimConfig_t &config)
+{
+  dexSimConfig_t simConfig = config;
+  DexelaSimDevice *pDevice = NULL;
+  int sizeX, sizeY;
+
+  if ((simConfig.sensorX <= 0) || (simConfig.sensorY <= 0)) {
+    if (!modelSize(simConfig.model, &sizeX, &sizeY)) {
+      printf("%s::create unknown model %d, the sensor size is needed\n", driverName, simConfig.model);
+      return NULL;
+    }
+    if (simConfig.sensorX <= 0) simConfig.sensorX = sizeX;
+    if (simConfig.sensorY <= 0) simConfig.sensorY = sizeY;
+  }
+  if (simConfig.signalRate < 0) simConfig.signalRate = 0;
+  if (simConfig.rowTimeUs <= 0) simConfig.rowTimeUs = DEX_SIM_ROW_TIME_US;
+  epicsThreadOnce(&registryOnce, registryInit, NULL);
+  epicsMutexLock(pRegistry->mutex);
+  if (pRegistry->devices.find(simConfig.serialNumber) == pRegistry->devices.end()) {
+    pDevice = new DexelaSimDevice(simConfig);
+    pRegistry->devices[simConfig.serialNumber] = pDevice;
+  }
+  epicsMutexUnlock(pRegistry->mutex);
+  if (!pDevice) printf("%s::create serial number %d is already used\n", driverName, simConfig.serialNumber);
+  return pDevice;
+}
+
+/** Returns the simulated detector with a serial number, NULL if there is none */
+DexelaSimDevice *DexelaSimDevice::find(int serialNumber)
+{
+  std::map<int, DexelaSimDevice *>::iterator it;
+  DexelaSimDevice *pDevice = NULL;
+
+  epicsThreadOnce(&registryOnce, registryInit, NULL);
+  epicsMutexLock(pRegistry->mutex);
+  it = pRegistry->devices.find(serialNumber);
+  if (it != pRegistry->devices.end()) pDevice = it->second;
+  epicsMutexUnlock(pRegistry->mutex);
+  return pDevice;
+}
+
+/** Returns the simulated detector with a serial number for a driver to use, NULL if there is none or another
+  * driver already uses it */
+DexelaSimDevice *DexelaSimDevice::take(int serialNumber)
+{
+  DexelaSimDevice *pDevice = find(serialNumber);
+
+  if (!pDevice) return NULL;
+  epicsMutexLock(pRegistry->mutex);
+  if (pRegistry->taken[serialNumber]) pDevice = NULL;
+  else                                pRegistry->taken[serialNumber] = true;
+  epicsMutexUnlock(pRegistry->mutex);
+  return pDevice;
+}
+
+/** Gets the unbinned sensor size of a model. Returns false if the model is not known. */
+bool DexelaSimDevice::modelSize(int model, int *pSizeX, int *pSizeY)
+{
+  size_t i;
+
+  for (i=0; i<sizeof(simModels)/sizeof(simModels[0]); i++) {
+    if (simModels[i].model == model) {
+      *pSizeX = simModels[i].sizeX;
+      *pSizeY = simModels[i].sizeY;
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Constructor, starts the thread that produces the frames */
+DexelaSimDevice::DexelaSimDevice(const dexSimConfig_t &config)
+  : config_(config),
+    randomState_(0x9E3779B97F4A7C15ULL ^ (epicsUInt64)config.serialNumber),
+    open_(false), fullWell_(High), exposureMode_(Sequence_Exposure), exposureMs_(100.f), gapMs_(0.f),
+    binning_(x11), triggerSource_(Internal_Software), numExposures_(1), pixelCounter_(false),
+    linearization_(false), xTalk_(false), roiEnabled_(false), roiMargin_(false),
+    roiWidth_(config.sensorX), roiHeight_(config.sensorY), roiStartRow_(0), roiStartColumn_(0),
+    generatorEnabled_(false), generatorOn_(false), generatorFrequency_(0.f),
+    callback_(NULL), pCallbackData_(NULL),
+    live_(false), startBuffer_(0), stopBuffer_(DEX_SIM_NUM_BUFFERS-1), nextBuffer_(0), framesToTake_(0),
+    framesTaken_(0), pendingFrames_(0), snapBuffer_(-1), frameCounter_(0), frameStart_(0), nextPulse_(0),
+    buffers_(DEX_SIM_NUM_BUFFERS),
+    dropFraction_(0), errorFraction_(0), framesGenerated_(0), framesDropped_(0), readErrors_(0)
+{
+  char threadName[32];
+
+  mutex_ = epicsMutexMustCreate();
+  wakeEvent_ = epicsEventMustCreate(epicsEventEmpty);
+  snapEvent_ = epicsEventMustCreate(epicsEventEmpty);
+  epicsSnprintf(threadName, sizeof(threadName), "DexelaSim%d", config_.serialNumber);
+  epicsThreadCreate(threadName, epicsThreadPriorityHigh,
+                    epicsThreadGetStackSize(epicsThreadStackMedium), simTaskC, this);
+}
+
+/** Sets the fraction of the frames that are not delivered, and the fraction whose ReadBuffer fails with
+  * BAD_COMMS_READ as if the connection had been lost */
+void DexelaSimDevice::setFaults(double dropFraction, double errorFraction)
+{
+  epicsMutexLock(mutex_);
+  dropFraction_ = std::min(std::max(dropFraction, 0.), 1.);
+  errorFraction_ = std::min(std::max(errorFraction, 0.), 1.);
+  epicsMutexUnlock(mutex_);
+}
+
+/** Changes the illumination, so dark and flood frames can be taken with the same detector.
+  * \param[in] signalRate Counts per second per unbinned pixel, 0 for dark frames */
+void DexelaSimDevice::setSignalRate(double signalRate)
+{
+  epicsMutexLock(mutex_);
+  config_.signalRate = std::max(signalRate, 0.);
+  pPattern_.reset();
+  epicsMutexUnlock(mutex_);
+}
+
+/** Thread that takes the frames. It sleeps until the next pulse of the pulse generator or the end of the
+  * current frame, and wakes up early when the settings change. */
+void DexelaSimDevice::simTask()
+{
+  epicsUInt64 now, due;
+  double waitTime, period;
+  bool freeRun;
+
+  epicsMutexLock(mutex_);
+  for (;;) {
+    now = dexTimeNow();
+    waitTime = -1;
+    if (open_ && (live_ || (snapBuffer_ >= 0))) {
+      freeRun = live_ && generatorEnabled_ && generatorOn_;
+      if ((pendingFrames_ == 0) && freeRun) {
+        if (generatorFrequency_ <= 0) {
+          pendingFrames_ = numExposures_;
+        } else if (now >= nextPulse_) {
+          // Pulses that come while the detector is still busy with the previous ones are missed
+          pendingFrames_ = numExposures_;
+          period = 1.e9 / generatorFrequency_;
+          nextPulse_ += (epicsUInt64)period;
+          if (nextPulse_ <= now) nextPulse_ = now + (epicsUInt64)period;
+        } else {
+          waitTime = (nextPulse_ - now) / 1.e9;
+        }
+      }
+      if (pendingFrames_ > 0) {
+        if (frameStart_ == 0) frameStart_ = now;
+        due = frameStart_ + (epicsUInt64)(frameTimeMs(framesTaken_ % numCycleExposures()) * 1.e6);
+        if (now >= due) {
+          if (now - due > DEX_SIM_MAX_LAG) due = now;
+          produceFrame(due);
+          continue;
+        }
+        waitTime = (due - now) / 1.e9;
+      }
+    }
+    epicsMutexUnlock(mutex_);
+    if (waitTime < 0) epicsEventMustWait(wakeEvent_);
+    else              epicsEventWaitWithTimeout(wakeEvent_, waitTime);
+    epicsMutexLock(mutex_);
+  }
+}
+
+/** Writes the frame that ended at frameEnd into the next buffer and calls the callback.
+  * Called with the mutex held, which is released during the callback. */
+void DexelaSimDevice::produceFrame(epicsUInt64 frameEnd)
+{
+  DexelaDeviceCallback callback;
+  dexSimBuffer_t *pBuffer;
+  bool snap = !live_ && (snapBuffer_ >= 0);
+  bool freeRun = live_ && generatorEnabled_ && generatorOn_ && (generatorFrequency_ <= 0);
+  int bufferNumber;
+  int frameCounter;
+
+  if (!pPattern_) buildPattern();
+  if (snap) {
+    bufferNumber = snapBuffer_;
+  } else {
+    bufferNumber = nextBuffer_;
+    nextBuffer_++;
+    if (nextBuffer_ > stopBuffer_) nextBuffer_ = startBuffer_;
+  }
+  frameCounter = frameCounter_++;
+  pBuffer = &buffers_[bufferNumber];
+  pBuffer->pPattern      = pPattern_;
+  pBuffer->exposureIndex = framesTaken_ % (int)pPattern_->base.size();
+  pBuffer->frameCounter  = frameCounter;
+  pBuffer->noiseStart    = (size_t)(random() * DEX_SIM_NOISE_MARGIN);
+  pBuffer->pixelCounter  = pixelCounter_;
+  pBuffer->readError     = (random() < errorFraction_);
+  framesTaken_++;
+  pendingFrames_--;
+  framesGenerated_++;
+  // The next frame of a trigger follows without a gap, a new trigger starts when it comes
+  frameStart_ = ((pendingFrames_ > 0) || freeRun) ? frameEnd : 0;
+  if (live_ && (framesToTake_ > 0) && (framesTaken_ >= framesToTake_)) {
+    live_ = false;
+    pendingFrames_ = 0;
+  }
+  if (!snap && (random() < dropFraction_)) {
+    framesDropped_++;
+    return;
+  }
+  callback = callback_;
+  epicsMutexUnlock(mutex_);
+  if (callback) callback(frameCounter, bufferNumber, this);
+  epicsMutexLock(mutex_);
+  if (snap) {
+    snapBuffer_ = -1;
+    epicsEventSignal(snapEvent_);
+  }
+}
+
+/** Computes the noise-free frames of the current mode and a new noise table. Called with the mutex held. */
+void DexelaSimDevice::buildPattern()
+{
+  std::shared_ptr<dexSimPattern_t> pPattern = std::make_shared<dexSimPattern_t>();
+  std::vector<double> exposureS;
+  int binX, binY;
+  bool analog;
+  int sizeX, sizeY;
+  int startX = roiEnabled_ ? roiStartColumn_ : 0;
+  int startY = roiEnabled_ ? roiStartRow_ : 0;
+  int badColumn = config_.sensorX * 5 / 8;
+  epicsUInt32 seed = (epicsUInt32)config_.serialNumber * 8;
+  double charge, offset, rate, value, noise;
+  double hot = DEX_SIM_MAX_COUNTS + DEX_SIM_MAX_NOISE + 1;
+  double defect;
+  int numExposures = numCycleExposures();
+  int x, y, ux, uy, e, k;
+  size_t i, numPixels;
+
+  binFactors(&binX, &binY, &analog);
+  outputSize(&sizeX, &sizeY);
+  numPixels = (size_t)sizeX * sizeY;
+  // Analog binning adds the charge of the pixels, digital binning averages them
+  charge = analog ? binX * binY : 1;
+  if (fullWell_ == High) charge *= DEX_SIM_HIGH_WELL_GAIN;
+  for (e=0; e<numExposures; e++) {
+    exposureS.push_back(exposureTimeMs(e) / 1000.);
+  }
+  pPattern->sizeX = sizeX;
+  pPattern->sizeY = sizeY;
+  pPattern->base.resize(numExposures);
+  for (e=0; e<numExposures; e++) pPattern->base[e].resize(numPixels);
+  for (y=0, i=0; y<sizeY; y++) {
+    uy = startY + y * binY;
+    for (x=0; x<sizeX; x++, i++) {
+      ux = startX + x * binX;
+      offset = DEX_SIM_OFFSET + DEX_SIM_OFFSET_SPREAD * (simUniform(ux, uy, seed) - 0.5)
+                              + DEX_SIM_COLUMN_SPREAD * (simUniform(ux, 0, seed + 1) - 0.5);
+      if ((badColumn >= ux) && (badColumn < ux + binX)) offset += DEX_SIM_BAD_COLUMN;
+      rate = DEX_SIM_DARK_RATE * (0.5 + simUniform(ux, uy, seed + 2)) +
+             config_.signalRate * (1. + DEX_SIM_GAIN_SPREAD * (simUniform(ux, uy, seed + 3) - 0.5));
+      rate *= charge;
+      defect = simUniform(ux, uy, seed + 4);
+      for (e=0; e<numExposures; e++) {
+        value = offset + rate * exposureS[e];
+        if (defect < DEX_SIM_DEFECT_FRACTION) value = hot;
+        else if (defect > 1. - DEX_SIM_DEFECT_FRACTION) value = 0;
+        pPattern->base[e][i] = (epicsUInt16)std::min(value + 0.5, 65535.);
+      }
+    }
+  }
+  // The sum of 4 uniform values is close enough to a normal distribution for read noise
+  pPattern->noise.resize(numPixels + DEX_SIM_NOISE_MARGIN);
+  for (i=0; i<pPattern->noise.size(); i++) {
+    noise = 0;
+    for (k=0; k<4; k++) noise += random();
+    noise = (noise - 2.) * DEX_SIM_READ_NOISE * 1.7320508;
+    noise = std::min(std::max(noise, (double)-DEX_SIM_MAX_NOISE), (double)DEX_SIM_MAX_NOISE);
+    pPattern->noise[i] = (epicsInt16)(noise < 0 ? noise - 0.5 : noise + 0.5);
+  }
+  pPattern_ = pPattern;
+}
+
+/** Adds the noise to the noise-free frame of a buffer */
+void DexelaSimDevice::fillFrame(const dexSimBuffer_t &frame, epicsUInt16 *pOut)
+{
+  const epicsUInt16 *pBase = &frame.pPattern->base[frame.exposureIndex][0];
+  const epicsInt16 *pNoise = &frame.pPattern->noise[frame.noiseStart];
+  size_t numPixels = (size_t)frame.pPattern->sizeX * frame.pPattern->sizeY;
+  size_t i;
+  int value;
+
+  for (i=0; i<numPixels; i++) {
+    value = (int)pBase[i] + pNoise[i];
+    if (value < 0) value = 0;
+    if (value > DEX_SIM_MAX_COUNTS) value = DEX_SIM_MAX_COUNTS;
+    pOut[i] = (epicsUInt16)value;
+  }
+  if (frame.pixelCounter) pOut[0] = (epicsUInt16)(frame.frameCounter & 0xFFFF);
+}
+
+/** Returns a copy of a buffer. Throws DexelaException if the buffer cannot be read. */
+dexSimBuffer_t DexelaSimDevice::getBuffer(int bufNum)
+{
+  dexSimBuffer_t frame;
+  bool open;
+
+  checkOpen();
+  if ((bufNum < 0) || (bufNum >= DEX_SIM_NUM_BUFFERS)) throwNewEr("Invalid buffer number", BAD_PARAM, 0, "");
+  epicsMutexLock(mutex_);
+  open = open_;
+  frame = buffers_[bufNum];
+  // Each injected error fails only the first read of the frame
+  buffers_[bufNum].readError = false;
+  if (frame.readError) readErrors_++;
+  epicsMutexUnlock(mutex_);
+  if (!open || frame.readError) throwNewEr("Simulated read error", BAD_COMMS_READ, 0, "");
+  if (!frame.pPattern) throwNewEr("Buffer does not contain a frame", BAD_PARAM, 0, "");
+  return frame;
+}
+
+/** Throws DexelaException if the detector is not open */
+void DexelaSimDevice::checkOpen()
+{
+  bool open;
+
+  epicsMutexLock(mutex_);
+  open = open_;
+  epicsMutexUnlock(mutex_);
+  if (!open) throwNewEr("Detector is not open", BAD_COMMS, 0, "");
+}
+
+/** Gets the binning factors, and whether the binning is done on the sensor. Called with the mutex held. */
+void DexelaSimDevice::binFactors(int *pBinX, int *pBinY, bool *pAnalog)
+{
+  *pAnalog = true;
+  switch (binning_) {
+    case x12:  *pBinX = 1; *pBinY = 2; break;
+    case x14:  *pBinX = 1; *pBinY = 4; break;
+    case x21:  *pBinX = 2; *pBinY = 1; break;
+    case x22:  *pBinX = 2; *pBinY = 2; break;
+    case x24:  *pBinX = 2; *pBinY = 4; break;
+    case x41:  *pBinX = 4; *pBinY = 1; break;
+    case x42:  *pBinX = 4; *pBinY = 2; break;
+    case x44:  *pBinX = 4; *pBinY = 4; break;
+    case ix22: *pBinX = 2; *pBinY = 2; *pAnalog = false; break;
+    case ix44: *pBinX = 4; *pBinY = 4; *pAnalog = false; break;
+    default:   *pBinX = 1; *pBinY = 1; break;
+  }
+}
+
+/** Gets the size of the frames in the current ROI and binning. Called with the mutex held. */
+void DexelaSimDevice::outputSize(int *pSizeX, int *pSizeY)
+{
+  int binX, binY;
+  bool analog;
+
+  binFactors(&binX, &binY, &analog);
+  *pSizeX = (roiEnabled_ ? roiWidth_ : config_.sensorX) / binX;
+  *pSizeY = (roiEnabled_ ? roiHeight_ : config_.sensorY) / binY;
+}
+
+/** Readout time in ms, the rows of the ROI divided by the analog vertical binning. Called with the mutex held. */
+double DexelaSimDevice::readoutMs()
+{
+  int binX, binY;
+  bool analog;
+  int rows = roiEnabled_ ? roiHeight_ : config_.sensorY;
+
+  binFactors(&binX, &binY, &analog);
+  if (analog) rows /= binY;
+  return rows * config_.rowTimeUs / 1000.;
+}
+
+/** Time from the start of a frame to the start of the next one of the same trigger, in ms.
+  * Called with the mutex held.
+  * \param[in] exposureIndex Index of the frame in the preprogrammed exposure cycle */
+double DexelaSimDevice::frameTimeMs(int exposureIndex)
+{
+  double exposure = exposureTimeMs(exposureIndex);
+  double readout = readoutMs();
+
+  switch (exposureMode_) {
+    case Expose_and_read:     return exposure + readout;
+    case Frame_Rate_exposure: return std::max(exposure + gapMs_, readout);
+    default:                  return std::max(exposure, readout);
+  }
+}
+
+/** Exposure time in ms of a frame of the preprogrammed exposure cycle. Called with the mutex held. */
+double DexelaSimDevice::exposureTimeMs(int exposureIndex)
+{
+  if (numCycleExposures() > 1) return preProgrammedMs_[exposureIndex];
+  return exposureMs_;
+}
+
+/** Number of exposures in the preprogrammed cycle, 1 in the other modes. Called with the mutex held. */
+int DexelaSimDevice::numCycleExposures()
+{
+  if ((exposureMode_ == Preprogrammed_exposure) && !preProgrammedMs_.empty()) return (int)preProgrammedMs_.size();
+  return 1;
+}
+
+/** Uniform random value in [0, 1) from an xorshift generator. Called with the mutex held. */
+double DexelaSimDevice::random()
+{
+  randomState_ ^= randomState_ >> 12;
+  randomState_ ^= randomState_ << 25;
+  randomState_ ^= randomState_ >> 27;
+  return ((randomState_ * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.;
+}
+
+//_____________________________________________________________________________________________
+
+void DexelaSimDevice::OpenBoard()
+{
+  epicsMutexLock(mutex_);
+  open_ = true;
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::CloseBoard()
+{
+  epicsMutexLock(mutex_);
+  open_ = false;
+  live_ = false;
+  pendingFrames_ = 0;
+  generatorOn_ = false;
+  epicsMutexUnlock(mutex_);
+  epicsEventSignal(wakeEvent_);
+}
+
+int DexelaSimDevice::GetBufferXdim()
+{
+  int sizeX, sizeY;
+
+  epicsMutexLock(mutex_);
+  outputSize(&sizeX, &sizeY);
+  epicsMutexUnlock(mutex_);
+  return sizeX;
+}
+
+int DexelaSimDevice::GetBufferYdim()
+{
+  int sizeX, sizeY;
+
+  epicsMutexLock(mutex_);
+  outputSize(&sizeX, &sizeY);
+  epicsMutexUnlock(mutex_);
+  return sizeY;
+}
+
+/** Copies the frame in a buffer, which is always unscrambled */
+void DexelaSimDevice::ReadBuffer(int bufNum, byte *buffer)
+{
+  dexSimBuffer_t frame = getBuffer(bufNum);
+
+  fillFrame(frame, (epicsUInt16 *)buffer);
+}
+
+/** Copies the frame in a buffer into a plane of a DexImage. The image is built again if it does not have the
+  * size of the frame, and grown by a plane when iZ is one past its last plane, keeping the planes it has. */
+void DexelaSimDevice::ReadBuffer(int bufNum, DexImage &img, int iZ)
+{
+  dexSimBuffer_t frame = getBuffer(bufNum);
+  int sizeX = frame.pPattern->sizeX;
+  int sizeY = frame.pPattern->sizeY;
+  size_t planeBytes = (size_t)sizeX * sizeY * sizeof(epicsUInt16);
+  bool matches = !img.IsEmpty() && (img.GetImageXdim() == sizeX) && (img.GetImageYdim() == sizeY) &&
+                 (img.GetImagePixelType() == u16);
+  DexImage grown;
+  int z;
+
+  if ((iZ < 0) || (iZ > (matches ? img.GetImageDepth() : 0))) {
+    throwNewEr("Invalid image plane", BAD_PARAM, 0, "");
+  }
+  if (!matches) {
+    img.Build(sizeX, sizeY, 1, u16);
+  } else if (iZ == img.GetImageDepth()) {
+    grown.Build(sizeX, sizeY, iZ + 1, u16);
+    for (z=0; z<iZ; z++) memcpy(grown.GetDataPointerToPlane(z), img.GetDataPointerToPlane(z), planeBytes);
+    img = grown;
+  }
+  fillFrame(frame, (epicsUInt16 *)img.GetDataPointerToPlane(iZ));
+}
+
+void DexelaSimDevice::SetFullWellMode(FullWellModes fwm)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  fullWell_ = fwm;
+  pPattern_.reset();
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetExposureMode(ExposureModes mode)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  exposureMode_ = mode;
+  pPattern_.reset();
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetExposureTime(float timems)
+{
+  checkOpen();
+  if (timems < 0) throwNewEr("Invalid exposure time", BAD_PARAM, 0, "");
+  epicsMutexLock(mutex_);
+  exposureMs_ = timems;
+  pPattern_.reset();
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetBinningMode(bins flag)
+{
+  checkOpen();
+  if (!QueryBinningMode(flag)) throwNewEr("Invalid binning mode", BAD_BIN_LEVEL, 0, "");
+  epicsMutexLock(mutex_);
+  binning_ = flag;
+  pPattern_.reset();
+  epicsMutexUnlock(mutex_);
+}
+
+/** Sets the trigger source. There are no trigger inputs, so with the external sources frames are only
+  * taken on SoftwareTrigger(). */
+void DexelaSimDevice::SetTriggerSource(ExposureTriggerSource ets)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  triggerSource_ = ets;
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetNumOfExposures(int num)
+{
+  checkOpen();
+  if (num < 1) throwNewEr("Invalid number of exposures", BAD_PARAM, 0, "");
+  epicsMutexLock(mutex_);
+  numExposures_ = num;
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetGapTime(float timems)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  gapMs_ = std::max(timems, 0.f);
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetReadoutMode(ReadoutModes /*mode*/)
+{
+  checkOpen();
+}
+
+void DexelaSimDevice::SetPreProgrammedExposureTimes(const float *exposureTimes, size_t size)
+{
+  checkOpen();
+  if ((size < 1) || !exposureTimes) throwNewEr("Invalid exposure times", BAD_PARAM, 0, "");
+  epicsMutexLock(mutex_);
+  preProgrammedMs_.assign(exposureTimes, exposureTimes + size);
+  pPattern_.reset();
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetPixelFrameCounter(bool isEnabled)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  pixelCounter_ = isEnabled;
+  epicsMutexUnlock(mutex_);
+}
+
+bins DexelaSimDevice::GetBinningMode()
+{
+  bins binning;
+
+  epicsMutexLock(mutex_);
+  binning = binning_;
+  epicsMutexUnlock(mutex_);
+  return binning;
+}
+
+float DexelaSimDevice::GetReadOutTime()
+{
+  double readout;
+
+  epicsMutexLock(mutex_);
+  readout = readoutMs();
+  epicsMutexUnlock(mutex_);
+  return (float)readout;
+}
+
+/** The on-board corrections are only remembered, the simulated frames do not need them */
+void DexelaSimDevice::ToggleOnBoardLinearization(bool onOff)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  linearization_ = onOff;
+  epicsMutexUnlock(mutex_);
+}
+
+bool DexelaSimDevice::GetOnBoardLinearizationState()
+{
+  bool state;
+
+  epicsMutexLock(mutex_);
+  state = linearization_;
+  epicsMutexUnlock(mutex_);
+  return state;
+}
+
+void DexelaSimDevice::ToggleOnBoardXTalkCorrection(bool onOff)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  xTalk_ = onOff;
+  epicsMutexUnlock(mutex_);
+}
+
+bool DexelaSimDevice::GetOnBoardXTalkCorrectionState()
+{
+  bool state;
+
+  epicsMutexLock(mutex_);
+  state = xTalk_;
+  epicsMutexUnlock(mutex_);
+  return state;
+}
+
+bool DexelaSimDevice::IsLive()
+{
+  bool live;
+
+  epicsMutexLock(mutex_);
+  live = live_;
+  epicsMutexUnlock(mutex_);
+  return live;
+}
+
+/** Takes one frame into a buffer, waiting for the callback to return.
+  * Throws DexelaException with EXPOSURE_FAILED if the frame does not come within the timeout. */
+void DexelaSimDevice::Snap(int buffer, int timeout)
+{
+  bool busy;
+  int status;
+
+  checkOpen();
+  if ((buffer < 0) || (buffer >= DEX_SIM_NUM_BUFFERS)) throwNewEr("Invalid buffer number", BAD_PARAM, 0, "");
+  epicsMutexLock(mutex_);
+  busy = live_ || (snapBuffer_ >= 0);
+  if (!busy) {
+    snapBuffer_ = buffer;
+    pendingFrames_ = 1;
+    framesTaken_ = 0;
+    frameStart_ = 0;
+    epicsEventTryWait(snapEvent_);
+  }
+  epicsMutexUnlock(mutex_);
+  if (busy) throwNewEr("Detector is already acquiring", EXPOSURE_FAILED, 0, "");
+  epicsEventSignal(wakeEvent_);
+  status = epicsEventWaitWithTimeout(snapEvent_, timeout / 1000.);
+  if (status != epicsEventOK) {
+    epicsMutexLock(mutex_);
+    snapBuffer_ = -1;
+    pendingFrames_ = 0;
+    epicsMutexUnlock(mutex_);
+    throwNewEr("Snap timed out", EXPOSURE_FAILED, 0, "");
+  }
+}
+
+/** Starts acquiring into the buffers start to stop in turn, numBuf frames or until GoUnLive() if numBuf is 0 */
+void DexelaSimDevice::GoLiveSeq(int start, int stop, int numBuf)
+{
+  checkOpen();
+  if ((start < 0) || (stop >= DEX_SIM_NUM_BUFFERS) || (start > stop) || (numBuf < 0)) {
+    throwNewEr("Invalid buffer range", BAD_PARAM, 0, "");
+  }
+  epicsMutexLock(mutex_);
+  live_ = true;
+  startBuffer_ = start;
+  stopBuffer_ = stop;
+  nextBuffer_ = start;
+  framesToTake_ = numBuf;
+  framesTaken_ = 0;
+  pendingFrames_ = 0;
+  frameStart_ = 0;
+  nextPulse_ = 0;
+  epicsMutexUnlock(mutex_);
+  epicsEventSignal(wakeEvent_);
+}
+
+void DexelaSimDevice::GoUnLive()
+{
+  epicsMutexLock(mutex_);
+  live_ = false;
+  pendingFrames_ = 0;
+  epicsMutexUnlock(mutex_);
+  epicsEventSignal(wakeEvent_);
+}
+
+/** Triggers the number of exposures set with SetNumOfExposures() */
+void DexelaSimDevice::SoftwareTrigger()
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  if (live_) pendingFrames_ += numExposures_;
+  epicsMutexUnlock(mutex_);
+  epicsEventSignal(wakeEvent_);
+}
+
+/** Enables the pulse generator, which triggers at a frequency in Hz, or as fast as the detector can if 0 */
+void DexelaSimDevice::EnablePulseGenerator(float frequency)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  generatorEnabled_ = true;
+  generatorFrequency_ = std::max(frequency, 0.f);
+  epicsMutexUnlock(mutex_);
+  epicsEventSignal(wakeEvent_);
+}
+
+void DexelaSimDevice::DisablePulseGenerator()
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  generatorEnabled_ = false;
+  epicsMutexUnlock(mutex_);
+  epicsEventSignal(wakeEvent_);
+}
+
+void DexelaSimDevice::ToggleGenerator(BOOL onOff)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  generatorOn_ = (onOff != 0);
+  nextPulse_ = 0;
+  epicsMutexUnlock(mutex_);
+  epicsEventSignal(wakeEvent_);
+}
+
+void DexelaSimDevice::SetCallback(DexelaDeviceCallback func)
+{
+  epicsMutexLock(mutex_);
+  callback_ = func;
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetCallbackData(void *cbData)
+{
+  epicsMutexLock(mutex_);
+  pCallbackData_ = cbData;
+  epicsMutexUnlock(mutex_);
+}
+
+void *DexelaSimDevice::GetCallbackData()
+{
+  void *pData;
+
+  epicsMutexLock(mutex_);
+  pData = pCallbackData_;
+  epicsMutexUnlock(mutex_);
+  return pData;
+}
+
+void DexelaSimDevice::GetMaximumROISize(int &width, int &height)
+{
+  width = config_.sensorX;
+  height = config_.sensorY;
+}
+
+/** Sets the ROI in unbinned pixels. The width and height are rounded down to a multiple of 4, so the driver
+  * has to read back the ROI as it does for a real detector. */
+void DexelaSimDevice::SetROIArea(int width, int height, int startRow, int startColumn)
+{
+  checkOpen();
+  width &= ~3;
+  height &= ~3;
+  if ((width < 4) || (height < 4) || (startRow < 0) || (startColumn < 0) ||
+      (startColumn + width > config_.sensorX) || (startRow + height > config_.sensorY)) {
+    throwNewEr("Invalid ROI", BAD_PARAM, 0, "");
+  }
+  epicsMutexLock(mutex_);
+  roiWidth_ = width;
+  roiHeight_ = height;
+  roiStartRow_ = startRow;
+  roiStartColumn_ = startColumn;
+  pPattern_.reset();
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::GetROIArea(int &width, int &height, int &startRow, int &startColumn)
+{
+  epicsMutexLock(mutex_);
+  width = roiWidth_;
+  height = roiHeight_;
+  startRow = roiStartRow_;
+  startColumn = roiStartColumn_;
+  epicsMutexUnlock(mutex_);
+}
+
+void DexelaSimDevice::SetROIEnabled(bool isEnabled)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  roiEnabled_ = isEnabled;
+  pPattern_.reset();
+  epicsMutexUnlock(mutex_);
+}
+
+bool DexelaSimDevice::IsROIEnabled()
+{
+  bool enabled;
+
+  epicsMutexLock(mutex_);
+  enabled = roiEnabled_;
+  epicsMutexUnlock(mutex_);
+  return enabled;
+}
+
+void DexelaSimDevice::SetROIMarginEnabled(bool isEnabled)
+{
+  checkOpen();
+  epicsMutexLock(mutex_);
+  roiMargin_ = isEnabled;
+  epicsMutexUnlock(mutex_);
+}
+
+bool DexelaSimDevice::IsROIMarginEnabled()
+{
+  bool enabled;
+
+  epicsMutexLock(mutex_);
+  enabled = roiMargin_;
+  epicsMutexUnlock(mutex_);
+  return enabled;
+}
+
+/** Prints the simulation settings and how many frames were taken, dropped and failed */
+void DexelaSimDevice::report(FILE *fp)
+{
+  epicsMutexLock(mutex_);
+  fprintf(fp, "  Simulated:         %d x %d, signal %g counts/s, row time %g us\n",
+    config_.sensorX, config_.sensorY, config_.signalRate, config_.rowTimeUs);
+  fprintf(fp, "  Injected faults:   drop %g, read error %g\n", dropFraction_, errorFraction_);
+  fprintf(fp, "  Frames simulated:  %llu, dropped %llu, read errors %llu\n",
+    (unsigned long long)framesGenerated_, (unsigned long long)framesDropped_, (unsigned long long)readErrors_);
+  epicsMutexUnlock(mutex_);
+}
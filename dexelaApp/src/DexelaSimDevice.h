@@ -0,0 +1,210 @@
+/* DexelaSimDevice.h
+ *
+ * Simulated Dexela detector, so the frame path can be load tested and profiled without a detector.
+ *
+ * Frames have a fixed pattern offset, dark current and illumination that scale with the exposure time and the
+ * binning, pixel gain variations, read noise, hot and dead pixels, a bad column and optionally the frame counter
+ * in the first pixel. They are produced at the rate the exposure time, the readout time and the pulse generator
+ * allow, and the callback is called from the simulator's own thread like the SDK does. Frames can be dropped
+ * and reads can fail at random to exercise the gap detection and the reconnection.
+ *
+ */
+
+#ifndef DexelaSimDevice_H
+#define DexelaSimDevice_H
+
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsTypes.h>
+
+#include "DexelaDevice.h"
+
+/** Largest value of the 14-bit digitizer */
+#define DEX_SIM_MAX_COUNTS 16383
+/** Number of SDK buffers of a simulated detector */
+#define DEX_SIM_NUM_BUFFERS 16
+
+/** Settings of a simulated detector */
+typedef struct {
+  int    serialNumber;
+  int    model;
+  int    sensorX;           /**< Unbinned width in pixels, 0 for the width of the model */
+  int    sensorY;           /**< Unbinned height in pixels, 0 for the height of the model */
+  double signalRate;        /**< Illumination in counts per second per unbinned pixel, 0 for dark frames */
+  double rowTimeUs;         /**< Readout time of one row in microseconds, 0 for DEX_SIM_ROW_TIME_US */
+} dexSimConfig_t;
+
+/** Pixel values of the current mode, shared by the buffers that were filled in that mode */
+typedef struct {
+  int sizeX;
+  int sizeY;
+  std::vector<std::vector<epicsUInt16> > base;  /**< Noise-free frame for each exposure of the cycle */
+  std::vector<epicsInt16> noise;                /**< Read noise, each frame starts at a random offset */
+} dexSimPattern_t;
+
+/** A simulated SDK buffer */
+typedef struct {
+  std::shared_ptr<const dexSimPattern_t> pPattern;   /**< NULL until a frame has been written */
+  int    exposureIndex;
+  int    frameCounter;
+  size_t noiseStart;
+  bool   pixelCounter;
+  bool   readError;
+} dexSimBuffer_t;
+
+/** Simulated detector, created with DexelaSimConfig and used by the driver with the same serial number.
+  * All the methods can be called from any thread. The simulator always unscrambles on board, because the pixel
+  * order of the real sensors is only known to the SDK. */
+class DexelaSimDevice : public DexelaDevice
+{
+public:
+  static DexelaSimDevice *create(const dexSimConfig_t &config);
+  static DexelaSimDevice *find(int serialNumber);
+  static DexelaSimDevice *take(int serialNumber);
+  static bool modelSize(int model, int *pSizeX, int *pSizeY);
+
+  void setFaults(double dropFraction, double errorFraction);
+  void setSignalRate(double signalRate);
+  void simTask();
+
+  void OpenBoard();
+  void CloseBoard();
+
+  int GetBufferXdim();
+  int GetBufferYdim();
+  int GetNumBuffers() { return DEX_SIM_NUM_BUFFERS; }
+  void ReadBuffer(int bufNum, byte *buffer);
+  void ReadBuffer(int bufNum, DexImage &img, int iZ = 0);
+
+  void SetFullWellMode(FullWellModes fwm);
+  void SetExposureMode(ExposureModes mode);
+  void SetExposureTime(float timems);
+  void SetBinningMode(bins flag);
+  void SetTriggerSource(ExposureTriggerSource ets);
+  void SetNumOfExposures(int num);
+  void SetGapTime(float timems);
+  void SetReadoutMode(ReadoutModes mode);
+  void SetPreProgrammedExposureTimes(const float *exposureTimes, size_t size);
+  void SetPixelFrameCounter(bool isEnabled);
+
+  bins GetBinningMode();
+  int GetSerialNumber() { return config_.serialNumber; }
+  int GetModelNumber() { return config_.model; }
+  int GetSensorVersion() { return 1; }
+  bool GetSliceInterlacing() { return false; }
+  float GetReadOutTime();
+  unsigned short GetSensorWidth() { return (unsigned short)config_.sensorX; }
+  unsigned short GetSensorHeight() { return (unsigned short)config_.sensorY; }
+
+  int QueryExposureMode(ExposureModes /*mode*/) { return 1; }
+  int QueryFullWellMode(FullWellModes /*fwm*/) { return 1; }
+  int QueryBinningMode(bins flag) { return (flag >= x11) && (flag <= ix44) ? 1 : 0; }
+  int QueryOnBoardUnscrambling() { return 1; }
+  int QueryOnBoardLinearization() { return 1; }
+  void ToggleOnBoardLinearization(bool onOff);
+  bool GetOnBoardLinearizationState();
+  int QueryOnBoardXTalkCorrection() { return 1; }
+  void ToggleOnBoardXTalkCorrection(bool onOff);
+  bool GetOnBoardXTalkCorrectionState();
+
+  bool IsLive();
+  void Snap(int buffer, int timeout);
+  void GoLiveSeq(int start, int stop, int numBuf);
+  void GoLiveSeq() { GoLiveSeq(0, DEX_SIM_NUM_BUFFERS-1, 0); }
+  void GoUnLive();
+  void SoftwareTrigger();
+  void EnablePulseGenerator(float frequency);
+  void EnablePulseGenerator() { EnablePulseGenerator(0.f); }
+  void DisablePulseGenerator();
+  void ToggleGenerator(BOOL onOff);
+
+  void SetCallback(DexelaDeviceCallback func);
+  void SetCallbackData(void *cbData);
+  void *GetCallbackData();
+
+  int QueryROI() { return 1; }
+  void GetMaximumROISize(int &width, int &height);
+  void SetROIArea(int width, int height, int startRow, int startColumn);
+  void GetROIArea(int &width, int &height, int &startRow, int &startColumn);
+  void SetROIEnabled(bool isEnabled);
+  bool IsROIEnabled();
+  void SetROIMarginEnabled(bool isEnabled);
+  bool IsROIMarginEnabled();
+
+  void report(FILE *fp);
+
+private:
+  explicit DexelaSimDevice(const dexSimConfig_t &config);
+
+  dexSimConfig_t config_;
+  epicsMutexId mutex_;
+  epicsEventId wakeEvent_;          /**< Signalled when anything changes that the simulator thread waits for */
+  epicsEventId snapEvent_;
+  epicsUInt64 randomState_;
+
+  // Settings, all protected by mutex_
+  bool open_;
+  FullWellModes fullWell_;
+  ExposureModes exposureMode_;
+  float exposureMs_;
+  float gapMs_;
+  bins binning_;
+  ExposureTriggerSource triggerSource_;
+  int numExposures_;
+  std::vector<float> preProgrammedMs_;
+  bool pixelCounter_;
+  bool linearization_;
+  bool xTalk_;
+  bool roiEnabled_;
+  bool roiMargin_;
+  int roiWidth_;
+  int roiHeight_;
+  int roiStartRow_;
+  int roiStartColumn_;
+  bool generatorEnabled_;
+  bool generatorOn_;
+  float generatorFrequency_;
+  std::shared_ptr<const dexSimPattern_t> pPattern_;   /**< NULL when the settings have changed */
+  DexelaDeviceCallback callback_;
+  void *pCallbackData_;
+
+  // Acquisition state
+  bool live_;
+  int startBuffer_;
+  int stopBuffer_;
+  int nextBuffer_;
+  int framesToTake_;                /**< 0 to acquire until GoUnLive() */
+  int framesTaken_;
+  int pendingFrames_;               /**< Frames still to be taken for the triggers so far */
+  int snapBuffer_;                  /**< Buffer Snap() is waiting for, -1 if none */
+  int frameCounter_;
+  epicsUInt64 frameStart_;          /**< When the exposure of the next frame starts, 0 if not started */
+  epicsUInt64 nextPulse_;           /**< When the pulse generator triggers next */
+  std::vector<dexSimBuffer_t> buffers_;
+
+  // Fault injection and statistics
+  double dropFraction_;
+  double errorFraction_;
+  epicsUInt64 framesGenerated_;
+  epicsUInt64 framesDropped_;
+  epicsUInt64 readErrors_;
+
+  void checkOpen();
+  void binFactors(int *pBinX, int *pBinY, bool *pAnalog);
+  void outputSize(int *pSizeX, int *pSizeY);
+  double readoutMs();
+  double exposureTimeMs(int exposureIndex);
+  double frameTimeMs(int exposureIndex);
+  int numCycleExposures();
+  void buildPattern();
+  void produceFrame(epicsUInt64 frameEnd);
+  dexSimBuffer_t getBuffer(int bufNum);
+  void fillFrame(const dexSimBuffer_t &frame, epicsUInt16 *pOut);
+  double random();
+};
+
+#endif
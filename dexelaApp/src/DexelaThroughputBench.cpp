@@ -0,0 +1,437 @@
+// DexelaThroughputBench.cpp : End-to-end throughput benchmark of the driver's frame processing path.
+//
+// Usage:
+//   DexelaThroughputBench [-model model] [-size sizeX sizeY] [-rate Hz] [-exposure s] [-rowtime us]
+//                         [-time s] [-threads n,n,...] [-dir directory]
+//     Creates a driver with a simulated detector and measures it in one configuration after another: no
+//     corrections, offset, offset+gain and offset+gain+defect with each number of frame processing threads, then
+//     with all the corrections and the most threads, software binning to each output data type and 2x2 hardware
+//     binning. The sustained frame rate, the dropped frames, the CPU utilisation and the latency percentiles of
+//     each stage are printed as JSON on stdout, the progress on stderr.
+//
+//     -rate 0, the default, takes frames as fast as the simulated detector can, which is set by the exposure time
+//     and by the readout time of a row (-rowtime, 0 for the simulator default). Otherwise the frames are taken at
+//     the fixed rate. The offset and gain are acquired and a synthetic defect map is written to -dir and loaded
+//     for each hardware binning, before its configurations are measured.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <epicsExit.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <asynInt32SyncIO.h>
+#include <asynFloat64SyncIO.h>
+#include <asynOctetSyncIO.h>
+
+#include "DexelaException.h"
+#include "Dexela.h"
+#include "DexelaSimDevice.h"
+
+using namespace std;
+
+#define BENCH_PORT "DEXBENCH"
+/** Serial number of the simulated detector */
+#define BENCH_SERIAL_NUMBER 99999
+/** Timeout of the parameter reads and writes, in seconds */
+#define BENCH_IO_TIMEOUT 5.0
+/** Time to wait for the detector to connect, a calibration or a file to load, in seconds */
+#define BENCH_WAIT_TIMEOUT 60.0
+/** Time each configuration runs before it is measured, in seconds */
+#define BENCH_WARMUP_TIME 2.0
+/** Number of frames in the offset and the gain */
+#define BENCH_CALIBRATION_FRAMES 10
+/** Mean signal of the flood and data frames in counts, above the offset */
+#define BENCH_SIGNAL 4000.
+/** Fraction of the pixels that are bad in the synthetic defect map */
+#define BENCH_DEFECT_FRACTION 1.e-4
+
+// Names of the software binning data types, in the order of DexBinType_t
+static const char *binTypeNames[] = {"UInt16", "UInt32", "Float32"};
+
+static const struct {
+  const char *name;
+  int useOffset;
+  int useGain;
+  int useDefectMap;
+} corrections[] = {
+  {"raw",                0, 0, 0},
+  {"offset",             1, 0, 0},
+  {"offset+gain",        1, 1, 0},
+  {"offset+gain+defect", 1, 1, 1},
+};
+#define NUM_CORRECTIONS (sizeof(corrections)/sizeof(corrections[0]))
+
+/** One configuration of the frame processing path */
+typedef struct {
+  int  correction;    /**< Index in corrections */
+  bins binning;       /**< Hardware binning */
+  int  softwareBin;   /**< Software binning in both directions */
+  int  binDataType;   /**< DexBinType_t */
+  int  numThreads;
+} benchCase_t;
+
+static void fail(const char *message, const char *name)
+{
+  fprintf(stderr, "Error: %s %s\n", message, name);
+  epicsExit(1);
+}
+
+static double elapsed(epicsTimeStamp *pStart)
+{
+  epicsTimeStamp now;
+  epicsTimeGetCurrent(&now);
+  return epicsTimeDiffInSeconds(&now, pStart);
+}
+
+/** Returns the CPU time used by all the threads of the process, in seconds */
+static double cpuSeconds()
+{
+#ifdef _WIN32
+  FILETIME creationTime, exitTime, kernelTime, userTime;
+  ULARGE_INTEGER kernel, user;
+
+  GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+  kernel.LowPart  = kernelTime.dwLowDateTime;
+  kernel.HighPart = kernelTime.dwHighDateTime;
+  user.LowPart    = userTime.dwLowDateTime;
+  user.HighPart   = userTime.dwHighDateTime;
+  return (double)(kernel.QuadPart + user.QuadPart) * 1.e-7;
+#else
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1.e-6;
+#endif
+}
+
+static void writeInt(const char *drvInfo, epicsInt32 value)
+{
+  asynUser *pasynUser;
+  asynStatus status = pasynInt32SyncIO->connect(BENCH_PORT, 0, &pasynUser, drvInfo);
+
+  if (status == asynSuccess) {
+    status = pasynInt32SyncIO->write(pasynUser, value, BENCH_IO_TIMEOUT);
+    pasynInt32SyncIO->disconnect(pasynUser);
+  }
+  if (status != asynSuccess) fail("cannot write", drvInfo);
+}
+
+static epicsInt32 readInt(const char *drvInfo)
+{
+  asynUser *pasynUser;
+  epicsInt32 value = 0;
+  asynStatus status = pasynInt32SyncIO->connect(BENCH_PORT, 0, &pasynUser, drvInfo);
+
+  if (status == asynSuccess) {
+    status = pasynInt32SyncIO->read(pasynUser, &value, BENCH_IO_TIMEOUT);
+    pasynInt32SyncIO->disconnect(pasynUser);
+  }
+  if (status != asynSuccess) fail("cannot read", drvInfo);
+  return value;
+}
+
+static void writeDouble(const char *drvInfo, epicsFloat64 value)
+{
+  asynUser *pasynUser;
+  asynStatus status = pasynFloat64SyncIO->connect(BENCH_PORT, 0, &pasynUser, drvInfo);
+
+  if (status == asynSuccess) {
+    status = pasynFloat64SyncIO->write(pasynUser, value, BENCH_IO_TIMEOUT);
+    pasynFloat64SyncIO->disconnect(pasynUser);
+  }
+  if (status != asynSuccess) fail("cannot write", drvInfo);
+}
+
+static epicsFloat64 readDouble(const char *drvInfo)
+{
+  asynUser *pasynUser;
+  epicsFloat64 value = 0;
+  asynStatus status = pasynFloat64SyncIO->connect(BENCH_PORT, 0, &pasynUser, drvInfo);
+
+  if (status == asynSuccess) {
+    status = pasynFloat64SyncIO->read(pasynUser, &value, BENCH_IO_TIMEOUT);
+    pasynFloat64SyncIO->disconnect(pasynUser);
+  }
+  if (status != asynSuccess) fail("cannot read", drvInfo);
+  return value;
+}
+
+static void writeString(const char *drvInfo, const char *value)
+{
+  asynUser *pasynUser;
+  size_t nActual;
+  asynStatus status = pasynOctetSyncIO->connect(BENCH_PORT, 0, &pasynUser, drvInfo);
+
+  if (status == asynSuccess) {
+    status = pasynOctetSyncIO->write(pasynUser, value, strlen(value), BENCH_IO_TIMEOUT, &nActual);
+    pasynOctetSyncIO->disconnect(pasynUser);
+  }
+  if (status != asynSuccess) fail("cannot write", drvInfo);
+}
+
+/** Waits until an integer parameter has a value, returns false on timeout */
+static bool waitForInt(const char *drvInfo, epicsInt32 value)
+{
+  epicsTimeStamp start;
+
+  epicsTimeGetCurrent(&start);
+  while (readInt(drvInfo) != value) {
+    if (elapsed(&start) > BENCH_WAIT_TIMEOUT) return false;
+    epicsThreadSleep(0.05);
+  }
+  return true;
+}
+
+/** Stops acquisition and waits until the detector is idle */
+static void stopAcquisition()
+{
+  writeInt(ADAcquireString, 0);
+  if (!waitForInt(ADStatusString, ADStatusIdle)) fail("timeout waiting for", ADStatusString);
+}
+
+/** Writes a defect map with isolated bad pixels and a bad column at the column of the simulated one, and loads it.
+  * The size is that of the last frame, so it must be called after a calibration with no software binning. */
+static void loadDefectMap(const char *directory, bins binning)
+{
+  int sizeX = readInt(NDArraySizeXString);
+  int sizeY = readInt(NDArraySizeYString);
+  vector<epicsUInt16> map((size_t)sizeX * sizeY, 0);
+  const void *pPlane = &map[0];
+  DexelaCalibrationKey key;
+  char fileName[64];
+  string path;
+  size_t i;
+  int y;
+
+  srand(1);
+  for (i=0; i<map.size(); i++) {
+    if (rand() < RAND_MAX * BENCH_DEFECT_FRACTION) map[i] = 1;
+  }
+  for (y=0; y<sizeY; y++) map[(size_t)y*sizeX + sizeX*5/8] = 12;
+  key.binning = binning;
+  sprintf(fileName, "DexelaThroughputBench_defects_%d%s", (int)binning, DEX_CALIBRATION_FILE_EXTENSION);
+  path = string(directory) + fileName;
+  DexelaCalibrationFile::write(path.c_str(), DexCalibrationDefectMap, key, 0, BENCH_SERIAL_NUMBER, u16,
+                               sizeX, sizeY, &pPlane, 1);
+  writeString(DEX_DefectMapFileString, fileName);
+  writeInt(DEX_LoadDefectMapFileString, 1);
+  if (!waitForInt(DEX_CalibrationIOBusyString, 0)) fail("timeout loading", path.c_str());
+  remove(path.c_str());
+  if (readInt(DEX_DefectMapAvailableString) != 1) fail("cannot load", path.c_str());
+}
+
+/** Acquires the offset with the detector dark and the gain with it illuminated, and loads a defect map,
+  * for the binning and the exposure time that are set */
+static void calibrate(DexelaSimDevice *pDevice, double signalRate, const char *directory, bins binning)
+{
+  writeInt(DEX_SoftwareBinXString, 1);
+  writeInt(DEX_SoftwareBinYString, 1);
+  writeInt(DEX_NumOffsetFramesString, BENCH_CALIBRATION_FRAMES);
+  writeInt(DEX_NumGainFramesString, BENCH_CALIBRATION_FRAMES);
+
+  pDevice->setSignalRate(0);
+  writeInt(DEX_AcquireOffsetString, 1);
+  if (!waitForInt(DEX_AcquireOffsetString, 0)) fail("timeout waiting for", DEX_AcquireOffsetString);
+  stopAcquisition();
+
+  pDevice->setSignalRate(signalRate);
+  writeInt(DEX_AcquireGainString, 1);
+  if (!waitForInt(DEX_AcquireGainString, 0)) fail("timeout waiting for", DEX_AcquireGainString);
+  stopAcquisition();
+
+  loadDefectMap(directory, binning);
+}
+
+/** Runs one configuration and prints its results as a JSON object */
+static void runCase(const benchCase_t &benchCase, double measureTime, bool first)
+{
+  char drvInfo[64];
+  epicsTimeStamp start;
+  double wallTime, cpuTime;
+  int startCounter, startDropped;
+  int numFrames, numDropped;
+  int numCPUs = epicsThreadGetCPUs();
+  int stage;
+
+  fprintf(stderr, "Measuring %s, binning %d, software binning %d %s, %d threads\n",
+          corrections[benchCase.correction].name, (int)benchCase.binning, benchCase.softwareBin,
+          binTypeNames[benchCase.binDataType], benchCase.numThreads);
+  writeInt(DEX_NumThreadsString, benchCase.numThreads);
+  writeInt(DEX_UseOffsetString, corrections[benchCase.correction].useOffset);
+  writeInt(DEX_UseGainString, corrections[benchCase.correction].useGain);
+  writeInt(DEX_UseDefectMapString, corrections[benchCase.correction].useDefectMap);
+  writeInt(DEX_SoftwareBinXString, benchCase.softwareBin);
+  writeInt(DEX_SoftwareBinYString, benchCase.softwareBin);
+  writeInt(DEX_SoftwareBinDataTypeString, benchCase.binDataType);
+
+  writeInt(ADAcquireString, 1);
+  epicsThreadSleep(BENCH_WARMUP_TIME);
+  writeInt(DEX_ResetLatencyString, 1);
+  startCounter = readInt(NDArrayCounterString);
+  startDropped = readInt(DEX_DroppedFramesString);
+  cpuTime = cpuSeconds();
+  epicsTimeGetCurrent(&start);
+  epicsThreadSleep(measureTime);
+  numFrames = readInt(NDArrayCounterString) - startCounter;
+  numDropped = readInt(DEX_DroppedFramesString) - startDropped;
+  cpuTime = cpuSeconds() - cpuTime;
+  wallTime = elapsed(&start);
+  // The latency parameters are updated when the last frame has been published
+  stopAcquisition();
+  epicsThreadSleep(0.1);
+
+  printf("%s\n    {\"correction\": \"%s\", \"binning\": %d, \"softwareBin\": %d, \"dataType\": \"%s\", "
+         "\"threads\": %d,\n", first ? "" : ",", corrections[benchCase.correction].name, (int)benchCase.binning,
+         benchCase.softwareBin, binTypeNames[benchCase.binDataType], benchCase.numThreads);
+  printf("     \"frames\": %d, \"seconds\": %.3f, \"fps\": %.2f, \"droppedFrames\": %d,\n",
+         numFrames, wallTime, numFrames / wallTime, numDropped);
+  printf("     \"cpuCores\": %.3f, \"cpuUtilisation\": %.4f, \"cpuMsPerFrame\": %.3f,\n",
+         cpuTime / wallTime, cpuTime / wallTime / numCPUs, numFrames ? cpuTime * 1000. / numFrames : 0.);
+  printf("     \"latencyMs\": {");
+  for (stage=0; stage<DexNumStages; stage++) {
+    printf("%s\n       \"%s\": {", stage ? "," : "", dexStageName((DexStage_t)stage));
+    sprintf(drvInfo, "DEX_%s_LATENCY_P50", dexStageName((DexStage_t)stage));
+    printf("\"p50\": %.4f, ", readDouble(drvInfo));
+    sprintf(drvInfo, "DEX_%s_LATENCY_P99", dexStageName((DexStage_t)stage));
+    printf("\"p99\": %.4f, ", readDouble(drvInfo));
+    sprintf(drvInfo, "DEX_%s_LATENCY_MAX", dexStageName((DexStage_t)stage));
+    printf("\"max\": %.4f}", readDouble(drvInfo));
+  }
+  printf("}}");
+  fflush(stdout);
+}
+
+static void usage(const char *program)
+{
+  printf("Usage: %s [-model model] [-size sizeX sizeY] [-rate Hz] [-exposure s] [-rowtime us]\n", program);
+  printf("       %*s [-time s] [-threads n,n,...] [-dir directory]\n", (int)strlen(program), "");
+}
+
+int main(int argc, char* argv[])
+{
+  dexSimConfig_t config;
+  DexelaSimDevice *pDevice;
+  vector<benchCase_t> cases;
+  vector<int> threads;
+  benchCase_t benchCase;
+  const char *threadList = "1,2,4,8";
+  const char *directory = "./";
+  double rate = 0;
+  double exposure = 0.01;
+  double measureTime = 10;
+  char buffer[256];
+  char *pToken;
+  int maxThreads = 0;
+  bins binning;
+  size_t i, j;
+  int arg;
+
+  config.serialNumber = BENCH_SERIAL_NUMBER;
+  config.model = 2923;
+  config.sensorX = 0;
+  config.sensorY = 0;
+  config.rowTimeUs = 0;
+  for (arg=1; arg<argc; arg++) {
+    if      ((strcmp(argv[arg], "-model") == 0) && (arg+1 < argc))    config.model = atoi(argv[++arg]);
+    else if ((strcmp(argv[arg], "-size") == 0) && (arg+2 < argc)) {
+      config.sensorX = atoi(argv[++arg]);
+      config.sensorY = atoi(argv[++arg]);
+    }
+    else if ((strcmp(argv[arg], "-rate") == 0) && (arg+1 < argc))     rate = atof(argv[++arg]);
+    else if ((strcmp(argv[arg], "-exposure") == 0) && (arg+1 < argc)) exposure = atof(argv[++arg]);
+    else if ((strcmp(argv[arg], "-rowtime") == 0) && (arg+1 < argc))  config.rowTimeUs = atof(argv[++arg]);
+    else if ((strcmp(argv[arg], "-time") == 0) && (arg+1 < argc))     measureTime = atof(argv[++arg]);
+    else if ((strcmp(argv[arg], "-threads") == 0) && (arg+1 < argc))  threadList = argv[++arg];
+    else if ((strcmp(argv[arg], "-dir") == 0) && (arg+1 < argc))      directory = argv[++arg];
+    else {
+      usage(argv[0]);
+      return -1;
+    }
+  }
+  strncpy(buffer, threadList, sizeof(buffer)-1);
+  buffer[sizeof(buffer)-1] = 0;
+  for (pToken = strtok(buffer, ","); pToken; pToken = strtok(NULL, ",")) {
+    int numThreads = atoi(pToken);
+    if ((numThreads < 1) || (numThreads > DEX_MAX_THREADS)) {
+      printf("The number of threads must be 1 to %d\n", DEX_MAX_THREADS);
+      return -1;
+    }
+    threads.push_back(numThreads);
+    if (numThreads > maxThreads) maxThreads = numThreads;
+  }
+  if (threads.empty() || (exposure <= 0) || (measureTime <= 0) || (rate < 0)) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  // Each correction with each number of threads, then the binning with all the corrections and the most threads
+  benchCase.binning = x11;
+  benchCase.softwareBin = 1;
+  benchCase.binDataType = DexBinUInt16;
+  for (i=0; i<NUM_CORRECTIONS; i++) {
+    benchCase.correction = (int)i;
+    for (j=0; j<threads.size(); j++) {
+      benchCase.numThreads = threads[j];
+      cases.push_back(benchCase);
+    }
+  }
+  benchCase.numThreads = maxThreads;
+  benchCase.softwareBin = 2;
+  for (benchCase.binDataType=DexBinUInt16; benchCase.binDataType<=DexBinFloat32; benchCase.binDataType++) {
+    cases.push_back(benchCase);
+  }
+  benchCase.softwareBin = 4;
+  benchCase.binDataType = DexBinUInt16;
+  cases.push_back(benchCase);
+  benchCase.binning = x22;
+  benchCase.softwareBin = 1;
+  cases.push_back(benchCase);
+
+  // The frames are illuminated so the gain and the saturation behave as with real data
+  config.signalRate = BENCH_SIGNAL / exposure;
+  pDevice = DexelaSimDevice::create(config);
+  if (!pDevice) return -1;
+  new Dexela(BENCH_PORT, 0, 0, 0, 0, 0, BENCH_SERIAL_NUMBER);
+  if (!waitForInt(DEX_ConnectionStateString, DEXConnected)) fail("timeout waiting for", DEX_ConnectionStateString);
+
+  writeString(DEX_CorrectionsDirectoryString, directory);
+  writeDouble(ADAcquireTimeString, exposure);
+  writeDouble(ADAcquirePeriodString, (rate > 0) ? 1./rate : 0.);
+  writeInt(ADTriggerModeString, (rate > 0) ? DEXInternalFixedRate : DEXInternalFreeRun);
+  writeInt(ADImageModeString, ADImageContinuous);
+  writeInt(NDArrayCallbacksString, 1);
+
+  printf("{\"model\": %d, \"sizeX\": %d, \"sizeY\": %d, \"rate\": %g, \"exposure\": %g, \"readoutMs\": %.3f, "
+         "\"cpus\": %d,\n", config.model, readInt(ADMaxSizeXString), readInt(ADMaxSizeYString), rate, exposure,
+         readDouble(DEX_ReadoutTimeString), epicsThreadGetCPUs());
+  printf(" \"cases\": [");
+  try {
+    binning = (bins)-1;
+    for (i=0; i<cases.size(); i++) {
+      if (cases[i].binning != binning) {
+        binning = cases[i].binning;
+        fprintf(stderr, "Calibrating binning %d\n", (int)binning);
+        writeInt(DEX_BinningModeString, binning);
+        calibrate(pDevice, config.signalRate, directory, binning);
+      }
+      runCase(cases[i], measureTime, i == 0);
+    }
+  }
+  catch (DexelaException &ex) {
+    fprintf(stderr, "Exception: %s, function: %s\n", ex.what(), ex.GetFunctionName());
+    epicsExit(-1);
+  }
+  printf("\n ]\n}\n");
+  epicsExit(0);
+  return 0;
+}
@@ -0,0 +1,74 @@
+/* DexelaTimeStampFit.cpp
+ *
+ * Running linear fit of frame arrival time against frame counter.
+ *
+ */
+
+#include <math.h>
+
+#include "DexelaTimeStampFit.h"
+
+/** Constructor
+  * \param[in] numFrames Time constant of the fit in frames */
+DexelaTimeStampFit::DexelaTimeStampFit(int numFrames)
+  : decay_(1. - 1. / (numFrames > 1 ? numFrames : 2))
+{
+  reset();
+}
+
+void DexelaTimeStampFit::reset()
+{
+  numFrames_ = 0;
+  firstCounter_ = 0;
+  firstTime_ = 0.;
+  s0_ = sx_ = sy_ = sxx_ = sxy_ = 0.;
+  intercept_ = slope_ = 0.;
+  residual2_ = 0.;
+  period_.store(0., std::memory_order_relaxed);
+  jitter_.store(0., std::memory_order_relaxed);
+}
+
+/** Adds a frame to the fit.
+  * Returns true and the fitted arrival time when enough frames have been fitted.
+  * \param[in] frameCounter Frame counter from the SDK
+  * \param[in] time Arrival time of the frame in seconds
+  * \param[out] pFitted Fitted arrival time of the frame in seconds */
+bool DexelaTimeStampFit::add(int frameCounter, double time, double *pFitted)
+{
+  double x, y, residual, denominator;
+
+  // The sums use the first frame as the origin so they keep their precision
+  if (numFrames_ > 0) {
+    x = frameCounter - firstCounter_;
+    y = time - firstTime_;
+    if (numFrames_ >= DEX_TIMESTAMP_FIT_MIN_FRAMES) {
+      residual = y - (intercept_ + slope_ * x);
+      if ((x < 0) || (fabs(residual) > 0.25 * slope_)) reset();
+      else residual2_ = decay_ * residual2_ + (1. - decay_) * residual * residual;
+    }
+  }
+  if (numFrames_ == 0) {
+    firstCounter_ = frameCounter;
+    firstTime_ = time;
+  }
+  x = frameCounter - firstCounter_;
+  y = time - firstTime_;
+
+  s0_  = decay_ * s0_  + 1.;
+  sx_  = decay_ * sx_  + x;
+  sy_  = decay_ * sy_  + y;
+  sxx_ = decay_ * sxx_ + x * x;
+  sxy_ = decay_ * sxy_ + x * y;
+  numFrames_++;
+
+  denominator = s0_ * sxx_ - sx_ * sx_;
+  if ((numFrames_ < 2) || (denominator <= 0.)) return false;
+  slope_ = (s0_ * sxy_ - sx_ * sy_) / denominator;
+  intercept_ = (sy_ - slope_ * sx_) / s0_;
+  if (numFrames_ < DEX_TIMESTAMP_FIT_MIN_FRAMES) return false;
+
+  period_.store(slope_, std::memory_order_relaxed);
+  jitter_.store(sqrt(residual2_), std::memory_order_relaxed);
+  *pFitted = firstTime_ + intercept_ + slope_ * x;
+  return true;
+}
@@ -0,0 +1,46 @@
+/* DexelaTimeStampFit.h
+ *
+ * Running linear fit of frame arrival time against frame counter.
+ *
+ * When the frames come from the pulse generator or a periodic external trigger the arrival time is a linear
+ * function of the frame counter, and the scatter about the fit is the callback latency jitter of the host.
+ * The fitted times remove that jitter.
+ *
+ */
+
+#ifndef DexelaTimeStampFit_H
+#define DexelaTimeStampFit_H
+
+#include <atomic>
+
+/** Minimum number of frames before the fitted times are used */
+#define DEX_TIMESTAMP_FIT_MIN_FRAMES 8
+
+/** Exponentially weighted least squares fit of arrival time against frame counter.
+  * The weights decay with a time constant of a number of frames, so slow drift of the detector clock relative to
+  * the host clock is followed. A frame that arrives more than a quarter of a period away from the fit means the
+  * frames are not periodic, for example the trigger was paused, and the fit is restarted from that frame.
+  * add() and reset() must be called from one thread, the getters can be called from any thread. */
+class DexelaTimeStampFit
+{
+public:
+  DexelaTimeStampFit(int numFrames);
+
+  void reset();
+  bool add(int frameCounter, double time, double *pFitted);
+  double getPeriod() const { return period_.load(std::memory_order_relaxed); }
+  double getJitter() const { return jitter_.load(std::memory_order_relaxed); }
+
+private:
+  double decay_;
+  int numFrames_;
+  int firstCounter_;
+  double firstTime_;
+  double s0_, sx_, sy_, sxx_, sxy_;   /**< Weighted sums of 1, x, y, x*x and x*y */
+  double intercept_, slope_;
+  double residual2_;                  /**< Weighted mean squared residual */
+  std::atomic<double> period_;
+  std::atomic<double> jitter_;
+};
+
+#endif
@@ -0,0 +1,187 @@
+/* DexImage.cpp
+ *
+ * Stand-in for the DexImage library of the Dexela SDK on Linux, where there is no SDK.
+ *
+ * It stores images the way the driver and the simulated detector use them: building an image of a given size and
+ * pixel type, the data pointer of each plane, the dimensions, the flags and copying planes and sub-images. The
+ * image processing of the SDK (unscrambling, the SDK offset and gain correction, FixFlood, FindMedianofPlanes and
+ * the SDK file formats) throws DexelaException, so on Linux the frames must come from a detector that unscrambles
+ * them and are corrected by DexelaCorrection. Only the methods the driver calls are defined.
+ *
+ */
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "DexImage.h"
+#include "DexelaException.h"
+
+/** The image data and the properties the stand-in keeps */
+class BaseImage
+{
+public:
+  BaseImage() : width(0), height(0), depth(0), pixelType(u16), imageType(UnknownType), darkOffset(0),
+                sorted(false) {}
+  size_t planeBytes() const { return (size_t)width * height * pixelBytes(); }
+  size_t pixelBytes() const { return (pixelType == u16) ? sizeof(unsigned short) : 4; }
+
+  int width;
+  int height;
+  int depth;
+  pType pixelType;
+  DexImageTypes imageType;
+  int darkOffset;
+  bool sorted;
+  std::vector<char> data;
+};
+
+//_____________________________________________________________________________________________
+
+DexImage::DexImage(void)
+  : baseIm(std::make_shared<BaseImage>())
+{
+}
+
+/** Copies the image, the copy has its own data */
+DexImage::DexImage(const DexImage &input)
+  : baseIm(std::make_shared<BaseImage>(*input.baseIm))
+{
+}
+
+void DexImage::operator=(const DexImage &input)
+{
+  if (this != &input) *baseIm = *input.baseIm;
+}
+
+DexImage::~DexImage(void)
+{
+}
+
+/** Allocates an image of iDepth planes, all pixels 0 */
+void DexImage::Build(int iWidth, int iHeight, int iDepth, pType iPxType)
+{
+  if ((iWidth <= 0) || (iHeight <= 0) || (iDepth <= 0)) throwNewEr("Invalid image size", WRONG_DIMS, 0, "");
+  if ((iPxType != u16) && (iPxType != flt) && (iPxType != u32)) throwNewEr("Invalid pixel type", WRONG_TYPE, 0, "");
+  baseIm->width = iWidth;
+  baseIm->height = iHeight;
+  baseIm->depth = iDepth;
+  baseIm->pixelType = iPxType;
+  baseIm->sorted = false;
+  baseIm->data.assign(baseIm->planeBytes() * iDepth, 0);
+}
+
+/** The sensor layout of a model is only known to the SDK */
+void DexImage::Build(int /*model*/, bins /*binFmt*/, int /*iDepth*/, pType /*iPxType*/, int /*sensorVersion*/,
+                     bool /*isSliceInterlaced*/, bool /*roiEnabled*/, int /*roiStartColumn*/, int /*roiStartRow*/,
+                     int /*roiWidth*/, int /*roiHeight*/)
+{
+  throwNewEr("Building an image for a detector model needs the Dexela SDK", BAD_PARAM, 0, "");
+}
+
+void *DexImage::GetDataPointerToPlane(int iZ)
+{
+  if ((iZ < 0) || (iZ >= baseIm->depth)) throwNewEr("Invalid image plane", BAD_PARAM, 0, "");
+  return &baseIm->data[baseIm->planeBytes() * iZ];
+}
+
+int DexImage::GetImageXdim() { return baseIm->width; }
+int DexImage::GetImageYdim() { return baseIm->height; }
+int DexImage::GetImageDepth() { return baseIm->depth; }
+pType DexImage::GetImagePixelType() { return baseIm->pixelType; }
+bool DexImage::IsEmpty() { return baseIm->depth == 0; }
+DexImageTypes DexImage::GetImageType() { return baseIm->imageType; }
+void DexImage::SetImageType(DexImageTypes type) { baseIm->imageType = type; }
+void DexImage::SetDarkOffset(int offset) { baseIm->darkOffset = offset; }
+int DexImage::GetDarkOffset() { return baseIm->darkOffset; }
+bool DexImage::IsSorted() { return baseIm->sorted; }
+void DexImage::SetSortedFlag(bool onOff) { baseIm->sorted = onOff; }
+
+/** Returns a copy of one plane */
+DexImage DexImage::GetImagePlane(int iZ)
+{
+  DexImage plane;
+
+  plane.Build(baseIm->width, baseIm->height, 1, baseIm->pixelType);
+  memcpy(plane.GetDataPointerToPlane(0), GetDataPointerToPlane(iZ), baseIm->planeBytes());
+  plane.baseIm->imageType = baseIm->imageType;
+  plane.baseIm->darkOffset = baseIm->darkOffset;
+  plane.baseIm->sorted = baseIm->sorted;
+  return plane;
+}
+
+/** Crops every plane of the image to width x height pixels starting at (startCol, startRow) */
+void DexImage::GetSubImage(int startCol, int startRow, int width, int height)
+{
+  std::vector<char> data;
+  size_t pixelBytes = baseIm->pixelBytes();
+  size_t rowBytes = (size_t)width * pixelBytes;
+  const char *pIn;
+  char *pOut;
+  int z, y;
+
+  if ((startCol < 0) || (startRow < 0) || (width <= 0) || (height <= 0) ||
+      (startCol + width > baseIm->width) || (startRow + height > baseIm->height)) {
+    throwNewEr("Invalid sub-image", WRONG_DIMS, 0, "");
+  }
+  data.resize(rowBytes * height * baseIm->depth);
+  pOut = &data[0];
+  for (z=0; z<baseIm->depth; z++) {
+    pIn = &baseIm->data[baseIm->planeBytes() * z];
+    for (y=0; y<height; y++) {
+      memcpy(pOut, pIn + ((size_t)(startRow + y) * baseIm->width + startCol) * pixelBytes, rowBytes);
+      pOut += rowBytes;
+    }
+  }
+  baseIm->data.swap(data);
+  baseIm->width = width;
+  baseIm->height = height;
+}
+
+//_____________________________________________________________________________________________
+// Image processing and file formats of the SDK
+
+void DexImage::ReadImage(const char * /*filename*/)
+{
+  throwNewEr("Reading SDK image files needs the Dexela SDK", BAD_FILE_IO, 0, "");
+}
+
+void DexImage::WriteImage(const char * /*filename*/)
+{
+  throwNewEr("Writing SDK image files needs the Dexela SDK", BAD_FILE_IO, 0, "");
+}
+
+void DexImage::UnscrambleImage()
+{
+  throwNewEr("Unscrambling on the host needs the Dexela SDK", BAD_PARAM, 0, "");
+}
+
+void DexImage::FixFlood()
+{
+  throwNewEr("FixFlood needs the Dexela SDK", BAD_PARAM, 0, "");
+}
+
+void DexImage::FindMedianofPlanes()
+{
+  throwNewEr("FindMedianofPlanes needs the Dexela SDK", BAD_PARAM, 0, "");
+}
+
+void DexImage::LoadDarkImage(const DexImage & /*dark*/)
+{
+  throwNewEr("The SDK correction needs the Dexela SDK", BAD_PARAM, 0, "");
+}
+
+void DexImage::LoadFloodImage(const DexImage & /*flood*/)
+{
+  throwNewEr("The SDK correction needs the Dexela SDK", BAD_PARAM, 0, "");
+}
+
+void DexImage::SubtractDark()
+{
+  throwNewEr("The SDK correction needs the Dexela SDK", BAD_PARAM, 0, "");
+}
+
+void DexImage::FloodCorrection()
+{
+  throwNewEr("The SDK correction needs the Dexela SDK", BAD_PARAM, 0, "");
+}
@@ -0,0 +1,58 @@
+/* DexelaException.cpp
+ *
+ * Stand-in for the DexelaException library of the Dexela SDK on Linux, where there is no SDK.
+ *
+ * The exception keeps the pointers it is given, as the SDK does, so the messages must be string literals.
+ *
+ */
+
+#include "DexelaException.h"
+
+DexelaException::DexelaException(const char *message, Derr code, int line, const char *filename,
+                                 const char *function, int transportEr, const char *transportMessage)
+  : _msg(message), _code(code), _filename(filename), _line(line), _func(function), _transEr(transportEr),
+    _transMsg(transportMessage)
+{
+}
+
+/** Copies an exception that is thrown again from another function */
+DexelaException::DexelaException(const DexelaException &ex, const char *function)
+  : _msg(ex._msg), _code(ex._code), _filename(ex._filename), _line(ex._line), _func(function),
+    _transEr(ex._transEr), _transMsg(ex._transMsg)
+{
+}
+
+DexelaException::DexelaException(const DexelaException &ex)
+  : std::exception(ex), _msg(ex._msg), _code(ex._code), _filename(ex._filename), _line(ex._line), _func(ex._func),
+    _transEr(ex._transEr), _transMsg(ex._transMsg)
+{
+}
+
+DexelaException &DexelaException::operator=(const DexelaException &ex)
+{
+  _msg = ex._msg;
+  _code = ex._code;
+  _filename = ex._filename;
+  _line = ex._line;
+  _func = ex._func;
+  _transEr = ex._transEr;
+  _transMsg = ex._transMsg;
+  return *this;
+}
+
+DexelaException::~DexelaException(void) throw()
+{
+}
+
+const char *DexelaException::what() const throw() { return _msg; }
+Derr DexelaException::GetCode() { return _code; }
+int DexelaException::GetTransportError() { return _transEr; }
+const char *DexelaException::GetFileName() { return _filename; }
+int DexelaException::GetLineNumber() { return _line; }
+const char *DexelaException::GetFunctionName() { return _func; }
+const char *DexelaException::GetTransportMessage() { return _transMsg; }
+
+/** The messages are in the exceptions themselves, so there are no error strings to load */
+void DexelaException::LoadErrorStrings(const char * /*filename*/)
+{
+}
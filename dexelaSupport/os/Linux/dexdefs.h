@@ -0,0 +1,7 @@
+/* dexdefs.h
+ *
+ * DexelaException.h includes dexdefs.h, which only matches DexDefs.h on file systems that ignore case.
+ *
+ */
+
+#include "DexDefs.h"
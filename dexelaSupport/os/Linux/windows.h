@@ -0,0 +1,24 @@
+/* windows.h
+ *
+ * The Windows types that the Dexela SDK headers use, so the headers can be included on Linux where there is no SDK.
+ *
+ */
+
+#ifndef DexelaWindowsShim_H
+#define DexelaWindowsShim_H
+
+typedef int BOOL;
+typedef void *HANDLE;
+typedef unsigned int UINT;
+
+#ifndef TRUE
+  #define TRUE 1
+#endif
+#ifndef FALSE
+  #define FALSE 0
+#endif
+
+/* DllExport is __declspec(dllimport) in DexDefines.h */
+#define __declspec(x)
+
+#endif
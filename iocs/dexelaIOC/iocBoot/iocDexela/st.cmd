@@ -23,10 +23,13 @@ epicsEnvSet("CBUFFS", "500")
 epicsEnvSet("EPICS_DB_INCLUDE_PATH", "$(ADCORE)/db")
 
 # Create a Dexels driver
-# DexelaConfig(const char *portName, detIndex, maxBuffers, size_t maxMemory, int priority, int stackSize)
+# DexelaConfig(const char *portName, detIndex, maxBuffers, size_t maxMemory, int priority, int stackSize,
+#              int serialNumber)
+# With several detectors, DexelaOpenBoards("serialNumber1 serialNumber2 ...") before the DexelaConfig commands
+# connects to all of them in parallel, and each DexelaConfig selects its detector by serial number.
 
 # This is for the first detector in the system
-DexelaConfig("$(PORT)", 0, 0, 0, 0, 0)
+DexelaConfig("$(PORT)", 0, 0, 0, 0, 0, 0)
 
 asynSetTraceIOMask($(PORT), 0, 2)
 #asynSetTraceMask($(PORT),0,0xff)